@@ -7,11 +7,64 @@ SOURCES += src/source/main.cpp
 
 SOURCES += \
     src/source/mainwidget.cpp \
-    src/source/geometryengine.cpp
+    src/source/geometryengine.cpp \
+    src/source/bvh.cpp \
+    src/source/mesh.cpp \
+    src/source/xsensdata.cpp \
+    src/source/xsensstream.cpp \
+    src/source/offscreenrenderer.cpp \
+    src/source/renderstate.cpp \
+    src/source/shadercache.cpp \
+    src/source/assetloader.cpp \
+    src/source/cliplibrary.cpp \
+    src/source/retarget.cpp \
+    src/source/autoweights.cpp \
+    src/source/clipexport.cpp \
+    src/source/motionmatching.cpp \
+    src/source/memorystats.cpp \
+    src/source/bounds.cpp \
+    src/source/xsensfilter.cpp \
+    src/source/ik.cpp \
+    src/source/posecache.cpp \
+    src/source/meshlod.cpp \
+    src/source/gpupose.cpp \
+    src/source/framecapture.cpp \
+    src/source/morphtargets.cpp \
+    src/source/jobsystem.cpp \
+    src/source/picking.cpp \
+    src/source/timing.cpp
 
 HEADERS += \
     src/header/mainwidget.h \
-    src/header/geometryengine.h
+    src/header/geometryengine.h \
+    src/header/bvh.h \
+    src/header/mesh.h \
+    src/header/xsensdata.h \
+    src/header/xsensstream.h \
+    src/header/offscreenrenderer.h \
+    src/header/renderstate.h \
+    src/header/shadercache.h \
+    src/header/assetloader.h \
+    src/header/cliplibrary.h \
+    src/header/retarget.h \
+    src/header/autoweights.h \
+    src/header/clipexport.h \
+    src/header/motionmatching.h \
+    src/header/memorystats.h \
+    src/header/bounds.h \
+    src/header/xsensfilter.h \
+    src/header/ik.h \
+    src/header/posecache.h \
+    src/header/meshlod.h \
+    src/header/gpupose.h \
+    src/header/framecapture.h \
+    src/header/morphtargets.h \
+    src/header/jobsystem.h \
+    src/header/picking.h \
+    src/header/timing.h
+
+# qmake CONFIG+=track_allocations counts the calls to operator new for the memory dump
+track_allocations: DEFINES += TRACK_ALLOCATIONS
 
 RESOURCES += \
     src/ressource/shaders.qrc \
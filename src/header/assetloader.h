@@ -0,0 +1,54 @@
+#ifndef ASSETLOADER_H
+#define ASSETLOADER_H
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "jobsystem.h"
+
+// Parses assets on the job system while the GL thread keeps running.
+// A load task fills CPU-ready data owned by the caller, then its upload runs as a main thread job
+// once the GL thread runs them (JobSystem::runMainThreadJobs) and hands the data to the GPU.
+// A failed load is reported and never uploaded
+class AssetLoader
+{
+public:
+    AssetLoader();
+    // Waits for the load tasks, the uploads not run yet are cancelled
+    ~AssetLoader();
+
+    int load(const std::string& name, std::function<void()> task, std::function<void()> upload);
+    // Main thread: runs the upload too
+    void wait(int asset);
+
+    bool failed(int asset) const { return assets[asset]->state == failedState; }
+    bool finished() const;
+    float progress() const; // Fraction of the assets loaded or failed
+    void printProgress() const;
+
+private:
+    enum assetState { loadingState, loadedState, uploadedState, failedState };
+
+    struct asset {
+        std::string name;
+        JobHandle task;
+        JobHandle upload;
+        assetState state = loadingState; // Changed by the upload job only
+        bool cancelled = false;
+        double loadTime = 0;
+        double uploadTime = 0;
+        double availableTime = 0; // ms from the loader creation to the upload
+        std::string error;
+    };
+
+    double elapsed() const;
+    void markUploaded(asset& a, double uploadTime);
+
+    std::chrono::steady_clock::time_point startTime;
+    std::vector<std::shared_ptr<asset>> assets; // Shared with their jobs
+};
+
+#endif // ASSETLOADER_H
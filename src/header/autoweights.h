@@ -0,0 +1,41 @@
+#ifndef AUTOWEIGHTS_H
+#define AUTOWEIGHTS_H
+
+#include <string>
+#include <vector>
+
+#include <QVector3D>
+
+#include "bvh.h"
+#include "mesh.h"
+
+// Segment from a joint to one of its children, in mesh units
+struct skinBone {
+    int joint; // nodeIndex, the column of the joint in weights.txt
+    QVector3D head;
+    QVector3D tail;
+};
+
+enum skinWeightMethod { distanceWeights, heatWeights };
+
+struct autoWeightStats {
+    double distanceTime = 0; // ms
+    double solveTime = 0;
+    int nbJoints = 0;
+    int nbIterations = 0;    // Summed over the heat solves
+    int nbUnconverged = 0;
+};
+
+std::vector<skinBone> skinBones(const std::vector<BVHTree*>& skeleton, float unitScale);
+
+// Weights of every vertex in the layout of readWeights, at most maxInfluences per vertex, strongest
+// first and summing to 1. distanceWeights falls off with the distance to the bones a vertex faces,
+// heatWeights diffuses them over the surface (Baran and Popovic, bounded heat equilibrium). The vertices
+// and the joints are spread over the shared job system
+std::vector<std::vector<weight>> computeSkinWeights(const mesh& myMesh, const std::vector<skinBone>& bones, skinWeightMethod method,
+                                                    int maxInfluences = 4, autoWeightStats* stats = nullptr);
+
+// Compares both methods with the painted weights, then times them on subdivided copies of the mesh
+void benchmarkSkinWeights(const std::string& meshFile, const std::string& weightsFile, const std::vector<BVHTree*>& skeleton, float unitScale);
+
+#endif // AUTOWEIGHTS_H
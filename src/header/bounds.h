@@ -0,0 +1,32 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include <QMatrix4x4>
+#include <QVector3D>
+#include <QVector4D>
+
+struct aabb {
+    QVector3D min = QVector3D(1e30f, 1e30f, 1e30f); // Empty until a point is added
+    QVector3D max = QVector3D(-1e30f, -1e30f, -1e30f);
+
+    bool empty() const { return min.x() > max.x(); }
+    void add(const QVector3D& p);
+    void add(const aabb& box);
+    QVector3D center() const { return (min + max) * 0.5f; }
+    QVector3D extent() const { return (max - min) * 0.5f; }
+};
+
+// Box of the transformed corners of a box, in O(1) from the center and the half extents
+aabb transformBox(const QMatrix4x4& matrix, const aabb& box);
+
+enum cullResult { Outside, Intersecting, Inside };
+
+// Clip space planes of a model view projection matrix, normals pointing inside
+struct frustum {
+    QVector4D planes[6];
+
+    explicit frustum(const QMatrix4x4& mvp);
+    cullResult classify(const aabb& box) const;
+};
+
+#endif // BOUNDS_H
@@ -0,0 +1,69 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <iterator>
+#include <stdexcept>
+
+#include <QVector3D>
+#include <QMatrix4x4>
+#include <QQuaternion>
+
+struct BVHTree {
+    std::string name;
+    QVector3D offset;
+    std::vector<std::string> channels;
+    std::vector<std::vector<float>>channelsValues;
+    std::vector<BVHTree*> joints;
+    BVHTree* parent = NULL;
+    int nbNode = 1;
+    int nbLink = 0;
+    int nodeIndex;
+};
+
+// Hierarchy and motion layout of a BVH file, read without decoding the keyframes
+struct BVHHeader {
+    std::vector<std::string> jointNames; // ROOT and JOINT names in file order
+    int nbChannels = 0;
+    int nbFrames = 0;
+    float frameTime = 0;
+};
+
+int readNode(const std::vector<std::string>& tokens, int i, BVHTree* node);
+int readAnimNode(const std::vector<std::string>& tokens, int i, BVHTree* node, float time);
+std::vector<BVHTree*> readBVH(const std::string& file);
+std::vector<BVHTree*> parseBVH(const std::string& content);
+BVHHeader readBVHHeader(const std::string& file);
+void deleteBVH(std::vector<BVHTree*>& roots);
+std::vector<BVHTree*> copyHierarchy(const std::vector<BVHTree*>& roots); // Without the keyframes
+
+// Channel values of a node at a time in seconds, in channel order, interpolated between the
+// surrounding keyframes (angles along the shortest arc). keyFrame is the search cursor, kept
+// between calls so increasing times are found in constant time
+void sampleChannels(const BVHTree* node, float time, float* values, int& keyFrame);
+
+// Parents before children, the order of the channels in a BVH frame and of nodeIndex
+std::vector<BVHTree*> preorder(const std::vector<BVHTree*>& roots);
+// Xposition..Zrotation -> 0..5, -1 for any other channel
+int channelSlot(const std::string& channel);
+// Lower case, without the _dup suffix of repeated joints, to match joints across skeletons
+std::string normalizedName(std::string name);
+// Rotation of the channels in degrees, Rz(psi) Ry(phi) Rx(theta) like GeometryEngine::updateAnimation
+QQuaternion eulerToQuaternion(float theta, float phi, float psi);
+// Time of the first and last keyframes of the animated nodes
+void clipRange(const std::vector<BVHTree*>& nodes, float& start, float& end);
+
+// Channel values of a node, in file order, moved to their channelSlot. The missing ones are 0,
+// returns true if the node has position channels
+bool valuesBySlot(const BVHTree* node, const float* channelValues, float values[6]);
+
+// Global rotation and position of every joint at a time, walking the hierarchy from the channels
+// the way GeometryEngine::updateAnimation does. nodes in preorder, cursors one per node
+void evaluatePose(const std::vector<BVHTree*>& nodes, float time, std::vector<int>& cursors,
+                  std::vector<QQuaternion>& rotations, std::vector<QVector3D>& positions);
+
+#endif // BVH_H
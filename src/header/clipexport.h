@@ -0,0 +1,59 @@
+#ifndef CLIPEXPORT_H
+#define CLIPEXPORT_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+
+struct resampleOptions {
+    float frameTime = 1.0f / 60.0f;
+    float start = 0.0f; // Trim, in seconds of the source clip
+    float end = -1.0f;  // Negative keeps the end of the clip
+    bool loop = false;  // Whole number of frames over [start, end], the frame after the last one is the first
+};
+
+// Every channel of a clip in file order, nbFrames rows of nbChannels values
+struct clipFrames {
+    int nbChannels = 0;
+    int nbFrames = 0;
+    float frameTime = 0;
+    std::vector<float> values;
+};
+
+enum clipFormat { bvhText, binaryClip };
+
+// Samples the clip at the target rate with the interpolation of the animation
+clipFrames resampleClip(const std::vector<BVHTree*>& roots, const resampleOptions& options);
+
+// Both return the number of bytes written and throw std::runtime_error on failure
+size_t writeBVH(const std::string& file, const std::vector<BVHTree*>& roots, const clipFrames& frames);
+size_t writeBinaryClip(const std::string& file, const std::vector<BVHTree*>& roots, const clipFrames& frames);
+
+// Binary clips (.clip) hold the BVH hierarchy as text followed by the frames as raw floats
+std::vector<BVHTree*> readBinaryClip(const std::string& file);
+BVHHeader readBinaryClipHeader(const std::string& file);
+
+// Dispatch on the extension, .clip files are binary clips and anything else BVH
+std::vector<BVHTree*> readClip(const std::string& file);
+BVHHeader readClipHeader(const std::string& file);
+
+struct exportResult {
+    std::string name;
+    std::string file;
+    int nbFrames = 0;
+    size_t bytes = 0;
+    double readTime = 0; // ms
+    double resampleTime = 0;
+    double writeTime = 0;
+    bool failed = false;
+};
+
+// Converts every clip of inputDirectory into outputDirectory, clips are spread over nbThreads
+std::vector<exportResult> exportDirectory(const std::string& inputDirectory, const std::string& outputDirectory,
+                                          const resampleOptions& options, clipFormat format, int nbThreads);
+// Same, with the throughput of each clip and of the whole directory, and of an iostream writer for reference
+void benchmarkExport(const std::string& inputDirectory, const std::string& outputDirectory, const resampleOptions& options, clipFormat format);
+
+#endif // CLIPEXPORT_H
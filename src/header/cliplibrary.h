@@ -0,0 +1,97 @@
+#ifndef CLIPLIBRARY_H
+#define CLIPLIBRARY_H
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "jobsystem.h"
+
+// Decoded motion of a clip, the trees are deleted with the last reference
+struct decodedClip {
+    std::vector<BVHTree*> roots;
+    size_t bytes = 0;     // Resident size of the trees and their keyframes
+    double loadTime = 0;  // ms spent parsing the file
+    ~decodedClip() { deleteBVH(roots); }
+};
+
+struct clipInfo {
+    std::string name; // File name without the .bvh or .clip extension
+    std::string file;
+    BVHHeader header;
+};
+
+struct clipCacheStats {
+    long long hits = 0;
+    long long misses = 0;
+    long long prefetchHits = 0;  // Requests served by a prefetch, finished or still running
+    long long prefetches = 0;
+    long long evictions = 0;
+    long long loads = 0;
+    double loadTime = 0;         // Total and worst parse time, ms
+    double maxLoadTime = 0;
+    double stallTime = 0;        // Total time acquire() waited for a parse, ms
+    size_t peakBytes = 0;
+};
+
+// Indexes a directory of BVH and binary clips from their headers only and parses the motion on first use.
+// Decoded clips are kept in an LRU cache under a memory budget, the least recently used ones are
+// evicted once a new clip goes over it. A clip still held by the caller stays valid after its
+// eviction, it is only dropped from the cache. Thread safe, clips are parsed by jobs of the shared job
+// system and prefetch() submits one so the clip is ready when acquire() asks for it.
+class ClipLibrary
+{
+public:
+    explicit ClipLibrary(size_t budget = 64 << 20);
+    ~ClipLibrary();
+
+    // Returns the number of clips found
+    int index(const std::string& directory);
+    const std::vector<clipInfo>& clips() const { return entries; }
+    int find(const std::string& name) const;
+
+    // Throws std::runtime_error for an unknown clip or a file that does not parse
+    std::shared_ptr<decodedClip> acquire(const std::string& name);
+    void prefetch(const std::string& name);
+
+    void setBudget(size_t bytes);
+    size_t budget() const { return byteBudget; }
+    size_t residentBytes() const;
+
+    clipCacheStats stats() const;
+    void printStats() const;
+
+private:
+    // Parse in flight, the job writes clip
+    struct pendingClip {
+        JobHandle job;
+        std::shared_ptr<decodedClip> clip;
+    };
+
+    struct cacheSlot {
+        std::shared_ptr<decodedClip> clip;
+        std::shared_ptr<pendingClip> pending;
+        bool prefetched = false;
+        std::list<int>::iterator recent; // Position in the LRU list, valid while the clip is cached
+    };
+
+    std::shared_ptr<pendingClip> submitDecode(int clip);
+    void install(int clip, std::shared_ptr<decodedClip> decoded);
+    void collectPrefetched();
+    void evict(int keep);
+
+    std::vector<clipInfo> entries;
+    std::vector<cacheSlot> slots;
+    std::list<int> recentlyUsed; // Most recent first
+
+    size_t byteBudget;
+    size_t resident = 0;
+    clipCacheStats cacheStats;
+    mutable std::mutex mutex;
+};
+
+#endif // CLIPLIBRARY_H
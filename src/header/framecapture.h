@@ -0,0 +1,100 @@
+#ifndef FRAMECAPTURE_H
+#define FRAMECAPTURE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <QOpenGLExtraFunctions>
+
+// Png writes frame_0000.png..., Yuv appends I420 frames (BT.601, limited range) to capture_WxH.yuv
+enum captureFormat { CapturePng, CaptureYuv };
+
+struct captureOptions {
+    captureFormat format = CapturePng;
+    std::string directory = "capture";
+    int nbBuffers = 3;         // Pixel buffer objects, a frame is mapped at most nbBuffers - 1 frames later
+    int nbThreads = 0;         // Encoders, 0 uses every hardware thread but one
+    int maxQueued = 8;         // Frames read back and waiting for an encoder
+    bool dropWhenBusy = true;  // A frame is dropped when the queue is full, otherwise the GL thread waits
+};
+
+struct captureStats {
+    long long captured = 0;  // capture() calls
+    long long written = 0;
+    long long dropped = 0;   // Queue full
+    long long late = 0;      // Readbacks still running when their buffer came round again, waited for
+    long long failed = 0;    // Files not written
+    double readbackTime = 0; // ms of the GL thread: reads, fence checks, maps and copies
+    double encodeTime = 0;   // ms summed over the encoders
+};
+
+// Reads frames back through a ring of pixel buffer objects and encodes them on worker threads.
+// capture() starts the copy of the bound read framebuffer into the next buffer, then hands the
+// buffers whose fence passed to the encoders: the GL thread only waits when the ring is full.
+// Frames entering the queue are numbered in order, dropped frames leave no gap.
+class FrameCapture : protected QOpenGLExtraFunctions
+{
+public:
+    FrameCapture();
+    ~FrameCapture();
+
+    // With the context current. Needs fences, OpenGL 3.2 or ES 3.0
+    bool start(int width, int height, const captureOptions& options);
+    void capture();
+    // Maps the frames still in flight, waits for the encoders and frees the buffers, context current
+    void finish();
+
+    bool active() const { return running; }
+    int width() const { return frameWidth; }
+    int height() const { return frameHeight; }
+    captureStats stats() const;
+    void printStats() const;
+
+private:
+    struct captureJob {
+        long long sequence;
+        std::vector<uint8_t> pixels; // RGBA rows, bottom row first
+    };
+
+    bool retireOldest(bool wait);
+    void encodeLoop();
+    bool writePng(const captureJob& job);
+    bool writeYuv(captureJob& job, std::vector<uint8_t>& yuv);
+
+    captureOptions settings;
+    int frameWidth = 0;
+    int frameHeight = 0;
+    bool running = false;
+
+    // GL thread: the ring, head is the next buffer to read into
+    std::vector<GLuint> buffers;
+    std::vector<GLsync> fences;
+    int head = 0;
+    int inFlight = 0;
+    long long nextSequence = 0; // Never reset, a restarted capture continues the numbering
+
+    // Shared with the encoders
+    mutable std::mutex mutex;
+    std::condition_variable jobReady;
+    std::condition_variable jobTaken;
+    std::deque<captureJob> jobs;
+    std::vector<std::vector<uint8_t>> freePixels; // Reused so the steady state does not allocate
+    bool stopping = false;
+    captureStats counters;
+    std::vector<std::thread> encoders;
+
+    // Yuv frames are converted in parallel and appended in sequence
+    std::mutex fileMutex;
+    std::ofstream yuvFile;
+    std::map<long long, std::vector<uint8_t>> pendingYuv;
+    long long nextYuvSequence = 0;
+};
+
+#endif // FRAMECAPTURE_H
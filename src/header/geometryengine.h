@@ -7,7 +7,12 @@
 #include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
 #include <QOpenGLBuffer>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLTimerQuery>
+#include <QOpenGLTexture>
 
+#include <algorithm>
+#include <cstddef>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -15,43 +20,273 @@
 #include <vector>
 #include <deque>
 #include <cmath>
+#include <map>
+#include <memory>
 
 #include <QVector2D>
 #include <QVector3D>
+#include <QVector4D>
 #include <QMatrix4x4>
 
+#include "bvh.h"
 #include "mesh.h"
+#include "xsensdata.h"
+#include "xsensstream.h"
+#include "renderstate.h"
+#include "shadercache.h"
+#include "assetloader.h"
+#include "cliplibrary.h"
+#include "retarget.h"
+#include "ik.h"
+#include "autoweights.h"
+#include "memorystats.h"
+#include "bounds.h"
+#include "posecache.h"
+#include "meshlod.h"
+#include "gpupose.h"
+#include "morphtargets.h"
+#include "picking.h"
 
-struct BVHTree {
-    std::string name;
-    QVector3D offset;
+struct VertexData
+{
+    QVector3D position;
+    QVector3D color;
+    QVector2D texCoord;
+};
+
+struct VertexSkinData
+{
+    QVector3D position;
+    QVector3D color;
+    float weight0;
+    float weight1;
+    float weight2;
+    float weight3;
+    QVector4D joints;
+    QVector3D normal;
+};
+
+// Influences 5 to 8, only uploaded when a vertex has more than 4
+struct VertexSkinExtraData
+{
+    QVector4D weights;
+    QVector4D joints;
+};
+
+// Output of the transform feedback skinning pre-pass
+struct SkinnedVertexData
+{
+    QVector3D position;
+    QVector3D normal;
+};
+
+// GPU time of a render pass, read back on a later frame so it never stalls
+struct gpuPassTimer
+{
+    QOpenGLTimerQuery query;
+    bool unsupported = false;
+    bool running = false;
+    bool pending = false;
+    double totalTime = 0; // ms
+    int nbSamples = 0;
+
+    void begin();
+    void end();
+    void reset();
+    double averageTime() const;
+};
+
+// Size of the u_palette uniform array of the vertex shader
+const int maxSkinJoints = 32;
+const int maxSkinInfluences = 8;
+
+// Vertices with up to nbInfluences influences (1, 2, 4 or 8) are contiguous, and so are the
+// triangles whose most influenced vertex is in the bucket
+struct influenceBucket
+{
+    int nbInfluences;
+    int firstVertex;
+    int nbVertices;
+    int firstIndex;
+    int nbIndices;
+};
+
+// Level of detail of the skin mesh: its influence buckets, vertices and triangles are contiguous ranges
+// of the shared skin buffers
+struct meshLod
+{
+    int firstBucket;
+    int nbBuckets;
+    int firstVertex;
+    int nbVertices;
+    int firstIndex;
+    int nbIndices;
+    float error; // Mesh units
+};
+
+// Evaluated pose of a node of the engine's skeleton. The trees can be shared with the clip cache
+// and other players, what an evaluation leaves behind stays here
+struct jointPose
+{
     QMatrix4x4 rotationMatrix;
-    std::vector<std::string> channels;
-    std::vector<std::vector<float>>channelsValues;
-    std::vector<BVHTree*> joints;
-    BVHTree* parent = NULL;
-    int nbNode = 1;
-    int nbLink = 0;
-    int vertexIndex;
-    int nodeIndex;
+    QVector3D worldPosition;
+    float values[6] = {0, 0, 0, 0, 0, 0}; // Last sampled channels, used to recompute only the changed subtrees
+    int parent = -1;                      // In nodeList
+    int keyFrameIndex = 0;                // Search cursor of sampleChannels
+    bool evaluated = false;
+    bool dirty = true;
+};
+
+// Hand or foot held at a target by a two bone chain ending at it, in the space the rig is drawn in
+struct ikPin
+{
+    std::string effector; // Normalized joint name
+    QVector3D target;
+    float weight = 1.0f;
+    int chain = -1;       // In the solver of the current rig, -1 if the rig has no such limb
+};
+
+struct cullingStats
+{
+    long long tests = 0;        // drawScene calls with a character to draw
+    long long culled = 0;
+    long long unbounded = 0;    // Dual quaternion poses too spread out to bound, drawn untested
+    long long time = 0;         // ns spent bounding and testing
+};
+
+// What a ray meets on the character: the joint whose star it crosses nearest, and the nearest skin triangle
+struct pickResult
+{
+    int joint = -1;          // nodeIndex, -1 if the ray crosses no star
+    std::string jointName;
+    QVector3D jointPosition;
+    int triangle = -1;       // Of the full level in its packed order, -1 if the ray misses the skin
+    int vertex = -1;         // Vertex of skin.off at the corner of the triangle nearest to the hit
+    QVector3D point;
+    QVector3D normal;        // Facing the ray
+    float distance = 0;      // Along the ray to the skin
 };
 
-int readNode(const std::vector<std::string>& tokens, int i, BVHTree* node);
-int readAnimNode(const std::vector<std::string>& tokens, int i, BVHTree* node, float time);
-std::vector<BVHTree*> readBVH(const std::string& file);
+struct pickingStats
+{
+    double buildTime = 0;    // ms, the tree is built once per mesh
+    long long refits = 0;
+    double skinTime = 0;     // ms spent skinning the full level for the refits
+    double refitTime = 0;
+    long long picks = 0;
+    long long hits = 0;      // Picks that met the skin or a joint
+    double pickTime = 0;     // ms, a refit left for the pick included
+    double maxPickTime = 0;
+};
 
 class GeometryEngine : protected QOpenGLFunctions
 {
 public:
+    // SkinInShader skins in the vertex shader of every draw, SkinOnce skins
+    // once per pose into skinnedBuf with transform feedback and every pass reads it,
+    // SkinOnCpu fills skinnedBuf once per pose on the CPU
+    enum SkinningMode { SkinInShader, SkinOnce, SkinOnCpu };
+    enum SkinningMethod { LinearBlend, DualQuaternion };
+
     GeometryEngine();
     virtual ~GeometryEngine();
 
+    bool setSkinningMode(SkinningMode mode);
+    SkinningMode skinningMode() const { return mode; }
+    void printSkinningStats();
+
+    // Selects the compiled mesh and pre-pass variants. nbInfluences (1, 2, 4 or 8) caps the
+    // influences of every bucket, the strongest ones are kept
+    bool setSkinningVariant(SkinningMethod method, int nbInfluences);
+    SkinningMethod skinningMethod() const { return method; }
+    int skinningInfluences() const { return nbInfluences; }
+    void printShaderStats();
+
+    void setStateCaching(bool enabled);
+    void resetRenderStats();
+    void printRenderStats();
+
+    // Skips skinning and drawing when the character is outside the view
+    void setCulling(bool enabled) { culling = enabled; }
+    const aabb& characterBox() const { return characterBounds; }
+    void printCullingStats() const;
+
+    // The coarsest level whose error stays under maxPixelError pixels on screen is drawn, 0 always
+    // draws the full mesh. forceLod() overrides the choice, -1 restores it
+    void setLodSelection(float maxPixelError) { lodPixelError = maxPixelError; }
+    void forceLod(int lod) { forcedLod = lod; }
+    void setViewportHeight(int height) { viewportHeight = height; }
+    int nbLods() const { return skinLods.size(); }
+    const meshLod& lod(int level) const { return skinLods[level]; }
+    void printLodStats() const;
+
+    // Uploads the assets parsed since the last call, the skeleton is drawn as soon as
+    // its clip is uploaded and the mesh once the mesh and its weights are
+    void uploadReadyAssets();
+    void waitForAssets();
+    bool assetsReady() const { return rigReady && skinReady; }
+    void printAssetProgress() const;
+
+    // Switches the rig to a clip of the library once it is parsed, the following clip is prefetched
+    bool playClip(const std::string& name);
+    void playNextClip();
+    const std::string& clipName() const { return currentClipName; }
+    void setClipBudget(size_t bytes);
+    void printClipStats() const;
+    // Plays the sensor files of an Xsens recording directory like a clip, smoothed by the filter
+    // set before and retargeted onto the skeleton of the skin
+    bool playXsensRecording(const std::string& directory);
+    void setXsensFilter(const xsensFilterOptions& options);
+
+    // Plays clips from a table of global joint transforms baked once per clip, instead of
+    // walking the hierarchy every frame. Live input is never baked
+    void setPoseBaking(bool enabled, bakePrecision precision = BakeFloat);
+    void printBakeStats() const;
+
+    // Evaluates the poses of the clip in the skinning shaders from a keyframe texture uploaded once
+    // per clip, updateAnimation() then only sets the time the next draws read. The rig is not drawn,
+    // its lines are posed on the CPU. Needs float textures in vertex shaders, neither CPU skinning
+    // nor live input
+    bool setGpuPose(bool enabled);
+    bool gpuPose() const { return gpuPoseEnabled; }
+
+    // Inverse kinematics on top of the clip or live pose: the effector is solved with its parent and
+    // grandparent, weight 0 leaves the limb animated and 1 reaches the target when it can. Pins are
+    // kept by joint name across clips and only move poses evaluated on the CPU. Returns false if the
+    // current rig has no such limb
+    bool pinJoint(const std::string& effector, const QVector3D& target, float weight = 1.0f);
+    void releaseJoint(const std::string& effector);
+    void releaseJoints();
+    void printIkStats() const;
+    // Where the joint is drawn in the current pose, false if the rig has no such joint
+    bool jointPosition(const std::string& joint, QVector3D& position) const;
+
+    // Shapes read next to the mesh, skin.<name>.off for skin.off, added to the rest vertices by weight
+    // before any skinning. Weights are clamped to [0, 1] and may be set before the mesh is loaded
+    void setMorphWeight(const std::string& name, float weight);
+    int nbMorphTargets() const { return morphs.nbTargets(); }
+    void printMorphStats() const;
+
+    // Picks against the full level of the skin, skinned on the CPU into a tree built once and refit when
+    // the pose or the morph weights change. The refit is done by the first pick of a pose, or by drawScene()
+    // every frame once enabled here, so picks only query the tree but each frame pays a CPU skinning
+    void setPicking(bool enabled) { picking = enabled; }
+    bool pickingEveryFrame() const { return picking; }
+    pickResult pick(const pickRay& ray);
+    void printPickStats() const;
+
+    // CPU bytes of the clip, the skeleton and the mesh copies, GPU bytes of each buffer
+    void memoryReport(MemoryReport& report) const;
+
     void updateAnimation(float elapseTime);
+    // Drives the skeleton of the skin from the stream, false if that skeleton could not be loaded
+    bool initLiveGeometry(XsensStream* stream);
 
     void drawCubeGeometry(QOpenGLShaderProgram *program);
     void drawRepereGeometry(QOpenGLShaderProgram *program);
     void drawBVHGeometry(QOpenGLShaderProgram *program);
-    void drawMeshGeometry(QOpenGLShaderProgram *program);
+    void drawScene(const QMatrix4x4& mvp);
+    void skinMeshGeometry();
 
 private:
     BVHTree loadBVH(std::string filename);
@@ -59,20 +294,236 @@ private:
     void initCubeGeometry();
     void initRepereGeometry();
     void initBVHGeometry(std::string filename);
-    void initMeshGeometry(std::string filenameMesh, std::string filenameWeights);
-
-    // std::vector<QMatrix4x4> rigTranfosList;
-    QVector3D rigTranfosList[31]; // Use the number of joint
+    std::shared_ptr<decodedClip> loadSkinSkeleton();
+    void initRigGeometry(std::vector<BVHTree*> roots);
+    void initMeshGeometry(const std::vector<VertexSkinData>& vertices, const std::vector<VertexSkinExtraData>& extra,
+                          const std::vector<GLushort>& indices, const std::vector<influenceBucket>& buckets,
+                          const std::vector<meshLod>& lods);
+    void initShaders();
+    bool initSkinningPass();
+    void uploadSkinPalette(QOpenGLShaderProgram *program);
+    void markPaletteDirty(int first, int last);
+    void packCpuPalette(const std::vector<QMatrix4x4>& matrices, const std::vector<QVector4D>& dqReal,
+                        const std::vector<QVector4D>& dqDual, std::vector<float>& palette) const;
+    void skinLevelOnCpu(const meshLod& lod, const float* palette, SkinnedVertexData* output) const;
+    void skinMeshOnCpu();
+    void updateCharacterBounds();
+    void bakeCurrentClip();
+    void uploadPoseTexture();
+    void uploadPoseUniforms(QOpenGLShaderProgram *program);
+    void updatePoseBounds();
+    bool skinBounds(const std::vector<aabb>& boxes, const std::vector<QVector4D>& rotations, const std::vector<float>& slack,
+                    aabb& bounds) const;
+    void evaluateJoint(int i, float elapseTime, bool baked, int bakedFrame, float bakedBlend);
+    void writeJoint(int i);
+    void compileIk();
+    void applyIk();
+    void uploadRig();
+    void uploadSkin();
+    void initMorphTargets();
+    void applyMorphTargets();
+    void updatePickTree();
+    bool characterVisible(const QMatrix4x4& mvp);
+    void selectLod(const QMatrix4x4& mvp);
 
-    int nbVertex;
-    int nbIndex;
+    int nbVertex = 0;
+    int nbIndex = 0;
+    int nbIndexSkin = 0;
+    int nbVertexSkin = 0;
 
     std::vector<BVHTree*> rootList;
+    std::vector<BVHTree*> nodeList; // Breadth first, parents before children
+    std::vector<jointPose> jointPoses; // Same order, the stars of a node start at vertex 7 * its index
+    std::vector<int> poseLevels;       // Ranges of nodeList whose parents all come before the range
+    const int poseGrain = 64;          // Joints per pose job, a job costs about as much as a few joints
+    std::vector<VertexData> rigVertices;
+    float lastElapseTime = -1.0f;
 
-    std::vector<BVHTree*> rootList;
+    // Pins solved after each CPU evaluation. ikJointNodes maps the joints of ikRig (preorder) to nodeList,
+    // ikNodeJoints back
+    std::vector<ikPin> ikPins;
+    bool ikCompiled = false;
+    ikSkeleton ikRig;
+    std::vector<ikChain> ikChains;
+    std::vector<int> ikJointNodes;
+    std::vector<int> ikNodeJoints;
+    std::unique_ptr<IkSolver> ikSolver;
+    ikPoseBatch ikPose;
+    std::vector<ikTarget> ikTargets;
+    std::vector<ikStats> ikChainStats;
+    std::vector<char> ikMoved;            // Per node, by the last solve
+    std::vector<QMatrix4x4> ikOldRotation; // Per node, the evaluated pose before the solve
+    std::vector<QVector3D> ikOldPosition;
+    double ikTime = 0;
+    long long nbIkUpdates = 0;
+
+    // Rest position of each joint in mesh units and skinning matrices
+    std::vector<QVector3D> restPositions;
+    std::vector<QMatrix4x4> skinPalette;
+    std::vector<QVector4D> skinDqReal; // Same transforms without the scale, for SKINNING_DQS
+    std::vector<QVector4D> skinDqDual;
+
+    // Per program u_palette locations, [firstDirtyJoint, lastDirtyJoint] is not uploaded yet
+    struct paletteUpload {
+        std::vector<int> locations;
+        std::vector<int> dqRealLocations;
+        std::vector<int> dqDualLocations;
+        int firstDirtyJoint = 0;
+        int lastDirtyJoint = -1;
+    };
+    std::map<GLuint, paletteUpload> paletteUploads;
+
+    SkinningMode mode = SkinInShader;
+    bool skinningPassSupported = false;
+    bool skinnedMeshDirty = true;
+
+    // Programs of the current variants, owned by shaders
+    ShaderCache shaders;
+    QOpenGLShaderProgram* rigProgram = nullptr;
+    QOpenGLShaderProgram* skinnedProgram = nullptr; // Shades the vertices of skinnedBuf
+    QOpenGLShaderProgram* meshProgram = nullptr;
+    QOpenGLShaderProgram* skinProgram = nullptr;
+    std::vector<QOpenGLShaderProgram*> bucketMeshPrograms; // Per influence bucket, 1, 2, 4 and 8
+    std::vector<QOpenGLShaderProgram*> bucketSkinPrograms;
+    SkinningMethod method = LinearBlend;
+    int nbInfluences = 4;
+    QOpenGLBuffer skinnedBuf;
+    gpuPassTimer skinPassTimer;
+    gpuPassTimer scenePassTimer;
+
+    // Copies of the mesh buffers for SkinOnCpu, palette packed as 3x4 rows or dual quaternions.
+    // Buckets of every level of detail, the current one is skinned and drawn
+    std::vector<influenceBucket> skinBuckets;
+    std::vector<meshLod> skinLods;
+    int currentLod = 0;
+    int forcedLod = -1;
+    float lodPixelError = 0.0f;
+    int viewportHeight = 480;
+    std::vector<float> lodErrors;
+    std::vector<long long> lodFrames; // drawScene calls per level
+    std::vector<VertexSkinData> skinVertices;
+    std::vector<VertexSkinExtraData> skinExtra; // Empty if no vertex has more than 4 influences
+    std::vector<SkinnedVertexData> cpuSkinned;
+    std::vector<float> cpuPalette;
+    double cpuSkinTime = 0; // ms
+    int nbCpuSkinPasses = 0;
+
+    // Rest pose boxes of the vertices each joint influences, posed by the palette every frame.
+    // The character box holds them, the box of the rig, and the dual quaternion blends of influenceSets
+    std::vector<aabb> jointBounds;
+    std::vector<aabb> posedJointBounds; // By joint
+    aabb rigBounds;
+    aabb characterBounds;
+    bool characterBounded = true;
+
+    // Joints blended together by some vertex, the strongest (the pivot of the shader) first. Over the
+    // vertices and the influence caps of the set, with weights w normalized: the smallest sum of w^2
+    // and the largest sum of w_i w_j over the pairs of other joints
+    struct influenceSet {
+        int joints[maxSkinInfluences];
+        int nbJoints;
+        float minSquares;
+        float maxCross;
+    };
+    std::vector<influenceSet> influenceSets;
+    bool culling = true;
+    cullingStats cullStats;
+
+    // Meshes of renderState, the cube and the repere reuse the rig buffers
+    RenderState renderState;
+    int rigMesh = -1;
+    int skinMesh = -1;
+    int skinnedMesh = -1;
+
+    // Clip driving the rig, held here so an eviction from the library does not free it
+    ClipLibrary clips;
+    std::shared_ptr<decodedClip> currentClip;
+    std::string currentClipName;
+    std::string loadingClipName;
+    // Written on the GUI thread only, by uploadRig(). A load task reads what playClip() hands it
+    std::shared_ptr<decodedClip> skinSkeleton; // Hierarchy only, the target of the retargeting
+    std::map<std::string, retargetMap> retargetMaps; // By clip name
+
+    // Baked clips by name, kept when another clip plays
+    bool poseBaking = false;
+    bakePrecision bakedPrecision = BakeFloat;
+    std::map<std::string, std::shared_ptr<BakedClip>> bakedClips;
+    std::shared_ptr<BakedClip> currentBake;
+    double bakedSampleTime = 0; // ms
+    long long nbBakedPoses = 0;
+
+    // GPU poses: keys of the current clip, kept on the CPU for the bounds, and the time of the next draws
+    bool gpuPoseEnabled = false;
+    poseTexture poseKeys;
+    QOpenGLTexture poseKeyTexture;
+    int poseKeysVersion = 0; // Bumped by each upload, the programs reload the uniforms of the clip
+    struct poseUpload {
+        int version = -1;
+        int timeLocation = -1;
+    };
+    std::map<GLuint, poseUpload> poseUploads;
+    float poseTime = 0.0f;
+    aabb poseBounds; // Character over the whole clip
+    bool poseBounded = true;
+
+    // Morph targets remapped onto the skin vertices of every level, applied to skinVertices and the
+    // spans of arrayBufSkin they change when a weight does
+    MorphAccumulator morphs;
+    std::vector<float> morphWeights;
+    std::map<std::string, float> morphWeightsByName;
+    bool morphWeightsDirty = false;
+    double morphTime = 0; // ms
+    long long nbMorphPasses = 0;
+    long long nbMorphDeltas = 0;
+    long long morphUploadBytes = 0;
+
+    // Picking: triangles of the full level, its skinned vertices and the tree over them
+    bool picking = false;
+    bool pickTreeDirty = true;
+    std::vector<int> pickIndices;
+    std::vector<int> pickSources; // Vertex of skin.off of each packed vertex of the full level
+    std::vector<SkinnedVertexData> pickSkinned;
+    std::vector<QVector3D> pickPositions;
+    std::vector<float> pickPalette;
+    TriangleBvh pickTree;
+    pickingStats pickStats;
+
+    // Background loading, the tasks fill the loaded* members for the GL thread.
+    // assets is declared after them so its destructor waits for the tasks first
+    std::shared_ptr<decodedClip> loadedClip;
+    std::shared_ptr<decodedClip> loadedSkinSkeleton;
+    std::shared_ptr<retargetMap> loadedRetargetMap; // Compiled by the task, null if it was known
+    std::vector<VertexSkinData> loadedSkinVertices;
+    std::vector<VertexSkinExtraData> loadedSkinExtra;
+    std::vector<GLushort> loadedSkinIndices;
+    std::vector<influenceBucket> loadedSkinBuckets;
+    std::vector<meshLod> loadedSkinLods;
+    std::vector<int> loadedSkinSources;
+    std::vector<morphTarget> loadedMorphTargets;
+    AssetLoader assets;
+    int rigAsset = -1;
+    int skinAsset = -1;
+    bool rigReady = false;
+    bool skinReady = false;
+
+    // Live Xsens input retargeted onto skinSkeleton: each pose is written as a frame of liveSource, the
+    // rig of the suit, then mapped to a frame of the rig where node i reads from channel liveChannels[i]
+    XsensStream* liveStream = nullptr;
+    std::vector<BVHTree*> liveSource;
+    retargetMap liveMap;
+    retargetScratch liveScratch;
+    std::vector<int> liveSourceJoints; // Joint of xsensSkeleton of each liveSource joint in preorder, -1 for end sites
+    std::vector<float> liveSourceFrame;
+    std::vector<float> liveFrame;
+    std::vector<int> liveChannels;
+    xsensPose livePose;
+    bool hasLivePose = false;
+    bool xsensFiltered = false;
+    xsensFilterOptions xsensFilter;
 
     QOpenGLBuffer arrayBufRig;
     QOpenGLBuffer arrayBufSkin;
+    QOpenGLBuffer arrayBufSkinExtra;
     QOpenGLBuffer indexBufRig;
     QOpenGLBuffer indexBufSkin;
 };
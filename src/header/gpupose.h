@@ -0,0 +1,40 @@
+#ifndef GPUPOSE_H
+#define GPUPOSE_H
+
+#include <cstddef>
+#include <vector>
+
+#include <QQuaternion>
+#include <QVector3D>
+
+#include "bvh.h"
+#include "cliplibrary.h"
+
+// Local transform of the joints of a clip at regular times, laid out like the keyframe texture of the
+// GPU_POSE shaders: a row per frame, joint j in texels 2j (rotation x, y, z, w) and 2j + 1 (offset from
+// its parent in skeleton units, w unused). Consecutive rotations of a joint are in the same hemisphere
+struct poseTexture {
+    int nbJoints = 0;        // First joints in preorder, joint j at nodeIndex j
+    int nbFrames = 0;
+    float startTime = 0.0f;
+    float frameTime = 0.0f;
+    std::vector<float> texels;
+    std::vector<int> parents; // Of each joint, -1 for a root
+    double buildTime = 0;     // ms
+
+    int width() const { return 2 * nbJoints; }
+    size_t bytes() const { return texels.size() * sizeof(float) + parents.size() * sizeof(int); }
+};
+
+// Joints past maxJoints are left out, none of them is the parent of a joint kept
+poseTexture compilePoseTexture(const std::vector<BVHTree*>& roots, int maxJoints);
+
+// What the shaders compute: global rotation and position in skeleton units of a joint at a time,
+// clamped to the clip, keys blended by normalized lerp and composed up to the root
+void samplePoseTexture(const poseTexture& keys, float time, int joint, QQuaternion& rotation, QVector3D& position);
+
+// Texture size and error of the GPU evaluation of each clip of the library against the hierarchy,
+// with the CPU cost per instance it replaces
+void benchmarkGpuPose(ClipLibrary& library, int maxJoints);
+
+#endif // GPUPOSE_H
@@ -0,0 +1,109 @@
+#ifndef IK_H
+#define IK_H
+
+#include <string>
+#include <vector>
+
+#include <QQuaternion>
+#include <QVector3D>
+
+#include "bvh.h"
+#include "cliplibrary.h"
+
+// Hierarchy of a BVH skeleton in preorder, parents first. Channel indices point into a flat frame
+// of every channel in file order, -1 when the joint has no such channel
+struct ikSkeleton {
+    std::vector<std::string> names; // Lowercase, without the "_dup" suffix
+    std::vector<int> parent;
+    std::vector<QVector3D> offset;
+    std::vector<int> rotationChannels; // X, Y, Z per joint
+    int positionChannels[3] = {-1, -1, -1};
+    int nbChannels = 0;
+};
+
+ikSkeleton compileIkSkeleton(const std::vector<BVHTree*>& roots);
+int findIkJoint(const ikSkeleton& skeleton, const std::string& name);
+
+// TwoBone is analytic (shoulder or hip, elbow or knee, hand or foot), Fabrik and Ccd iterate
+// over chains of any length
+enum ikMethod { TwoBone, Fabrik, Ccd };
+
+struct ikChain {
+    ikMethod method = TwoBone;
+    std::vector<int> joints; // Root to effector, each joint the parent of the next
+    bool keepEffectorOrientation = false; // Planted feet stay flat
+    int maxIterations = 16;
+    float tolerance = 0.01f; // Skeleton units
+};
+
+// Throws std::invalid_argument for unknown joints or joints that do not form a parent to child path
+ikChain makeIkChain(const ikSkeleton& skeleton, ikMethod method, const std::vector<std::string>& names);
+
+// Evaluated poses of several characters, joint j of character c at c * nbJoints + j
+struct ikPoseBatch {
+    int nbCharacters = 0;
+    int nbJoints = 0;
+    std::vector<QQuaternion> local;
+    std::vector<QVector3D> rootPosition;
+
+    void resize(int characters, int joints);
+};
+
+void poseFromFrame(const ikSkeleton& skeleton, const float* frame, ikPoseBatch& poses, int character);
+void poseToFrame(const ikSkeleton& skeleton, const ikPoseBatch& poses, int character, float* frame);
+
+// Goal of one chain of one character, weight 0 leaves the chain as it is and 1 reaches the target
+struct ikTarget {
+    QVector3D position;
+    float weight = 0.0f;
+};
+
+struct ikStats {
+    long long solves = 0;
+    long long unreachable = 0; // Target farther than the stretched chain, never converged
+    long long converged = 0; // Effector within the tolerance of its target
+    long long iterations = 0;
+    double errorSum = 0;     // Effector distance to the target after the solve
+    double maxError = 0;
+};
+
+// Solves every chain of every character of a batch. The buffers are sized once by the
+// constructor, solve() does not allocate
+class IkSolver
+{
+public:
+    IkSolver(const ikSkeleton& skeleton, const std::vector<ikChain>& chains);
+
+    int nbChains() const { return chains.size(); }
+
+    // targets[c * nbChains() + k] is the target of chain k of character c, stats[k] collects chain k
+    void solve(ikPoseBatch& poses, const ikTarget* targets, ikStats* stats);
+    // Global effector position of a chain of a character, for planting targets
+    QVector3D effectorPosition(const ikPoseBatch& poses, int character, int chain);
+
+private:
+    void forwardKinematics(const ikPoseBatch& poses, int character);
+    void gatherChain(const ikChain& chain);
+    void scatterChain(const ikChain& chain, QQuaternion* local);
+    int solveTwoBone(const ikChain& chain, const QVector3D& target);
+    int solveFabrik(const ikChain& chain, const QVector3D& target);
+    int solveCcd(const ikChain& chain, const QVector3D& target);
+
+    ikSkeleton skeleton;
+    std::vector<ikChain> chains;
+
+    // Whole skeleton of the current character, then the chain being solved
+    std::vector<QQuaternion> globalRotation;
+    std::vector<QVector3D> globalPosition;
+    std::vector<QQuaternion> chainRotation;
+    std::vector<QVector3D> chainPosition;
+    std::vector<QVector3D> chainOffset; // Offset of each joint from the previous one
+    std::vector<float> chainLength;
+    QQuaternion effectorRotation;       // Global, kept by keepEffectorOrientation
+};
+
+// Solves per second and convergence of each solver on batches of reach targets, then foot sliding of
+// a clip before and after planting its feet
+void benchmarkIk(ClipLibrary& library, const std::string& clipName);
+
+#endif // IK_H
@@ -0,0 +1,132 @@
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Where a job may run: on any thread, or only on the main thread, for the work that needs its GL context
+enum jobAffinity { AnyThread, MainThread };
+
+// One job run, recorded while profiling. Thread 0 is the main thread, 1.. the workers, -1 any other
+struct jobSample {
+    const char* name;
+    int thread;
+    double start;    // ms since the creation of the job system
+    double duration; // ms
+};
+
+struct jobTask;
+
+class JobHandle
+{
+public:
+    bool valid() const { return task != nullptr; }
+    bool done() const;
+    // Once done, what the job threw, null if it returned
+    std::exception_ptr error() const;
+
+private:
+    friend class JobSystem;
+    std::shared_ptr<jobTask> task;
+};
+
+// Work stealing scheduler. Every thread has its own deque: it pushes and pops its jobs at the back, idle
+// threads steal the oldest ones at the front. A job starts once all its dependencies are done, failed or
+// not, and main thread jobs wait for runMainThreadJobs() or a wait() of the main thread on one of them.
+// Threads that wait run other jobs meanwhile
+class JobSystem
+{
+public:
+    // The calling thread is the main thread. A negative count uses every hardware thread but this one
+    // and one worker at least, 0 runs every job on the threads that wait and in runMainThreadJobs()
+    explicit JobSystem(int nbWorkers = -1);
+    // Runs the jobs still queued first, main thread jobs released later are dropped
+    ~JobSystem();
+
+    // Shared by the loaders, the pose and the skinning stages. main() creates it on the GUI thread
+    static JobSystem& shared();
+
+    // name is kept as a pointer, a string literal
+    JobHandle submit(const char* name, std::function<void()> job, const std::vector<JobHandle>& dependencies = {},
+                     jobAffinity affinity = AnyThread);
+    // Main thread jobs are only run meanwhile when job is one of them
+    void wait(const JobHandle& job);
+    void wait(const std::vector<JobHandle>& jobs);
+
+    // body(first, last) over [0, count) in chunks of grain items or more, the caller runs its share.
+    // Returns once every chunk ran, rethrows the first exception of a chunk
+    void parallelFor(const char* name, int count, int grain, const std::function<void(int, int)>& body);
+
+    // Main thread only, returns the number of jobs run. Without workers, the other queued jobs too
+    int runMainThreadJobs();
+
+    int nbWorkers() const { return workers.size(); }
+    int nbThreads() const { return workers.size() + 1; }
+    bool onMainThread() const { return std::this_thread::get_id() == mainThread; }
+
+    // Samples are kept per thread while profiling. The hook is called by the thread that ran each job,
+    // set it before submitting
+    void setProfiling(bool enabled) { profiling = enabled; }
+    void setProfileHook(std::function<void(const jobSample&)> hook) { profileHook = std::move(hook); }
+    std::vector<jobSample> takeProfile();
+    // Jobs by name, then the jobs, steals and busy time of each thread since the last call
+    void printProfile();
+
+private:
+    struct alignas(64) threadQueue {
+        std::mutex mutex;
+        std::deque<std::shared_ptr<jobTask>> jobs;
+        std::vector<jobSample> samples;
+        std::atomic<long long> nbJobs{0};
+        std::atomic<long long> nbSteals{0};
+        std::atomic<long long> busyTime{0}; // ns
+    };
+
+    int queueIndex() const;
+    void schedule(const std::shared_ptr<jobTask>& task);
+    void release(const std::shared_ptr<jobTask>& task);
+    std::shared_ptr<jobTask> findJob(int index);
+    std::shared_ptr<jobTask> popMainThreadJob();
+    void run(const std::shared_ptr<jobTask>& task, int index);
+    void notifyWaiters();
+    void waitUntil(const std::function<bool()>& finished, bool runMainJobs);
+    void workerLoop(int index);
+
+    std::thread::id mainThread;
+    std::chrono::steady_clock::time_point startTime;
+    std::vector<std::unique_ptr<threadQueue>> queues; // 0 is the main thread, the last one other threads
+    std::vector<std::thread> workers;
+
+    std::mutex mainMutex;
+    std::deque<std::shared_ptr<jobTask>> mainJobs;
+    std::atomic<int> nbMainJobs{0};
+
+    // Workers sleep when no deque holds a job, waiting threads until a job ends or is queued
+    std::atomic<int> nbQueued{0};
+    std::mutex sleepMutex;
+    std::condition_variable wakeWorkers;
+    std::atomic<int> nbWaiting{0};
+    std::mutex waitMutex;
+    std::condition_variable jobDone;
+    bool stopping = false;
+
+    std::atomic<bool> profiling{false};
+    std::function<void(const jobSample&)> profileHook;
+};
+
+class ClipLibrary;
+
+// Time of each stage on 1 to every hardware thread: clip parsing, crowd pose evaluation, CPU skinning of
+// the mesh and empty jobs, with the speedup over one thread and the profile of the widest run
+void benchmarkJobSystem(ClipLibrary& library, const std::string& meshFile, const std::string& weightsFile);
+
+#endif // JOBSYSTEM_H
@@ -5,6 +5,7 @@
 #define MAINWIDGET_H
 
 #include "geometryengine.h"
+#include "framecapture.h"
 
 #include <QOpenGLWidget>
 #include <QOpenGLFunctions>
@@ -26,25 +27,64 @@ public:
     using QOpenGLWidget::QOpenGLWidget;
     ~MainWidget();
 
+    void setLivePort(int port);
+    // Smooths the live stream and the Xsens recordings alike
+    void setXsensFilter(const xsensFilterOptions& options);
+    void setSkinningMode(GeometryEngine::SkinningMode mode);
+    void setSkinningVariant(GeometryEngine::SkinningMethod method, int nbInfluences);
+    void setClip(const std::string& name, size_t budget);
+    // Played instead of the clip, through the Xsens filter if one is set
+    void setXsensRecording(const std::string& directory);
+    void setPoseBaking(bakePrecision precision);
+    void setLodSelection(float maxPixelError);
+    void setGpuPose(bool enabled);
+    void setMorphWeight(const std::string& name, float weight);
+    // Records every painted frame from the start, C toggles the capture
+    void setCapture(const captureOptions& options);
+
 protected:
     void mousePressEvent(QMouseEvent *e) override;
     void mouseReleaseEvent(QMouseEvent *e) override;
+    void keyPressEvent(QKeyEvent *e) override;
     void timerEvent(QTimerEvent *e) override;
 
     void initializeGL() override;
     void resizeGL(int w, int h) override;
     void paintGL() override;
 
-    void initShaders();
     void initTextures();
 
 private:
+    QMatrix4x4 modelView() const;
+
     QBasicTimer timer;
-    QOpenGLShaderProgram program;
     GeometryEngine *geometries = nullptr;
 
+    int livePort = 0;
+    XsensStream *liveStream = nullptr;
+    bool xsensFiltered = false;
+    xsensFilterOptions xsensFilter;
+    GeometryEngine::SkinningMode skinningMode = GeometryEngine::SkinInShader;
+    GeometryEngine::SkinningMethod skinningMethod = GeometryEngine::LinearBlend;
+    int skinningInfluences = 4;
+    std::string clipName;
+    std::string xsensRecording;
+    size_t clipBudget = 0;
+    bool poseBaking = false;
+    bakePrecision bakedPrecision = BakeFloat;
+    float lodPixelError = 0.0f;
+    bool gpuPose = false;
+    std::map<std::string, float> morphWeights;
+
     QOpenGLTexture *texture = nullptr;
 
+    AllocationMonitor frameAllocations;
+
+    FrameCapture frameCapture;
+    captureOptions captureSettings;
+    bool capturing = false;
+    bool feetPinned = false;
+
     qint64 startTime = QDateTime::currentMSecsSinceEpoch();
 
     QMatrix4x4 projection;
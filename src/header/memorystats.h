@@ -0,0 +1,91 @@
+#ifndef MEMORYSTATS_H
+#define MEMORYSTATS_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "mesh.h"
+
+// Heap bytes of a string, 0 when it is short enough to live in the string itself
+size_t stringBytes(const std::string& s);
+
+template <typename T>
+size_t vectorBytes(const std::vector<T>& v) { return v.capacity() * sizeof(T); }
+
+// Resident bytes of parsed BVH trees, split between the hierarchy and the keyframes
+struct hierarchyMemory {
+    size_t hierarchyBytes = 0;   // Nodes, names, channel names and child lists
+    size_t keyframeBytes = 0;    // channelsValues, the per frame vectors and their values
+    size_t channelNameBytes = 0; // Part of hierarchyBytes in channel name strings and their vectors
+    size_t valueBytes = 0;       // Part of keyframeBytes in the float values alone
+    int nbNodes = 0;
+    int nbChannelNames = 0;
+    int nbUniqueChannelNames = 0;
+    int nbKeyframeVectors = 0;
+};
+
+hierarchyMemory measureHierarchy(const std::vector<BVHTree*>& roots);
+size_t meshBytes(const mesh& myMesh);
+size_t weightsBytes(const std::vector<std::vector<weight>>& weights);
+
+// CPU bytes by subsystem and item, GPU bytes by buffer
+class MemoryReport
+{
+public:
+    void addCpu(const std::string& subsystem, const std::string& item, size_t bytes);
+    void addGpu(const std::string& buffer, size_t bytes);
+    void addHierarchy(const std::string& item, const std::vector<BVHTree*>& roots);
+
+    size_t cpuBytes() const;
+    size_t cpuBytes(const std::string& subsystem) const;
+    size_t gpuBytes() const;
+    void print() const;
+
+private:
+    struct memoryItem {
+        std::string subsystem;
+        std::string name;
+        size_t bytes;
+    };
+
+    std::vector<memoryItem> cpu;
+    std::vector<memoryItem> gpu;
+};
+
+// Calls to the global operator new and delete. They are only counted in builds with
+// TRACK_ALLOCATIONS defined (qmake CONFIG+=track_allocations), the counters stay at 0 otherwise
+struct allocationCounters {
+    long long allocations = 0;
+    long long frees = 0;
+    size_t bytes = 0; // Requested by the allocations
+};
+
+bool allocationTrackingEnabled();
+allocationCounters allocationSnapshot();
+
+// Allocations between beginFrame() and endFrame(), for the last frame and over all of them
+class AllocationMonitor
+{
+public:
+    void beginFrame();
+    void endFrame();
+
+    const allocationCounters& lastFrame() const { return last; }
+    void print() const;
+
+private:
+    allocationCounters start;
+    allocationCounters last;
+    allocationCounters total;
+    long long peakAllocations = 0;
+    size_t peakBytes = 0;
+    int nbFrames = 0;
+};
+
+// Parses the clip, the mesh and the weights of a models directory and prints what each costs,
+// with the layout of a BVHTree node
+void printAssetFootprint(const std::string& directory, const std::string& clip);
+
+#endif // MEMORYSTATS_H
@@ -1,7 +1,11 @@
+#ifndef MESH_H
+#define MESH_H
+
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <cstdint>
 #include <QVector3D>
 
 struct int3{
@@ -10,11 +14,24 @@ struct int3{
     int k;
 };
 
+// Shape of a morph target as sparse deltas: only the vertices it moves, each component quantized on
+// 16 bits with a step per target. Components are stored apart so they convert four at a time
+struct morphTarget{
+    std::string name;
+    float positionStep; // Mesh units per quantization step
+    float normalStep;
+    std::vector<int> vertices; // Ascending
+    std::vector<int16_t> positionDeltas[3];
+    std::vector<int16_t> normalDeltas[3];
+};
+
 struct mesh{
     int nbVertices;
     int nbFaces;
     std::vector<QVector3D> vertexList;
     std::vector<int3> indexList;
+    std::vector<QVector3D> normalList;
+    std::vector<morphTarget> morphTargets;
 };
 
 struct weight{
@@ -23,4 +40,7 @@ struct weight{
 };
 
 mesh readMesh(const std::string& fileName);
-std::vector<std::vector<weight>> readWeights(const std::string& fileName, int nbVertex);
\ No newline at end of file
+void computeNormals(mesh& myMesh);
+std::vector<std::vector<weight>> readWeights(const std::string& fileName, int nbVertex);
+
+#endif // MESH_H
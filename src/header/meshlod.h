@@ -0,0 +1,43 @@
+#ifndef MESHLOD_H
+#define MESHLOD_H
+
+#include <string>
+#include <vector>
+
+#include "mesh.h"
+
+struct lodOptions {
+    int nbLods = 4;            // Including the full mesh
+    float reduction = 0.5f;    // Triangles kept from one level to the next
+    int maxInfluences = 8;     // Per vertex once the weights of a collapse are merged
+    bool respectInfluences = true; // No collapse between vertices driven by different dominant joints
+    int nbThreads = 0;         // 1 runs serially, else each level is a job of the shared job system
+};
+
+// One level of the chain, with normals and weights that sum to 1
+struct lodMesh {
+    mesh geometry;
+    std::vector<std::vector<weight>> weights;
+    std::vector<int> sourceVertices; // Vertex of the source each vertex survives from
+    float error = 0.0f;    // Root of the largest quadric error of a collapse, at least the distance of the vertex to any of its planes, mesh units
+    double buildTime = 0;  // ms
+    int nbRejected = 0;    // Collapses refused by the topology, flip or influence tests
+};
+
+// Quadric error edge collapses (Garland and Heckbert) down to targetTriangles. The merged vertex takes
+// the weights of both ends, blended by its position along the edge
+lodMesh simplifyMesh(const mesh& source, const std::vector<std::vector<weight>>& weights, int targetTriangles,
+                     const lodOptions& options);
+
+// Level 0 is the source itself, level k keeps reduction^k of its triangles
+std::vector<lodMesh> buildLodChain(const mesh& source, const std::vector<std::vector<weight>>& weights,
+                                   const lodOptions& options);
+
+// Level whose error projects under maxPixelError pixels, the coarsest one if several do.
+// pixelsPerUnit is the screen size of one mesh unit at the distance of the character
+int selectLod(const std::vector<float>& errors, float pixelsPerUnit, float maxPixelError);
+
+// Counts, errors and build time of the chain of a mesh, serial and threaded
+void benchmarkLods(const std::string& meshFile, const std::string& weightsFile, const lodOptions& options);
+
+#endif // MESHLOD_H
@@ -0,0 +1,88 @@
+#ifndef MORPHTARGETS_H
+#define MORPHTARGETS_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <QVector3D>
+
+#include "mesh.h"
+
+// Vertices a shape moves less than this, in mesh units, and whose normal turns less than
+// morphNormalThreshold are left out of its target
+const float morphThreshold = 1e-4f;
+const float morphNormalThreshold = 1e-3f;
+
+// Target of the difference between a mesh and a shape with the same vertices, normals included
+morphTarget buildMorphTarget(const std::string& name, const mesh& base, const mesh& shape);
+
+// Reads an OFF shape of the mesh, same vertices in the same order, and attaches its target
+void readMorphTarget(const std::string& fileName, const std::string& name, mesh& myMesh);
+
+// Every shape named <stem>.<name>.off next to the mesh file, skin.smile.off for skin.off
+void readMorphTargets(const std::string& meshFile, mesh& myMesh);
+
+// Targets of a mesh moved onto other vertices, vertex v taking the deltas of sourceVertices[v]
+// (-1 for none). Several vertices may share a source
+std::vector<morphTarget> remapMorphTargets(const std::vector<morphTarget>& targets, const std::vector<int>& sourceVertices,
+                                           int nbSourceVertices);
+
+// Adds the weighted deltas of the targets to the base shape of the vertices they touch. A call only
+// writes the vertices of the targets active now or on the previous call, so its cost follows the
+// deltas of the active targets and not the size of the mesh
+class MorphAccumulator
+{
+public:
+    // positions and normals of every vertex the targets index
+    void init(std::vector<morphTarget> targets, const std::vector<QVector3D>& positions, const std::vector<QVector3D>& normals);
+    void clear();
+
+    // One weight per target, 0 skips it. The vertices written are listed by changedSlots()
+    void apply(const float* weights);
+
+    int nbTargets() const { return targets.size(); }
+    const std::string& name(int target) const { return targets[target].name; }
+    int find(const std::string& name) const;
+
+    // Slots are the vertices touched by at least one target, by increasing vertex
+    int nbSlots() const { return slotVertices.size(); }
+    int vertex(int slot) const { return slotVertices[slot]; }
+    QVector3D position(int slot) const { return QVector3D(x[slot], y[slot], z[slot]); }
+    QVector3D normal(int slot) const { return QVector3D(nx[slot], ny[slot], nz[slot]); }
+    const std::vector<int>& changedSlots() const { return changed; }
+    // Box of the positions a slot reaches with weights in [0, 1]
+    void bounds(int slot, QVector3D& lo, QVector3D& hi) const;
+
+    long long nbDeltas() const { return deltas; } // Accumulated by the last call
+    size_t bytes() const;
+    size_t denseBytes() const; // Same targets as float deltas of every vertex
+
+private:
+    struct slotTarget {
+        std::vector<int> slots; // Of each delta of the target
+    };
+
+    std::vector<morphTarget> targets;
+    std::vector<slotTarget> targetSlots;
+    std::vector<int> slotVertices;
+    int nbVertices = 0;
+
+    // Base and current shape of the slots, one array per component
+    std::vector<float> baseX, baseY, baseZ, baseNx, baseNy, baseNz;
+    std::vector<float> x, y, z, nx, ny, nz;
+    std::vector<float> lowX, lowY, lowZ, highX, highY, highZ;
+
+    std::vector<int> touched; // Slots moved by the previous call
+    std::vector<int> changed;
+    std::vector<unsigned> touchedMark;
+    std::vector<unsigned> changedMark;
+    unsigned generation = 0;
+    long long deltas = 0;
+};
+
+// Storage, quantization error and cost per frame of sparse targets against dense float ones, on
+// synthetic bumps of the mesh
+void benchmarkMorphTargets(const std::string& meshFile, int nbTargets);
+
+#endif // MORPHTARGETS_H
@@ -0,0 +1,79 @@
+#ifndef MOTIONMATCHING_H
+#define MOTIONMATCHING_H
+
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "cliplibrary.h"
+
+// Feature vector of a frame, in the character space of the frame (root on the ground, facing +Z):
+// foot positions and velocities, hip velocity, root positions and facing directions on the ground
+// 1/3, 2/3 and 1 s ahead
+const int nbMotionFeatures = 27;
+
+struct motionEntry {
+    int clip;  // Index in clipNames
+    int frame; // Keyframe of the clip
+};
+
+struct motionMatch {
+    int row = -1; // Database frame, -1 when the database is empty
+    float distance = 0;
+};
+
+// Frames of a clip library searchable by pose and trajectory. Features are normalized per group
+// (each group weighs the same whatever its units) and stored as nbMotionFeatures columns of
+// stride values (nbFrames() rounded up to the blocks the brute force search streams). The k-d
+// tree keeps its own row copy in leaf order.
+class MotionDatabase
+{
+public:
+    // Frames whose trajectory runs past the end of their clip are left out
+    void build(ClipLibrary& library);
+    // Rows given directly, already normalized, for benchmarks at sizes the library does not reach
+    void build(const std::vector<float>& rows, const std::vector<motionEntry>& rowEntries);
+
+    int nbFrames() const { return entries.size(); }
+    const motionEntry& entry(int row) const { return entries[row]; }
+    const std::vector<std::string>& clipNames() const { return names; }
+
+    // Normalized features of a database frame, or of any frame of a clip with this skeleton
+    void frameFeatures(int row, float* features) const;
+    bool clipFeatures(const std::vector<BVHTree*>& clip, int frame, float* features) const;
+
+    motionMatch searchBruteForce(const float* query) const;
+    // Exact with maxLeaves 0, otherwise stops after visiting maxLeaves leaves
+    motionMatch searchTree(const float* query, int maxLeaves = 0) const;
+
+    size_t memoryBytes() const;
+
+private:
+    struct kdNode {
+        int dimension; // -1 for a leaf
+        float split;
+        int children[2];
+        int first; // Leaf rows in treeRows
+        int count;
+    };
+
+    int buildTree(int first, int count, std::vector<int>& order);
+    void searchNode(int node, const float* query, motionMatch& best, int& leavesLeft) const;
+
+    std::vector<std::string> names;
+    std::vector<motionEntry> entries;
+    std::vector<float> columns; // Feature d of row r at d * stride + r
+    int stride = 0;
+    float mean[nbMotionFeatures] = {};
+    float deviation[nbMotionFeatures] = {}; // Shared by the features of a group
+
+    std::vector<kdNode> nodes;
+    std::vector<float> treeRows; // Row major, in leaf order
+    std::vector<int> treeRowIndex;
+};
+
+// Build time, then queries per second and recall of the brute force and k-d tree searches
+// against an exact scan, on the library and on a larger synthetic database
+void benchmarkMotionMatching(ClipLibrary& library);
+
+#endif // MOTIONMATCHING_H
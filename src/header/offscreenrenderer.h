@@ -0,0 +1,66 @@
+#ifndef OFFSCREENRENDERER_H
+#define OFFSCREENRENDERER_H
+
+#include "geometryengine.h"
+#include "framecapture.h"
+
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLShaderProgram>
+#include <QOffscreenSurface>
+#include <QImage>
+#include <QMatrix4x4>
+#include <QString>
+
+// Renders the scene of MainWidget into an FBO, without a window.
+// Works on GPU-less machines with QT_QPA_PLATFORM=offscreen and Mesa llvmpipe.
+class OffscreenRenderer : protected QOpenGLFunctions
+{
+public:
+    OffscreenRenderer(int width = 640, int height = 480);
+    ~OffscreenRenderer();
+
+    bool init();
+    void resize(int width, int height);
+    bool setSkinningMode(GeometryEngine::SkinningMode mode);
+    bool setSkinningVariant(GeometryEngine::SkinningMethod method, int nbInfluences);
+    // Plays a clip of the library from the next frame on, budget 0 keeps the default cache size
+    bool setClip(const std::string& name, size_t budget);
+    void setPoseBaking(bakePrecision precision);
+    void setLodSelection(float maxPixelError);
+    bool setGpuPose(bool enabled);
+    void setMorphWeight(const std::string& name, float weight);
+
+    QImage renderFrame(float time);
+
+    // Frames are sampled every frameInterval seconds of clip time, saved as frame_0000.png...
+    bool renderClip(const QString& outputDir, int nbFrames, float frameInterval);
+    // Same frames read back through the pixel buffer ring and encoded on worker threads, none dropped
+    bool captureClip(const captureOptions& options, int nbFrames, float frameInterval);
+    bool compareWithGolden(const QString& goldenDir, int nbFrames, float frameInterval, int tolerance, double maxMismatch);
+    // Every size is measured with every skinning mode, drawing the mesh once and several times per
+    // frame like a renderer with depth, shadow and color passes would. The CPU cost of draw
+    // submission is then compared with and without render state caching, and the time to
+    // switch between every shader variant is reported, and every level of detail is drawn on its own.
+    // Then a crowd playing the clip at different times is drawn with poses evaluated on the CPU and on the GPU,
+    // and frames are read back synchronously and through the capture ring
+    void benchmark(int nbFrames);
+
+private:
+    void drawFrame(float time, int nbPasses = 1);
+    void drawCrowd(float time, int nbInstances);
+
+    QOpenGLContext context;
+    QOffscreenSurface surface;
+    QOpenGLFramebufferObject *fbo = nullptr;
+    GeometryEngine *geometries = nullptr;
+
+    int width;
+    int height;
+    QMatrix4x4 projection;
+};
+
+int imageDifference(const QImage& image, const QImage& golden, int tolerance, double& meanError);
+
+#endif // OFFSCREENRENDERER_H
@@ -0,0 +1,94 @@
+#ifndef PICKING_H
+#define PICKING_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <QMatrix4x4>
+#include <QVector3D>
+
+#include "bounds.h"
+
+struct pickRay {
+    QVector3D origin;
+    QVector3D direction; // Normalized
+};
+
+// Ray through a point of the viewport, in pixels from the top left corner, in the space the
+// model view matrix maps to the eye
+pickRay rayFromViewport(const QMatrix4x4& projection, const QMatrix4x4& modelView, float x, float y, int width, int height);
+
+struct triangleHit {
+    int triangle = -1;  // Index in the triangles given to build(), -1 for a miss
+    float distance = 0; // Along the ray
+    float u = 0;        // Barycentric coordinates of the second and third vertices
+    float v = 0;
+};
+
+// Bounding volume hierarchy over the triangles of a deforming mesh. The tree is built once with the
+// surface area heuristic, then refit() moves the vertices and only recomputes the boxes bottom up: the
+// triangles stay in their leaves, so queries slow down a little as the pose drifts from the one built on
+class TriangleBvh
+{
+public:
+    // Three vertex indices per triangle
+    void build(const std::vector<QVector3D>& positions, const std::vector<int>& indices);
+    void refit(const std::vector<QVector3D>& positions);
+    void clear();
+
+    // Nearest hit no farther than maxDistance
+    bool intersect(const pickRay& ray, triangleHit& hit, float maxDistance = 1e30f) const;
+    // Every triangle tested, the reference the tree is checked against
+    bool intersectBruteForce(const pickRay& ray, triangleHit& hit, float maxDistance = 1e30f) const;
+
+    bool empty() const { return nodes.empty(); }
+    int nbTriangles() const { return indices.size() / 3; }
+    int nbNodes() const { return nodes.size(); }
+    int depth() const { return treeDepth; }
+    const QVector3D& position(int vertex) const { return vertices[vertex]; }
+    const int* triangle(int t) const { return &indices[3 * t]; }
+    // Node boxes summed over the root box, grows when a refit loosens the tree
+    float surfaceRatio() const;
+    size_t bytes() const;
+
+    long long nbNodeTests() const { return nodeTests; } // By the queries since the last build
+    long long nbTriangleTests() const { return triangleTests; }
+
+private:
+    // Children of an inner node are the next node and right, leaves hold count triangles from first
+    struct bvhNode {
+        QVector3D low;
+        QVector3D high;
+        int first; // Leaf: first entry of order. Inner node: right child
+        int count; // 0 for an inner node
+    };
+
+    // Nodes [root, end) of a subtree, refit by one job
+    struct subtree {
+        int root;
+        int end;
+    };
+
+    int buildNode(int first, int last, std::vector<aabb>& boxes, std::vector<QVector3D>& centers, int level);
+    void refitNode(int n);
+    bool intersectTriangle(const pickRay& ray, const int* tri, triangleHit& hit) const;
+
+    std::vector<bvhNode> nodes;    // Depth first, a parent before its children
+    std::vector<int> order;        // Triangles by leaf
+    std::vector<int> indices;      // As given to build()
+    std::vector<int> leafIndices;  // Same triangles in the order of the leaves
+    std::vector<QVector3D> vertices;
+    std::vector<subtree> subtrees;
+    std::vector<int> topNodes;     // Inner nodes above the subtrees
+    int treeDepth = 0;
+
+    mutable long long nodeTests = 0;
+    mutable long long triangleTests = 0;
+};
+
+// Build, refit and query times of the tree on the mesh subdivided to hundreds of thousands of
+// triangles and bent a little more every frame, against a rebuild per frame and brute force rays
+void benchmarkPicking(const std::string& meshFile, int minTriangles);
+
+#endif // PICKING_H
@@ -0,0 +1,69 @@
+#ifndef POSECACHE_H
+#define POSECACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <QQuaternion>
+#include <QVector3D>
+
+#include "bvh.h"
+#include "cliplibrary.h"
+
+// Float keeps 28 bytes per joint and frame, Quantized 14: the rotation as four 16 bit
+// components and the position as three 16 bit steps of the clip's bounding box
+enum bakePrecision { BakeFloat, BakeQuantized };
+
+struct bakeOptions {
+    bakePrecision precision = BakeFloat;
+    float frameTime = 0.0f; // 0 bakes at the rate of the clip
+    int nbThreads = 0;      // 1 runs serially, else the frames are split over the shared job system
+};
+
+// Global transform of every joint of a clip at regular times, joint j at nodeIndex j. Positions are
+// in skeleton units, before the scale and the offset of the engine
+class BakedClip
+{
+public:
+    BakedClip(const std::vector<BVHTree*>& roots, const bakeOptions& options);
+
+    int nbJoints() const { return joints; }
+    int nbFrames() const { return frames; }
+    float frameTime() const { return interval; }
+    bakePrecision precision() const { return settings.precision; }
+    size_t bytes() const;
+    double bakeTime() const { return bakingTime; } // ms
+
+    // Interpolated between the two baked frames around time, clamped to the clip like sampleChannels.
+    // frameAt() finds them once for every joint of a pose
+    void frameAt(float time, int& frame, float& blend) const;
+    void sample(int frame, float blend, int joint, QQuaternion& rotation, QVector3D& position) const;
+
+private:
+    void bakeFrames(const std::vector<BVHTree*>& nodes, int first, int last);
+    void store(int frame, int joint, const QQuaternion& rotation, const QVector3D& position);
+    void load(int frame, int joint, QQuaternion& rotation, QVector3D& position) const;
+
+    bakeOptions settings;
+    int joints = 0;
+    int frames = 0;
+    float interval = 0.0f;
+    float startTime = 0.0f;
+    double bakingTime = 0;
+
+    // Quantized positions: positionMin + step * positionScale
+    QVector3D positionMin;
+    QVector3D positionScale;
+
+    std::vector<float> floatPoses;       // Per frame and joint x, y, z, w, then x, y, z
+    std::vector<int16_t> quantizedRotations;
+    std::vector<uint16_t> quantizedPositions;
+};
+
+// Bake time, memory and sampling cost of each clip of the library in both precisions, against
+// evaluating the hierarchy, with the error of the baked poses between two baked frames
+void benchmarkPoseBaking(ClipLibrary& library);
+
+#endif // POSECACHE_H
@@ -0,0 +1,125 @@
+#ifndef RENDERSTATE_H
+#define RENDERSTATE_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <QOpenGLFunctions>
+#include <QOpenGLBuffer>
+#include <QOpenGLShaderProgram>
+#include <QOpenGLVertexArrayObject>
+#include <QMatrix4x4>
+
+// One shader attribute read from a vertex buffer
+struct vertexAttribute {
+    const char* name;
+    int offset;
+    int tupleSize;
+};
+
+// Attributes read from one buffer, several bindings can feed the same mesh
+struct vertexBinding {
+    QOpenGLBuffer* buffer;
+    int stride;
+    std::vector<vertexAttribute> attributes;
+};
+
+struct uniformInt {
+    const char* name;
+    int value;
+};
+
+struct drawCall {
+    QOpenGLShaderProgram* program;
+    int mesh;
+    GLenum primitive;
+    int count;
+    std::vector<uniformInt> uniforms;
+    int first = 0; // First index, or first vertex without an index buffer
+};
+
+struct renderStats {
+    long long draws = 0;
+    long long batches = 0;
+    long long programBinds = 0;
+    long long meshBinds = 0;
+    long long attributeSetups = 0;
+    long long uniformUploads = 0;
+    long long skippedStateChanges = 0;
+    long long submitTime = 0; // ns of CPU time spent issuing GL calls
+    int frames = 0;
+};
+
+// Draw submission layer: each mesh gets one vertex array object per program, built once from
+// its declarative layout, with attribute and uniform locations resolved at that time.
+// Bindings and uniform values already set are skipped, queued draws are sorted by program and
+// mesh so each batch binds its state once.
+class RenderState : protected QOpenGLFunctions
+{
+public:
+    RenderState();
+    ~RenderState();
+
+    void init();
+
+    // indexBuffer may be null, the mesh is then drawn with glDrawArrays
+    int addMesh(const std::vector<vertexBinding>& layout, QOpenGLBuffer* indexBuffer);
+
+    // Forget the cached bindings, other code may have bound a program or buffers since
+    void beginFrame();
+
+    void bindProgram(QOpenGLShaderProgram* program);
+    void bindMesh(int mesh, QOpenGLShaderProgram* program);
+    void setUniform(QOpenGLShaderProgram* program, const char* name, int value);
+    void setUniform(QOpenGLShaderProgram* program, const char* name, const QMatrix4x4& value);
+    void release();
+
+    void draw(const drawCall& call);
+    void submit(drawCall call);
+    void flush();
+
+    // Without caching every draw binds and resolves everything by name, like the draws used to
+    void setStateCaching(bool enabled);
+    bool stateCaching() const { return caching; }
+
+    const renderStats& stats() const { return frameStats; }
+    void resetStats();
+    void printStats() const;
+
+private:
+    struct meshLayout {
+        std::vector<vertexBinding> bindings;
+        QOpenGLBuffer* indexBuffer;
+    };
+
+    struct vertexArray {
+        std::unique_ptr<QOpenGLVertexArrayObject> vao;
+        std::vector<int> locations; // Flattened over the bindings, -1 when the program lacks it
+    };
+
+    vertexArray& vertexArrayOf(int mesh, QOpenGLShaderProgram* program);
+    void setupAttributes(const meshLayout& layout, QOpenGLShaderProgram* program, const std::vector<int>& locations);
+    int uniformLocation(QOpenGLShaderProgram* program, const char* name);
+    void issue(const drawCall& call);
+
+    bool vaoSupported = false;
+    bool caching = true;
+
+    std::vector<meshLayout> meshes;
+    std::map<std::pair<int, GLuint>, vertexArray> vertexArrays;
+    std::map<std::pair<GLuint, std::string>, int> uniformLocations;
+    std::map<std::pair<GLuint, int>, int> uniformValues;
+
+    QOpenGLShaderProgram* currentProgram = nullptr;
+    int currentMesh = -1;
+    GLuint currentMeshProgram = 0;
+    std::vector<int> enabledLocations; // Only used without vertex array objects
+
+    std::vector<drawCall> queue;
+    renderStats frameStats;
+};
+
+#endif // RENDERSTATE_H
@@ -0,0 +1,73 @@
+#ifndef RETARGET_H
+#define RETARGET_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <QQuaternion>
+#include <QVector3D>
+
+#include "bvh.h"
+#include "cliplibrary.h"
+
+// Source to target mapping compiled once per pair of skeletons, joints are in preorder so
+// parents come first. Channel indices point into a flat frame of every channel of a skeleton
+// in file order, -1 when the joint has no such channel.
+struct retargetMap {
+    int nbSourceChannels = 0;
+    int nbTargetChannels = 0;
+
+    std::vector<int> sourceParent;
+    std::vector<int> sourceRotationChannels; // X, Y, Z per source joint
+
+    std::vector<int> targetParent;
+    std::vector<int> targetSource;           // Matched source joint, -1 keeps the parent orientation
+    std::vector<QQuaternion> restCorrection; // Target rest bone direction onto the source one
+    std::vector<int> targetRotationChannels; // X, Y, Z per target joint
+
+    // Root translation, bone lengths of the target over those of the source
+    int sourceRoot = -1;
+    int targetRoot = -1;
+    int sourcePositionChannels[3] = {-1, -1, -1};
+    int targetPositionChannels[3] = {-1, -1, -1};
+    QVector3D sourceRootOffset;
+    QVector3D targetRootOffset;
+    float lengthScale = 1.0f;
+
+    int nbMatched = 0;
+};
+
+// Working buffers of retargetFrame, one per thread
+struct retargetScratch {
+    std::vector<QQuaternion> sourceGlobal;
+    std::vector<QQuaternion> targetGlobal;
+};
+
+// Equivalent joint names of the rigs we use, the Xsens rig included
+const std::map<std::string, std::string>& defaultJointAliases();
+
+// Names are compared lowercase, without the "_dup" suffix, then through the aliases (both ways)
+retargetMap compileRetargetMap(const std::vector<BVHTree*>& source, const std::vector<BVHTree*>& target,
+                               const std::map<std::string, std::string>& aliases = defaultJointAliases());
+
+void retargetFrame(const retargetMap& map, const float* sourceFrame, float* targetFrame, retargetScratch& scratch);
+
+// New trees with the target hierarchy and the source motion, every keyframe retargeted
+std::vector<BVHTree*> retargetClip(const retargetMap& map, const std::vector<BVHTree*>& source, const std::vector<BVHTree*>& target);
+bool sameHierarchy(const std::vector<BVHTree*>& a, const std::vector<BVHTree*>& b);
+
+struct retargetResult {
+    std::string name;
+    std::shared_ptr<decodedClip> clip; // Null if the clip failed to load
+    int nbFrames = 0;
+    double compileTime = 0; // ms
+    double retargetTime = 0;
+};
+
+// Retargets every clip of the library onto the target skeleton, one map per source hierarchy
+std::vector<retargetResult> retargetLibrary(ClipLibrary& library, const std::vector<BVHTree*>& target, int nbThreads);
+void benchmarkRetargeting(ClipLibrary& library, const std::string& targetName);
+
+#endif // RETARGET_H
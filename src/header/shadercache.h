@@ -0,0 +1,63 @@
+#ifndef SHADERCACHE_H
+#define SHADERCACHE_H
+
+#include <map>
+
+#include <QByteArray>
+#include <QList>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLShaderProgram>
+#include <QString>
+#include <QStringList>
+
+// One program generated from the shader sources: defines are inserted before the source
+// ("SKINNING_DQS", "NB_INFLUENCES 2"), feedbackVaryings are captured by transform feedback
+struct shaderVariant {
+    QString vertexFile;
+    QString fragmentFile; // May be empty for transform feedback only programs
+    QStringList defines;
+    QList<QByteArray> feedbackVaryings;
+};
+
+struct shaderCacheStats {
+    int memoryHits = 0;
+    int diskHits = 0;
+    int compiled = 0;
+    int rejectedBinaries = 0;
+    double loadTime = 0;    // ms, programs restored from disk
+    double compileTime = 0; // ms, programs compiled and linked from source
+};
+
+// Linked programs by variant, kept in memory and saved as program binaries on disk.
+// Binaries are keyed by a hash of the driver and of the preprocessed sources, a binary the
+// driver refuses is deleted and the program is compiled from source again.
+class ShaderCache : protected QOpenGLExtraFunctions
+{
+public:
+    // Empty directory: the application cache location
+    ShaderCache(const QString& directory = QString());
+    ~ShaderCache();
+
+    void init();
+
+    // Null when the variant does not compile, the cache keeps ownership
+    QOpenGLShaderProgram* program(const shaderVariant& variant);
+
+    const shaderCacheStats& stats() const { return cacheStats; }
+    void printStats() const;
+
+private:
+    QByteArray readSource(const QString& fileName, int depth = 0);
+    QByteArray preprocess(const QString& fileName, const QStringList& defines);
+    bool loadBinary(QOpenGLShaderProgram* program, const QString& fileName);
+    void saveBinary(QOpenGLShaderProgram* program, const QString& fileName);
+
+    QString directory;
+    QByteArray driver;
+    bool binarySupported = false;
+
+    std::map<QByteArray, QOpenGLShaderProgram*> programs;
+    shaderCacheStats cacheStats;
+};
+
+#endif // SHADERCACHE_H
@@ -0,0 +1,12 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <chrono>
+
+// Milliseconds since start, for the load, bake and benchmark reports
+double elapsedMs(std::chrono::steady_clock::time_point start);
+
+// The benchmarks store a result here so the timed loops are not optimized away
+extern volatile float benchmarkSink;
+
+#endif // TIMING_H
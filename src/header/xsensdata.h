@@ -0,0 +1,63 @@
+#ifndef XSENSDATA_H
+#define XSENSDATA_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <QVector3D>
+#include <QQuaternion>
+
+#include "bvh.h"
+
+// One MTw sensor recording (MT Manager text export)
+struct xsensSensor {
+    std::string deviceId;
+    std::string label;
+    std::vector<int> packetCounters; // Unwrapped, the 16 bit counter restarts at 0
+    std::vector<QVector3D> accelerations;
+    std::vector<QVector3D> freeAccelerations;
+    std::vector<QQuaternion> quaternions;
+};
+
+// Channel remap from the sensor frame to the rig frame: {axis, sign} for q1, q2, q3
+struct xsensAxis {
+    int dir;
+    int sens;
+};
+
+struct xsensJoint {
+    std::string label;
+    std::string name;
+    std::string parentLabel;
+    QVector3D offset;
+    xsensAxis rotationOrder[3];
+};
+
+extern const std::vector<xsensJoint> xsensSkeleton;
+
+std::map<std::string, std::string> readLabels(const std::string& fileName);
+xsensSensor readXsensFile(const std::string& fileName);
+std::vector<xsensSensor> readXsensSession(const std::string& directory);
+
+QQuaternion multInvQuaternion(const QQuaternion& q1, const QQuaternion& q2);
+QVector3D quaternionToEuler(const QQuaternion& q);
+QQuaternion remapQuaternion(const QQuaternion& q, const xsensAxis order[3]);
+
+// Remapped samples of the skeleton sensors over their common packet range, indexed like
+// xsensSkeleton then by frame. Missing packets hold the previous sample
+struct xsensFrames {
+    int firstPacket = 0;
+    int nbFrames = 0;
+    std::vector<std::vector<QQuaternion>> orientations;
+    std::vector<std::vector<QVector3D>> freeAccelerations;
+};
+
+struct xsensFilterOptions;
+
+xsensFrames alignXsensSession(const std::vector<xsensSensor>& sensors);
+std::vector<BVHTree*> buildXsensSkeleton(std::map<std::string, BVHTree*>& nodeByLabel);
+// filter null keeps the raw quaternions
+std::vector<BVHTree*> readXsens(const std::string& directory, float frameInterval = 1.0f/60.0f, const xsensFilterOptions* filter = nullptr);
+
+#endif // XSENSDATA_H
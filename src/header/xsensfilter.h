@@ -0,0 +1,75 @@
+#ifndef XSENSFILTER_H
+#define XSENSFILTER_H
+
+#include <string>
+#include <vector>
+
+#include <QQuaternion>
+#include <QVector3D>
+
+// One Euro filter on the sensor quaternions: the cutoff rises with the filtered rotation speed,
+// beta 0 makes it a plain low-pass at minCutoff
+struct xsensFilterOptions {
+    float minCutoff = 1.5f;        // Hz
+    float beta = 0.5f;             // Hz of cutoff per rad/s
+    float derivativeCutoff = 1.0f; // Hz, of the speed estimate
+
+    // Zero velocity update: while a sensor is still its orientation should not move, what it
+    // does then is gyroscope drift and is removed from the following samples
+    bool driftCorrection = false;
+    float stillRate = 0.1f;         // rad/s
+    float stillAcceleration = 0.3f; // m/s^2 of free acceleration, ignored without accelerations
+    float stillTime = 0.25f;        // s the sensor has to stay under both first
+};
+
+struct filterConstants;
+
+// Filters every sensor of a session at once, four sensors per SIMD lane block. Quaternions are
+// kept in the hemisphere of the previous sample so the interpolation never takes the long way
+class XsensFilter
+{
+public:
+    XsensFilter(int nbSensors, const xsensFilterOptions& options);
+
+    void reset();
+    // One sample of every sensor, dt seconds after the previous one. freeAccelerations may be
+    // null (live packets carry none), the stillness test then only uses the rotation rate.
+    // filtered may be quaternions
+    void filter(const QQuaternion* quaternions, const QVector3D* freeAccelerations, float dt, QQuaternion* filtered);
+
+    int nbSensors() const { return sensors; }
+    const xsensFilterOptions& options() const { return settings; }
+    long long nbSamples() const { return samples; }
+    int nbStillSensors() const; // In the last frame, with drift correction
+
+private:
+    // Component c of lane l at [c][l]
+    struct alignas(16) laneBlock {
+        float raw[4][4];
+        float filtered[4][4];
+        float derivative[4][4];
+        float correction[4][4]; // Drift removed so far, applied on the left
+        float stillTime[4];
+    };
+
+    void filterBlock(laneBlock& block, const float input[4][4], const float acceleration[4],
+                     float output[4][4], const filterConstants& k) const;
+
+    int sensors;
+    xsensFilterOptions settings;
+    std::vector<laneBlock> blocks;
+    bool primed = false;
+    long long samples = 0;
+};
+
+// Batch ingest: orientations[sensor][frame] filtered in place, freeAccelerations aligned the same
+// way or null
+void filterXsensFrames(std::vector<std::vector<QQuaternion>>& orientations,
+                       const std::vector<std::vector<QVector3D>>* freeAccelerations,
+                       float frameInterval, const xsensFilterOptions& options);
+
+// Cost per sample of the lane kernel against a scalar quaternion version, and jitter of the session
+// before and after filtering
+void benchmarkXsensFilter(const std::string& directory, const xsensFilterOptions& options);
+
+#endif // XSENSFILTER_H
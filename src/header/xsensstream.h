@@ -0,0 +1,125 @@
+#ifndef XSENSSTREAM_H
+#define XSENSSTREAM_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <QQuaternion>
+
+#include "xsensdata.h"
+#include "xsensfilter.h"
+
+const int xsensStreamPort = 9763;
+const int xsensMaxJoints = 32;
+const int xsensPoseRingSize = 8;
+const int xsensReorderWindow = 4; // Packets, ~66 ms at 60 Hz
+const float xsensSampleInterval = 1.0f / 60.0f;
+
+// One UDP datagram per sensor sample, little endian, same fields as the MT text export.
+// The packet counter is already unwrapped by the sender.
+#pragma pack(push, 1)
+struct xsensPacket {
+    uint32_t deviceId;
+    uint32_t packetCounter;
+    float quaternion[4]; // Quat_q0..q3
+    int64_t sendTime;    // steady_clock, nanoseconds
+};
+#pragma pack(pop)
+
+// Calibrated parent relative rotations, indexed like xsensSkeleton
+struct xsensPose {
+    uint32_t packetCounter = 0;
+    int64_t sendTime = 0;
+    int64_t publishTime = 0;
+    int nbJoints = 0;
+    std::array<QQuaternion, xsensMaxJoints> local;
+};
+
+struct xsensStreamStats {
+    uint64_t packetsReceived = 0;
+    uint64_t latePackets = 0;
+    uint64_t droppedPackets = 0;
+    uint64_t framesPublished = 0;
+    uint64_t posesConsumed = 0;
+    double averageLatency = 0; // ms, send to pose consumption
+    double maxLatency = 0;
+    double filterTime = 0; // ns per sensor sample, 0 without a filter
+};
+
+class XsensStream
+{
+public:
+    XsensStream(const std::string& labelsFile, int port = xsensStreamPort);
+    ~XsensStream();
+
+    // Smooths the calibrated orientations before they are published, call before start()
+    void setFilter(const xsensFilterOptions& options);
+
+    bool start();
+    void stop();
+
+    // Pose evaluation side, returns false when no new pose was published since the last call
+    bool latestPose(xsensPose& pose);
+
+    xsensStreamStats stats() const;
+    void printStats() const;
+
+private:
+    struct pendingFrame {
+        std::array<QQuaternion, xsensMaxJoints> orientation;
+        uint32_t receivedMask = 0;
+        int64_t sendTime = 0;
+    };
+
+    struct poseSlot {
+        std::atomic<uint32_t> sequence{0};
+        xsensPose pose;
+    };
+
+    void receiveLoop();
+    void receivePacket(const xsensPacket& packet);
+    void publish(uint32_t packetCounter, const pendingFrame& frame);
+
+    int port;
+    int socketFd = -1;
+    std::thread receiver;
+    std::atomic<bool> running{false};
+
+    std::map<uint32_t, int> jointOfDevice;
+    std::vector<int> parentJoint;
+    uint32_t completeMask = 0;
+
+    // Receiver thread only
+    std::map<uint32_t, pendingFrame> pendingFrames;
+    std::array<QQuaternion, xsensMaxJoints> lastOrientation;
+    std::array<QQuaternion, xsensMaxJoints> firstOrientation;
+    uint32_t calibratedMask = 0;
+    std::unique_ptr<XsensFilter> filter;
+    bool hasPublished = false;
+    uint32_t lastPublished = 0;
+
+    // Single producer single consumer seqlock ring
+    poseSlot ring[xsensPoseRingSize];
+    std::atomic<uint64_t> nbPublished{0};
+    uint64_t nbConsumed = 0;
+
+    std::atomic<uint64_t> packetsReceived{0};
+    std::atomic<uint64_t> latePackets{0};
+    std::atomic<uint64_t> droppedPackets{0};
+    std::atomic<uint64_t> posesConsumed{0};
+    std::atomic<int64_t> latencySum{0};
+    std::atomic<int64_t> latencyMax{0};
+    std::atomic<int64_t> filterTime{0};
+    std::atomic<uint64_t> filterSamples{0};
+};
+
+int64_t xsensClock();
+void replayXsensSession(const std::string& directory, int port = xsensStreamPort, float speed = 1.0f);
+
+#endif // XSENSSTREAM_H
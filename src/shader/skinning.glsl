@@ -0,0 +1,189 @@
+// Skinning shared by the vertex shader and the skinning pre-pass.
+// SKINNING_LBS blends matrices, SKINNING_DQS blends dual quaternions,
+// NB_INFLUENCES (1, 2, 4 or 8) strongest weights are used and renormalized,
+// each influence bucket of the mesh is drawn with its own variant.
+// GPU_POSE evaluates the palette from the keyframe texture of the clip instead of the uniforms.
+#if defined(SKINNING_LBS) || defined(SKINNING_DQS)
+
+#ifndef NB_INFLUENCES
+#define NB_INFLUENCES 4
+#endif
+
+attribute float a_weight0;
+attribute float a_weight1;
+attribute float a_weight2;
+attribute float a_weight3;
+attribute vec4 a_joints;
+#if NB_INFLUENCES > 4
+// Influences 5 to 8, from the extra buffer
+attribute vec4 a_weights1;
+attribute vec4 a_joints1;
+#endif
+
+uniform float u_skinScale; // Rig to mesh units
+
+#ifdef GPU_POSE
+
+// A row per frame, joint j in texels 2j (local rotation) and 2j + 1 (offset from its parent)
+uniform sampler2D u_poseTexture;
+uniform vec4 u_poseClip;         // Start time, frame time, number of frames and of joints
+uniform float u_poseTime;
+uniform int u_parent[32];        // -1 for a root
+uniform vec3 u_restPosition[32]; // Mesh units
+uniform vec3 u_poseOffset;       // World position of the skeleton origin
+uniform float u_poseScale;       // Skeleton to world units
+
+vec4 quaternionProduct(vec4 a, vec4 b)
+{
+    return vec4(a.w * b.xyz + b.w * a.xyz + cross(a.xyz, b.xyz), a.w * b.w - dot(a.xyz, b.xyz));
+}
+
+vec3 quaternionRotate(vec4 q, vec3 v)
+{
+    return v + 2. * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+// Global rotation and position of a joint in skeleton units: the keys around u_poseTime are
+// blended, then composed with those of every ancestor up to the root
+void poseJoint(int joint, out vec4 rotation, out vec3 position)
+{
+    float frame = clamp((u_poseTime - u_poseClip.x) / u_poseClip.y, 0., u_poseClip.z - 1.);
+    float first = min(floor(frame), max(u_poseClip.z - 2., 0.));
+    float blend = frame - first;
+    vec2 rows = (vec2(first, min(first + 1., u_poseClip.z - 1.)) + 0.5) / u_poseClip.z;
+    float texel = 1. / (2. * u_poseClip.w);
+
+    rotation = vec4(0., 0., 0., 1.);
+    position = vec3(0.);
+    for (int depth = 0; depth < 32; depth++) {
+        if (joint < 0) {
+            break;
+        }
+        float column = (2. * float(joint) + 0.5) * texel;
+        vec4 localRotation = normalize(mix(texture2D(u_poseTexture, vec2(column, rows.x)),
+                                           texture2D(u_poseTexture, vec2(column, rows.y)), blend));
+        vec3 offset = mix(texture2D(u_poseTexture, vec2(column + texel, rows.x)).xyz,
+                          texture2D(u_poseTexture, vec2(column + texel, rows.y)).xyz, blend);
+        position = offset + quaternionRotate(localRotation, position);
+        rotation = quaternionProduct(localRotation, rotation);
+        joint = u_parent[joint];
+    }
+}
+
+#endif
+
+#ifdef SKINNING_LBS
+
+uniform mat4 u_palette[32]; // maxSkinJoints, rest pose to animated joint
+
+mat4 jointMatrix(int joint)
+{
+#ifdef GPU_POSE
+    vec4 rotation;
+    vec3 position;
+    poseJoint(joint, rotation, position);
+    // Same matrix as the palette of the engine: rest pose in mesh units to the posed joint in world units
+    mat3 linear = mat3(quaternionRotate(rotation, vec3(1., 0., 0.)), quaternionRotate(rotation, vec3(0., 1., 0.)),
+                       quaternionRotate(rotation, vec3(0., 0., 1.))) * u_skinScale;
+    vec3 translation = u_poseOffset + u_poseScale * position - linear * u_restPosition[joint];
+    return mat4(vec4(linear[0], 0.), vec4(linear[1], 0.), vec4(linear[2], 0.), vec4(translation, 1.));
+#else
+    return u_palette[joint];
+#endif
+}
+
+void skin(vec3 position, vec3 normal, out vec3 skinnedPosition, out vec3 skinnedNormal)
+{
+    mat4 skinMatrix = a_weight0 * jointMatrix(int(a_joints.x));
+    float weightSum = a_weight0;
+#if NB_INFLUENCES >= 2
+    skinMatrix += a_weight1 * jointMatrix(int(a_joints.y));
+    weightSum += a_weight1;
+#endif
+#if NB_INFLUENCES >= 3
+    skinMatrix += a_weight2 * jointMatrix(int(a_joints.z));
+    weightSum += a_weight2;
+#endif
+#if NB_INFLUENCES >= 4
+    skinMatrix += a_weight3 * jointMatrix(int(a_joints.w));
+    weightSum += a_weight3;
+#endif
+#if NB_INFLUENCES > 4
+    skinMatrix += a_weights1.x * jointMatrix(int(a_joints1.x));
+    skinMatrix += a_weights1.y * jointMatrix(int(a_joints1.y));
+    skinMatrix += a_weights1.z * jointMatrix(int(a_joints1.z));
+    skinMatrix += a_weights1.w * jointMatrix(int(a_joints1.w));
+    weightSum += dot(a_weights1, vec4(1.));
+#endif
+    skinMatrix /= max(weightSum, 1e-6);
+
+    skinnedPosition = (skinMatrix * vec4(position, 1.)).xyz;
+    skinnedNormal = normalize((skinMatrix * vec4(normal, 0.)).xyz);
+}
+
+#else
+
+// Rigid part of each palette matrix as (rotation, translation) dual quaternions,
+// the uniform scale from rig to mesh units is applied after blending
+uniform vec4 u_dqReal[32];
+uniform vec4 u_dqDual[32];
+
+void jointDualQuaternion(int joint, out vec4 real, out vec4 dual)
+{
+#ifdef GPU_POSE
+    vec3 position;
+    poseJoint(joint, real, position);
+    vec3 translation = (u_poseOffset + u_poseScale * position) / u_skinScale - quaternionRotate(real, u_restPosition[joint]);
+    dual = 0.5 * quaternionProduct(vec4(translation, 0.), real);
+#else
+    real = u_dqReal[joint];
+    dual = u_dqDual[joint];
+#endif
+}
+
+void blendDualQuaternion(float weight, int joint, vec4 pivot, inout vec4 real, inout vec4 dual)
+{
+    vec4 jointReal;
+    vec4 jointDual;
+    jointDualQuaternion(joint, jointReal, jointDual);
+    // Stay in the hemisphere of the first joint, q and -q are the same rotation
+    float side = dot(pivot, jointReal) < 0. ? -weight : weight;
+    real += side * jointReal;
+    dual += side * jointDual;
+}
+
+void skin(vec3 position, vec3 normal, out vec3 skinnedPosition, out vec3 skinnedNormal)
+{
+    vec4 pivot;
+    vec4 pivotDual;
+    jointDualQuaternion(int(a_joints.x), pivot, pivotDual);
+    vec4 real = a_weight0 * pivot;
+    vec4 dual = a_weight0 * pivotDual;
+#if NB_INFLUENCES >= 2
+    blendDualQuaternion(a_weight1, int(a_joints.y), pivot, real, dual);
+#endif
+#if NB_INFLUENCES >= 3
+    blendDualQuaternion(a_weight2, int(a_joints.z), pivot, real, dual);
+#endif
+#if NB_INFLUENCES >= 4
+    blendDualQuaternion(a_weight3, int(a_joints.w), pivot, real, dual);
+#endif
+#if NB_INFLUENCES > 4
+    blendDualQuaternion(a_weights1.x, int(a_joints1.x), pivot, real, dual);
+    blendDualQuaternion(a_weights1.y, int(a_joints1.y), pivot, real, dual);
+    blendDualQuaternion(a_weights1.z, int(a_joints1.z), pivot, real, dual);
+    blendDualQuaternion(a_weights1.w, int(a_joints1.w), pivot, real, dual);
+#endif
+    float norm = max(length(real), 1e-6);
+    real /= norm;
+    dual /= norm;
+
+    vec3 rotated = position + 2. * cross(real.xyz, cross(real.xyz, position) + real.w * position);
+    vec3 translation = 2. * (real.w * dual.xyz - dual.w * real.xyz + cross(real.xyz, dual.xyz));
+    skinnedPosition = u_skinScale * (rotated + translation);
+    skinnedNormal = normalize(normal + 2. * cross(real.xyz, cross(real.xyz, normal) + real.w * normal));
+}
+
+#endif
+
+#endif
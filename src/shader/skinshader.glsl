@@ -0,0 +1,24 @@
+#ifdef GL_ES
+// Set default precision to medium
+precision mediump int;
+precision mediump float;
+#endif
+
+// Skinning pre-pass, the outputs are captured by transform feedback.
+// Built with the same SKINNING_* and NB_INFLUENCES defines as the mesh variant.
+#include "skinning.glsl"
+
+attribute vec3 a_position;
+attribute vec3 a_normal;
+
+varying vec3 v_position;
+varying vec3 v_normal;
+
+//! [0]
+void main()
+{
+    skin(a_position, a_normal, v_position, v_normal);
+
+    gl_Position = vec4(v_position, 1.);
+}
+//! [0]
@@ -4,20 +4,25 @@ precision mediump int;
 precision mediump float;
 #endif
 
+// Variants: no define draws the rig, SKINNED the vertices skinned by the pre-pass or the CPU,
+// SKINNING_LBS / SKINNING_DQS and NB_INFLUENCES skin the mesh
+#include "skinning.glsl"
+
 uniform mat4 mvp_matrix;
-uniform bool isMesh;
 
 attribute vec3 a_position;
 attribute vec3 a_color;
+#if defined(SKINNING_LBS) || defined(SKINNING_DQS) || defined(SKINNED)
+attribute vec3 a_normal;
+
+// Diffuse light from a fixed direction of the scene, the mesh is never black
+vec3 shade(vec3 color, vec3 normal)
+{
+    const vec3 light = vec3(0.32, 0.84, 0.44);
+    return color * (0.4 + 0.6 * max(dot(normalize(normal), light), 0.));
+}
+#endif
 // attribute vec2 a_texcoord;
-attribute float a_weight0;
-attribute float a_weight1;
-attribute float a_weight2;
-attribute float a_weight3;
-attribute vec3 a_mat0;
-attribute vec3 a_mat1;
-attribute vec3 a_mat2;
-attribute vec3 a_mat3;
 
 // varying vec2 v_texcoord;
 varying vec3 v_color;
@@ -26,15 +31,19 @@ varying vec3 v_color;
 void main()
 {
     // Calculate vertex position in screen space
-    if (isMesh){
-        gl_Position = mvp_matrix * vec4(a_weight0*(a_mat0+a_position) + a_weight1*(a_mat1+a_position) + a_weight2*(a_mat2+a_position) + a_weight3*(a_mat3+a_position), 1.);
-        // gl_Position = mvp_matrix * vec4(a_position, 1.);
-        v_color = a_color;
-    }
-    else{
-        gl_Position = mvp_matrix * vec4(a_position, 1.);
-        v_color = a_color;
-    }
+#if defined(SKINNING_LBS) || defined(SKINNING_DQS)
+    vec3 position;
+    vec3 normal;
+    skin(a_position, a_normal, position, normal);
+    gl_Position = mvp_matrix * vec4(position, 1.);
+    v_color = shade(a_color, normal);
+#elif defined(SKINNED)
+    gl_Position = mvp_matrix * vec4(a_position, 1.);
+    v_color = shade(a_color, a_normal);
+#else
+    gl_Position = mvp_matrix * vec4(a_position, 1.);
+    v_color = a_color;
+#endif
 
     // Pass texture coordinate to fragment shader
     // Value will be automatically interpolated to fragments inside polygon faces
@@ -0,0 +1,110 @@
+#include "../header/assetloader.h"
+
+#include <exception>
+#include <iostream>
+
+AssetLoader::AssetLoader()
+    : startTime(std::chrono::steady_clock::now())
+{
+}
+
+AssetLoader::~AssetLoader()
+{
+    // The tasks write into their caller, they must not outlive it
+    for (auto& a : assets) {
+        a->cancelled = true;
+        JobSystem::shared().wait(a->task);
+    }
+}
+
+double AssetLoader::elapsed() const
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+int AssetLoader::load(const std::string& name, std::function<void()> task, std::function<void()> upload)
+{
+    auto a = std::make_shared<asset>();
+    a->name = name;
+    a->task = JobSystem::shared().submit("load asset", [a, task]() {
+        auto start = std::chrono::steady_clock::now();
+        task();
+        a->loadTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    });
+
+    // A job of its own so the GL thread only runs the upload, never the parsing
+    a->upload = JobSystem::shared().submit("upload asset", [this, a, upload]() {
+        if (a->cancelled) {
+            return;
+        }
+        try {
+            if (std::exception_ptr error = a->task.error()) {
+                std::rethrow_exception(error);
+            }
+        } catch (const std::exception& e) {
+            a->error = e.what();
+            a->state = failedState;
+            std::cerr << "Error loading " << a->name << ": " << a->error << "\n";
+            return;
+        }
+        a->state = loadedState;
+        auto start = std::chrono::steady_clock::now();
+        upload();
+        markUploaded(*a, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }, {a->task}, MainThread);
+
+    assets.push_back(a);
+    return assets.size() - 1;
+}
+
+void AssetLoader::markUploaded(asset& a, double uploadTime)
+{
+    a.state = uploadedState;
+    a.uploadTime = uploadTime;
+    a.availableTime = elapsed();
+    std::cout << "Asset " << a.name << ": parsed in " << a.loadTime << " ms, uploaded in " << uploadTime
+              << " ms, available " << a.availableTime << " ms after start (" << progress() * 100.0f << " % loaded)\n";
+}
+
+void AssetLoader::wait(int index)
+{
+    JobSystem& jobs = JobSystem::shared();
+    jobs.wait(jobs.onMainThread() ? assets[index]->upload : assets[index]->task);
+}
+
+bool AssetLoader::finished() const
+{
+    for (const auto& a : assets) {
+        if (a->state != uploadedState && a->state != failedState) {
+            return false;
+        }
+    }
+    return true;
+}
+
+float AssetLoader::progress() const
+{
+    if (assets.empty()) {
+        return 1.0f;
+    }
+    int done = 0;
+    for (const auto& a : assets) {
+        done += a->state == uploadedState || a->state == failedState;
+    }
+    return float(done) / assets.size();
+}
+
+void AssetLoader::printProgress() const
+{
+    const char* stateNames[] = {"loading", "loaded", "uploaded", "failed"};
+    for (const auto& a : assets) {
+        std::cout << "Asset " << a->name << ": " << stateNames[a->state];
+        if (a->state == uploadedState) {
+            std::cout << ", parsed in " << a->loadTime << " ms, uploaded in " << a->uploadTime
+                      << " ms, available after " << a->availableTime << " ms";
+        } else if (a->state == failedState) {
+            std::cout << ", " << a->error;
+        }
+        std::cout << "\n";
+    }
+}
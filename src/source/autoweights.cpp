@@ -0,0 +1,440 @@
+#include "../header/autoweights.h"
+#include "../header/jobsystem.h"
+#include "../header/timing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <unordered_map>
+
+std::vector<skinBone> skinBones(const std::vector<BVHTree*>& skeleton, float unitScale) {
+    std::vector<skinBone> bones;
+    std::vector<std::pair<BVHTree*, QVector3D>> nodeQueue;
+    for (auto root : skeleton) {
+        // Same rest pose as GeometryEngine::initRigGeometry, the roots sit at the origin
+        nodeQueue.push_back({root, QVector3D(0.0f, 0.0f, 0.0f)});
+    }
+    while (!nodeQueue.empty()) {
+        BVHTree* node = nodeQueue.back().first;
+        QVector3D position = nodeQueue.back().second;
+        nodeQueue.pop_back();
+        for (auto child : node->joints) {
+            QVector3D childPosition = position + child->offset * unitScale;
+            bones.push_back({node->nodeIndex, position, childPosition});
+            nodeQueue.push_back({child, childPosition});
+        }
+    }
+    return bones;
+}
+
+static float segmentDistance(const QVector3D& p, const QVector3D& a, const QVector3D& b, QVector3D& closest) {
+    QVector3D ab = b - a;
+    float length2 = ab.lengthSquared();
+    float t = length2 > 0.0f ? std::max(0.0f, std::min(1.0f, QVector3D::dotProduct(p - a, ab) / length2)) : 0.0f;
+    closest = a + ab * t;
+    return (p - closest).length();
+}
+
+// Strongest influences of a dense row, renormalized, as readWeights would list them
+static std::vector<weight> selectInfluences(const float* row, const std::vector<int>& joints, int maxInfluences) {
+    std::vector<weight> influences;
+    for (size_t j = 0; j < joints.size(); j++) {
+        if (row[j] > 0.0f) {
+            influences.push_back({joints[j], row[j]});
+        }
+    }
+    auto stronger = [](const weight& a, const weight& b) { return a.w > b.w; };
+    if (static_cast<int>(influences.size()) > maxInfluences) {
+        std::nth_element(influences.begin(), influences.begin() + maxInfluences, influences.end(), stronger);
+        influences.resize(maxInfluences);
+    }
+    std::sort(influences.begin(), influences.end(), stronger);
+
+    float sum = 0.0f;
+    for (const auto& w : influences) {
+        sum += w.w;
+    }
+    for (auto& w : influences) {
+        w.w /= sum;
+    }
+    return influences;
+}
+
+// Symmetric sparse matrix in compressed rows, diagonal kept apart for the preconditioner
+struct sparseMatrix {
+    std::vector<int> rowStart;
+    std::vector<int> columns;
+    std::vector<double> values;
+    std::vector<double> diagonal;
+
+    void multiply(const std::vector<double>& x, std::vector<double>& y) const {
+        for (size_t i = 0; i < diagonal.size(); i++) {
+            double sum = diagonal[i] * x[i];
+            for (int k = rowStart[i]; k < rowStart[i + 1]; k++) {
+                sum += values[k] * x[columns[k]];
+            }
+            y[i] = sum;
+        }
+    }
+};
+
+// Clamped cotangent stiffness matrix and lumped vertex areas
+static sparseMatrix cotangentLaplacian(const mesh& myMesh, std::vector<double>& areas) {
+    int n = myMesh.nbVertices;
+    sparseMatrix laplacian;
+    laplacian.diagonal.assign(n, 0.0);
+    areas.assign(n, 0.0);
+
+    struct entry { int row; int column; double value; };
+    std::vector<entry> entries;
+    entries.reserve(myMesh.indexList.size() * 6);
+
+    for (const auto& face : myMesh.indexList) {
+        int v[3] = {face.i, face.j, face.k};
+        QVector3D p[3] = {myMesh.vertexList[v[0]], myMesh.vertexList[v[1]], myMesh.vertexList[v[2]]};
+        double area = 0.5 * QVector3D::crossProduct(p[1] - p[0], p[2] - p[0]).length();
+        for (int c = 0; c < 3; c++) {
+            areas[v[c]] += area / 3.0;
+
+            // The angle at corner c weights the opposite edge, obtuse angles are clamped to keep an M-matrix
+            QVector3D e1 = p[(c + 1) % 3] - p[c];
+            QVector3D e2 = p[(c + 2) % 3] - p[c];
+            double sine = QVector3D::crossProduct(e1, e2).length();
+            double cotangent = sine > 1e-12 ? std::max(0.0, double(QVector3D::dotProduct(e1, e2)) / sine) : 0.0;
+            int a = v[(c + 1) % 3];
+            int b = v[(c + 2) % 3];
+            laplacian.diagonal[a] += 0.5 * cotangent;
+            laplacian.diagonal[b] += 0.5 * cotangent;
+            entries.push_back({a, b, -0.5 * cotangent});
+            entries.push_back({b, a, -0.5 * cotangent});
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const entry& x, const entry& y) {
+        return x.row != y.row ? x.row < y.row : x.column < y.column;
+    });
+
+    laplacian.rowStart.assign(n + 1, 0);
+    for (size_t e = 0; e < entries.size(); e++) {
+        if (e > 0 && entries[e].row == entries[e - 1].row && entries[e].column == entries[e - 1].column) {
+            laplacian.values.back() += entries[e].value;
+            continue;
+        }
+        laplacian.columns.push_back(entries[e].column);
+        laplacian.values.push_back(entries[e].value);
+        laplacian.rowStart[entries[e].row + 1]++;
+    }
+    for (int i = 0; i < n; i++) {
+        laplacian.rowStart[i + 1] += laplacian.rowStart[i];
+    }
+    return laplacian;
+}
+
+// Jacobi preconditioned conjugate gradient, x holds the initial guess. Returns the iterations
+static int conjugateGradient(const sparseMatrix& matrix, const std::vector<double>& b, std::vector<double>& x,
+                             double tolerance, int maxIterations, bool& converged) {
+    int n = b.size();
+    std::vector<double> r(n), z(n), p(n), ap(n);
+
+    matrix.multiply(x, ap);
+    double bNorm = 0.0;
+    double rz = 0.0;
+    for (int i = 0; i < n; i++) {
+        r[i] = b[i] - ap[i];
+        z[i] = r[i] / matrix.diagonal[i];
+        p[i] = z[i];
+        rz += r[i] * z[i];
+        bNorm += b[i] * b[i];
+    }
+    double threshold = tolerance * tolerance * std::max(bNorm, 1e-30);
+
+    converged = false;
+    int iteration = 0;
+    for (; iteration < maxIterations; iteration++) {
+        matrix.multiply(p, ap);
+        double pap = 0.0;
+        for (int i = 0; i < n; i++) {
+            pap += p[i] * ap[i];
+        }
+        if (pap <= 0.0) {
+            break;
+        }
+        double alpha = rz / pap;
+        double rNorm = 0.0;
+        for (int i = 0; i < n; i++) {
+            x[i] += alpha * p[i];
+            r[i] -= alpha * ap[i];
+            rNorm += r[i] * r[i];
+        }
+        if (rNorm < threshold) {
+            converged = true;
+            iteration++;
+            break;
+        }
+        double rzNext = 0.0;
+        for (int i = 0; i < n; i++) {
+            z[i] = r[i] / matrix.diagonal[i];
+            rzNext += r[i] * z[i];
+        }
+        double beta = rzNext / rz;
+        rz = rzNext;
+        for (int i = 0; i < n; i++) {
+            p[i] = z[i] + beta * p[i];
+        }
+    }
+    return iteration;
+}
+
+std::vector<std::vector<weight>> computeSkinWeights(const mesh& myMesh, const std::vector<skinBone>& bones, skinWeightMethod method,
+                                                    int maxInfluences, autoWeightStats* stats) {
+    JobSystem& jobs = JobSystem::shared();
+    autoWeightStats localStats;
+    autoWeightStats& s = stats ? *stats : localStats;
+    s = autoWeightStats();
+
+    // Compact joint columns, a joint with several children owns several bones
+    std::vector<int> joints;
+    std::vector<int> boneColumn;
+    for (const auto& bone : bones) {
+        auto it = std::find(joints.begin(), joints.end(), bone.joint);
+        boneColumn.push_back(it - joints.begin());
+        if (it == joints.end()) {
+            joints.push_back(bone.joint);
+        }
+    }
+    int nbJoints = joints.size();
+    int n = myMesh.nbVertices;
+    s.nbJoints = nbJoints;
+
+    // Distance pass: inverse distance to the bones on the side the vertex faces, the normal test
+    // stands in for a visibility ray. The nearest of them is the heat source of the vertex
+    auto start = std::chrono::steady_clock::now();
+    std::vector<float> dense(size_t(n) * nbJoints, 0.0f);
+    std::vector<int> nearestJoint(n, 0);
+    std::vector<float> nearestDistance(n, 0.0f);
+    jobs.parallelFor("bone distances", n, 256, [&](int first, int last) {
+        std::vector<float> distances(nbJoints);
+        std::vector<char> visible(nbJoints);
+        for (int i = first; i < last; i++) {
+            const QVector3D& position = myMesh.vertexList[i];
+            const QVector3D& normal = myMesh.normalList[i];
+            std::fill(distances.begin(), distances.end(), std::numeric_limits<float>::max());
+            std::fill(visible.begin(), visible.end(), 0);
+            for (size_t b = 0; b < bones.size(); b++) {
+                QVector3D closest;
+                float d = segmentDistance(position, bones[b].head, bones[b].tail, closest);
+                int j = boneColumn[b];
+                if (d < distances[j]) {
+                    distances[j] = d;
+                    visible[j] = QVector3D::dotProduct(normal, position - closest) >= -0.1f * d;
+                }
+            }
+
+            int nearest = -1;
+            for (int j = 0; j < nbJoints; j++) {
+                if (visible[j] && (nearest < 0 || distances[j] < distances[nearest])) {
+                    nearest = j;
+                }
+            }
+            if (nearest < 0) {
+                // Nothing faces the vertex (a fold), fall back to every bone
+                std::fill(visible.begin(), visible.end(), 1);
+                nearest = std::min_element(distances.begin(), distances.end()) - distances.begin();
+            }
+            nearestJoint[i] = nearest;
+            nearestDistance[i] = std::max(distances[nearest], 1e-4f);
+
+            float* row = &dense[size_t(i) * nbJoints];
+            float sum = 0.0f;
+            for (int j = 0; j < nbJoints; j++) {
+                if (visible[j]) {
+                    float d = std::max(distances[j], 1e-4f) / nearestDistance[i];
+                    row[j] = 1.0f / (d * d * d * d);
+                    sum += row[j];
+                }
+            }
+            for (int j = 0; j < nbJoints; j++) {
+                row[j] /= sum;
+            }
+        }
+    });
+    s.distanceTime = elapsedMs(start);
+
+    if (method == heatWeights) {
+        // (L + M H) w_j = M H p_j, H = 1 / d^2 toward the nearest visible bone, p_j = 1 where it is j
+        start = std::chrono::steady_clock::now();
+        std::vector<double> areas;
+        sparseMatrix system = cotangentLaplacian(myMesh, areas);
+        std::vector<double> heat(n);
+        for (int i = 0; i < n; i++) {
+            heat[i] = std::max(areas[i], 1e-12) / (double(nearestDistance[i]) * nearestDistance[i]);
+            system.diagonal[i] += heat[i];
+        }
+
+        // Each joint is solved on the band where its distance weight is not negligible, two rings
+        // wider, with w = 0 around it: the heat decays fast and CG converges in far fewer iterations
+        std::atomic<int> nbIterations(0);
+        std::atomic<int> nbUnconverged(0);
+        jobs.parallelFor("heat solves", nbJoints, 1, [&](int firstJoint, int lastJoint) {
+            std::vector<int> local(n, -1);
+            std::vector<int> band;
+            for (int j = firstJoint; j < lastJoint; j++) {
+                band.clear();
+                for (int i = 0; i < n; i++) {
+                    if (nearestJoint[i] == j || dense[size_t(i) * nbJoints + j] >= 1e-3f) {
+                        local[i] = band.size();
+                        band.push_back(i);
+                    }
+                }
+                for (int ring = 0; ring < 2; ring++) {
+                    for (size_t k = 0, end = band.size(); k < end; k++) {
+                        for (int e = system.rowStart[band[k]]; e < system.rowStart[band[k] + 1]; e++) {
+                            int neighbour = system.columns[e];
+                            if (local[neighbour] < 0) {
+                                local[neighbour] = band.size();
+                                band.push_back(neighbour);
+                            }
+                        }
+                    }
+                }
+
+                sparseMatrix restricted;
+                restricted.rowStart.push_back(0);
+                std::vector<double> b(band.size()), x(band.size());
+                for (size_t k = 0; k < band.size(); k++) {
+                    int i = band[k];
+                    for (int e = system.rowStart[i]; e < system.rowStart[i + 1]; e++) {
+                        if (local[system.columns[e]] >= 0) {
+                            restricted.columns.push_back(local[system.columns[e]]);
+                            restricted.values.push_back(system.values[e]);
+                        }
+                    }
+                    restricted.rowStart.push_back(restricted.columns.size());
+                    restricted.diagonal.push_back(system.diagonal[i]);
+                    b[k] = nearestJoint[i] == j ? heat[i] : 0.0;
+                    x[k] = dense[size_t(i) * nbJoints + j]; // The distance weights are a close first guess
+                }
+
+                bool converged = false;
+                nbIterations += conjugateGradient(restricted, b, x, 1e-3, 2000, converged);
+                nbUnconverged += !converged;
+
+                for (int i = 0; i < n; i++) {
+                    dense[size_t(i) * nbJoints + j] = local[i] >= 0 ? std::max(0.0, std::min(1.0, x[local[i]])) : 0.0f;
+                }
+                for (int i : band) {
+                    local[i] = -1;
+                }
+            }
+        });
+        s.nbIterations = nbIterations;
+        s.nbUnconverged = nbUnconverged;
+        s.solveTime = elapsedMs(start);
+    }
+
+    std::vector<std::vector<weight>> weights(n);
+    jobs.parallelFor("select influences", n, 256, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            weights[i] = selectInfluences(&dense[size_t(i) * nbJoints], joints, maxInfluences);
+        }
+    });
+    return weights;
+}
+
+// Midpoint subdivision, each triangle becomes four
+static mesh subdivideMesh(const mesh& source) {
+    mesh result = source;
+    result.indexList.clear();
+    std::unordered_map<uint64_t, int> midpoints;
+    auto midpoint = [&](int a, int b) {
+        uint64_t key = (uint64_t(std::min(a, b)) << 32) | uint64_t(std::max(a, b));
+        auto it = midpoints.find(key);
+        if (it != midpoints.end()) {
+            return it->second;
+        }
+        result.vertexList.push_back((source.vertexList[a] + source.vertexList[b]) * 0.5f);
+        midpoints[key] = result.vertexList.size() - 1;
+        return static_cast<int>(result.vertexList.size() - 1);
+    };
+    for (const auto& face : source.indexList) {
+        int ij = midpoint(face.i, face.j);
+        int jk = midpoint(face.j, face.k);
+        int ki = midpoint(face.k, face.i);
+        result.indexList.push_back({face.i, ij, ki});
+        result.indexList.push_back({ij, face.j, jk});
+        result.indexList.push_back({ki, jk, face.k});
+        result.indexList.push_back({ij, jk, ki});
+    }
+    result.nbVertices = result.vertexList.size();
+    result.nbFaces = result.indexList.size();
+    computeNormals(result);
+    return result;
+}
+
+void benchmarkSkinWeights(const std::string& meshFile, const std::string& weightsFile, const std::vector<BVHTree*>& skeleton, float unitScale) {
+    mesh myMesh = readMesh(meshFile);
+    std::vector<skinBone> bones = skinBones(skeleton, unitScale);
+    std::vector<std::vector<weight>> painted = readWeights(weightsFile, myMesh.nbVertices);
+    const char* methodNames[2] = {"distance", "heat"};
+    for (skinWeightMethod method : {distanceWeights, heatWeights}) {
+        autoWeightStats stats;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::vector<weight>> weights = computeSkinWeights(myMesh, bones, method, 4, &stats);
+        double totalTime = elapsedMs(start);
+
+        // Painted weights reduced the way the loader reduces them, then compared row by row
+        int sameDominant = 0;
+        double difference = 0.0;
+        int nbCompared = std::min(painted.size(), weights.size());
+        for (int i = 0; i < nbCompared; i++) {
+            std::vector<weight> reference = painted[i];
+            std::sort(reference.begin(), reference.end(), [](const weight& a, const weight& b) { return a.w > b.w; });
+            if (reference.size() > 4) {
+                reference.resize(4);
+            }
+            std::map<int, float> delta;
+            float sum = 0.0f;
+            for (const auto& w : reference) {
+                sum += w.w;
+            }
+            for (const auto& w : reference) {
+                delta[w.i] += w.w / sum;
+            }
+            for (const auto& w : weights[i]) {
+                delta[w.i] -= w.w;
+            }
+            double rowDifference = 0.0;
+            for (const auto& d : delta) {
+                rowDifference += std::abs(d.second);
+            }
+            difference += rowDifference / 2.0;
+            sameDominant += !reference.empty() && !weights[i].empty() && reference[0].i == weights[i][0].i;
+        }
+
+        std::cout << "Automatic " << methodNames[method] << " weights: " << myMesh.nbVertices << " vertices, "
+                  << stats.nbJoints << " joints in " << totalTime << " ms (" << stats.distanceTime << " ms distances, "
+                  << stats.solveTime << " ms solving, " << stats.nbIterations << " iterations, "
+                  << stats.nbUnconverged << " unconverged), dominant joint as painted on "
+                  << 100.0 * sameDominant / std::max(nbCompared, 1) << " % of the vertices, mean weight difference "
+                  << difference / std::max(nbCompared, 1) << "\n";
+    }
+
+    // Scaling toward production meshes
+    mesh large = myMesh;
+    for (int level = 1; level <= 3; level++) {
+        large = subdivideMesh(large);
+        for (skinWeightMethod method : {distanceWeights, heatWeights}) {
+            autoWeightStats stats;
+            auto start = std::chrono::steady_clock::now();
+            computeSkinWeights(large, bones, method, 4, &stats);
+            std::cout << "Automatic " << methodNames[method] << " weights, subdivided " << level << " times: "
+                      << large.nbVertices << " vertices in " << elapsedMs(start) << " ms on " << JobSystem::shared().nbThreads() << " threads ("
+                      << stats.nbIterations << " iterations, " << stats.nbUnconverged << " unconverged)\n";
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#include "../header/bounds.h"
+
+#include <algorithm>
+#include <cmath>
+
+void aabb::add(const QVector3D& p) {
+    min = QVector3D(std::min(min.x(), p.x()), std::min(min.y(), p.y()), std::min(min.z(), p.z()));
+    max = QVector3D(std::max(max.x(), p.x()), std::max(max.y(), p.y()), std::max(max.z(), p.z()));
+}
+
+void aabb::add(const aabb& box) {
+    if (!box.empty()) {
+        add(box.min);
+        add(box.max);
+    }
+}
+
+aabb transformBox(const QMatrix4x4& matrix, const aabb& box) {
+    if (box.empty()) {
+        return box;
+    }
+    QVector3D center = matrix.map(box.center());
+    QVector3D extent = box.extent();
+    float radius[3];
+    for (int row = 0; row < 3; row++) {
+        radius[row] = std::abs(matrix(row, 0)) * extent.x() + std::abs(matrix(row, 1)) * extent.y()
+                    + std::abs(matrix(row, 2)) * extent.z();
+    }
+    aabb transformed;
+    transformed.min = center - QVector3D(radius[0], radius[1], radius[2]);
+    transformed.max = center + QVector3D(radius[0], radius[1], radius[2]);
+    return transformed;
+}
+
+frustum::frustum(const QMatrix4x4& mvp) {
+    // Gribb and Hartmann: -w <= x, y, z <= w gives the row 3 plus or minus rows 0, 1 and 2
+    for (int axis = 0; axis < 3; axis++) {
+        planes[2 * axis] = mvp.row(3) + mvp.row(axis);
+        planes[2 * axis + 1] = mvp.row(3) - mvp.row(axis);
+    }
+}
+
+cullResult frustum::classify(const aabb& box) const {
+    if (box.empty()) {
+        return Outside;
+    }
+    QVector3D center = box.center();
+    QVector3D extent = box.extent();
+    cullResult result = Inside;
+    for (const QVector4D& plane : planes) {
+        float distance = plane.x() * center.x() + plane.y() * center.y() + plane.z() * center.z() + plane.w();
+        float radius = std::abs(plane.x()) * extent.x() + std::abs(plane.y()) * extent.y() + std::abs(plane.z()) * extent.z();
+        if (distance + radius < 0) {
+            return Outside;
+        }
+        if (distance - radius < 0) {
+            result = Intersecting;
+        }
+    }
+    return result;
+}
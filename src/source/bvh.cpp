@@ -0,0 +1,389 @@
+#include "../header/bvh.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+
+int readNode(const std::vector<std::string>& tokens, int i, BVHTree* node) {
+    // if (tokens[i] != keyWord) {
+    //     throw std::invalid_argument("\"" + keyWord + "\" token not found");
+    // }
+
+    node->name = tokens[i + 1];
+    // std::cout << node->name << "\n";
+
+    std::string accolade = tokens[i + 2];
+    if (accolade != "{") {
+        throw std::invalid_argument("\"{\" token not found");
+    }
+
+    std::string offset = tokens[i + 3];
+    if (offset != "OFFSET") {
+        throw std::invalid_argument("\"OFFSET\" token not found");
+    }
+
+    node->offset = QVector3D(std::stof(tokens[i + 4]), std::stof(tokens[i + 5]), std::stof(tokens[i + 6]));
+
+    std::string channels = tokens[i + 7];
+    if (channels != "CHANNELS") {
+        throw std::invalid_argument("\"CHANNELS\" token not found");
+    }
+
+    int channelsLen = std::stoi(tokens[i + 8]);
+
+    for (int j = 0; j < channelsLen; j++) {
+        node->channels.push_back(tokens[i + 9 + j]);
+    }
+
+    return i + 9 + channelsLen;
+}
+
+int readAnimNode(const std::vector<std::string>& tokens, int i, BVHTree* node, float time) {
+    if (node->channels.empty()) {
+        return i;
+    }
+    int nbChannels = node->channels.size();
+    std::vector<float> keyFrame;
+    keyFrame.push_back(time);
+    for (int j = 0; j < nbChannels; j++) {
+        keyFrame.push_back(std::stof(tokens[i]));
+        i++;
+    }
+    node->channelsValues.push_back(keyFrame);
+    return i;
+}
+
+std::vector<BVHTree*> readBVH(const std::string& file) {
+    std::ifstream fch(file);
+    if (!fch.is_open()) {
+        throw std::runtime_error("Error opening file: " + file);
+    }
+
+    std::stringstream buffer;
+    buffer << fch.rdbuf();
+    return parseBVH(buffer.str());
+}
+
+std::vector<BVHTree*> parseBVH(const std::string& content) {
+    std::istringstream iss(content);
+    std::vector<std::string> tokens{std::istream_iterator<std::string>{iss},
+                                    std::istream_iterator<std::string>{}};
+
+    int i = 0;
+    if (tokens[i] != "HIERARCHY") {
+        throw std::invalid_argument("\"HIERARCHY\" token not found");
+    }
+    i++;
+
+    std::string nextKeyword = tokens[i];
+
+    std::vector<BVHTree*> rootList;
+    std::vector<BVHTree*> nodeQueue;
+
+    int indexQueue = 0;
+
+    while (nextKeyword == "ROOT") {
+        BVHTree* root = new BVHTree();
+        root->nodeIndex = indexQueue;
+        indexQueue++;
+        i = readNode(tokens, i, root);
+        rootList.push_back(root);
+        nodeQueue.push_back(root);
+
+        while (!nodeQueue.empty()) {
+            BVHTree* node = new BVHTree();
+            std::string t = tokens[i];
+
+            if (t == "JOINT") {
+                i = readNode(tokens, i, node);
+                nodeQueue.back()->joints.push_back(node);
+                node->parent = nodeQueue.back();
+                node->nodeIndex = indexQueue;
+                indexQueue++;
+                nodeQueue.push_back(node);
+            } else if (t == "End") {
+
+                node->name = tokens[i + 1];
+                t = tokens[i + 2];
+                if (t != "{") {
+                    throw std::invalid_argument("\"{\" token not found");
+                }
+
+                t = tokens[i + 3];
+                if (t != "OFFSET") {
+                    throw std::invalid_argument("\"OFFSET\" token not found");
+                }
+
+                node->offset = QVector3D(std::stof(tokens[i + 4]), std::stof(tokens[i + 5]), std::stof(tokens[i + 6]));
+                
+                nodeQueue.back()->joints.push_back(node);
+                node->parent = nodeQueue.back();
+                
+                node->nodeIndex = indexQueue;
+                indexQueue++;
+
+                t = tokens[i + 7];
+                if (t != "}") {
+                    throw std::invalid_argument("\"}\" token not found");
+                }
+
+                i += 8;
+            } else if (t == "}") {
+                delete node;
+                BVHTree* closingNode = nodeQueue.back();
+                for (auto child: closingNode->joints) {
+                    closingNode->nbNode += child->nbNode;
+                    closingNode->nbLink += child->nbLink + 1;
+                }
+                nodeQueue.pop_back();
+                i++;
+            } else {
+                throw std::invalid_argument("Missing valid token");
+            }
+        }
+
+        nextKeyword = tokens[i];
+    }
+
+    if (tokens[i] != "MOTION") {
+        throw std::invalid_argument("\"MOTION\" token not found");
+    }
+
+    if (tokens[i+1] != "Frames:") {
+        throw std::invalid_argument("\"Frames:\" token not found");
+    }
+
+    int nbFrames = std::stoi(tokens[i+2]);
+
+    if (tokens[i+3] != "Frame" && tokens[i+4] != "Time:") {
+        throw std::invalid_argument("\"Frame Time:\" token not found");
+    }
+
+    float frameInterval = std::stof(tokens[i+5]);
+    float time = 0;
+
+    i += 6;
+
+    for (int j = 0; j < nbFrames; j++) {
+        int k = 0;
+        while (k < static_cast<int>(rootList.size())) {
+            BVHTree* root = rootList[k];
+            nodeQueue.push_back(root);
+            while (!nodeQueue.empty()) {
+                BVHTree* node = nodeQueue.back();
+                nodeQueue.pop_back();
+                i = readAnimNode(tokens, i, node, time);
+                for (int childIndex = node->joints.size()-1; childIndex >= 0; childIndex--) {
+                    BVHTree* child = node->joints[childIndex];
+                    nodeQueue.push_back(child);
+                }
+            }
+            k++;
+        }
+        time += frameInterval;
+    }
+    
+    if (i < static_cast<int>(tokens.size())) {
+        throw std::invalid_argument("The file contains more values than expected");
+    }
+
+
+    return rootList;
+}
+
+void sampleChannels(const BVHTree* node, float time, float* values, int& keyFrame) {
+    const std::vector<std::vector<float>>& keyFrames = node->channelsValues;
+    if (keyFrames.size() < 2) {
+        for (size_t k = 0; k < node->channels.size(); k++) {
+            values[k] = keyFrames.empty() ? 0.0f : keyFrames[0][k + 1];
+        }
+        return;
+    }
+
+    // Resume the keyframe search where the previous evaluation stopped
+    int i = keyFrame;
+    if (i > 0 && keyFrames[i][0] >= time) {
+        i = 0;
+    }
+    while (i+2 < static_cast<int>(keyFrames.size()) && keyFrames[i+1][0] < time) i++;
+
+    float p = (time - keyFrames[i][0]) / (keyFrames[i+1][0] - keyFrames[i][0]);
+
+    p = std::max(0.0f, std::min(1.0f, p));
+
+    keyFrame = i;
+
+    for (size_t k = 0; k < node->channels.size(); k++) {
+        bool rotation = node->channels[k].compare(1, std::string::npos, "rotation") == 0;
+        float prev = keyFrames[ i ][k + 1];
+        float next = keyFrames[i+1][k + 1];
+        // Angles take the short way around
+        if (rotation && std::abs(prev + 360 - next) < std::abs(prev - next)) {
+            prev += 360;
+        } else if (rotation && std::abs(prev - (next + 360)) < std::abs(prev - next)) {
+            next += 360;
+        }
+        values[k] = (1-p) * prev + p * next;
+    }
+}
+
+BVHHeader readBVHHeader(const std::string& file) {
+    std::ifstream fch(file);
+    if (!fch.is_open()) {
+        throw std::runtime_error("Error opening file: " + file);
+    }
+
+    // Stops at "Frame Time:", the motion lines are never read
+    BVHHeader header;
+    std::string token;
+    bool hasMotion = false;
+    while (fch >> token) {
+        if (token == "ROOT" || token == "JOINT") {
+            fch >> token;
+            header.jointNames.push_back(token);
+        } else if (token == "CHANNELS") {
+            int nbChannels = 0;
+            fch >> nbChannels;
+            header.nbChannels += nbChannels;
+        } else if (token == "MOTION") {
+            hasMotion = true;
+        } else if (token == "Frames:" && hasMotion) {
+            fch >> header.nbFrames;
+        } else if (token == "Time:" && hasMotion) {
+            fch >> header.frameTime;
+            break;
+        }
+    }
+
+    if (!fch || header.jointNames.empty()) {
+        throw std::invalid_argument("Invalid BVH header: " + file);
+    }
+    return header;
+}
+
+void deleteBVH(std::vector<BVHTree*>& roots) {
+    std::vector<BVHTree*> nodeQueue(roots.begin(), roots.end());
+    while (!nodeQueue.empty()) {
+        BVHTree* node = nodeQueue.back();
+        nodeQueue.pop_back();
+        nodeQueue.insert(nodeQueue.end(), node->joints.begin(), node->joints.end());
+        delete node;
+    }
+    roots.clear();
+}
+
+static BVHTree* copyNode(const BVHTree* node, BVHTree* parent) {
+    BVHTree* copy = new BVHTree();
+    copy->name = node->name;
+    copy->offset = node->offset;
+    copy->channels = node->channels;
+    copy->parent = parent;
+    copy->nbNode = node->nbNode;
+    copy->nbLink = node->nbLink;
+    copy->nodeIndex = node->nodeIndex;
+    for (auto child: node->joints) {
+        copy->joints.push_back(copyNode(child, copy));
+    }
+    return copy;
+}
+
+std::vector<BVHTree*> copyHierarchy(const std::vector<BVHTree*>& roots) {
+    std::vector<BVHTree*> copies;
+    for (auto root: roots) {
+        copies.push_back(copyNode(root, NULL));
+    }
+    return copies;
+}
+
+std::vector<BVHTree*> preorder(const std::vector<BVHTree*>& roots) {
+    std::vector<BVHTree*> nodes;
+    std::vector<BVHTree*> nodeQueue(roots.rbegin(), roots.rend());
+    while (!nodeQueue.empty()) {
+        BVHTree* node = nodeQueue.back();
+        nodeQueue.pop_back();
+        nodes.push_back(node);
+        nodeQueue.insert(nodeQueue.end(), node->joints.rbegin(), node->joints.rend());
+    }
+    return nodes;
+}
+
+int channelSlot(const std::string& channel) {
+    static const char* names[6] = {"Xposition", "Yposition", "Zposition", "Xrotation", "Yrotation", "Zrotation"};
+    for (int i = 0; i < 6; i++) {
+        if (channel == names[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+std::string normalizedName(std::string name) {
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+    const std::string suffix = "_dup";
+    if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        name.erase(name.size() - suffix.size());
+    }
+    return name;
+}
+
+QQuaternion eulerToQuaternion(float theta, float phi, float psi) {
+    return QQuaternion::fromAxisAndAngle(QVector3D(0.0f, 0.0f, 1.0f), psi)
+         * QQuaternion::fromAxisAndAngle(QVector3D(0.0f, 1.0f, 0.0f), phi)
+         * QQuaternion::fromAxisAndAngle(QVector3D(1.0f, 0.0f, 0.0f), theta);
+}
+
+void clipRange(const std::vector<BVHTree*>& nodes, float& start, float& end) {
+    start = 0.0f;
+    end = 0.0f;
+    bool found = false;
+    for (const BVHTree* node : nodes) {
+        if (node->channelsValues.empty()) {
+            continue;
+        }
+        float first = node->channelsValues.front()[0];
+        float last = node->channelsValues.back()[0];
+        start = found ? std::min(start, first) : first;
+        end = found ? std::max(end, last) : last;
+        found = true;
+    }
+}
+
+bool valuesBySlot(const BVHTree* node, const float* channelValues, float values[6]) {
+    std::fill(values, values + 6, 0.0f);
+    bool hasPosition = false;
+    for (size_t k = 0; k < node->channels.size() && k < 6; k++) {
+        int slot = channelSlot(node->channels[k]);
+        if (slot >= 0) {
+            values[slot] = channelValues[k];
+            hasPosition = hasPosition || slot < 3;
+        }
+    }
+    return hasPosition;
+}
+
+void evaluatePose(const std::vector<BVHTree*>& nodes, float time, std::vector<int>& cursors,
+                  std::vector<QQuaternion>& rotations, std::vector<QVector3D>& positions) {
+    for (size_t n = 0; n < nodes.size(); n++) {
+        const BVHTree* node = nodes[n];
+        int joint = node->nodeIndex;
+        int parent = node->parent ? node->parent->nodeIndex : -1;
+
+        float values[6] = {0, 0, 0, 0, 0, 0};
+        bool hasPosition = false;
+        if (!node->channels.empty()) {
+            float sampled[6];
+            sampleChannels(node, time, sampled, cursors[n]);
+            hasPosition = valuesBySlot(node, sampled, values);
+        }
+        QVector3D offset = hasPosition ? QVector3D(values[0], values[1], values[2]) : node->offset;
+        QQuaternion local = eulerToQuaternion(values[3], values[4], values[5]);
+
+        if (parent >= 0) {
+            rotations[joint] = rotations[parent] * local;
+            positions[joint] = positions[parent] + rotations[parent].rotatedVector(offset);
+        } else {
+            rotations[joint] = local;
+            positions[joint] = offset;
+        }
+    }
+}
@@ -0,0 +1,453 @@
+#include "../header/clipexport.h"
+#include "../header/timing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+static const char binaryClipMagic[4] = {'B', 'V', 'H', 'C'};
+static const uint32_t binaryClipVersion = 1;
+
+// Numbers are formatted with std::to_chars straight into a fixed buffer, flushed in large writes
+class BufferedWriter
+{
+public:
+    explicit BufferedWriter(const std::string& file)
+        : out(file, std::ios::binary), fileName(file)
+    {
+        if (!out.is_open()) {
+            throw std::runtime_error("Error opening file: " + file);
+        }
+    }
+
+    void put(char c) {
+        reserve(1);
+        buffer[used++] = c;
+    }
+
+    void write(const char* data, size_t size) {
+        if (size > sizeof(buffer)) {
+            flush();
+            out.write(data, size);
+            written += size;
+            return;
+        }
+        reserve(size);
+        std::memcpy(buffer + used, data, size);
+        used += size;
+    }
+
+    void write(const std::string& text) {
+        write(text.data(), text.size());
+    }
+
+    // Fixed notation with 6 decimals, like the files we read
+    void write(float value) {
+        reserve(maxNumberSize);
+        used = std::to_chars(buffer + used, buffer + sizeof(buffer), value, std::chars_format::fixed, 6).ptr - buffer;
+    }
+
+    void write(int value) {
+        reserve(maxNumberSize);
+        used = std::to_chars(buffer + used, buffer + sizeof(buffer), value).ptr - buffer;
+    }
+
+    // Returns the size of the file
+    size_t close() {
+        flush();
+        out.close();
+        if (!out) {
+            throw std::runtime_error("Error writing file: " + fileName);
+        }
+        return written;
+    }
+
+private:
+    static const size_t maxNumberSize = 64;
+
+    void reserve(size_t size) {
+        if (used + size > sizeof(buffer)) {
+            flush();
+        }
+    }
+
+    void flush() {
+        out.write(buffer, used);
+        written += used;
+        used = 0;
+    }
+
+    char buffer[1 << 16];
+    size_t used = 0;
+    size_t written = 0;
+    std::ofstream out;
+    std::string fileName;
+};
+
+static void appendNumber(std::string& text, float value) {
+    char number[64];
+    text.append(number, std::to_chars(number, number + sizeof(number), value, std::chars_format::fixed, 6).ptr);
+}
+
+static void appendNode(std::string& text, const BVHTree* node, int depth) {
+    std::string indent(depth, '\t');
+    if (node->channels.empty() && node->joints.empty()) {
+        text += indent + "End " + node->name + "\n" + indent + "{\n" + indent + "\tOFFSET ";
+    } else {
+        text += indent + (node->parent ? "JOINT " : "ROOT ") + node->name + "\n" + indent + "{\n" + indent + "\tOFFSET ";
+    }
+    appendNumber(text, node->offset.x());
+    text += ' ';
+    appendNumber(text, node->offset.y());
+    text += ' ';
+    appendNumber(text, node->offset.z());
+    text += '\n';
+
+    if (!node->channels.empty()) {
+        text += indent + "\tCHANNELS " + std::to_string(node->channels.size());
+        for (const auto& channel : node->channels) {
+            text += ' ' + channel;
+        }
+        text += '\n';
+    }
+    for (auto child : node->joints) {
+        appendNode(text, child, depth + 1);
+    }
+    text += indent + "}\n";
+}
+
+// HIERARCHY section of a BVH file, up to MOTION
+static std::string hierarchyText(const std::vector<BVHTree*>& roots) {
+    std::string text = "HIERARCHY\n";
+    for (auto root : roots) {
+        appendNode(text, root, 0);
+    }
+    return text;
+}
+
+static std::string frameTimeText(float frameTime) {
+    // Shortest representation reading back to the same float, 1/60 s does not fit in 6 decimals
+    char number[64];
+    return std::string(number, std::to_chars(number, number + sizeof(number), frameTime).ptr);
+}
+
+clipFrames resampleClip(const std::vector<BVHTree*>& roots, const resampleOptions& options) {
+    if (!(options.frameTime > 0.0f)) {
+        throw std::invalid_argument("The frame time must be positive");
+    }
+
+    std::vector<BVHTree*> nodes;
+    for (auto node : preorder(roots)) {
+        if (!node->channels.empty()) {
+            nodes.push_back(node);
+        }
+    }
+
+    clipFrames frames;
+    for (auto node : nodes) {
+        frames.nbChannels += node->channels.size();
+    }
+
+    float duration = 0.0f;
+    if (!nodes.empty() && !nodes[0]->channelsValues.empty()) {
+        duration = nodes[0]->channelsValues.back()[0];
+    }
+    float start = std::clamp(options.start, 0.0f, duration);
+    float end = options.end < 0.0f ? duration : std::clamp(options.end, start, duration);
+
+    // A loop ends one frame before it starts again, the frame time is stretched to a whole number of frames
+    frames.frameTime = options.frameTime;
+    if (options.loop) {
+        frames.nbFrames = std::max(1, static_cast<int>(std::lround((end - start) / options.frameTime)));
+        if (end > start) {
+            frames.frameTime = (end - start) / frames.nbFrames;
+        }
+    } else {
+        frames.nbFrames = static_cast<int>(std::floor((end - start) / options.frameTime + 1e-4f)) + 1;
+    }
+    frames.values.resize(static_cast<size_t>(frames.nbFrames) * frames.nbChannels);
+
+    // Node by node, so the keyframe cursor only moves forward
+    int channel = 0;
+    for (auto node : nodes) {
+        int keyFrame = 0;
+        for (int f = 0; f < frames.nbFrames; f++) {
+            sampleChannels(node, start + f * frames.frameTime, &frames.values[static_cast<size_t>(f) * frames.nbChannels + channel], keyFrame);
+        }
+        channel += node->channels.size();
+    }
+    return frames;
+}
+
+size_t writeBVH(const std::string& file, const std::vector<BVHTree*>& roots, const clipFrames& frames) {
+    BufferedWriter out(file);
+    out.write(hierarchyText(roots));
+    out.write("MOTION\nFrames: ", 15);
+    out.write(frames.nbFrames);
+    out.write("\nFrame Time: ", 13);
+    out.write(frameTimeText(frames.frameTime));
+    out.put('\n');
+
+    const float* value = frames.values.data();
+    for (int f = 0; f < frames.nbFrames; f++) {
+        for (int c = 0; c < frames.nbChannels; c++) {
+            if (c > 0) {
+                out.put(' ');
+            }
+            out.write(*value++);
+        }
+        out.put('\n');
+    }
+    return out.close();
+}
+
+template <typename T>
+static void writeRaw(BufferedWriter& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+size_t writeBinaryClip(const std::string& file, const std::vector<BVHTree*>& roots, const clipFrames& frames) {
+    std::string hierarchy = hierarchyText(roots);
+
+    BufferedWriter out(file);
+    out.write(binaryClipMagic, sizeof(binaryClipMagic));
+    writeRaw(out, binaryClipVersion);
+    writeRaw(out, static_cast<uint32_t>(hierarchy.size()));
+    out.write(hierarchy);
+    writeRaw(out, static_cast<uint32_t>(frames.nbFrames));
+    writeRaw(out, static_cast<uint32_t>(frames.nbChannels));
+    writeRaw(out, frames.frameTime);
+    out.write(reinterpret_cast<const char*>(frames.values.data()), frames.values.size() * sizeof(float));
+    return out.close();
+}
+
+template <typename T>
+static T readRaw(std::ifstream& in) {
+    T value;
+    in.read(reinterpret_cast<char*>(&value), sizeof(T));
+    return value;
+}
+
+// Fields before the frames, the hierarchy is parsed as a BVH file without frames
+static std::vector<BVHTree*> readBinaryClipHierarchy(std::ifstream& in, const std::string& file, clipFrames& frames) {
+    char magic[sizeof(binaryClipMagic)];
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, binaryClipMagic, sizeof(magic)) != 0 || readRaw<uint32_t>(in) != binaryClipVersion) {
+        throw std::invalid_argument("Not a binary clip: " + file);
+    }
+
+    std::string hierarchy(readRaw<uint32_t>(in), '\0');
+    in.read(&hierarchy[0], hierarchy.size());
+    frames.nbFrames = readRaw<uint32_t>(in);
+    frames.nbChannels = readRaw<uint32_t>(in);
+    frames.frameTime = readRaw<float>(in);
+    if (!in) {
+        throw std::invalid_argument("Truncated binary clip: " + file);
+    }
+    return parseBVH(hierarchy + "MOTION\nFrames: 0\nFrame Time: " + frameTimeText(frames.frameTime) + "\n");
+}
+
+std::vector<BVHTree*> readBinaryClip(const std::string& file) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("Error opening file: " + file);
+    }
+
+    clipFrames frames;
+    std::vector<BVHTree*> roots = readBinaryClipHierarchy(in, file, frames);
+    std::vector<BVHTree*> nodes;
+    int nbChannels = 0;
+    for (auto node : preorder(roots)) {
+        if (!node->channels.empty()) {
+            nodes.push_back(node);
+            nbChannels += node->channels.size();
+        }
+    }
+    if (nbChannels != frames.nbChannels) {
+        deleteBVH(roots);
+        throw std::invalid_argument("Channel count does not match the hierarchy: " + file);
+    }
+
+    frames.values.resize(static_cast<size_t>(frames.nbFrames) * frames.nbChannels);
+    in.read(reinterpret_cast<char*>(frames.values.data()), frames.values.size() * sizeof(float));
+    if (!in) {
+        deleteBVH(roots);
+        throw std::invalid_argument("Truncated binary clip: " + file);
+    }
+
+    // Same keyframes as readBVH gives, the time first
+    int channel = 0;
+    for (auto node : nodes) {
+        int nbNodeChannels = node->channels.size();
+        node->channelsValues.resize(frames.nbFrames);
+        for (int f = 0; f < frames.nbFrames; f++) {
+            const float* values = &frames.values[static_cast<size_t>(f) * frames.nbChannels + channel];
+            std::vector<float>& keyFrame = node->channelsValues[f];
+            keyFrame.reserve(nbNodeChannels + 1);
+            keyFrame.push_back(f * frames.frameTime);
+            keyFrame.insert(keyFrame.end(), values, values + nbNodeChannels);
+        }
+        channel += nbNodeChannels;
+    }
+    return roots;
+}
+
+BVHHeader readBinaryClipHeader(const std::string& file) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("Error opening file: " + file);
+    }
+
+    clipFrames frames;
+    std::vector<BVHTree*> roots = readBinaryClipHierarchy(in, file, frames);
+    BVHHeader header;
+    for (auto node : preorder(roots)) {
+        if (!node->channels.empty()) {
+            header.jointNames.push_back(node->name);
+        }
+    }
+    deleteBVH(roots);
+    header.nbChannels = frames.nbChannels;
+    header.nbFrames = frames.nbFrames;
+    header.frameTime = frames.frameTime;
+    return header;
+}
+
+static bool isBinaryClip(const std::string& file) {
+    return std::filesystem::path(file).extension() == ".clip";
+}
+
+std::vector<BVHTree*> readClip(const std::string& file) {
+    return isBinaryClip(file) ? readBinaryClip(file) : readBVH(file);
+}
+
+BVHHeader readClipHeader(const std::string& file) {
+    return isBinaryClip(file) ? readBinaryClipHeader(file) : readBVHHeader(file);
+}
+
+std::vector<exportResult> exportDirectory(const std::string& inputDirectory, const std::string& outputDirectory,
+                                          const resampleOptions& options, clipFormat format, int nbThreads) {
+    std::vector<std::filesystem::path> files;
+    for (const auto& entry : std::filesystem::directory_iterator(inputDirectory)) {
+        std::string extension = entry.path().extension().string();
+        if (entry.is_regular_file() && (extension == ".bvh" || extension == ".clip")) {
+            files.push_back(entry.path());
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    std::filesystem::create_directories(outputDirectory);
+    if (std::filesystem::equivalent(inputDirectory, outputDirectory)) {
+        throw std::invalid_argument("The clips would overwrite themselves, choose another directory than " + inputDirectory);
+    }
+
+    std::vector<exportResult> results(files.size());
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < static_cast<int>(files.size()); i = next++) {
+            exportResult& result = results[i];
+            result.name = files[i].stem().string();
+            result.file = (std::filesystem::path(outputDirectory) / (result.name + (format == binaryClip ? ".clip" : ".bvh"))).string();
+            std::vector<BVHTree*> roots;
+            try {
+                auto start = std::chrono::steady_clock::now();
+                roots = readClip(files[i].string());
+                result.readTime = elapsedMs(start);
+
+                start = std::chrono::steady_clock::now();
+                clipFrames frames = resampleClip(roots, options);
+                result.resampleTime = elapsedMs(start);
+                result.nbFrames = frames.nbFrames;
+
+                start = std::chrono::steady_clock::now();
+                result.bytes = format == binaryClip ? writeBinaryClip(result.file, roots, frames) : writeBVH(result.file, roots, frames);
+                result.writeTime = elapsedMs(start);
+            } catch (const std::exception& e) {
+                std::cerr << "Error exporting " << files[i].string() << ": " << e.what() << "\n";
+                result.failed = true;
+            }
+            deleteBVH(roots);
+        }
+    };
+
+    std::vector<std::future<void>> workers;
+    for (int t = 1; t < nbThreads; t++) {
+        workers.push_back(std::async(std::launch::async, worker));
+    }
+    worker();
+    for (auto& w : workers) {
+        w.wait();
+    }
+    return results;
+}
+
+// What a writer formatting through iostreams costs, for comparison with writeBVH
+static double ostreamWriteTime(const std::string& file, const std::vector<BVHTree*>& roots, const clipFrames& frames) {
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::ofstream out(file);
+        out << hierarchyText(roots) << "MOTION\nFrames: " << frames.nbFrames << "\nFrame Time: " << frames.frameTime << "\n";
+        out << std::fixed << std::setprecision(6);
+        const float* value = frames.values.data();
+        for (int f = 0; f < frames.nbFrames; f++) {
+            for (int c = 0; c < frames.nbChannels; c++) {
+                out << (c > 0 ? " " : "") << *value++;
+            }
+            out << "\n";
+        }
+    }
+    double time = elapsedMs(start);
+    std::filesystem::remove(file);
+    return time;
+}
+
+void benchmarkExport(const std::string& inputDirectory, const std::string& outputDirectory, const resampleOptions& options, clipFormat format) {
+    int nbThreads = std::max(1u, std::thread::hardware_concurrency());
+    auto start = std::chrono::steady_clock::now();
+    std::vector<exportResult> results = exportDirectory(inputDirectory, outputDirectory, options, format, nbThreads);
+    double totalTime = elapsedMs(start);
+
+    size_t totalBytes = 0;
+    double writeTime = 0;
+    for (const auto& result : results) {
+        if (result.failed) {
+            continue;
+        }
+        totalBytes += result.bytes;
+        writeTime += result.writeTime;
+        std::cout << "Export " << result.name << " -> " << result.file << ": " << result.nbFrames << " frames, "
+                  << result.bytes / 1024.0 << " KiB, read " << result.readTime << " ms, resampled " << result.resampleTime
+                  << " ms, written " << result.writeTime << " ms (" << (result.writeTime > 0 ? result.bytes / 1e3 / result.writeTime : 0.0)
+                  << " MB/s)\n";
+    }
+    std::cout << "Exported " << results.size() << " clips at " << 1.0f / options.frameTime << " fps on " << nbThreads << " threads in "
+              << totalTime << " ms: " << totalBytes / 1e6 << " MB, " << (writeTime > 0 ? totalBytes / 1e3 / writeTime : 0.0)
+              << " MB/s written per thread, " << (totalTime > 0 ? totalBytes / 1e3 / totalTime : 0.0) << " MB/s overall\n";
+
+    // Same text through iostreams, on the longest clip
+    auto longest = std::max_element(results.begin(), results.end(), [](const exportResult& a, const exportResult& b) {
+        return a.failed || (!b.failed && a.bytes < b.bytes);
+    });
+    if (format == bvhText && longest != results.end() && !longest->failed) {
+        std::vector<BVHTree*> roots = readClip(longest->file);
+        resampleOptions copy;
+        copy.frameTime = readClipHeader(longest->file).frameTime;
+        clipFrames frames = resampleClip(roots, copy);
+        double time = ostreamWriteTime(longest->file + ".ostream", roots, frames);
+        deleteBVH(roots);
+        std::cout << "iostream writer on " << longest->name << ": " << time << " ms (" << (time > 0 ? longest->bytes / 1e3 / time : 0.0)
+                  << " MB/s), buffered to_chars writer " << longest->writeTime << " ms\n";
+    }
+}
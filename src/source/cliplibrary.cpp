@@ -0,0 +1,251 @@
+#include "../header/cliplibrary.h"
+#include "../header/clipexport.h"
+#include "../header/memorystats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+static std::shared_ptr<decodedClip> decodeClip(const std::string& file) {
+    auto start = std::chrono::steady_clock::now();
+    auto clip = std::make_shared<decodedClip>();
+    clip->roots = readClip(file);
+    hierarchyMemory memory = measureHierarchy(clip->roots);
+    clip->bytes = memory.hierarchyBytes + memory.keyframeBytes;
+    clip->loadTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return clip;
+}
+
+ClipLibrary::ClipLibrary(size_t budget)
+    : byteBudget(budget)
+{
+}
+
+ClipLibrary::~ClipLibrary()
+{
+    // A running prefetch reads the entries
+    for (auto& slot : slots) {
+        if (slot.pending) {
+            JobSystem::shared().wait(slot.pending->job);
+        }
+    }
+}
+
+int ClipLibrary::index(const std::string& directory)
+{
+    std::vector<std::filesystem::path> files;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        std::string extension = entry.path().extension().string();
+        if (entry.is_regular_file() && (extension == ".bvh" || extension == ".clip")) {
+            files.push_back(entry.path());
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    std::vector<clipInfo> found;
+    for (const auto& path : files) {
+        try {
+            found.push_back({path.stem().string(), path.string(), readClipHeader(path.string())});
+        } catch (const std::exception& e) {
+            std::cerr << "Skipping clip " << path.string() << ": " << e.what() << "\n";
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& clip : found) {
+        if (std::none_of(entries.begin(), entries.end(), [&](const clipInfo& c) { return c.name == clip.name; })) {
+            entries.push_back(std::move(clip));
+        }
+    }
+    slots.resize(entries.size());
+    return entries.size();
+}
+
+int ClipLibrary::find(const std::string& name) const
+{
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+std::shared_ptr<decodedClip> ClipLibrary::acquire(const std::string& name)
+{
+    int clip = find(name);
+    if (clip < 0) {
+        throw std::runtime_error("Unknown clip: " + name);
+    }
+
+    std::shared_ptr<pendingClip> pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        collectPrefetched();
+
+        cacheSlot& slot = slots[clip];
+        if (slot.clip) {
+            // The first request of a prefetched clip is credited to the prefetch
+            if (slot.prefetched) {
+                cacheStats.prefetchHits++;
+            } else {
+                cacheStats.hits++;
+            }
+            slot.prefetched = false;
+            recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, slot.recent);
+            return slot.clip;
+        }
+
+        if (slot.pending) {
+            cacheStats.prefetchHits += slot.prefetched;
+            slot.prefetched = false;
+        } else {
+            // The thread waiting for it runs the job unless a worker took it, the others wait on the same result
+            slot.pending = submitDecode(clip);
+            slot.prefetched = false;
+            cacheStats.misses++;
+        }
+        pending = slot.pending;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<decodedClip> decoded;
+    // Through the job system: a worker asking for a clip runs other jobs meanwhile, the parse included
+    JobSystem::shared().wait(pending->job);
+    if (std::exception_ptr error = pending->job.error()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slots[clip].pending == pending) {
+            slots[clip].pending.reset();
+        }
+        std::rethrow_exception(error);
+    }
+    decoded = pending->clip;
+    double stall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    cacheStats.stallTime += stall;
+    if (!slots[clip].clip && slots[clip].pending) {
+        install(clip, decoded);
+        evict(clip);
+    } else if (slots[clip].clip) {
+        recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, slots[clip].recent);
+    }
+    return decoded;
+}
+
+void ClipLibrary::prefetch(const std::string& name)
+{
+    int clip = find(name);
+    if (clip < 0) {
+        std::cerr << "Cannot prefetch unknown clip " << name << "\n";
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    collectPrefetched();
+    cacheSlot& slot = slots[clip];
+    if (slot.clip || slot.pending) {
+        return;
+    }
+    slot.pending = submitDecode(clip);
+    slot.prefetched = true;
+    cacheStats.prefetches++;
+}
+
+// Called with the mutex held
+std::shared_ptr<ClipLibrary::pendingClip> ClipLibrary::submitDecode(int clip)
+{
+    auto pending = std::make_shared<pendingClip>();
+    std::string file = entries[clip].file;
+    pending->job = JobSystem::shared().submit("decode clip", [pending, file]() { pending->clip = decodeClip(file); });
+    return pending;
+}
+
+// Called with the mutex held
+void ClipLibrary::install(int clip, std::shared_ptr<decodedClip> decoded)
+{
+    cacheSlot& slot = slots[clip];
+    slot.pending.reset();
+    slot.clip = decoded;
+    recentlyUsed.push_front(clip);
+    slot.recent = recentlyUsed.begin();
+
+    resident += decoded->bytes;
+    cacheStats.peakBytes = std::max(cacheStats.peakBytes, resident);
+    cacheStats.loads++;
+    cacheStats.loadTime += decoded->loadTime;
+    cacheStats.maxLoadTime = std::max(cacheStats.maxLoadTime, decoded->loadTime);
+}
+
+// Finished prefetches join the cache, even if nobody asked for them yet
+void ClipLibrary::collectPrefetched()
+{
+    for (size_t i = 0; i < slots.size(); i++) {
+        cacheSlot& slot = slots[i];
+        if (!slot.prefetched || slot.clip || !slot.pending || !slot.pending->job.done()) {
+            continue;
+        }
+        try {
+            if (std::exception_ptr error = slot.pending->job.error()) {
+                std::rethrow_exception(error);
+            }
+            install(i, slot.pending->clip);
+            evict(i);
+        } catch (const std::exception& e) {
+            std::cerr << "Error prefetching clip " << entries[i].name << ": " << e.what() << "\n";
+            slot.pending.reset();
+            slot.prefetched = false;
+        }
+    }
+}
+
+// Evicts from the least recently used end until the cache fits, the clip just used is kept
+void ClipLibrary::evict(int keep)
+{
+    while (resident > byteBudget && !recentlyUsed.empty() && recentlyUsed.back() != keep) {
+        cacheSlot& slot = slots[recentlyUsed.back()];
+        resident -= slot.clip->bytes;
+        slot.clip.reset();
+        slot.prefetched = false;
+        recentlyUsed.pop_back();
+        cacheStats.evictions++;
+    }
+}
+
+void ClipLibrary::setBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    byteBudget = bytes;
+    evict(recentlyUsed.empty() ? -1 : recentlyUsed.front());
+}
+
+size_t ClipLibrary::residentBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return resident;
+}
+
+clipCacheStats ClipLibrary::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return cacheStats;
+}
+
+void ClipLibrary::printStats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    long long requests = cacheStats.hits + cacheStats.misses + cacheStats.prefetchHits;
+    double hitRate = requests ? double(cacheStats.hits + cacheStats.prefetchHits) / requests : 0.0;
+    std::cout << "Clip library: " << entries.size() << " clips indexed, " << recentlyUsed.size() << " cached, "
+              << resident / 1024.0 << " KiB resident (peak " << cacheStats.peakBytes / 1024.0
+              << " KiB, budget " << byteBudget / 1024.0 << " KiB)\n"
+              << "Clip cache: " << requests << " requests, " << hitRate * 100.0 << " % hit rate ("
+              << cacheStats.hits << " hits, " << cacheStats.prefetchHits << " served by " << cacheStats.prefetches
+              << " prefetches, " << cacheStats.misses << " misses), " << cacheStats.evictions << " evictions\n"
+              << "Clip loads: " << cacheStats.loads << " parsed in "
+              << (cacheStats.loads ? cacheStats.loadTime / cacheStats.loads : 0.0) << " ms on average, "
+              << cacheStats.maxLoadTime << " ms worst, " << cacheStats.stallTime << " ms waited by callers\n";
+}
@@ -0,0 +1,318 @@
+#include "../header/framecapture.h"
+#include "../header/timing.h"
+
+#include <QDir>
+#include <QImage>
+#include <QOpenGLContext>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+FrameCapture::FrameCapture()
+{
+}
+
+FrameCapture::~FrameCapture()
+{
+    // The owner calls finish() while its context is current, only the threads can be left
+    if (running) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for (auto& encoder : encoders) {
+            encoder.join();
+        }
+    }
+}
+
+bool FrameCapture::start(int width, int height, const captureOptions& options)
+{
+    if (running) {
+        finish();
+    }
+    initializeOpenGLFunctions();
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    bool fencesSupported = context->isOpenGLES() ? context->format().majorVersion() >= 3
+                                                 : context->format().version() >= qMakePair(3, 2) || context->hasExtension("GL_ARB_sync");
+    if (!fencesSupported) {
+        std::cerr << "No fences to read frames back asynchronously, capture disabled\n";
+        return false;
+    }
+    if (!QDir().mkpath(QString::fromStdString(options.directory))) {
+        std::cerr << "Error creating " << options.directory << "\n";
+        return false;
+    }
+
+    settings = options;
+    settings.nbBuffers = std::max(2, options.nbBuffers);
+    settings.maxQueued = std::max(1, options.maxQueued);
+    frameWidth = width;
+    frameHeight = height;
+
+    if (settings.format == CaptureYuv) {
+        std::string fileName = settings.directory + "/capture_" + std::to_string(width) + "x" + std::to_string(height) + ".yuv";
+        yuvFile.open(fileName, std::ios::binary | std::ios::trunc);
+        if (!yuvFile) {
+            std::cerr << "Error opening " << fileName << "\n";
+            return false;
+        }
+        pendingYuv.clear();
+        nextYuvSequence = nextSequence;
+    }
+
+    size_t frameBytes = static_cast<size_t>(width) * height * 4;
+    buffers.assign(settings.nbBuffers, 0);
+    fences.assign(settings.nbBuffers, nullptr);
+    glGenBuffers(settings.nbBuffers, buffers.data());
+    for (GLuint buffer : buffers) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes, nullptr, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    head = 0;
+    inFlight = 0;
+
+    stopping = false;
+    int nbThreads = settings.nbThreads > 0 ? settings.nbThreads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+    for (int t = 0; t < nbThreads; t++) {
+        encoders.emplace_back(&FrameCapture::encodeLoop, this);
+    }
+    running = true;
+    std::cout << "Capturing " << width << "x" << height << (settings.format == CapturePng ? " PNG" : " YUV") << " frames to "
+              << settings.directory << " through " << settings.nbBuffers << " pixel buffers and " << nbThreads << " encoders\n";
+    return true;
+}
+
+void FrameCapture::capture()
+{
+    if (!running) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    // The ring is full: the oldest frame has to leave before its buffer is read into again
+    if (inFlight == settings.nbBuffers) {
+        retireOldest(true);
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[head]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, frameWidth, frameHeight, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    fences[head] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    head = (head + 1) % settings.nbBuffers;
+    inFlight++;
+
+    // Every older copy the GPU already finished, in order
+    while (inFlight > 0 && retireOldest(false)) {
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.captured++;
+    counters.readbackTime += elapsedMs(start);
+}
+
+bool FrameCapture::retireOldest(bool wait)
+{
+    int oldest = (head - inFlight + settings.nbBuffers) % settings.nbBuffers;
+    GLenum status = glClientWaitSync(fences[oldest], 0, 0);
+    bool signaled = status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+    if (!signaled) {
+        if (!wait) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            counters.late++;
+        }
+        glClientWaitSync(fences[oldest], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+    }
+    glDeleteSync(fences[oldest]);
+    fences[oldest] = nullptr;
+    inFlight--;
+
+    // A slot in the queue and a buffer to copy into, or the frame is dropped without mapping it
+    std::vector<uint8_t> pixels;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (static_cast<int>(jobs.size()) >= settings.maxQueued) {
+            if (settings.dropWhenBusy) {
+                counters.dropped++;
+                return true;
+            }
+            jobTaken.wait(lock, [this]() { return static_cast<int>(jobs.size()) < settings.maxQueued; });
+        }
+        if (!freePixels.empty()) {
+            pixels.swap(freePixels.back());
+            freePixels.pop_back();
+        }
+    }
+
+    size_t frameBytes = static_cast<size_t>(frameWidth) * frameHeight * 4;
+    pixels.resize(frameBytes);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[oldest]);
+    const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameBytes, GL_MAP_READ_BIT);
+    bool copied = mapped != nullptr;
+    if (copied) {
+        std::memcpy(pixels.data(), mapped, frameBytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (copied) {
+            jobs.push_back({nextSequence++, std::move(pixels)});
+        } else {
+            counters.failed++;
+        }
+    }
+    jobReady.notify_one();
+    return true;
+}
+
+void FrameCapture::finish()
+{
+    if (!running) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool dropWhenBusy = settings.dropWhenBusy;
+    settings.dropWhenBusy = false; // The last frames wait for the encoders
+    while (inFlight > 0) {
+        retireOldest(true);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glDeleteBuffers(buffers.size(), buffers.data());
+    buffers.clear();
+    fences.clear();
+    settings.dropWhenBusy = dropWhenBusy;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        counters.readbackTime += elapsedMs(start);
+    }
+    jobReady.notify_all();
+    for (auto& encoder : encoders) {
+        encoder.join();
+    }
+    encoders.clear();
+    freePixels.clear();
+    if (yuvFile.is_open()) {
+        yuvFile.close();
+    }
+    running = false;
+}
+
+void FrameCapture::encodeLoop()
+{
+    std::vector<uint8_t> yuv;
+    for (;;) {
+        captureJob job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobReady.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        jobTaken.notify_one();
+
+        auto start = std::chrono::steady_clock::now();
+        bool written = settings.format == CapturePng ? writePng(job) : writeYuv(job, yuv);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        (written ? counters.written : counters.failed)++;
+        counters.encodeTime += elapsedMs(start);
+        freePixels.push_back(std::move(job.pixels));
+    }
+}
+
+bool FrameCapture::writePng(const captureJob& job)
+{
+    // GL rows start at the bottom
+    QImage image(job.pixels.data(), frameWidth, frameHeight, QImage::Format_RGBA8888);
+    QString fileName = QDir(QString::fromStdString(settings.directory)).filePath(QString("frame_%1.png").arg(job.sequence, 4, 10, QChar('0')));
+    if (!image.mirrored().save(fileName)) {
+        std::cerr << "Error writing " << fileName.toStdString() << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool FrameCapture::writeYuv(captureJob& job, std::vector<uint8_t>& yuv)
+{
+    // I420: the luma plane, then the chroma planes averaged over 2x2 pixels. Odd sizes round the chroma up
+    int chromaWidth = (frameWidth + 1) / 2;
+    int chromaHeight = (frameHeight + 1) / 2;
+    yuv.resize(static_cast<size_t>(frameWidth) * frameHeight + 2 * static_cast<size_t>(chromaWidth) * chromaHeight);
+    uint8_t* lumaPlane = yuv.data();
+    uint8_t* uPlane = lumaPlane + static_cast<size_t>(frameWidth) * frameHeight;
+    uint8_t* vPlane = uPlane + static_cast<size_t>(chromaWidth) * chromaHeight;
+
+    auto pixel = [&](int x, int y) {
+        return &job.pixels[(static_cast<size_t>(frameHeight - 1 - y) * frameWidth + x) * 4];
+    };
+    for (int y = 0; y < frameHeight; y++) {
+        for (int x = 0; x < frameWidth; x++) {
+            const uint8_t* p = pixel(x, y);
+            lumaPlane[static_cast<size_t>(y) * frameWidth + x] = static_cast<uint8_t>(((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16);
+        }
+    }
+    for (int y = 0; y < chromaHeight; y++) {
+        for (int x = 0; x < chromaWidth; x++) {
+            int r = 0, g = 0, b = 0;
+            for (int k = 0; k < 4; k++) {
+                const uint8_t* p = pixel(std::min(2 * x + (k & 1), frameWidth - 1), std::min(2 * y + (k >> 1), frameHeight - 1));
+                r += p[0];
+                g += p[1];
+                b += p[2];
+            }
+            r = (r + 2) / 4;
+            g = (g + 2) / 4;
+            b = (b + 2) / 4;
+            uPlane[static_cast<size_t>(y) * chromaWidth + x] = static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            vPlane[static_cast<size_t>(y) * chromaWidth + x] = static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+
+    // Frames finish out of order on several encoders, each one is written once all its predecessors are
+    std::lock_guard<std::mutex> lock(fileMutex);
+    pendingYuv[job.sequence].swap(yuv);
+    bool success = true;
+    while (!pendingYuv.empty() && pendingYuv.begin()->first == nextYuvSequence) {
+        const std::vector<uint8_t>& frame = pendingYuv.begin()->second;
+        yuvFile.write(reinterpret_cast<const char*>(frame.data()), frame.size());
+        success = success && static_cast<bool>(yuvFile);
+        pendingYuv.erase(pendingYuv.begin());
+        nextYuvSequence++;
+    }
+    return success;
+}
+
+captureStats FrameCapture::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void FrameCapture::printStats() const
+{
+    captureStats s = stats();
+    if (s.captured == 0) {
+        return;
+    }
+    std::cout << "Capture: " << s.captured << " frames, " << s.written << " written, " << s.dropped << " dropped, "
+              << s.late << " late, " << s.failed << " failed, " << s.readbackTime * 1e3 / s.captured << " us per frame on the GL thread, "
+              << (s.written ? s.encodeTime / s.written : 0.0) << " ms per frame encoding\n";
+    if (settings.format == CaptureYuv) {
+        std::cout << "Play with: ffplay -f rawvideo -pixel_format yuv420p -video_size " << frameWidth << "x" << frameHeight
+                  << " " << settings.directory << "/capture_" << frameWidth << "x" << frameHeight << ".yuv\n";
+    }
+}
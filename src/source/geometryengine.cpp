@@ -3,44 +3,105 @@
 
 #include "../header/geometryengine.h"
 
-struct VertexData
-{
-    QVector3D position;
-    QVector3D color;
-    QVector2D texCoord;
-};
+#include <QElapsedTimer>
+
+#include <filesystem>
+#include <limits>
+#include <numeric>
+
+static void buildSkinGeometry(const std::string& filenameMesh, const std::string& filenameWeights, const std::vector<BVHTree*>& skeleton,
+                              std::vector<VertexSkinData>& vertices, std::vector<VertexSkinExtraData>& extra,
+                              std::vector<GLushort>& indices, std::vector<influenceBucket>& buckets, std::vector<meshLod>& lods,
+                              std::vector<morphTarget>& morphs, std::vector<int>& sourceVertices);
+static void packSkinLevel(const lodMesh& level, bool hasExtra, std::vector<VertexSkinData>& vertices,
+                          std::vector<VertexSkinExtraData>& extra, std::vector<GLushort>& indices,
+                          std::vector<influenceBucket>& buckets, std::vector<meshLod>& lods, std::vector<int>& sourceVertices);
+
+// Influence counts of the buckets, each has its kernel and shader variant
+static const int bucketSizes[] = {1, 2, 4, 8};
+static const int nbBuckets = 4;
+
+// Smallest bucket holding nbInfluences influences
+static int bucketOf(int nbInfluences) {
+    int bucket = 0;
+    while (bucket + 1 < nbBuckets && bucketSizes[bucket] < nbInfluences) {
+        bucket++;
+    }
+    return bucket;
+}
 
-struct VertexSkinData
-{
-    QVector3D position;
-    QVector3D color;
-    float weight0;
-    float weight1;
-    float weight2;
-    float weight3;
-    QVector3D transfo0;
-    QVector3D transfo1;
-    QVector3D transfo2;
-    QVector3D transfo3;
-};
+// Texture unit of the pose keys, the other units are free
+static const int poseTextureUnit = 1;
+
+// The skin levels share one GLushort index buffer
+static const int maxSkinVertices = std::numeric_limits<GLushort>::max() + 1;
+
+// Skeleton of the columns of weights.txt
+static const char* skinSkeletonClip = "walk1";
 
 //! [0]
 GeometryEngine::GeometryEngine()
-    : indexBufRig(QOpenGLBuffer::IndexBuffer), indexBufSkin(QOpenGLBuffer::IndexBuffer)
+    : poseKeyTexture(QOpenGLTexture::Target2D), indexBufRig(QOpenGLBuffer::IndexBuffer), indexBufSkin(QOpenGLBuffer::IndexBuffer)
 {
     initializeOpenGLFunctions();
 
-    // Generate 4 VBOs
+    // Generate 6 VBOs
     arrayBufRig.create();
     indexBufRig.create();
     arrayBufSkin.create();
+    arrayBufSkinExtra.create();
     indexBufSkin.create();
+    skinnedBuf.create();
+    skinnedBuf.bind();
+    skinnedBuf.setUsagePattern(QOpenGLBuffer::DynamicCopy);
+
+    renderState.init();
+    rigMesh = renderState.addMesh({{&arrayBufRig, sizeof(VertexData), {
+        {"a_position", offsetof(VertexData, position), 3},
+        {"a_color", offsetof(VertexData, color), 3},
+        {"a_texcoord", offsetof(VertexData, texCoord), 2}}}}, &indexBufRig);
+    skinMesh = renderState.addMesh({{&arrayBufSkin, sizeof(VertexSkinData), {
+        {"a_position", offsetof(VertexSkinData, position), 3},
+        {"a_color", offsetof(VertexSkinData, color), 3},
+        {"a_weight0", offsetof(VertexSkinData, weight0), 1},
+        {"a_weight1", offsetof(VertexSkinData, weight1), 1},
+        {"a_weight2", offsetof(VertexSkinData, weight2), 1},
+        {"a_weight3", offsetof(VertexSkinData, weight3), 1},
+        {"a_joints", offsetof(VertexSkinData, joints), 4},
+        {"a_normal", offsetof(VertexSkinData, normal), 3}}},
+        {&arrayBufSkinExtra, sizeof(VertexSkinExtraData), {
+        {"a_weights1", offsetof(VertexSkinExtraData, weights), 4},
+        {"a_joints1", offsetof(VertexSkinExtraData, joints), 4}}}}, &indexBufSkin);
+
+    // Positions and normals come from the skinning pre-pass or the CPU, colors from the mesh buffer
+    skinnedMesh = renderState.addMesh({
+        {&skinnedBuf, sizeof(SkinnedVertexData), {
+        {"a_position", offsetof(SkinnedVertexData, position), 3},
+        {"a_normal", offsetof(SkinnedVertexData, normal), 3}}},
+        {&arrayBufSkin, sizeof(VertexSkinData), {{"a_color", offsetof(VertexSkinData, color), 3}}}}, &indexBufSkin);
+
+    // Parse the clip and the mesh on worker threads while the shaders compile,
+    // only the headers of the other clips are read for now
+    clips.index("../models");
+    playClip("walk1");
+    skinAsset = assets.load("skin.off + weights.txt", [this]() {
+        // Without painted weights they are computed from the skeleton the weights would follow
+        std::shared_ptr<decodedClip> skeleton;
+        if (!std::filesystem::exists("../models/weights.txt")) {
+            skeleton = clips.acquire(skinSkeletonClip);
+        }
+        buildSkinGeometry("../models/skin.off", "../models/weights.txt", skeleton ? skeleton->roots : std::vector<BVHTree*>(),
+                          loadedSkinVertices, loadedSkinExtra, loadedSkinIndices, loadedSkinBuckets, loadedSkinLods,
+                          loadedMorphTargets, loadedSkinSources);
+    }, [this]() { uploadSkin(); });
 
     // Initializes cube geometry and transfers it to VBOs
     // initCubeGeometry();
     // initRepereGeometry();
-    initBVHGeometry("../models/walk1.bvh");
-    initMeshGeometry("../models/skin.off", "../models/weights.txt");
+
+    skinningPassSupported = initSkinningPass();
+    initShaders();
+    uploadReadyAssets();
 }
 
 GeometryEngine::~GeometryEngine()
@@ -48,142 +109,1110 @@ GeometryEngine::~GeometryEngine()
     arrayBufRig.destroy();
     indexBufRig.destroy();
     arrayBufSkin.destroy();
+    arrayBufSkinExtra.destroy();
     indexBufSkin.destroy();
+    skinnedBuf.destroy();
+    poseKeyTexture.destroy();
 }
 //! [0]
 
-std::map<std::string, int> equivalence = {
-    {"Xposition", 0},
-    {"Yposition", 1},
-    {"Zposition", 2},
-    {"Xrotation", 3},
-    {"Yrotation", 4},
-    {"Zrotation", 5}
-};
-
 float scale = 1.0f/200.0f;
+float meshScale = 1.0f/100.0f;
 
 QVector3D globalOffset = QVector3D(-350.0f, 0.0f, 0.0f) * scale;
 
+// Interpolated channel values of a node, returns true if the node has position channels
+static bool sampleNode(const BVHTree* node, float elapseTime, float values[6], int& keyFrame) {
+    float sampled[6];
+    sampleChannels(node, elapseTime, sampled, keyFrame);
+    return valuesBySlot(node, sampled, values);
+}
+
+void GeometryEngine::uploadReadyAssets() {
+    // The uploads of the assets loaded since the last call, and any other main thread job
+    JobSystem::shared().runMainThreadJobs();
+}
+
+void GeometryEngine::uploadRig() {
+    if (!skinSkeleton) {
+        skinSkeleton = loadedSkinSkeleton;
+    }
+    if (loadedRetargetMap) {
+        retargetMaps.emplace(loadingClipName, std::move(*loadedRetargetMap));
+    }
+    loadedSkinSkeleton.reset();
+    loadedRetargetMap.reset();
+
+    // A live stream installed its own skeleton meanwhile, the clip is not needed anymore
+    if (!liveStream) {
+        currentClip = loadedClip;
+        currentClipName = loadingClipName;
+        initRigGeometry(currentClip->roots);
+        bakeCurrentClip();
+        uploadPoseTexture();
+        rigReady = true;
+    }
+    loadedClip.reset();
+}
+
+void GeometryEngine::uploadSkin() {
+    initMeshGeometry(loadedSkinVertices, loadedSkinExtra, loadedSkinIndices, loadedSkinBuckets, loadedSkinLods);
+    skinReady = true;
+    // The CPU skinning path keeps the vertices, the indices only live in the buffer
+    skinVertices.swap(loadedSkinVertices);
+    skinExtra.swap(loadedSkinExtra);
+    skinBuckets.swap(loadedSkinBuckets);
+    skinLods.swap(loadedSkinLods);
+    // The picking tree is built on the first pose of the new mesh
+    const meshLod& full = skinLods[0];
+    pickIndices.assign(loadedSkinIndices.begin() + full.firstIndex, loadedSkinIndices.begin() + full.firstIndex + full.nbIndices);
+    pickSources.assign(loadedSkinSources.begin() + full.firstVertex, loadedSkinSources.begin() + full.firstVertex + full.nbVertices);
+    pickTree.clear();
+    pickTreeDirty = true;
+    currentLod = 0;
+    lodFrames.assign(skinLods.size(), 0);
+    lodErrors.clear();
+    for (const auto& lod : skinLods) {
+        lodErrors.push_back(lod.error);
+    }
+    std::vector<VertexSkinData>().swap(loadedSkinVertices);
+    std::vector<VertexSkinExtraData>().swap(loadedSkinExtra);
+    std::vector<GLushort>().swap(loadedSkinIndices);
+    std::vector<influenceBucket>().swap(loadedSkinBuckets);
+    std::vector<meshLod>().swap(loadedSkinLods);
+    std::vector<int>().swap(loadedSkinSources);
+    initMorphTargets();
+    updatePoseBounds();
+}
+
+void GeometryEngine::waitForAssets() {
+    assets.wait(rigAsset);
+    assets.wait(skinAsset);
+    uploadReadyAssets();
+}
+
+void GeometryEngine::printAssetProgress() const {
+    assets.printProgress();
+}
+
+bool GeometryEngine::playClip(const std::string& name) {
+    int clip = clips.find(name);
+    if (clip < 0) {
+        std::cerr << "Unknown clip " << name << "\n";
+        return false;
+    }
+
+    if (name == loadingClipName && !assets.failed(rigAsset)) {
+        return true;
+    }
+
+    // One clip load at a time, the task writes loadedClip
+    if (rigAsset >= 0) {
+        assets.wait(rigAsset);
+        uploadReadyAssets();
+    }
+    loadingClipName = name;
+
+    // The task gets the skeleton and the map already known. retargetMaps only grows in uploadRig(),
+    // after the task, so the pointer stays valid. What the task builds is published there too
+    std::shared_ptr<decodedClip> skeleton = skinSkeleton;
+    auto known = retargetMaps.find(name);
+    const retargetMap* knownMap = known != retargetMaps.end() ? &known->second : nullptr;
+    rigAsset = assets.load(name + ".bvh", [this, name, skeleton, knownMap]() {
+        std::shared_ptr<decodedClip> clip = clips.acquire(name);
+        std::shared_ptr<decodedClip> target = skeleton ? skeleton : loadSkinSkeleton();
+
+        // The mesh weights follow the joints of skinSkeleton, other skeletons are retargeted onto it
+        std::shared_ptr<retargetMap> compiled;
+        if (!sameHierarchy(clip->roots, target->roots)) {
+            const retargetMap* map = knownMap;
+            if (!map) {
+                compiled = std::make_shared<retargetMap>(compileRetargetMap(clip->roots, target->roots));
+                map = compiled.get();
+            }
+            auto retargeted = std::make_shared<decodedClip>();
+            retargeted->roots = retargetClip(*map, clip->roots, target->roots);
+            clip = retargeted;
+        }
+        loadedClip = clip;
+        loadedSkinSkeleton = target;
+        loadedRetargetMap = compiled;
+    }, [this]() { uploadRig(); });
+
+    const std::vector<clipInfo>& list = clips.clips();
+    clips.prefetch(list[(clip + 1) % list.size()].name);
+    return true;
+}
+
+bool GeometryEngine::playXsensRecording(const std::string& directory) {
+    if (!std::filesystem::is_directory(directory)) {
+        std::cerr << "No Xsens recording in " << directory << "\n";
+        return false;
+    }
+    if (rigAsset >= 0) {
+        assets.wait(rigAsset);
+        uploadReadyAssets();
+    }
+    loadingClipName = directory;
+
+    // Converted in memory, no output.bvh round trip, then retargeted like a clip of another rig
+    std::shared_ptr<decodedClip> skeleton = skinSkeleton;
+    std::shared_ptr<xsensFilterOptions> filter;
+    if (xsensFiltered) {
+        filter = std::make_shared<xsensFilterOptions>(xsensFilter);
+    }
+    rigAsset = assets.load(directory, [this, directory, skeleton, filter]() {
+        decodedClip recording;
+        recording.roots = readXsens(directory, 1.0f/60.0f, filter.get());
+        std::shared_ptr<decodedClip> target = skeleton ? skeleton : loadSkinSkeleton();
+        auto retargeted = std::make_shared<decodedClip>();
+        retargeted->roots = retargetClip(compileRetargetMap(recording.roots, target->roots), recording.roots, target->roots);
+        loadedClip = retargeted;
+        loadedSkinSkeleton = target;
+        loadedRetargetMap.reset();
+    }, [this]() { uploadRig(); });
+    return true;
+}
+
+// Joints of the columns of weights.txt, without the motion. Called by load tasks
+std::shared_ptr<decodedClip> GeometryEngine::loadSkinSkeleton() {
+    auto skeleton = std::make_shared<decodedClip>();
+    skeleton->roots = copyHierarchy(clips.acquire(skinSkeletonClip)->roots);
+    return skeleton;
+}
+
+void GeometryEngine::playNextClip() {
+    const std::vector<clipInfo>& list = clips.clips();
+    if (!list.empty()) {
+        playClip(list[(std::max(clips.find(loadingClipName), 0) + 1) % list.size()].name);
+    }
+}
+
+void GeometryEngine::setClipBudget(size_t bytes) {
+    clips.setBudget(bytes);
+}
+
+void GeometryEngine::printClipStats() const {
+    clips.printStats();
+}
+
+void GeometryEngine::setXsensFilter(const xsensFilterOptions& options) {
+    xsensFiltered = true;
+    xsensFilter = options;
+}
+
+void GeometryEngine::setPoseBaking(bool enabled, bakePrecision precision) {
+    if (precision != bakedPrecision) {
+        bakedClips.clear();
+    }
+    poseBaking = enabled;
+    bakedPrecision = precision;
+    bakeCurrentClip();
+}
+
+void GeometryEngine::bakeCurrentClip() {
+    currentBake.reset();
+    if (poseBaking && currentClip && !liveStream) {
+        auto baked = bakedClips.find(currentClipName);
+        if (baked == bakedClips.end()) {
+            bakeOptions options;
+            options.precision = bakedPrecision;
+            baked = bakedClips.emplace(currentClipName, std::make_shared<BakedClip>(currentClip->roots, options)).first;
+            std::cout << "Baked " << currentClipName << ": " << baked->second->nbFrames() << " frames in "
+                      << baked->second->bakeTime() << " ms, " << baked->second->bytes() / 1024.0 << " KiB\n";
+        }
+        currentBake = baked->second;
+    }
+    // Both paths leave different state in the poses, the next one is evaluated from scratch
+    for (auto& pose: jointPoses) {
+        pose.evaluated = false;
+    }
+    lastElapseTime = -1.0f;
+}
+
+void GeometryEngine::printBakeStats() const {
+    if (nbBakedPoses == 0) {
+        return;
+    }
+    size_t bytes = 0;
+    for (const auto& baked : bakedClips) {
+        bytes += baked.second->bytes();
+    }
+    std::cout << "Baked poses: " << bakedClips.size() << " clips, " << bytes / 1024.0 << " KiB, "
+              << bakedSampleTime * 1e3 / nbBakedPoses << " us per pose update\n";
+}
+
+bool GeometryEngine::setGpuPose(bool enabled) {
+    if (enabled == gpuPoseEnabled) {
+        return true;
+    }
+    if (enabled) {
+        if (liveStream || mode == SkinOnCpu) {
+            std::cerr << "GPU poses need a clip skinned on the GPU\n";
+            return false;
+        }
+        GLint vertexUnits = 0;
+        glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &vertexUnits);
+        QOpenGLContext *context = QOpenGLContext::currentContext();
+        if (vertexUnits < 1 || (context->format().majorVersion() < 3 && !context->hasExtension("GL_ARB_texture_float"))) {
+            std::cerr << "No float textures in vertex shaders, poses stay on the CPU\n";
+            return false;
+        }
+    }
+
+    gpuPoseEnabled = enabled;
+    if (!setSkinningVariant(method, nbInfluences)) {
+        gpuPoseEnabled = !enabled;
+        setSkinningVariant(method, nbInfluences);
+        return false;
+    }
+    if (enabled) {
+        uploadPoseTexture();
+        return gpuPoseEnabled;
+    }
+
+    // Back on the CPU, the next pose is evaluated from scratch
+    for (auto& pose: jointPoses) {
+        pose.evaluated = false;
+    }
+    lastElapseTime = -1.0f;
+    return true;
+}
+
+void GeometryEngine::uploadPoseTexture() {
+    if (!gpuPoseEnabled || !currentClip || liveStream) {
+        return;
+    }
+    poseKeys = compilePoseTexture(currentClip->roots, maxSkinJoints);
+
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    if (poseKeys.nbFrames > maxSize) {
+        std::cerr << currentClipName << " has " << poseKeys.nbFrames << " frames, more than the " << maxSize
+                  << " rows of a texture, poses stay on the CPU\n";
+        poseKeys = poseTexture();
+        setGpuPose(false);
+        return;
+    }
+
+    poseKeyTexture.destroy();
+    poseKeyTexture.setFormat(QOpenGLTexture::RGBA32F);
+    poseKeyTexture.setSize(poseKeys.width(), poseKeys.nbFrames);
+    poseKeyTexture.setMipLevels(1);
+    poseKeyTexture.allocateStorage(QOpenGLTexture::RGBA, QOpenGLTexture::Float32);
+    poseKeyTexture.setData(QOpenGLTexture::RGBA, QOpenGLTexture::Float32, poseKeys.texels.data());
+    // Keys are read at texel centers and blended by the shader
+    poseKeyTexture.setMinMagFilters(QOpenGLTexture::Nearest, QOpenGLTexture::Nearest);
+    poseKeyTexture.setWrapMode(QOpenGLTexture::ClampToEdge);
+
+    poseKeysVersion++;
+    skinnedMeshDirty = true;
+    updatePoseBounds();
+    std::cout << "GPU pose keys of " << currentClipName << ": " << poseKeys.width() << "x" << poseKeys.nbFrames
+              << " texels, " << poseKeys.bytes() / 1024.0 << " KiB, compiled in " << poseKeys.buildTime << " ms\n";
+}
+
+void GeometryEngine::uploadPoseUniforms(QOpenGLShaderProgram *program) {
+    poseKeyTexture.bind(poseTextureUnit, QOpenGLTexture::ResetTextureUnit);
+
+    // Constant over the clip: the parent table, the rest pose and the layout of the keys
+    poseUpload& upload = poseUploads[program->programId()];
+    if (upload.version != poseKeysVersion) {
+        int count = std::min(poseKeys.nbJoints, static_cast<int>(restPositions.size()));
+        program->setUniformValueArray("u_parent", poseKeys.parents.data(), count);
+        program->setUniformValueArray("u_restPosition", restPositions.data(), count);
+        program->setUniformValue("u_poseClip", QVector4D(poseKeys.startTime, poseKeys.frameTime, poseKeys.nbFrames, poseKeys.nbJoints));
+        program->setUniformValue("u_poseOffset", globalOffset);
+        program->setUniformValue("u_poseScale", scale);
+        program->setUniformValue("u_skinScale", scale / meshScale);
+        renderState.setUniform(program, "u_poseTexture", poseTextureUnit);
+        upload.version = poseKeysVersion;
+        upload.timeLocation = program->uniformLocation("u_poseTime");
+    }
+    program->setUniformValue(upload.timeLocation, poseTime);
+}
+
+void GeometryEngine::updatePoseBounds() {
+    poseBounds = aabb();
+    poseBounded = true;
+    if (poseKeys.texels.empty()) {
+        return;
+    }
+
+    // Between two keys the shader lerps the position of a joint and turns it from one key rotation to
+    // the other by an angle d. A point at distance r from the joint leaves the chord between its two
+    // rotated positions by r (1 - cos(d / 2)) at most, so the joint box of the interval is the box of
+    // both rotated rest boxes, padded, swept along the positions. The skin blends are bounded from these
+    const float radius = 0.05;
+    int nbJoints = std::min(poseKeys.nbJoints, maxSkinJoints);
+    std::vector<float> reach(nbJoints, 0.0f);
+    for (int joint = 0; joint < nbJoints && skinReady; joint++) {
+        const aabb& rest = jointBounds[joint];
+        if (!rest.empty()) {
+            reach[joint] = ((rest.center() - restPositions[joint]).length() + rest.extent().length()) * (scale / meshScale);
+        }
+    }
+    std::vector<aabb> boxes(nbJoints);
+    std::vector<QVector4D> rotations(nbJoints);
+    std::vector<float> slack(nbJoints);
+    QQuaternion rotation[2];
+    QVector3D position[2];
+    for (int f = 0; f < std::max(1, poseKeys.nbFrames - 1); f++) {
+        for (int joint = 0; joint < nbJoints; joint++) {
+            aabb sweep;
+            for (int key = 0; key < 2; key++) {
+                float time = poseKeys.startTime + std::min(f + key, poseKeys.nbFrames - 1) * poseKeys.frameTime;
+                samplePoseTexture(poseKeys, time, joint, rotation[key], position[key]);
+                sweep.add(position[key] * scale + globalOffset);
+            }
+            poseBounds.add(sweep.min - QVector3D(radius, radius, radius));
+            poseBounds.add(sweep.max + QVector3D(radius, radius, radius));
+
+            float halfAngle = std::acos(std::min(1.0f, std::abs(QQuaternion::dotProduct(rotation[0], rotation[1]))));
+            rotations[joint] = rotation[0].toVector4D();
+            slack[joint] = halfAngle;
+            boxes[joint] = aabb();
+            if (!skinReady || jointBounds[joint].empty()) {
+                continue;
+            }
+            for (int key = 0; key < 2; key++) {
+                QMatrix4x4 skinMatrix;
+                skinMatrix.rotate(rotation[key]);
+                skinMatrix.scale(scale / meshScale);
+                skinMatrix.translate(-restPositions[joint]);
+                boxes[joint].add(transformBox(skinMatrix, jointBounds[joint]));
+            }
+            float pad = reach[joint] * (1.0f - std::cos(halfAngle));
+            boxes[joint].min += sweep.min - QVector3D(pad, pad, pad);
+            boxes[joint].max += sweep.max + QVector3D(pad, pad, pad);
+        }
+        aabb skin;
+        poseBounded = skinBounds(boxes, rotations, slack, skin) && poseBounded;
+        if (!skin.empty()) {
+            poseBounds.add(skin);
+        }
+    }
+}
+
+void GeometryEngine::setMorphWeight(const std::string& name, float weight) {
+    weight = std::clamp(weight, 0.0f, 1.0f);
+    morphWeightsByName[name] = weight;
+    if (!skinReady) {
+        return;
+    }
+    int target = morphs.find(name);
+    if (target < 0) {
+        std::cerr << "Unknown morph target " << name << "\n";
+        return;
+    }
+    if (morphWeights[target] != weight) {
+        morphWeights[target] = weight;
+        morphWeightsDirty = true;
+    }
+}
+
+void GeometryEngine::initMorphTargets() {
+    std::vector<QVector3D> positions(skinVertices.size());
+    std::vector<QVector3D> normals(skinVertices.size());
+    for (size_t v = 0; v < skinVertices.size(); v++) {
+        positions[v] = skinVertices[v].position;
+        normals[v] = skinVertices[v].normal;
+    }
+    morphs.init(std::move(loadedMorphTargets), positions, normals);
+    std::vector<morphTarget>().swap(loadedMorphTargets);
+
+    morphWeights.assign(morphs.nbTargets(), 0.0f);
+    for (const auto& weight : morphWeightsByName) {
+        int target = morphs.find(weight.first);
+        if (target < 0) {
+            std::cerr << "Unknown morph target " << weight.first << "\n";
+            continue;
+        }
+        morphWeights[target] = weight.second;
+    }
+    morphWeightsDirty = std::any_of(morphWeights.begin(), morphWeights.end(), [](float w) { return w != 0.0f; });
+
+    // The culling boxes hold every shape the weights can reach
+    for (int slot = 0; slot < morphs.nbSlots(); slot++) {
+        int v = morphs.vertex(slot);
+        QVector3D lo, hi;
+        morphs.bounds(slot, lo, hi);
+        const float weights[8] = {skinVertices[v].weight0, skinVertices[v].weight1, skinVertices[v].weight2, skinVertices[v].weight3,
+                                  skinExtra.empty() ? 0.0f : skinExtra[v].weights.x(), skinExtra.empty() ? 0.0f : skinExtra[v].weights.y(),
+                                  skinExtra.empty() ? 0.0f : skinExtra[v].weights.z(), skinExtra.empty() ? 0.0f : skinExtra[v].weights.w()};
+        const float joints[8] = {skinVertices[v].joints.x(), skinVertices[v].joints.y(), skinVertices[v].joints.z(), skinVertices[v].joints.w(),
+                                 skinExtra.empty() ? 0.0f : skinExtra[v].joints.x(), skinExtra.empty() ? 0.0f : skinExtra[v].joints.y(),
+                                 skinExtra.empty() ? 0.0f : skinExtra[v].joints.z(), skinExtra.empty() ? 0.0f : skinExtra[v].joints.w()};
+        for (int k = 0; k < 8; k++) {
+            int joint = int(joints[k]);
+            if (weights[k] > 0.0f && joint >= 0 && joint < maxSkinJoints) {
+                jointBounds[joint].add(lo);
+                jointBounds[joint].add(hi);
+            }
+        }
+    }
+}
+
+void GeometryEngine::applyMorphTargets() {
+    if (!morphWeightsDirty) {
+        return;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    morphs.apply(morphWeights.data());
+
+    // One span of arrayBufSkin per level the changed vertices belong to
+    std::vector<int> first(skinLods.size(), nbVertexSkin);
+    std::vector<int> last(skinLods.size(), -1);
+    for (int slot : morphs.changedSlots()) {
+        int v = morphs.vertex(slot);
+        skinVertices[v].position = morphs.position(slot);
+        skinVertices[v].normal = morphs.normal(slot);
+        int level = 0;
+        while (level + 1 < static_cast<int>(skinLods.size()) && skinLods[level + 1].firstVertex <= v) {
+            level++;
+        }
+        first[level] = std::min(first[level], v);
+        last[level] = std::max(last[level], v);
+    }
+    arrayBufSkin.bind();
+    for (size_t level = 0; level < skinLods.size(); level++) {
+        if (last[level] < first[level]) {
+            continue;
+        }
+        int count = last[level] - first[level] + 1;
+        arrayBufSkin.write(first[level] * sizeof(VertexSkinData), &skinVertices[first[level]], count * sizeof(VertexSkinData));
+        morphUploadBytes += count * sizeof(VertexSkinData);
+    }
+
+    morphWeightsDirty = false;
+    skinnedMeshDirty = true;
+    pickTreeDirty = true;
+    morphTime += timer.nsecsElapsed() / 1e6;
+    nbMorphPasses++;
+    nbMorphDeltas += morphs.nbDeltas();
+}
+
+void GeometryEngine::printMorphStats() const {
+    if (nbMorphPasses == 0) {
+        return;
+    }
+    std::cout << "Morph targets: " << morphs.nbTargets() << " targets over " << morphs.nbSlots() << " of " << nbVertexSkin
+              << " vertices, " << morphs.bytes() / 1024.0 << " KiB (" << morphs.denseBytes() / 1024.0 << " KiB dense), "
+              << nbMorphPasses << " updates of " << double(nbMorphDeltas) / nbMorphPasses << " deltas, "
+              << morphTime * 1e3 / nbMorphPasses << " us and " << morphUploadBytes / 1024.0 / nbMorphPasses << " KiB uploaded each\n";
+}
+
+void GeometryEngine::updatePickTree() {
+    if (!skinReady || !rigReady || !pickTreeDirty) {
+        return;
+    }
+    QElapsedTimer timer;
+    timer.start();
+
+    // The shaders evaluate GPU poses, the palette is sampled here from the same keys
+    if (gpuPoseEnabled) {
+        std::vector<QMatrix4x4> matrices(maxSkinJoints);
+        std::vector<QVector4D> dqReal(maxSkinJoints, QVector4D(0.0f, 0.0f, 0.0f, 1.0f));
+        std::vector<QVector4D> dqDual(maxSkinJoints);
+        QQuaternion rotation;
+        QVector3D position;
+        for (int joint = 0; joint < std::min(poseKeys.nbJoints, maxSkinJoints); joint++) {
+            samplePoseTexture(poseKeys, poseTime, joint, rotation, position);
+            QVector3D worldPos = position * scale + globalOffset;
+            matrices[joint].translate(worldPos);
+            matrices[joint].rotate(rotation);
+            matrices[joint].scale(scale / meshScale);
+            matrices[joint].translate(-restPositions[joint]);
+            QVector3D translation = worldPos * (meshScale / scale) - rotation.rotatedVector(restPositions[joint]);
+            dqReal[joint] = rotation.toVector4D();
+            dqDual[joint] = (QQuaternion(0.0f, translation) * rotation * 0.5f).toVector4D();
+        }
+        packCpuPalette(matrices, dqReal, dqDual, pickPalette);
+    } else {
+        packCpuPalette(skinPalette, skinDqReal, skinDqDual, pickPalette);
+    }
+    const meshLod& full = skinLods[0];
+    pickSkinned.resize(full.firstVertex + full.nbVertices);
+    skinLevelOnCpu(full, pickPalette.data(), pickSkinned.data());
+    pickPositions.resize(pickSkinned.size());
+    for (size_t v = 0; v < pickSkinned.size(); v++) {
+        pickPositions[v] = pickSkinned[v].position;
+    }
+    double skinTime = timer.nsecsElapsed() / 1e6;
+
+    // Built on the first pose, refit on the following ones
+    timer.start();
+    if (pickTree.empty()) {
+        pickTree.build(pickPositions, pickIndices);
+        pickStats.buildTime += timer.nsecsElapsed() / 1e6;
+    } else {
+        pickTree.refit(pickPositions);
+        pickStats.refitTime += timer.nsecsElapsed() / 1e6;
+        pickStats.skinTime += skinTime;
+        pickStats.refits++;
+    }
+    pickTreeDirty = false;
+}
+
+pickResult GeometryEngine::pick(const pickRay& ray) {
+    pickResult result;
+    if (!rigReady) {
+        return result;
+    }
+    QElapsedTimer timer;
+    timer.start();
+
+    updatePickTree();
+    triangleHit hit;
+    if (skinReady && pickTree.intersect(ray, hit)) {
+        const int* corners = pickTree.triangle(hit.triangle);
+        const QVector3D& a = pickTree.position(corners[0]);
+        const QVector3D& b = pickTree.position(corners[1]);
+        const QVector3D& c = pickTree.position(corners[2]);
+        float barycentric[3] = {1.0f - hit.u - hit.v, hit.u, hit.v};
+        result.triangle = hit.triangle;
+        // Packed vertices are sorted by influence bucket, the result is the vertex of skin.off
+        int packed = corners[std::max_element(barycentric, barycentric + 3) - barycentric];
+        result.vertex = pickSources[packed - skinLods[0].firstVertex];
+        result.distance = hit.distance;
+        result.point = ray.origin + ray.direction * hit.distance;
+        result.normal = QVector3D::crossProduct(b - a, c - a).normalized();
+        if (QVector3D::dotProduct(result.normal, ray.direction) > 0.0f) {
+            result.normal = -result.normal;
+        }
+    }
+
+    // Joints are picked through the skin, the nearest star the ray crosses wins
+    const float radius = 0.05f;
+    float nearest = 1e30f;
+    QQuaternion rotation;
+    QVector3D position;
+    for (size_t i = 0; i < nodeList.size(); i++) {
+        const BVHTree* node = nodeList[i];
+        if (gpuPoseEnabled) {
+            if (node->nodeIndex >= poseKeys.nbJoints) {
+                continue;
+            }
+            samplePoseTexture(poseKeys, poseTime, node->nodeIndex, rotation, position);
+            position = position * scale + globalOffset;
+        } else {
+            position = jointPoses[i].worldPosition;
+        }
+        float along = QVector3D::dotProduct(position - ray.origin, ray.direction);
+        if (along < 0.0f || along >= nearest || (ray.origin + ray.direction * along - position).length() > radius) {
+            continue;
+        }
+        nearest = along;
+        result.joint = node->nodeIndex;
+        result.jointName = node->name;
+        result.jointPosition = position;
+    }
+
+    double time = timer.nsecsElapsed() / 1e6;
+    pickStats.picks++;
+    pickStats.hits += result.triangle >= 0 || result.joint >= 0;
+    pickStats.pickTime += time;
+    pickStats.maxPickTime = std::max(pickStats.maxPickTime, time);
+    return result;
+}
+
+void GeometryEngine::printPickStats() const {
+    if (pickTree.empty()) {
+        return;
+    }
+    std::cout << "Picking tree: " << pickTree.nbTriangles() << " triangles, " << pickTree.nbNodes() << " nodes, depth "
+              << pickTree.depth() << ", " << pickTree.bytes() / 1024.0 << " KiB, built in " << pickStats.buildTime << " ms";
+    if (pickStats.refits > 0) {
+        std::cout << ", " << pickStats.refits << " refits of " << pickStats.refitTime / pickStats.refits << " ms after "
+                  << pickStats.skinTime / pickStats.refits << " ms of skinning, node area " << pickTree.surfaceRatio()
+                  << " times the root";
+    }
+    std::cout << "\n";
+    if (pickStats.picks > 0) {
+        std::cout << "Picks: " << pickStats.picks << " (" << pickStats.hits << " hits), " << pickStats.pickTime / pickStats.picks
+                  << " ms on average, " << pickStats.maxPickTime << " ms worst\n";
+    }
+}
+
+void GeometryEngine::memoryReport(MemoryReport& report) const {
+    // The current clip is normally still cached, it is not counted twice
+    size_t cachedBytes = clips.residentBytes();
+    if (currentClip) {
+        report.addHierarchy(currentClipName, currentClip->roots);
+        cachedBytes -= std::min(cachedBytes, currentClip->bytes);
+    }
+    if (skinSkeleton) {
+        report.addHierarchy("skin skeleton", skinSkeleton->roots);
+    }
+    report.addCpu("clip cache", "other resident clips", cachedBytes);
+    for (const auto& map : retargetMaps) {
+        report.addCpu("skeleton", "retarget map " + map.first,
+                      vectorBytes(map.second.sourceParent) + vectorBytes(map.second.sourceRotationChannels)
+                      + vectorBytes(map.second.targetParent) + vectorBytes(map.second.targetSource)
+                      + vectorBytes(map.second.restCorrection) + vectorBytes(map.second.targetRotationChannels));
+    }
+    for (const auto& baked : bakedClips) {
+        report.addCpu("baked poses", baked.first, baked.second->bytes());
+    }
+    report.addCpu("GPU poses", "pose keys " + currentClipName, poseKeys.bytes());
+    report.addCpu("skeleton", "node lists and poses", vectorBytes(rootList) + vectorBytes(nodeList) + vectorBytes(jointPoses));
+    report.addCpu("skeleton", "rig vertices", vectorBytes(rigVertices));
+    report.addCpu("skeleton", "rest positions and palettes", vectorBytes(restPositions) + vectorBytes(skinPalette)
+                                                                 + vectorBytes(skinDqReal) + vectorBytes(skinDqDual));
+    report.addCpu("mesh", "skin vertices", vectorBytes(skinVertices));
+    report.addCpu("weights", "influences 5 to 8", vectorBytes(skinExtra));
+    report.addCpu("mesh", "influence buckets and levels", vectorBytes(skinBuckets) + vectorBytes(skinLods));
+    report.addCpu("mesh", "CPU skinning output", vectorBytes(cpuSkinned) + vectorBytes(cpuPalette));
+    report.addCpu("mesh", "morph targets", morphs.bytes() + vectorBytes(morphWeights));
+    report.addCpu("mesh", "picking tree", pickTree.bytes() + vectorBytes(pickIndices) + vectorBytes(pickSources) + vectorBytes(pickSkinned)
+                                              + vectorBytes(pickPositions) + vectorBytes(pickPalette));
+
+    // Sizes given to allocate(), the cube and the repere reuse the rig buffers
+    report.addGpu("arrayBufRig", rigVertices.size() * sizeof(VertexData));
+    report.addGpu("indexBufRig", nbIndex * sizeof(GLushort));
+    report.addGpu("arrayBufSkin", nbVertexSkin * sizeof(VertexSkinData));
+    report.addGpu("arrayBufSkinExtra", skinExtra.size() * sizeof(VertexSkinExtraData));
+    report.addGpu("indexBufSkin", nbIndexSkin * sizeof(GLushort));
+    report.addGpu("skinnedBuf", nbVertexSkin * sizeof(SkinnedVertexData));
+    report.addGpu("poseKeyTexture", poseKeys.texels.size() * sizeof(float));
+}
+
 void GeometryEngine::updateAnimation(float elapseTime) {
-    VertexData vertices[nbVertex];
+    uploadReadyAssets();
+    if (!rigReady) {
+        return;
+    }
 
-    float radius = 0.05;
+    // The shaders evaluate the pose, the draws only need its time
+    if (gpuPoseEnabled) {
+        if (elapseTime != poseTime) {
+            poseTime = elapseTime;
+            skinnedMeshDirty = true;
+            pickTreeDirty = true;
+        }
+        return;
+    }
 
-    std::deque<BVHTree*> nodeQueue;
-    for (auto root: rootList) {
-        nodeQueue.push_back(root);
-        while (!nodeQueue.empty()) {
-            BVHTree* node = nodeQueue.front();
-            nodeQueue.pop_front();
-            int indexVertices = node->vertexIndex;
+    bool newLivePose = liveStream && liveStream->latestPose(livePose);
+    if (newLivePose) {
+        hasLivePose = true;
+        for (size_t s = 0; s < liveSourceJoints.size(); s++) {
+            int joint = liveSourceJoints[s];
+            if (joint < 0) {
+                continue;
+            }
+            // quaternionToEuler gives (z, y, x)
+            QVector3D euler = quaternionToEuler(livePose.local[joint]) * (180.0f / M_PI);
+            const int* c = &liveMap.sourceRotationChannels[3 * s];
+            if (c[0] >= 0) liveSourceFrame[c[0]] = euler.z();
+            if (c[1] >= 0) liveSourceFrame[c[1]] = euler.y();
+            if (c[2] >= 0) liveSourceFrame[c[2]] = euler.x();
+        }
+        retargetFrame(liveMap, liveSourceFrame.data(), liveFrame.data(), liveScratch);
+    }
 
-            QVector3D worldPos = QVector3D(0.0f, 0.0f, 0.0f);
+    // Paused: nothing changed since the last evaluation
+    if (elapseTime == lastElapseTime && !newLivePose) {
+        return;
+    }
+    lastElapseTime = elapseTime;
+
+    // A baked clip gives every global transform directly, a table lookup per joint
+    bool baked = currentBake && !liveStream;
+    int bakedFrame = 0;
+    float bakedBlend = 0.0f;
+    QElapsedTimer bakedTimer;
+    if (baked) {
+        bakedTimer.start();
+        currentBake->frameAt(elapseTime, bakedFrame, bakedBlend);
+    }
 
-            if (node->channels.empty()) {    
-                worldPos = vertices[node->parent->vertexIndex].position;
-                worldPos += node->parent->rotationMatrix * node->offset * scale;
-            } else {
-                int i = 0;
-                while (i+2 < static_cast<int>(node->channelsValues.size()) && node->channelsValues[i+1][0] < elapseTime) i++;
-
-                float p = (elapseTime - node->channelsValues[i][0]) / (node->channelsValues[i+1][0] - node->channelsValues[i][0]);
-
-                p = std::max(0.0f, std::min(1.0f, p));
-
-                float values[6] = {0, 0, 0, 0, 0, 0};
-
-                bool hasNewOffset = false;
-
-                for (int k = 0; k < static_cast<int>(node->channels.size()); k++) {
-                    int equivalenceIndex = equivalence[node->channels[k]];
-                    if (equivalenceIndex < 3) {
-                        hasNewOffset = true;
-                    }
-                    float prev = node->channelsValues[ i ][k + 1];
-                    float next = node->channelsValues[i+1][k + 1];
-                    if (equivalenceIndex > 2  && abs(prev + 360 - next) < abs(prev - next)) {
-                        prev += 360;
-                    } else if (equivalenceIndex > 2  && abs(prev - (next + 360)) < abs(prev - next)) {
-                        next += 360;
-                    }
-                    values[equivalenceIndex] = (1-p) * prev + p * next;
-                }
+    // The nodes of a level only read the poses of the levels before, their joints are spread over
+    // the threads. A level smaller than the grain is evaluated here, as the walk skeleton is
+    JobSystem& jobs = JobSystem::shared();
+    for (size_t level = 0; level + 1 < poseLevels.size(); level++) {
+        int first = poseLevels[level];
+        jobs.parallelFor("pose joints", poseLevels[level + 1] - first, poseGrain, [&](int begin, int end) {
+            for (int i = first + begin; i < first + end; i++) {
+                evaluateJoint(i, elapseTime, baked, bakedFrame, bakedBlend);
+            }
+        });
+    }
 
-                QVector3D nodeAnimOffset = node->offset;
-                if (hasNewOffset) {
-                    nodeAnimOffset = QVector3D(values[0], values[1], values[2]);
-                }
+    if (baked) {
+        bakedSampleTime += bakedTimer.nsecsElapsed() / 1e6;
+        nbBakedPoses++;
+    }
 
-                float theta = values[3];
-                float phi = values[4];
-                float psi = values[5];
-
-                // theta -> z
-                // phi -> y
-                // psi -> x
-
-                float c1 = cos(theta * M_PI / 180.0);
-                float s1 = sin(theta * M_PI / 180.0);
-                float c2 = cos(phi * M_PI / 180.0);
-                float s2 = sin(phi * M_PI / 180.0);
-                float c3 = cos(psi * M_PI / 180.0);
-                float s3 = sin(psi * M_PI / 180.0);
-
-                //     (a b c 0)
-                // R = (d e f 0)
-                //     (g h i 0)
-                //     (0 0 0 1)
-
-                float a = c2 * c3;
-                float b = s1 * s2 * c3 - c1 * s3;
-                float c = c1 * s2 * c3 + s1 * s3;
-                float d = c2 * s3;
-                float e = s1 * s2 * s3 + c1 * c3;
-                float f = c1 * s2 * s3 - s1 * c3;
-                float g = -s2;
-                float h = s1 * c2;
-                float j = c1 * c2;
-
-                QMatrix4x4 localRotation = {a, b, c, 0, d, e, f, 0, g, h, j, 0, 0, 0, 0, 1};
-
-                if (node->parent){
-
-                    node->rotationMatrix = node->parent->rotationMatrix * localRotation;
-
-                    worldPos = node->parent->rotationMatrix * nodeAnimOffset * scale;
-                    worldPos += vertices[node->parent->vertexIndex].position;
-                } else {
-                    node->rotationMatrix = localRotation;
-
-                    worldPos = nodeAnimOffset * scale + globalOffset;
-                    // worldPos = QVector3D(0.0f, 0.0f, 0.0f);
-                }
+    // Pinned limbs are solved on the evaluated pose
+    if (!ikPins.empty()) {
+        applyIk();
+    }
+
+    // A node is dirty if it was recomputed by this update
+    int firstDirtyVertex = nbVertex;
+    int lastDirtyVertex = -1;
+    int firstDirtyJoint = maxSkinJoints;
+    int lastDirtyJoint = -1;
+    for (size_t i = 0; i < nodeList.size(); i++) {
+        if (!jointPoses[i].dirty) {
+            continue;
+        }
+        firstDirtyVertex = std::min(firstDirtyVertex, static_cast<int>(7 * i));
+        lastDirtyVertex = std::max(lastDirtyVertex, static_cast<int>(7 * i + 6));
+        int joint = nodeList[i]->nodeIndex;
+        if (joint < maxSkinJoints) {
+            firstDirtyJoint = std::min(firstDirtyJoint, joint);
+            lastDirtyJoint = std::max(lastDirtyJoint, joint);
+        }
+    }
+
+    // Upload only the range of star vertices that moved
+    if (lastDirtyVertex >= firstDirtyVertex) {
+        arrayBufRig.bind();
+        arrayBufRig.write(firstDirtyVertex * sizeof(VertexData), &rigVertices[firstDirtyVertex], (lastDirtyVertex - firstDirtyVertex + 1) * sizeof(VertexData));
+    }
+
+    markPaletteDirty(firstDirtyJoint, lastDirtyJoint);
+}
+
+// Writes the pose of node i, its stars and its skinning transforms, the pose of its parent is already evaluated
+void GeometryEngine::evaluateJoint(int i, float elapseTime, bool baked, int bakedFrame, float bakedBlend) {
+    const BVHTree* node = nodeList[i];
+    jointPose& pose = jointPoses[i];
+    const jointPose* parent = pose.parent >= 0 ? &jointPoses[pose.parent] : nullptr;
+    bool parentDirty = parent && parent->dirty;
+
+    QVector3D worldPos = QVector3D(0.0f, 0.0f, 0.0f);
+
+    if (baked) {
+        QQuaternion rotation;
+        QVector3D position;
+        currentBake->sample(bakedFrame, bakedBlend, node->nodeIndex, rotation, position);
+        pose.dirty = true;
+        pose.rotationMatrix = QMatrix4x4(rotation.toRotationMatrix());
+        worldPos = position * scale + globalOffset;
+    } else if (node->channels.empty()) {
+        pose.dirty = parentDirty || !pose.evaluated;
+        if (!pose.dirty) {
+            return;
+        }
+
+        pose.rotationMatrix = parent->rotationMatrix;
+        worldPos = parent->worldPosition;
+        worldPos += parent->rotationMatrix * node->offset * scale;
+    } else {
+        float values[6] = {0, 0, 0, 0, 0, 0};
+
+        bool hasNewOffset = false;
+
+        if (liveStream) {
+            // Rotations only, the suit does not track the root
+            if (hasLivePose) {
+                valuesBySlot(node, &liveFrame[liveChannels[i]], values);
             }
+        } else {
+            hasNewOffset = sampleNode(node, elapseTime, values, pose.keyFrameIndex);
+        }
 
-            VertexData vertex0 = {worldPos + node->rotationMatrix * QVector3D(   0.0f,    0.0f,    0.0f), QVector3D(1.0f, 1.0f, 1.0f), QVector2D(0.0f, 0.0f)};
-            VertexData vertex1 = {worldPos + node->rotationMatrix * QVector3D( radius,    0.0f,    0.0f), QVector3D(1.0f, 0.0f, 0.0f), QVector2D(0.0f, 0.0f)};
-            VertexData vertex2 = {worldPos + node->rotationMatrix * QVector3D(-radius,    0.0f,    0.0f), QVector3D(1.0f, 0.0f, 0.0f), QVector2D(0.0f, 0.0f)};
-            VertexData vertex3 = {worldPos + node->rotationMatrix * QVector3D(   0.0f,  radius,    0.0f), QVector3D(0.0f, 1.0f, 0.0f), QVector2D(0.0f, 0.0f)};
-            VertexData vertex4 = {worldPos + node->rotationMatrix * QVector3D(   0.0f, -radius,    0.0f), QVector3D(0.0f, 1.0f, 0.0f), QVector2D(0.0f, 0.0f)};
-            VertexData vertex5 = {worldPos + node->rotationMatrix * QVector3D(   0.0f,    0.0f,  radius), QVector3D(0.0f, 0.0f, 1.0f), QVector2D(0.0f, 0.0f)};
-            VertexData vertex6 = {worldPos + node->rotationMatrix * QVector3D(   0.0f,    0.0f, -radius), QVector3D(0.0f, 0.0f, 1.0f), QVector2D(0.0f, 0.0f)};
-            vertices[indexVertices] = vertex0;
-            vertices[indexVertices + 1] = vertex1;
-            vertices[indexVertices + 2] = vertex2;
-            vertices[indexVertices + 3] = vertex3;
-            vertices[indexVertices + 4] = vertex4;
-            vertices[indexVertices + 5] = vertex5;
-            vertices[indexVertices + 6] = vertex6;
+        bool changed = !pose.evaluated || !std::equal(values, values + 6, pose.values);
+        pose.dirty = parentDirty || changed;
+        if (!pose.dirty) {
+            return;
+        }
+        std::copy(values, values + 6, pose.values);
 
-            for (auto child: node->joints) {
-                nodeQueue.push_back(child);
+        QVector3D nodeAnimOffset = node->offset;
+        if (hasNewOffset) {
+            nodeAnimOffset = QVector3D(values[0], values[1], values[2]);
+        }
+
+        float theta = values[3];
+        float phi = values[4];
+        float psi = values[5];
+
+        // theta -> x
+        // phi -> y
+        // psi -> z
+
+        float c1 = cos(theta * M_PI / 180.0);
+        float s1 = sin(theta * M_PI / 180.0);
+        float c2 = cos(phi * M_PI / 180.0);
+        float s2 = sin(phi * M_PI / 180.0);
+        float c3 = cos(psi * M_PI / 180.0);
+        float s3 = sin(psi * M_PI / 180.0);
+
+        //     (a b c 0)
+        // R = (d e f 0)
+        //     (g h i 0)
+        //     (0 0 0 1)
+
+        float a = c2 * c3;
+        float b = s1 * s2 * c3 - c1 * s3;
+        float c = c1 * s2 * c3 + s1 * s3;
+        float d = c2 * s3;
+        float e = s1 * s2 * s3 + c1 * c3;
+        float f = c1 * s2 * s3 - s1 * c3;
+        float g = -s2;
+        float h = s1 * c2;
+        float j = c1 * c2;
+
+        QMatrix4x4 localRotation = {a, b, c, 0, d, e, f, 0, g, h, j, 0, 0, 0, 0, 1};
+
+        if (parent){
+
+            pose.rotationMatrix = parent->rotationMatrix * localRotation;
+
+            worldPos = parent->rotationMatrix * nodeAnimOffset * scale;
+            worldPos += parent->worldPosition;
+        } else {
+            pose.rotationMatrix = localRotation;
+
+            worldPos = nodeAnimOffset * scale + globalOffset;
+            // worldPos = QVector3D(0.0f, 0.0f, 0.0f);
+        }
+    }
+
+    pose.evaluated = true;
+    pose.worldPosition = worldPos;
+    writeJoint(i);
+}
+
+// Stars and skinning transforms of node i from its pose
+void GeometryEngine::writeJoint(int i) {
+    const float radius = 0.05;
+    const BVHTree* node = nodeList[i];
+    const jointPose& pose = jointPoses[i];
+    const QVector3D& worldPos = pose.worldPosition;
+
+    int indexVertices = 7 * i;
+    VertexData vertex0 = {worldPos + pose.rotationMatrix * QVector3D(   0.0f,    0.0f,    0.0f), QVector3D(1.0f, 1.0f, 1.0f), QVector2D(0.0f, 0.0f)};
+    VertexData vertex1 = {worldPos + pose.rotationMatrix * QVector3D( radius,    0.0f,    0.0f), QVector3D(1.0f, 0.0f, 0.0f), QVector2D(0.0f, 0.0f)};
+    VertexData vertex2 = {worldPos + pose.rotationMatrix * QVector3D(-radius,    0.0f,    0.0f), QVector3D(1.0f, 0.0f, 0.0f), QVector2D(0.0f, 0.0f)};
+    VertexData vertex3 = {worldPos + pose.rotationMatrix * QVector3D(   0.0f,  radius,    0.0f), QVector3D(0.0f, 1.0f, 0.0f), QVector2D(0.0f, 0.0f)};
+    VertexData vertex4 = {worldPos + pose.rotationMatrix * QVector3D(   0.0f, -radius,    0.0f), QVector3D(0.0f, 1.0f, 0.0f), QVector2D(0.0f, 0.0f)};
+    VertexData vertex5 = {worldPos + pose.rotationMatrix * QVector3D(   0.0f,    0.0f,  radius), QVector3D(0.0f, 0.0f, 1.0f), QVector2D(0.0f, 0.0f)};
+    VertexData vertex6 = {worldPos + pose.rotationMatrix * QVector3D(   0.0f,    0.0f, -radius), QVector3D(0.0f, 0.0f, 1.0f), QVector2D(0.0f, 0.0f)};
+    rigVertices[indexVertices] = vertex0;
+    rigVertices[indexVertices + 1] = vertex1;
+    rigVertices[indexVertices + 2] = vertex2;
+    rigVertices[indexVertices + 3] = vertex3;
+    rigVertices[indexVertices + 4] = vertex4;
+    rigVertices[indexVertices + 5] = vertex5;
+    rigVertices[indexVertices + 6] = vertex6;
+
+    // Skinning matrix: from the rest pose (mesh units) to the animated joint
+    int joint = node->nodeIndex;
+    if (joint < maxSkinJoints) {
+        QMatrix4x4 skinMatrix;
+        skinMatrix.translate(worldPos);
+        skinMatrix *= pose.rotationMatrix;
+        skinMatrix.scale(scale / meshScale);
+        skinMatrix.translate(-restPositions[joint]);
+        skinPalette[joint] = skinMatrix;
+
+        // Rigid part p -> R p + worldPos / k - R rest, the shader scales by k = scale / meshScale afterwards
+        QQuaternion rotation = QQuaternion::fromRotationMatrix(pose.rotationMatrix.toGenericMatrix<3, 3>());
+        QVector3D translation = worldPos * (meshScale / scale) - rotation.rotatedVector(restPositions[joint]);
+        skinDqReal[joint] = rotation.toVector4D();
+        skinDqDual[joint] = (QQuaternion(0.0f, translation) * rotation * 0.5f).toVector4D();
+    }
+}
+
+bool GeometryEngine::pinJoint(const std::string& effector, const QVector3D& target, float weight) {
+    std::string name = normalizedName(effector);
+    auto samePin = [&name](const ikPin& pin) { return pin.effector == name; };
+    auto pin = std::find_if(ikPins.begin(), ikPins.end(), samePin);
+    if (pin == ikPins.end()) {
+        ikPins.push_back({name, target, std::clamp(weight, 0.0f, 1.0f), -1});
+        ikCompiled = false;
+    } else {
+        pin->target = target;
+        pin->weight = std::clamp(weight, 0.0f, 1.0f);
+    }
+    lastElapseTime = -1.0f;
+    if (!rigReady) {
+        return true;
+    }
+    if (!ikCompiled) {
+        compileIk();
+    }
+    return std::find_if(ikPins.begin(), ikPins.end(), samePin)->chain >= 0;
+}
+
+void GeometryEngine::releaseJoint(const std::string& effector) {
+    std::string name = normalizedName(effector);
+    ikPins.erase(std::remove_if(ikPins.begin(), ikPins.end(), [&name](const ikPin& pin) { return pin.effector == name; }), ikPins.end());
+    ikCompiled = false;
+    lastElapseTime = -1.0f;
+}
+
+void GeometryEngine::releaseJoints() {
+    ikPins.clear();
+    ikCompiled = false;
+    lastElapseTime = -1.0f;
+}
+
+bool GeometryEngine::jointPosition(const std::string& joint, QVector3D& position) const {
+    std::string name = normalizedName(joint);
+    for (size_t i = 0; i < nodeList.size(); i++) {
+        if (i < jointPoses.size() && normalizedName(nodeList[i]->name) == name) {
+            position = jointPoses[i].worldPosition;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Chains of the pins on the current rig, compiled again when the pins or the rig change
+void GeometryEngine::compileIk() {
+    ikCompiled = true;
+    ikSolver.reset();
+    ikChains.clear();
+    if (ikPins.empty() || nodeList.empty()) {
+        return;
+    }
+
+    ikRig = compileIkSkeleton(rootList);
+    std::map<const BVHTree*, int> nodeOf;
+    for (size_t i = 0; i < nodeList.size(); i++) {
+        nodeOf[nodeList[i]] = i;
+    }
+    std::vector<BVHTree*> order = preorder(rootList);
+    ikJointNodes.resize(order.size());
+    ikNodeJoints.assign(nodeList.size(), -1);
+    for (size_t j = 0; j < order.size(); j++) {
+        ikJointNodes[j] = nodeOf[order[j]];
+        ikNodeJoints[ikJointNodes[j]] = j;
+    }
+
+    for (auto& pin : ikPins) {
+        pin.chain = -1;
+        int effector = findIkJoint(ikRig, pin.effector);
+        int middle = effector >= 0 ? ikRig.parent[effector] : -1;
+        int root = middle >= 0 ? ikRig.parent[middle] : -1;
+        if (root < 0 || ikRig.offset[middle].isNull() || ikRig.offset[effector].isNull()) {
+            std::cerr << "No limb ends at " << pin.effector << ", it is not pinned\n";
+            continue;
+        }
+        ikChain chain;
+        chain.joints = {root, middle, effector};
+        chain.keepEffectorOrientation = true;
+        pin.chain = ikChains.size();
+        ikChains.push_back(chain);
+    }
+    if (ikChains.empty()) {
+        return;
+    }
+    ikSolver = std::make_unique<IkSolver>(ikRig, ikChains);
+    ikPose.resize(1, ikRig.parent.size());
+    ikTargets.assign(ikChains.size(), ikTarget());
+    ikChainStats.assign(ikChains.size(), ikStats());
+    ikMoved.assign(nodeList.size(), 0);
+    ikOldRotation.resize(nodeList.size());
+    ikOldPosition.resize(nodeList.size());
+}
+
+// Solves the pinned limbs on the evaluated pose and carries what hangs from them. The moved nodes are
+// evaluated from the animation again by the next update, so a released pin lets the limb go
+void GeometryEngine::applyIk() {
+    if (!ikCompiled) {
+        compileIk();
+    }
+    if (!ikSolver) {
+        return;
+    }
+    QElapsedTimer timer;
+    timer.start();
+
+    // Global rotations, then local ones from the last joint down since parents come first
+    for (size_t j = 0; j < ikJointNodes.size(); j++) {
+        ikPose.local[j] = QQuaternion::fromRotationMatrix(jointPoses[ikJointNodes[j]].rotationMatrix.toGenericMatrix<3, 3>());
+    }
+    for (int j = ikJointNodes.size() - 1; j >= 0; j--) {
+        if (ikRig.parent[j] >= 0) {
+            ikPose.local[j] = ikPose.local[ikRig.parent[j]].conjugated() * ikPose.local[j];
+        }
+    }
+    ikPose.rootPosition[0] = (jointPoses[ikJointNodes[0]].worldPosition - globalOffset) / scale;
+
+    // The solver works in skeleton units
+    std::fill(ikMoved.begin(), ikMoved.end(), 0);
+    int first = nodeList.size();
+    for (const ikPin& pin : ikPins) {
+        if (pin.chain < 0) {
+            continue;
+        }
+        ikTargets[pin.chain] = {(pin.target - globalOffset) / scale, pin.weight};
+        if (pin.weight > 0.0f) {
+            for (int joint : ikChains[pin.chain].joints) {
+                ikMoved[ikJointNodes[joint]] = 1;
+                first = std::min(first, ikJointNodes[joint]);
+            }
+        }
+    }
+    ikSolver->solve(ikPose, ikTargets.data(), ikChainStats.data());
+
+    // Chain joints take their solved rotation, their descendants keep theirs relative to the parent
+    for (size_t i = first; i < nodeList.size(); i++) {
+        jointPose& pose = jointPoses[i];
+        bool solved = ikMoved[i];
+        if (!solved && (pose.parent < 0 || !ikMoved[pose.parent])) {
+            continue;
+        }
+        ikMoved[i] = 1;
+        ikOldRotation[i] = pose.rotationMatrix;
+        ikOldPosition[i] = pose.worldPosition;
+
+        QMatrix4x4 local = solved ? QMatrix4x4(ikPose.local[ikNodeJoints[i]].toRotationMatrix()) : pose.rotationMatrix;
+        if (pose.parent >= 0) {
+            const jointPose& parent = jointPoses[pose.parent];
+            QMatrix4x4 parentRotation = ikMoved[pose.parent] ? ikOldRotation[pose.parent] : parent.rotationMatrix;
+            QVector3D parentPosition = ikMoved[pose.parent] ? ikOldPosition[pose.parent] : parent.worldPosition;
+            if (!solved) {
+                local = parentRotation.transposed() * pose.rotationMatrix;
             }
+            QVector3D offset = parentRotation.transposed() * (pose.worldPosition - parentPosition);
+            pose.rotationMatrix = parent.rotationMatrix * local;
+            pose.worldPosition = parent.worldPosition + parent.rotationMatrix * offset;
+        } else {
+            pose.rotationMatrix = local;
+        }
+        pose.dirty = true;
+        pose.evaluated = false;
+        writeJoint(i);
+    }
+
+    ikTime += timer.nsecsElapsed() / 1e6;
+    nbIkUpdates++;
+}
+
+void GeometryEngine::printIkStats() const {
+    if (nbIkUpdates == 0) {
+        return;
+    }
+    std::cout << "IK: " << ikPins.size() << " pins, " << ikTime * 1e3 / nbIkUpdates << " us per pose update\n";
+    for (const ikPin& pin : ikPins) {
+        if (pin.chain < 0 || ikChainStats[pin.chain].solves == 0) {
+            continue;
         }
+        const ikStats& stats = ikChainStats[pin.chain];
+        std::cout << "  " << pin.effector << ": " << stats.solves << " solves, " << stats.unreachable << " out of reach, "
+                  << "error " << stats.errorSum / stats.solves << " on average, " << stats.maxError << " worst (skeleton units)\n";
     }
+}
 
-    arrayBuf.bind();
-    arrayBuf.write(0, vertices, nbVertex * sizeof(VertexData));
+void GeometryEngine::markPaletteDirty(int first, int last) {
+    if (last < first) {
+        return;
+    }
+    for (auto& upload: paletteUploads) {
+        upload.second.firstDirtyJoint = std::min(upload.second.firstDirtyJoint, first);
+        upload.second.lastDirtyJoint = std::max(upload.second.lastDirtyJoint, last);
+    }
+    skinnedMeshDirty = true;
+    pickTreeDirty = true;
 }
 
 void GeometryEngine::initCubeGeometry()
@@ -259,36 +1288,8 @@ void GeometryEngine::initCubeGeometry()
 //! [2]
 void GeometryEngine::drawCubeGeometry(QOpenGLShaderProgram *program)
 {
-    // Tell OpenGL which VBOs to use
-    arrayBufRig.bind();
-    indexBufRig.bind();
-
-    // Offset for position
-    quintptr offset = 0;
-
-    // Tell OpenGL programmable pipeline how to locate vertex position data
-    int vertexLocation = program->attributeLocation("a_position");
-    program->enableAttributeArray(vertexLocation);
-    program->setAttributeBuffer(vertexLocation, GL_FLOAT, offset, 3, sizeof(VertexData));
-
-    // Offset for texture coordinate
-    offset += sizeof(QVector3D);
-
-    // Tell OpenGL programmable pipeline how to locate vertex texture coordinate data
-    int colorLocation = program->attributeLocation("a_color");
-    program->enableAttributeArray(colorLocation);
-    program->setAttributeBuffer(colorLocation, GL_FLOAT, offset, 3, sizeof(VertexData));
-
-    // Offset for texture coordinate
-    offset += sizeof(QVector3D);
-
-    // Tell OpenGL programmable pipeline how to locate vertex texture coordinate data
-    int texcoordLocation = program->attributeLocation("a_texcoord");
-    program->enableAttributeArray(texcoordLocation);
-    program->setAttributeBuffer(texcoordLocation, GL_FLOAT, offset, 2, sizeof(VertexData));
-
     // Draw cube geometry using indices from VBO 1
-    glDrawElements(GL_TRIANGLE_STRIP, 34, GL_UNSIGNED_SHORT, nullptr);
+    renderState.draw({program, rigMesh, GL_TRIANGLE_STRIP, 34, {}});
 }
 //! [2]
 
@@ -315,228 +1316,76 @@ void GeometryEngine::initRepereGeometry() {
 }
 
 void GeometryEngine::drawRepereGeometry(QOpenGLShaderProgram *program) {
-    // Tell OpenGL which VBOs to use
-    arrayBufRig.bind();
-    indexBufRig.bind();
-
-    // Offset for position
-    quintptr offset = 0;
-
-    // Tell OpenGL programmable pipeline how to locate vertex position data
-    int vertexLocation = program->attributeLocation("a_position");
-    program->enableAttributeArray(vertexLocation);
-    program->setAttributeBuffer(vertexLocation, GL_FLOAT, offset, 3, sizeof(VertexData));
-
-    // Offset for texture coordinate
-    offset += sizeof(QVector3D);
-
-    // Tell OpenGL programmable pipeline how to locate vertex color data
-    int colorLocation = program->attributeLocation("a_color");
-    program->enableAttributeArray(colorLocation);
-    program->setAttributeBuffer(colorLocation, GL_FLOAT, offset, 3, sizeof(VertexData));
-
     // Draw lines geometry using indices from VBO 1
-    glDrawElements(GL_LINES, 6, GL_UNSIGNED_SHORT, nullptr);
+    renderState.draw({program, rigMesh, GL_LINES, 6, {}});
 }
 
-int readNode(const std::vector<std::string>& tokens, int i, BVHTree* node) {
-    // if (tokens[i] != keyWord) {
-    //     throw std::invalid_argument("\"" + keyWord + "\" token not found");
-    // }
-
-    node->name = tokens[i + 1];
-    // std::cout << node->name << "\n";
-
-    std::string accolade = tokens[i + 2];
-    if (accolade != "{") {
-        throw std::invalid_argument("\"{\" token not found");
-    }
-
-    std::string offset = tokens[i + 3];
-    if (offset != "OFFSET") {
-        throw std::invalid_argument("\"OFFSET\" token not found");
-    }
-
-    node->offset = QVector3D(std::stof(tokens[i + 4]), std::stof(tokens[i + 5]), std::stof(tokens[i + 6]));
-
-    std::string channels = tokens[i + 7];
-    if (channels != "CHANNELS") {
-        throw std::invalid_argument("\"CHANNELS\" token not found");
-    }
-
-    int channelsLen = std::stoi(tokens[i + 8]);
+void GeometryEngine::printBVHTree(const BVHTree& node, const std::string& dependency, const std::string& first, const std::string& next) {
+    std::string out = dependency + first + "Node \"" + node.name + "\", Index " + std::to_string(node.nodeIndex) + "\", NbSubTreeNodes :" + std::to_string(node.nbNode) + ", Offset: (" + std::to_string(node.offset.x()) + ", " + std::to_string(node.offset.y()) + ", " + std::to_string(node.offset.z()) + ")\n";
+    std::cout << out;
 
-    for (int j = 0; j < channelsLen; j++) {
-        node->channels.push_back(tokens[i + 9 + j]);
+    for (size_t i = 0; i < node.joints.size(); ++i) {
+        const BVHTree* child = node.joints[i];
+        std::string fst = (i == node.joints.size() - 1) ? " *> " : " +> ";
+        std::string snd = (i == node.joints.size() - 1) ? "   " : " | ";
+        printBVHTree(*child, dependency + next, fst, snd);
     }
-
-    return i + 9 + channelsLen;
 }
 
-int readAnimNode(const std::vector<std::string>& tokens, int i, BVHTree* node, float time) {
-    if (node->channels.empty()) {
-        return i;
-    }
-    int nbChannels = node->channels.size();
-    std::vector<float> keyFrame;
-    keyFrame.push_back(time);
-    for (int j = 0; j < nbChannels; j++) {
-        keyFrame.push_back(std::stof(tokens[i]));
-        i++;
-    }
-    node->channelsValues.push_back(keyFrame);
-    return i;
+void GeometryEngine::initBVHGeometry(std::string filename) {
+    initRigGeometry(readBVH(filename));
 }
 
-std::vector<BVHTree*> readBVH(const std::string& file) {
-    std::ifstream fch(file);
-    if (!fch.is_open()) {
-        throw std::runtime_error("Error opening file: " + file);
+bool GeometryEngine::initLiveGeometry(XsensStream* stream) {
+    // The skin is weighted on skinSkeleton, the joints of the suit are retargeted onto it
+    if (rigAsset >= 0) {
+        assets.wait(rigAsset);
+        uploadReadyAssets();
     }
-
-    std::stringstream buffer;
-    buffer << fch.rdbuf();
-    std::string content = buffer.str();
-
-    std::istringstream iss(content);
-    std::vector<std::string> tokens{std::istream_iterator<std::string>{iss},
-                                    std::istream_iterator<std::string>{}};
-
-    int i = 0;
-    if (tokens[i] != "HIERARCHY") {
-        throw std::invalid_argument("\"HIERARCHY\" token not found");
+    if (!skinSkeleton) {
+        std::cerr << "No skin skeleton to drive from the live stream\n";
+        return false;
     }
-    i++;
-
-    std::string nextKeyword = tokens[i];
-
-    std::vector<BVHTree*> rootList;
-    std::vector<BVHTree*> nodeQueue;
-
-    int indexQueue = 0;
-
-    while (nextKeyword == "ROOT") {
-        BVHTree* root = new BVHTree();
-        root->nodeIndex = indexQueue;
-        indexQueue++;
-        i = readNode(tokens, i, root);
-        rootList.push_back(root);
-        nodeQueue.push_back(root);
-
-        while (!nodeQueue.empty()) {
-            BVHTree* node = new BVHTree();
-            std::string t = tokens[i];
-
-            if (t == "JOINT") {
-                i = readNode(tokens, i, node);
-                nodeQueue.back()->joints.push_back(node);
-                node->parent = nodeQueue.back();
-                node->nodeIndex = indexQueue;
-                indexQueue++;
-                nodeQueue.push_back(node);
-            } else if (t == "End") {
-
-                node->name = tokens[i + 1];
-                t = tokens[i + 2];
-                if (t != "{") {
-                    throw std::invalid_argument("\"{\" token not found");
-                }
-
-                t = tokens[i + 3];
-                if (t != "OFFSET") {
-                    throw std::invalid_argument("\"OFFSET\" token not found");
-                }
-
-                node->offset = QVector3D(std::stof(tokens[i + 4]), std::stof(tokens[i + 5]), std::stof(tokens[i + 6]));
-                
-                nodeQueue.back()->joints.push_back(node);
-                node->parent = nodeQueue.back();
-                
-                node->nodeIndex = indexQueue;
-                indexQueue++;
-
-                t = tokens[i + 7];
-                if (t != "}") {
-                    throw std::invalid_argument("\"}\" token not found");
-                }
-
-                i += 8;
-            } else if (t == "}") {
-                BVHTree* closingNode = nodeQueue.back();
-                for (auto child: closingNode->joints) {
-                    closingNode->nbNode += child->nbNode;
-                    closingNode->nbLink += child->nbLink + 1;
-                }
-                nodeQueue.pop_back();
-                i++;
-            } else {
-                throw std::invalid_argument("Missing valid token");
-            }
-        }
-
-        nextKeyword = tokens[i];
-    }
-
-    if (tokens[i] != "MOTION") {
-        throw std::invalid_argument("\"MOTION\" token not found");
-    }
-
-    if (tokens[i+1] != "Frames:") {
-        throw std::invalid_argument("\"Frames:\" token not found");
+    setGpuPose(false);
+
+    std::map<std::string, BVHTree*> nodeByLabel;
+    liveSource = buildXsensSkeleton(nodeByLabel);
+    liveMap = compileRetargetMap(liveSource, skinSkeleton->roots);
+    std::map<const BVHTree*, int> jointOf;
+    for (size_t j = 0; j < xsensSkeleton.size(); j++) {
+        jointOf[nodeByLabel[xsensSkeleton[j].label]] = j;
     }
-
-    int nbFrames = std::stoi(tokens[i+2]);
-
-    if (tokens[i+3] != "Frame" && tokens[i+4] != "Time:") {
-        throw std::invalid_argument("\"Frame Time:\" token not found");
-    }
-
-    float frameInterval = std::stof(tokens[i+5]);
-    float time = 0;
-
-    i += 6;
-
-    for (int j = 0; j < nbFrames; j++) {
-        int k = 0;
-        while (k < static_cast<int>(rootList.size())) {
-            BVHTree* root = rootList[k];
-            nodeQueue.push_back(root);
-            while (!nodeQueue.empty()) {
-                BVHTree* node = nodeQueue.back();
-                nodeQueue.pop_back();
-                i = readAnimNode(tokens, i, node, time);
-                for (int childIndex = node->joints.size()-1; childIndex >= 0; childIndex--) {
-                    BVHTree* child = node->joints[childIndex];
-                    nodeQueue.push_back(child);
-                }
-            }
-            k++;
+    std::vector<BVHTree*> sourceNodes = preorder(liveSource);
+    liveSourceJoints.assign(sourceNodes.size(), -1);
+    for (size_t s = 0; s < sourceNodes.size(); s++) {
+        auto joint = jointOf.find(sourceNodes[s]);
+        if (joint != jointOf.end()) {
+            liveSourceJoints[s] = joint->second;
         }
-        time += frameInterval;
     }
-    
-    if (i < static_cast<int>(tokens.size())) {
-        throw std::invalid_argument("The file contains more values than expected");
+    liveSourceFrame.assign(liveMap.nbSourceChannels, 0.0f);
+    liveFrame.assign(liveMap.nbTargetChannels, 0.0f);
+
+    initRigGeometry(skinSkeleton->roots);
+    std::map<const BVHTree*, int> firstChannel;
+    int nbChannels = 0;
+    for (auto node : preorder(rootList)) {
+        firstChannel[node] = nbChannels;
+        nbChannels += node->channels.size();
     }
-
-
-    return rootList;
-}
-
-void GeometryEngine::printBVHTree(const BVHTree& node, const std::string& dependency, const std::string& first, const std::string& next) {
-    std::string out = dependency + first + "Node \"" + node.name + "\", Index " + std::to_string(node.nodeIndex) + "\", NbSubTreeNodes :" + std::to_string(node.nbNode) + ", Offset: (" + std::to_string(node.offset.x()) + ", " + std::to_string(node.offset.y()) + ", " + std::to_string(node.offset.z()) + ")\n";
-    std::cout << out;
-
-    for (size_t i = 0; i < node.joints.size(); ++i) {
-        const BVHTree* child = node.joints[i];
-        std::string fst = (i == node.joints.size() - 1) ? " *> " : " +> ";
-        std::string snd = (i == node.joints.size() - 1) ? "   " : " | ";
-        printBVHTree(*child, dependency + next, fst, snd);
+    liveChannels.resize(nodeList.size());
+    for (size_t i = 0; i < nodeList.size(); i++) {
+        liveChannels[i] = firstChannel[nodeList[i]];
     }
+
+    liveStream = stream;
+    hasLivePose = false;
+    rigReady = true;
+    return true;
 }
 
-void GeometryEngine::initBVHGeometry(std::string filename) {
-    rootList = readBVH(filename);
+void GeometryEngine::initRigGeometry(std::vector<BVHTree*> roots) {
+    rootList = roots;
     printBVHTree(*rootList[0]);
 
     int nbTotNode = 0;
@@ -552,28 +1401,37 @@ void GeometryEngine::initBVHGeometry(std::string filename) {
     VertexData vertices[nbTotNode * 7];
     GLushort indices[nbTotNode * 6 + nbTotLink * 2];
 
-
+    nodeList.clear();
+    jointPoses.assign(nbTotNode, jointPose());
+    restPositions.assign(nbTotNode, QVector3D(0.0f, 0.0f, 0.0f));
+    skinPalette.assign(std::min(nbTotNode, maxSkinJoints), QMatrix4x4());
+    skinDqReal.assign(skinPalette.size(), QVector4D(0.0f, 0.0f, 0.0f, 1.0f));
+    skinDqDual.assign(skinPalette.size(), QVector4D(0.0f, 0.0f, 0.0f, 0.0f));
+    markPaletteDirty(0, skinPalette.size() - 1);
+    lastElapseTime = -1.0f;
+    ikCompiled = false;
 
     int indexVertices = 0;
     int indexIndices = 0;
     float radius = 0.05;
-    float scale = 1.0f/100.0f;
+    float scale = meshScale;
 
-    std::deque<BVHTree*> nodeQueue;
+    // Nodes with the index of their parent in nodeList
+    std::deque<std::pair<BVHTree*, int>> nodeQueue;
     for (auto root: rootList) {
-        nodeQueue.push_back(root);
+        nodeQueue.push_back({root, -1});
         while (!nodeQueue.empty()) {
-            BVHTree* node = nodeQueue.front();
+            BVHTree* node = nodeQueue.front().first;
+            jointPoses[nodeList.size()].parent = nodeQueue.front().second;
             nodeQueue.pop_front();
-            node->vertexIndex = indexVertices;
+            nodeList.push_back(node);
             QVector3D worldPos = node->offset * scale;
-            rigTranfosList[node->nodeIndex] = (worldPos);
             if (node->parent){
-                worldPos += vertices[node->parent->vertexIndex].position;
+                worldPos += vertices[7 * jointPoses[nodeList.size() - 1].parent].position;
             } else {
                 worldPos = QVector3D(0.0f, 0.0f, 0.0f);
-                rigTranfosList[node->nodeIndex] = (worldPos);
             }
+            restPositions[node->nodeIndex] = worldPos;
             VertexData vertex0 = {worldPos + QVector3D(   0.0f,    0.0f,    0.0f), QVector3D(1.0f, 1.0f, 1.0f), QVector2D(0.0f, 0.0f)};
             VertexData vertex1 = {worldPos + QVector3D( radius,    0.0f,    0.0f), QVector3D(1.0f, 0.0f, 0.0f), QVector2D(0.0f, 0.0f)};
             VertexData vertex2 = {worldPos + QVector3D(-radius,    0.0f,    0.0f), QVector3D(1.0f, 0.0f, 0.0f), QVector2D(0.0f, 0.0f)};
@@ -582,15 +1440,6 @@ void GeometryEngine::initBVHGeometry(std::string filename) {
             VertexData vertex5 = {worldPos + QVector3D(   0.0f,    0.0f,  radius), QVector3D(0.0f, 0.0f, 1.0f), QVector2D(0.0f, 0.0f)};
             VertexData vertex6 = {worldPos + QVector3D(   0.0f,    0.0f, -radius), QVector3D(0.0f, 0.0f, 1.0f), QVector2D(0.0f, 0.0f)};
             vertices[indexVertices] = vertex0;
-
-            // QMatrix4x4 transfoMatrix;
-            // transfoMatrix.setToIdentity();
-            // transfoMatrix.translate(worldPos);
-            // rigTranfosList.push_back(transfoMatrix);
-
-            // rigTranfosList[node->nodeIndex] = (node->offset * scale);
-            // std::cout << node->nodeIndex << std::endl;
-
             vertices[indexVertices + 1] = vertex1;
             vertices[indexVertices + 2] = vertex2;
             vertices[indexVertices + 3] = vertex3;
@@ -612,14 +1461,26 @@ void GeometryEngine::initBVHGeometry(std::string filename) {
                 indices[indexIndices] = indexVertices;
                 indices[indexIndices + 1] = indexVertices + 7 * (nodeQueue.size() + 1);
                 indexIndices += 2;
-                nodeQueue.push_back(child);
+                nodeQueue.push_back({child, static_cast<int>(nodeList.size()) - 1});
             }
 
             indexVertices += 7;
         }
     }
 
+    rigVertices.assign(vertices, vertices + nbVertex);
+
+    // A level starts at the first node whose parent is in the current one
+    poseLevels.assign(1, 0);
+    for (size_t i = 0; i < nodeList.size(); i++) {
+        if (jointPoses[i].parent >= poseLevels.back()) {
+            poseLevels.push_back(i);
+        }
+    }
+    poseLevels.push_back(nodeList.size());
+
     arrayBufRig.bind();
+    arrayBufRig.setUsagePattern(QOpenGLBuffer::DynamicDraw);
     arrayBufRig.allocate(vertices, nbTotNode * 7 * sizeof(VertexData));
 
     indexBufRig.bind();
@@ -627,156 +1488,878 @@ void GeometryEngine::initBVHGeometry(std::string filename) {
 }
 
 void GeometryEngine::drawBVHGeometry(QOpenGLShaderProgram *program) {
-    // Tell OpenGL which VBOs to use
-    arrayBufRig.bind();
-    indexBufRig.bind();
-
-    // Offset for position
-    quintptr offset = 0;
-
-    // Tell OpenGL programmable pipeline how to locate vertex position data
-    int vertexLocation = program->attributeLocation("a_position");
-    program->enableAttributeArray(vertexLocation);
-    program->setAttributeBuffer(vertexLocation, GL_FLOAT, offset, 3, sizeof(VertexData));
-
-    // Offset for texture coordinate
-    offset += sizeof(QVector3D);
-
-    // Tell OpenGL programmable pipeline how to locate vertex color data
-    int colorLocation = program->attributeLocation("a_color");
-    program->enableAttributeArray(colorLocation);
-    program->setAttributeBuffer(colorLocation, GL_FLOAT, offset, 3, sizeof(VertexData));
-
     // Draw lines geometry using indices from VBO 1
-    glDrawElements(GL_LINES, nbIndex, GL_UNSIGNED_SHORT, nullptr);
+    renderState.draw({program, rigMesh, GL_LINES, nbIndex, {}});
 }
 
-void GeometryEngine::initMeshGeometry(std::string filenameMesh, std::string filenameWeights){
-
+// Worker thread: mesh and weights files are parsed in parallel, then packed into the vertex layout
+// An empty skeleton reads the weights from filenameWeights, otherwise they are computed from it
+static void buildSkinGeometry(const std::string& filenameMesh, const std::string& filenameWeights, const std::vector<BVHTree*>& skeleton,
+                              std::vector<VertexSkinData>& vertices, std::vector<VertexSkinExtraData>& extra,
+                              std::vector<GLushort>& indices, std::vector<influenceBucket>& buckets, std::vector<meshLod>& lods,
+                              std::vector<morphTarget>& morphs, std::vector<int>& sourceVertices){
+
+    // The weights are read by another job while this one parses the mesh, the job owns its result
+    // in case the mesh throws first
+    auto readRows = std::make_shared<std::vector<std::vector<weight>>>();
+    JobHandle weightsTask;
+    if (skeleton.empty()) {
+        weightsTask = JobSystem::shared().submit("read weights", [readRows, filenameWeights]() {
+            *readRows = readWeights(filenameWeights, -1);
+        });
+    }
     mesh myMesh = readMesh(filenameMesh);
-    std::vector<std::vector<weight>> myWeights = readWeights(filenameWeights, myMesh.nbVertices);
-
-    VertexSkinData vertices[myMesh.nbVertices];
+    if (myMesh.nbVertices > maxSkinVertices) {
+        throw std::runtime_error(filenameMesh + " has more vertices than 16 bit indices reach");
+    }
+    readMorphTargets(filenameMesh, myMesh);
+    std::vector<morphTarget> sourceMorphs;
+    sourceMorphs.swap(myMesh.morphTargets);
+
+    std::vector<std::vector<weight>> myWeights;
+    if (skeleton.empty()) {
+        JobSystem::shared().wait(weightsTask);
+        if (std::exception_ptr error = weightsTask.error()) {
+            std::rethrow_exception(error);
+        }
+        myWeights.swap(*readRows);
+        if (static_cast<int>(myWeights.size()) < myMesh.nbVertices) {
+            throw std::runtime_error(filenameWeights + " has fewer rows than " + filenameMesh + " has vertices");
+        }
+    } else {
+        autoWeightStats stats;
+        QElapsedTimer timer;
+        timer.start();
+        myWeights = computeSkinWeights(myMesh, skinBones(skeleton, meshScale), heatWeights, maxSkinInfluences, &stats);
+        std::cout << "No " << filenameWeights << ", heat weights of " << myMesh.nbVertices << " vertices computed in "
+                  << timer.nsecsElapsed() / 1e6 << " ms (" << stats.nbIterations << " solver iterations)\n";
+    }
 
+    // Strongest influences first, at most maxSkinInfluences, negligible ones dropped, summing to 1
     for (int i = 0; i < myMesh.nbVertices; i++){
-        
-        float vertexWeights[4];
-        QVector3D transfos[4];
+        std::vector<weight>& influences = myWeights[i];
+        influences.erase(std::remove_if(influences.begin(), influences.end(), [](const weight& w) {
+            return w.i < 0 || w.i >= maxSkinJoints || !(w.w > 0.0f);
+        }), influences.end());
+
+        auto stronger = [](const weight& a, const weight& b) { return a.w > b.w; };
+        int nbKept = std::min<int>(influences.size(), maxSkinInfluences);
+        std::partial_sort(influences.begin(), influences.begin() + nbKept, influences.end(), stronger);
+        influences.resize(nbKept);
+
+        float sum = 0.0f;
+        for (const auto& w : influences) {
+            sum += w.w;
+        }
+        while (!influences.empty() && influences.back().w < 1e-3f * sum) {
+            sum -= influences.back().w;
+            influences.pop_back();
+        }
+        if (influences.empty()) {
+            influences.push_back({0, 1.0f});
+            sum = 1.0f;
+        }
+        for (auto& w : influences) {
+            w.w /= sum;
+        }
+    }
 
-        int nbVertexWeights = myWeights[i].size();
+    // Coarser levels are simplified in parallel, the merged vertices keep at most maxSkinInfluences
+    QElapsedTimer timer;
+    timer.start();
+    lodOptions options;
+    options.maxInfluences = maxSkinInfluences;
+    std::vector<lodMesh> chain = buildLodChain(myMesh, myWeights, options);
+    std::cout << "Skin LOD chain of " << chain.size() << " levels built in " << timer.nsecsElapsed() / 1e6 << " ms\n";
+
+    bool hasExtra = false;
+    for (const auto& level : chain) {
+        hasExtra = hasExtra || std::any_of(level.weights.begin(), level.weights.end(), [](const std::vector<weight>& w) { return w.size() > 4; });
+    }
+    vertices.clear();
+    extra.clear();
+    indices.clear();
+    buckets.clear();
+    lods.clear();
+    sourceVertices.clear();
+    for (const auto& level : chain) {
+        // Every level is indexed in the same buffer, the chain stops at the levels that would not fit
+        if (static_cast<int>(vertices.size()) + level.geometry.nbVertices > maxSkinVertices) {
+            std::cerr << "Skin LOD chain cut to " << lods.size() << " levels, 16 bit indices reach " << maxSkinVertices << " vertices\n";
+            break;
+        }
+        packSkinLevel(level, hasExtra, vertices, extra, indices, buckets, lods, sourceVertices);
+    }
 
-        for (int j = 0; j < 4; j++){
-            if (j < nbVertexWeights){
-                vertexWeights[j] = myWeights[i][j].w;
-                transfos[j] = rigTranfosList[myWeights[i][j].i];
-            }
-            else{
-                vertexWeights[j] = 0.0;
-                transfos[j] = QVector3D(0.0f, 0.0f, 0.0f);
-            }
+    // Coarser levels take the deltas of the vertices their collapses kept
+    morphs = remapMorphTargets(sourceMorphs, sourceVertices, myMesh.nbVertices);
+}
+
+// Appends one level to the skin buffers, its vertices and triangles sorted by bucket
+static void packSkinLevel(const lodMesh& level, bool hasExtra, std::vector<VertexSkinData>& vertices,
+                          std::vector<VertexSkinExtraData>& extra, std::vector<GLushort>& indices,
+                          std::vector<influenceBucket>& buckets, std::vector<meshLod>& lods, std::vector<int>& sourceVertices){
+    const mesh& myMesh = level.geometry;
+    const std::vector<std::vector<weight>>& myWeights = level.weights;
+    std::vector<int> vertexBucket(myMesh.nbVertices);
+    for (int i = 0; i < myMesh.nbVertices; i++){
+        vertexBucket[i] = bucketOf(myWeights[i].size());
+    }
+
+    meshLod lod = {static_cast<int>(buckets.size()), 0, static_cast<int>(vertices.size()), myMesh.nbVertices,
+                   static_cast<int>(indices.size()), myMesh.nbFaces * 3, level.error};
+
+    // Vertices sorted by bucket, each bucket is a contiguous range skinned by its own kernel
+    std::vector<int> order(myMesh.nbVertices);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return vertexBucket[a] < vertexBucket[b]; });
+    std::vector<int> newIndex(myMesh.nbVertices);
+
+    vertices.resize(lod.firstVertex + myMesh.nbVertices);
+    sourceVertices.resize(vertices.size());
+    extra.resize(hasExtra ? vertices.size() : 0, {QVector4D(0, 0, 0, 0), QVector4D(0, 0, 0, 0)});
+
+    for (int n = 0; n < myMesh.nbVertices; n++){
+        int i = order[n];
+        newIndex[i] = lod.firstVertex + n;
+        sourceVertices[lod.firstVertex + n] = level.sourceVertices[i];
+
+        const std::vector<weight>& influences = myWeights[i];
+        float vertexWeights[maxSkinInfluences] = {};
+        float joints[maxSkinInfluences] = {};
+        for (size_t j = 0; j < influences.size() && j < maxSkinInfluences; j++){
+            vertexWeights[j] = influences[j].w;
+            joints[j] = influences[j].i;
         }
 
-        vertices[i] = {myMesh.vertexList[i],
+        vertices[lod.firstVertex + n] = {myMesh.vertexList[i],
                                         QVector3D(0.2f, 0.8f, 1.0f),
                                         vertexWeights[0],
                                         vertexWeights[1],
                                         vertexWeights[2],
                                         vertexWeights[3],
-                                        transfos[0],
-                                        transfos[1],
-                                        transfos[2],
-                                        transfos[3],
+                                        QVector4D(joints[0], joints[1], joints[2], joints[3]),
+                                        myMesh.normalList[i],
         };
-        
-    }
+        if (hasExtra) {
+            extra[lod.firstVertex + n] = {QVector4D(vertexWeights[4], vertexWeights[5], vertexWeights[6], vertexWeights[7]),
+                                          QVector4D(joints[4], joints[5], joints[6], joints[7])};
+        }
 
-    GLushort indices[myMesh.nbFaces*3];
+        int nbInfluences = bucketSizes[vertexBucket[i]];
+        if (static_cast<int>(buckets.size()) == lod.firstBucket || buckets.back().nbInfluences != nbInfluences) {
+            buckets.push_back({nbInfluences, lod.firstVertex + n, 0, 0, 0});
+        }
+        buckets.back().nbVertices++;
+    }
+    lod.nbBuckets = buckets.size() - lod.firstBucket;
 
+    // A triangle is drawn with the variant of its most influenced vertex
+    std::vector<int> faceBucket(myMesh.nbFaces);
+    std::vector<int> faceOrder(myMesh.nbFaces);
     for (int j = 0; j < myMesh.nbFaces; j++){
-        indices[3*j] = myMesh.indexList[j].i;
-        indices[3*j+1] = myMesh.indexList[j].j;
-        indices[3*j+2] = myMesh.indexList[j].k;
+        const auto& face = myMesh.indexList[j];
+        faceBucket[j] = std::max({vertexBucket[face.i], vertexBucket[face.j], vertexBucket[face.k]});
+        faceOrder[j] = j;
     }
+    std::stable_sort(faceOrder.begin(), faceOrder.end(), [&](int a, int b) { return faceBucket[a] < faceBucket[b]; });
 
-    arrayBufSkin.bind();
-    arrayBufSkin.allocate(vertices, myMesh.nbVertices * sizeof(VertexSkinData));
+    indices.resize(lod.firstIndex + myMesh.nbFaces * 3);
 
-    indexBufSkin.bind();
-    indexBufSkin.allocate(indices, myMesh.nbFaces * 3 * sizeof(GLushort));
-    nbIndex = myMesh.nbFaces * 3;
+    for (int n = 0; n < myMesh.nbFaces; n++){
+        int j = faceOrder[n];
+        int first = lod.firstIndex + 3 * n;
+        indices[first] = newIndex[myMesh.indexList[j].i];
+        indices[first+1] = newIndex[myMesh.indexList[j].j];
+        indices[first+2] = newIndex[myMesh.indexList[j].k];
 
+        int nbInfluences = bucketSizes[faceBucket[j]];
+        auto bucket = std::find_if(buckets.begin() + lod.firstBucket, buckets.end(), [&](const influenceBucket& b) { return b.nbInfluences == nbInfluences; });
+        if (bucket->nbIndices == 0) {
+            bucket->firstIndex = first;
+        }
+        bucket->nbIndices += 3;
+    }
+    lods.push_back(lod);
 }
 
-void GeometryEngine::drawMeshGeometry(QOpenGLShaderProgram *program){
-    // Tell OpenGL which VBOs to use
+void GeometryEngine::initMeshGeometry(const std::vector<VertexSkinData>& vertices, const std::vector<VertexSkinExtraData>& extra,
+                                      const std::vector<GLushort>& indices, const std::vector<influenceBucket>& buckets,
+                                      const std::vector<meshLod>& lods){
     arrayBufSkin.bind();
+    arrayBufSkin.allocate(vertices.data(), vertices.size() * sizeof(VertexSkinData));
+
+    arrayBufSkinExtra.bind();
+    arrayBufSkinExtra.allocate(extra.data(), extra.size() * sizeof(VertexSkinExtraData));
+
     indexBufSkin.bind();
+    indexBufSkin.allocate(indices.data(), indices.size() * sizeof(GLushort));
+    nbIndexSkin = indices.size();
+    nbVertexSkin = vertices.size();
+
+    skinnedBuf.bind();
+    skinnedBuf.allocate(nbVertexSkin * sizeof(SkinnedVertexData));
+    skinnedMeshDirty = true;
+
+    // Every vertex lies in the box of each joint it depends on. Its linear blend is a convex combination
+    // of the vertex posed by each joint, so it lies in the convex hull of their posed boxes, and in the
+    // box around them. Dual quaternion blends are bounded from the influence sets by skinBounds()
+    jointBounds.assign(maxSkinJoints, aabb());
+    std::map<std::vector<int>, size_t> setOfJoints;
+    influenceSets.clear();
+    for (size_t v = 0; v < vertices.size(); v++) {
+        const float weights[8] = {vertices[v].weight0, vertices[v].weight1, vertices[v].weight2, vertices[v].weight3,
+                                  extra.empty() ? 0.0f : extra[v].weights.x(), extra.empty() ? 0.0f : extra[v].weights.y(),
+                                  extra.empty() ? 0.0f : extra[v].weights.z(), extra.empty() ? 0.0f : extra[v].weights.w()};
+        const float joints[8] = {vertices[v].joints.x(), vertices[v].joints.y(), vertices[v].joints.z(), vertices[v].joints.w(),
+                                 extra.empty() ? 0.0f : extra[v].joints.x(), extra.empty() ? 0.0f : extra[v].joints.y(),
+                                 extra.empty() ? 0.0f : extra[v].joints.z(), extra.empty() ? 0.0f : extra[v].joints.w()};
+        int nbJoints = 0;
+        for (int k = 0; k < 8; k++) {
+            int joint = int(joints[k]);
+            if (weights[k] > 0.0f && joint >= 0 && joint < maxSkinJoints) {
+                jointBounds[joint].add(vertices[v].position);
+                nbJoints = k + 1;
+            }
+        }
+
+        // The shader blends the first NB_INFLUENCES, every prefix is a set
+        std::vector<int> prefix(1, int(joints[0]));
+        for (int count = 2; count <= nbJoints; count++) {
+            prefix.push_back(int(joints[count - 1]));
+            float sum = std::accumulate(weights, weights + count, 0.0f);
+            float squares = 0.0f;
+            float others = 0.0f;
+            float otherSquares = 0.0f;
+            for (int k = 0; k < count; k++) {
+                float w = weights[k] / sum;
+                squares += w * w;
+                if (k > 0) {
+                    others += w;
+                    otherSquares += w * w;
+                }
+            }
+            auto found = setOfJoints.emplace(prefix, influenceSets.size());
+            if (found.second) {
+                influenceSet set;
+                std::copy(prefix.begin(), prefix.end(), set.joints);
+                set.nbJoints = count;
+                set.minSquares = squares;
+                set.maxCross = 0.0f;
+                influenceSets.push_back(set);
+            }
+            influenceSet& set = influenceSets[found.first->second];
+            set.minSquares = std::min(set.minSquares, squares);
+            set.maxCross = std::max(set.maxCross, others * others - otherSquares);
+        }
+    }
+
+    for (size_t level = 0; level < lods.size(); level++) {
+        const meshLod& lod = lods[level];
+        std::cout << "Skin LOD " << level << ", error " << lod.error << ":";
+        for (int b = lod.firstBucket; b < lod.firstBucket + lod.nbBuckets; b++) {
+            std::cout << " " << buckets[b].nbVertices << " vertices and " << buckets[b].nbIndices / 3 << " triangles with "
+                      << buckets[b].nbInfluences << (b + 1 == lod.firstBucket + lod.nbBuckets ? "\n" : ",");
+        }
+    }
+    std::cout << "Skin vertices of every level: " << (vertices.size() * sizeof(VertexSkinData) + extra.size() * sizeof(VertexSkinExtraData)) / 1024.0 << " KiB\n";
+}
+
+void GeometryEngine::uploadSkinPalette(QOpenGLShaderProgram *program){
+    if (gpuPoseEnabled) {
+        uploadPoseUniforms(program);
+        return;
+    }
+
+    // Uniforms belong to the program, each program keeps its own dirty range
+    auto it = paletteUploads.find(program->programId());
+    if (it == paletteUploads.end()) {
+        paletteUpload upload;
+        for (int j = 0; j < maxSkinJoints; j++) {
+            std::string index = "[" + std::to_string(j) + "]";
+            upload.locations.push_back(program->uniformLocation(("u_palette" + index).c_str()));
+            upload.dqRealLocations.push_back(program->uniformLocation(("u_dqReal" + index).c_str()));
+            upload.dqDualLocations.push_back(program->uniformLocation(("u_dqDual" + index).c_str()));
+        }
+        upload.lastDirtyJoint = skinPalette.size() - 1;
+        it = paletteUploads.emplace(program->programId(), upload).first;
 
-    // Offset for position
-    quintptr offset = 0;
+        int scaleLocation = program->uniformLocation("u_skinScale");
+        if (scaleLocation >= 0) {
+            program->setUniformValue(scaleLocation, scale / meshScale);
+        }
+    }
 
-    // Tell OpenGL programmable pipeline how to locate vertex position data
-    int vertexLocation = program->attributeLocation("a_position");
-    program->enableAttributeArray(vertexLocation);
-    program->setAttributeBuffer(vertexLocation, GL_FLOAT, offset, 3, sizeof(VertexSkinData));
+    // Only the joints whose global transform changed since the last upload, in the form the variant reads
+    paletteUpload& upload = it->second;
+    int first = upload.firstDirtyJoint;
+    int count = upload.lastDirtyJoint - upload.firstDirtyJoint + 1;
+    if (count > 0) {
+        if (upload.locations[first] >= 0) {
+            program->setUniformValueArray(upload.locations[first], &skinPalette[first], count);
+        }
+        if (upload.dqRealLocations[first] >= 0) {
+            program->setUniformValueArray(upload.dqRealLocations[first], &skinDqReal[first], count);
+            program->setUniformValueArray(upload.dqDualLocations[first], &skinDqDual[first], count);
+        }
+        upload.firstDirtyJoint = maxSkinJoints;
+        upload.lastDirtyJoint = -1;
+    }
+}
 
-    // Offset for texture coordinate
-    offset += sizeof(QVector3D);
+void GeometryEngine::drawScene(const QMatrix4x4& mvp){
+    // Nothing to draw until the clip is uploaded, the mesh follows when it is
+    if (!rigReady) {
+        return;
+    }
+    bool drawMesh = skinReady;
 
-    // Tell OpenGL programmable pipeline how to locate vertex color data
-    int colorLocation = program->attributeLocation("a_color");
-    program->enableAttributeArray(colorLocation);
-    program->setAttributeBuffer(colorLocation, GL_FLOAT, offset, 3, sizeof(VertexSkinData));
+    if (culling && !characterVisible(mvp)) {
+        return;
+    }
+    if (drawMesh) {
+        selectLod(mvp);
+        applyMorphTargets();
+        if (picking) {
+            updatePickTree();
+        }
+    }
 
-    offset += sizeof(QVector3D);
+    renderState.beginFrame();
 
-    int weightLocation0 = program->attributeLocation("a_weight0");
-    program->enableAttributeArray(weightLocation0);
-    program->setAttributeBuffer(weightLocation0, GL_FLOAT, offset, 1, sizeof(VertexSkinData));
+    // Timer queries cannot nest, the pre-pass is timed on its own
+    if (drawMesh && mode != SkinInShader) {
+        skinMeshGeometry();
+    }
 
-    offset += sizeof(float);
+    scenePassTimer.begin();
 
-    int weightLocation1 = program->attributeLocation("a_weight1");
-    program->enableAttributeArray(weightLocation1);
-    program->setAttributeBuffer(weightLocation1, GL_FLOAT, offset, 1, sizeof(VertexSkinData));
+    renderState.bindProgram(rigProgram);
+    renderState.setUniform(rigProgram, "mvp_matrix", mvp);
+    if (!gpuPoseEnabled) {
+        renderState.submit({rigProgram, rigMesh, GL_LINES, nbIndex, {}});
+    }
+    if (drawMesh && mode != SkinInShader) {
+        const meshLod& lod = skinLods[currentLod];
+        renderState.bindProgram(skinnedProgram);
+        renderState.setUniform(skinnedProgram, "mvp_matrix", mvp);
+        renderState.submit({skinnedProgram, skinnedMesh, GL_TRIANGLES, lod.nbIndices, {}, lod.firstIndex});
+    } else if (drawMesh) {
+        // One draw per bucket of triangles, consecutive buckets sharing a variant are merged
+        const meshLod& lod = skinLods[currentLod];
+        int lastBucket = lod.firstBucket + lod.nbBuckets;
+        for (int b = lod.firstBucket; b < lastBucket;) {
+            QOpenGLShaderProgram* program = bucketMeshPrograms[bucketOf(skinBuckets[b].nbInfluences)];
+            int firstIndex = -1;
+            int nbIndices = 0;
+            for (; b < lastBucket && bucketMeshPrograms[bucketOf(skinBuckets[b].nbInfluences)] == program; b++) {
+                if (firstIndex < 0 && skinBuckets[b].nbIndices > 0) {
+                    firstIndex = skinBuckets[b].firstIndex;
+                }
+                nbIndices += skinBuckets[b].nbIndices;
+            }
+            if (nbIndices == 0) {
+                continue;
+            }
+            renderState.bindProgram(program);
+            renderState.setUniform(program, "mvp_matrix", mvp);
+            uploadSkinPalette(program);
+            renderState.submit({program, skinMesh, GL_TRIANGLES, nbIndices, {}, firstIndex});
+        }
+    }
+    renderState.flush();
 
-    offset += sizeof(float);
-    
-    int weightLocation2 = program->attributeLocation("a_weight2");
-    program->enableAttributeArray(weightLocation2);
-    program->setAttributeBuffer(weightLocation2, GL_FLOAT, offset, 1, sizeof(VertexSkinData));
+    scenePassTimer.end();
+}
 
-    offset += sizeof(float);
+bool GeometryEngine::initSkinningPass(){
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if (context->format().majorVersion() < 3 && !context->hasExtension("GL_EXT_transform_feedback")) {
+        std::cerr << "Transform feedback not supported, skinning stays in the vertex shader\n";
+        return false;
+    }
 
-    int weightLocation3 = program->attributeLocation("a_weight3");
-    program->enableAttributeArray(weightLocation3);
-    program->setAttributeBuffer(weightLocation3, GL_FLOAT, offset, 1, sizeof(VertexSkinData));
+    skinnedMeshDirty = true;
+    return true;
+}
 
-    offset += sizeof(float);
+void GeometryEngine::initShaders(){
+    shaders.init();
 
-    int matLocation0 = program->attributeLocation("a_mat0");
-    program->enableAttributeArray(matLocation0);
-    program->setAttributeBuffer(matLocation0, GL_FLOAT, offset, 3, sizeof(VertexSkinData));
+    rigProgram = shaders.program({":/vshader.glsl", ":/fshader.glsl", {}, {}});
+    skinnedProgram = shaders.program({":/vshader.glsl", ":/fshader.glsl", {"SKINNED"}, {}});
+    if (!rigProgram || !skinnedProgram || !setSkinningVariant(method, nbInfluences)) {
+        throw std::runtime_error("Error building the shaders");
+    }
+}
 
-    offset += sizeof(QVector3D);
+bool GeometryEngine::setSkinningVariant(SkinningMethod newMethod, int newNbInfluences){
+    if (std::find(bucketSizes, bucketSizes + nbBuckets, newNbInfluences) == bucketSizes + nbBuckets) {
+        std::cerr << "Skinning supports 1, 2, 4 or 8 influences, not " << newNbInfluences << "\n";
+        return false;
+    }
 
-    int matLocation1 = program->attributeLocation("a_mat1");
-    program->enableAttributeArray(matLocation1);
-    program->setAttributeBuffer(matLocation1, GL_FLOAT, offset, 3, sizeof(VertexSkinData));
+    // Each bucket gets the variant of its influence count, capped by newNbInfluences
+    std::vector<QOpenGLShaderProgram*> newMeshPrograms(nbBuckets, nullptr);
+    std::vector<QOpenGLShaderProgram*> newSkinPrograms(nbBuckets, nullptr);
+    for (int b = 0; b < nbBuckets; b++) {
+        QStringList defines = {newMethod == DualQuaternion ? "SKINNING_DQS" : "SKINNING_LBS",
+                               "NB_INFLUENCES " + QString::number(std::min(bucketSizes[b], newNbInfluences))};
+        if (gpuPoseEnabled) {
+            defines << "GPU_POSE";
+        }
+        newMeshPrograms[b] = shaders.program({":/vshader.glsl", ":/fshader.glsl", defines, {}});
+        if (!newMeshPrograms[b]) {
+            return false;
+        }
 
-    offset += sizeof(QVector3D);
-    
-    int matLocation2 = program->attributeLocation("a_mat2");
-    program->enableAttributeArray(matLocation2);
-    program->setAttributeBuffer(matLocation2, GL_FLOAT, offset, 3, sizeof(VertexSkinData));
+        // The pre-pass skins with the same variant as the mesh
+        if (skinningPassSupported) {
+            newSkinPrograms[b] = shaders.program({":/skinshader.glsl", "", defines, {"v_position", "v_normal"}});
+            if (!newSkinPrograms[b]) {
+                skinningPassSupported = false;
+                if (mode == SkinOnce) {
+                    mode = SkinInShader;
+                }
+            }
+        }
+    }
 
-    offset += sizeof(QVector3D);
+    bucketMeshPrograms = newMeshPrograms;
+    bucketSkinPrograms = newSkinPrograms;
+    meshProgram = newMeshPrograms[bucketOf(newNbInfluences)];
+    skinProgram = newSkinPrograms[bucketOf(newNbInfluences)];
+    method = newMethod;
+    nbInfluences = newNbInfluences;
+    skinnedMeshDirty = true;
+    return true;
+}
 
-    int matLocation3 = program->attributeLocation("a_mat3");
-    program->enableAttributeArray(matLocation3);
-    program->setAttributeBuffer(matLocation3, GL_FLOAT, offset, 3, sizeof(VertexSkinData));
+void GeometryEngine::printShaderStats(){
+    shaders.printStats();
+}
 
+bool GeometryEngine::setSkinningMode(SkinningMode newMode){
+    if ((newMode == SkinOnce && !skinningPassSupported) || (newMode == SkinOnCpu && gpuPoseEnabled)) {
+        return false;
+    }
+    mode = newMode;
+    skinnedMeshDirty = true;
+    skinPassTimer.reset();
+    scenePassTimer.reset();
+    cpuSkinTime = 0;
+    nbCpuSkinPasses = 0;
+    return true;
+}
 
-    // Draw lines geometry using indices from VBO 1
-    glDrawElements(GL_TRIANGLES, nbIndex, GL_UNSIGNED_SHORT, nullptr);
-}
\ No newline at end of file
+// First K influences of a vertex, the extra data holds influences 5 to 8
+template <int K>
+static inline void gatherInfluences(const VertexSkinData& vertex, const VertexSkinExtraData* extra, float weights[K], int joints[K]) {
+    const float w[4] = {vertex.weight0, vertex.weight1, vertex.weight2, vertex.weight3};
+    const float j[4] = {vertex.joints.x(), vertex.joints.y(), vertex.joints.z(), vertex.joints.w()};
+    for (int k = 0; k < K && k < 4; k++) {
+        weights[k] = w[k];
+        joints[k] = int(j[k]);
+    }
+    if constexpr (K > 4) {
+        const float we[4] = {extra->weights.x(), extra->weights.y(), extra->weights.z(), extra->weights.w()};
+        const float je[4] = {extra->joints.x(), extra->joints.y(), extra->joints.z(), extra->joints.w()};
+        for (int k = 4; k < K; k++) {
+            weights[k] = we[k - 4];
+            joints[k] = int(je[k - 4]);
+        }
+    }
+}
+
+// Linear blend skinning of count vertices with K influences, palette rows are 3x4 per joint.
+// Same result as SKINNING_LBS with NB_INFLUENCES K
+template <int K>
+static void skinLinearBlend(const VertexSkinData* vertices, const VertexSkinExtraData* extra, int count,
+                            const float* palette, SkinnedVertexData* skinned) {
+    for (int v = 0; v < count; v++) {
+        float weights[K];
+        int joints[K];
+        gatherInfluences<K>(vertices[v], extra ? extra + v : nullptr, weights, joints);
+
+        float m[12] = {};
+        float weightSum = 0.0f;
+        for (int k = 0; k < K; k++) {
+            const float* joint = palette + 12 * joints[k];
+            for (int c = 0; c < 12; c++) {
+                m[c] += weights[k] * joint[c];
+            }
+            weightSum += weights[k];
+        }
+        float norm = 1.0f / std::max(weightSum, 1e-6f);
+
+        const QVector3D& p = vertices[v].position;
+        const QVector3D& n = vertices[v].normal;
+        QVector3D position(m[0] * p.x() + m[1] * p.y() + m[2]  * p.z() + m[3],
+                           m[4] * p.x() + m[5] * p.y() + m[6]  * p.z() + m[7],
+                           m[8] * p.x() + m[9] * p.y() + m[10] * p.z() + m[11]);
+        QVector3D normal(m[0] * n.x() + m[1] * n.y() + m[2]  * n.z(),
+                         m[4] * n.x() + m[5] * n.y() + m[6]  * n.z(),
+                         m[8] * n.x() + m[9] * n.y() + m[10] * n.z());
+        skinned[v] = {position * norm, normal.normalized()};
+    }
+}
+
+// Dual quaternion skinning, palette holds (real, dual) as 8 floats per joint.
+// Same result as SKINNING_DQS with NB_INFLUENCES K
+template <int K>
+static void skinDualQuaternion(const VertexSkinData* vertices, const VertexSkinExtraData* extra, int count,
+                               const float* palette, float skinScale, SkinnedVertexData* skinned) {
+    for (int v = 0; v < count; v++) {
+        float weights[K];
+        int joints[K];
+        gatherInfluences<K>(vertices[v], extra ? extra + v : nullptr, weights, joints);
+
+        const float* pivot = palette + 8 * joints[0];
+        float dq[8] = {};
+        for (int k = 0; k < K; k++) {
+            const float* joint = palette + 8 * joints[k];
+            // Stay in the hemisphere of the first joint, q and -q are the same rotation
+            float side = pivot[0] * joint[0] + pivot[1] * joint[1] + pivot[2] * joint[2] + pivot[3] * joint[3] < 0.0f ? -weights[k] : weights[k];
+            for (int c = 0; c < 8; c++) {
+                dq[c] += side * joint[c];
+            }
+        }
+        float norm = 1.0f / std::max(std::sqrt(dq[0] * dq[0] + dq[1] * dq[1] + dq[2] * dq[2] + dq[3] * dq[3]), 1e-6f);
+        QVector3D real(dq[0] * norm, dq[1] * norm, dq[2] * norm);
+        float realW = dq[3] * norm;
+        QVector3D dual(dq[4] * norm, dq[5] * norm, dq[6] * norm);
+        float dualW = dq[7] * norm;
+
+        const QVector3D& p = vertices[v].position;
+        const QVector3D& n = vertices[v].normal;
+        QVector3D rotated = p + 2.0f * QVector3D::crossProduct(real, QVector3D::crossProduct(real, p) + realW * p);
+        QVector3D translation = 2.0f * (realW * dual - dualW * real + QVector3D::crossProduct(real, dual));
+        QVector3D normal = n + 2.0f * QVector3D::crossProduct(real, QVector3D::crossProduct(real, n) + realW * n);
+        skinned[v] = {skinScale * (rotated + translation), normal.normalized()};
+    }
+}
+
+template <int K>
+static void skinBucket(GeometryEngine::SkinningMethod method, const VertexSkinData* vertices, const VertexSkinExtraData* extra,
+                       int count, const float* palette, float skinScale, SkinnedVertexData* skinned) {
+    if (method == GeometryEngine::DualQuaternion) {
+        skinDualQuaternion<K>(vertices, extra, count, palette, skinScale, skinned);
+    } else {
+        skinLinearBlend<K>(vertices, extra, count, palette, skinned);
+    }
+}
+
+// Packed once per pose, the kernels read plain floats
+void GeometryEngine::packCpuPalette(const std::vector<QMatrix4x4>& matrices, const std::vector<QVector4D>& dqReal,
+                                    const std::vector<QVector4D>& dqDual, std::vector<float>& palette) const {
+    if (method == DualQuaternion) {
+        palette.resize(8 * maxSkinJoints);
+        for (size_t j = 0; j < dqReal.size(); j++) {
+            const QVector4D& real = dqReal[j];
+            const QVector4D& dual = dqDual[j];
+            float packed[8] = {real.x(), real.y(), real.z(), real.w(), dual.x(), dual.y(), dual.z(), dual.w()};
+            std::copy(packed, packed + 8, &palette[8 * j]);
+        }
+    } else {
+        palette.resize(12 * maxSkinJoints);
+        for (size_t j = 0; j < matrices.size(); j++) {
+            for (int r = 0; r < 3; r++) {
+                for (int c = 0; c < 4; c++) {
+                    palette[12 * j + 4 * r + c] = matrices[j](r, c);
+                }
+            }
+        }
+    }
+}
+
+// Writes the vertices of a level at their index in the skin buffers
+void GeometryEngine::skinLevelOnCpu(const meshLod& lod, const float* palette, SkinnedVertexData* output) const {
+    for (int b = lod.firstBucket; b < lod.firstBucket + lod.nbBuckets; b++) {
+        const influenceBucket& bucket = skinBuckets[b];
+        int influences = std::min(bucket.nbInfluences, nbInfluences);
+        // Vertices are independent, each chunk skins its own range
+        JobSystem::shared().parallelFor("skin vertices", bucket.nbVertices, 512, [&](int first, int last) {
+            const VertexSkinData* vertices = &skinVertices[bucket.firstVertex + first];
+            const VertexSkinExtraData* extra = skinExtra.empty() ? nullptr : &skinExtra[bucket.firstVertex + first];
+            SkinnedVertexData* skinned = output + bucket.firstVertex + first;
+            int count = last - first;
+            switch (influences) {
+            case 1: skinBucket<1>(method, vertices, extra, count, palette, scale / meshScale, skinned); break;
+            case 2: skinBucket<2>(method, vertices, extra, count, palette, scale / meshScale, skinned); break;
+            case 4: skinBucket<4>(method, vertices, extra, count, palette, scale / meshScale, skinned); break;
+            default: skinBucket<8>(method, vertices, extra, count, palette, scale / meshScale, skinned); break;
+            }
+        });
+    }
+}
+
+void GeometryEngine::skinMeshOnCpu(){
+    QElapsedTimer timer;
+    timer.start();
+
+    packCpuPalette(skinPalette, skinDqReal, skinDqDual, cpuPalette);
+    cpuSkinned.resize(nbVertexSkin);
+    const meshLod& lod = skinLods[currentLod];
+    skinLevelOnCpu(lod, cpuPalette.data(), cpuSkinned.data());
+
+    skinnedBuf.bind();
+    skinnedBuf.write(lod.firstVertex * sizeof(SkinnedVertexData), &cpuSkinned[lod.firstVertex], lod.nbVertices * sizeof(SkinnedVertexData));
+
+    cpuSkinTime += timer.nsecsElapsed() / 1e6;
+    nbCpuSkinPasses++;
+}
+
+void GeometryEngine::skinMeshGeometry(){
+    // The pose did not change, the cached skinned vertices are still valid
+    if (!skinnedMeshDirty) {
+        return;
+    }
+
+    if (mode == SkinOnCpu || !skinningPassSupported) {
+        skinMeshOnCpu();
+        skinnedMeshDirty = false;
+        return;
+    }
+
+    QOpenGLExtraFunctions *f = QOpenGLContext::currentContext()->extraFunctions();
+
+    skinPassTimer.begin();
+
+    // Each bucket of vertices is captured into its own range of skinnedBuf
+    glEnable(GL_RASTERIZER_DISCARD);
+    const meshLod& lod = skinLods[currentLod];
+    for (int b = lod.firstBucket; b < lod.firstBucket + lod.nbBuckets; b++) {
+        const influenceBucket& bucket = skinBuckets[b];
+        QOpenGLShaderProgram* program = bucketSkinPrograms[bucketOf(bucket.nbInfluences)];
+        renderState.bindProgram(program);
+        uploadSkinPalette(program);
+        renderState.bindMesh(skinMesh, program);
+
+        f->glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, skinnedBuf.bufferId(),
+                             bucket.firstVertex * sizeof(SkinnedVertexData), bucket.nbVertices * sizeof(SkinnedVertexData));
+        f->glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, bucket.firstVertex, bucket.nbVertices);
+        f->glEndTransformFeedback();
+    }
+    f->glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glDisable(GL_RASTERIZER_DISCARD);
+
+    renderState.release();
+
+    skinPassTimer.end();
+
+    skinnedMeshDirty = false;
+}
+
+void GeometryEngine::printSkinningStats(){
+    if (mode == SkinOnce) {
+        std::cout << "Skinning pre-pass: " << skinPassTimer.averageTime() << " ms over " << skinPassTimer.nbSamples << " passes, ";
+    } else if (mode == SkinOnCpu) {
+        std::cout << "CPU skinning: " << (nbCpuSkinPasses > 0 ? cpuSkinTime / nbCpuSkinPasses : 0.0) << " ms over "
+                  << nbCpuSkinPasses << " passes, ";
+    } else {
+        std::cout << "Skinning in shader: ";
+    }
+    std::cout << "scene pass " << scenePassTimer.averageTime() << " ms over " << scenePassTimer.nbSamples << " passes\n";
+}
+
+void GeometryEngine::setStateCaching(bool enabled){
+    renderState.setStateCaching(enabled);
+}
+
+void GeometryEngine::resetRenderStats(){
+    renderState.resetStats();
+}
+
+void GeometryEngine::printRenderStats(){
+    renderState.printStats();
+}
+
+void GeometryEngine::updateCharacterBounds(){
+    // Only the shaders know the pose, the box holds every pose of the clip
+    if (gpuPoseEnabled) {
+        rigBounds = poseBounds;
+        characterBounds = poseBounds;
+        characterBounded = poseBounded;
+        return;
+    }
+
+    rigBounds = aabb();
+    for (const auto& vertex : rigVertices) {
+        rigBounds.add(vertex.position);
+    }
+    characterBounds = rigBounds;
+    characterBounded = true;
+    if (!skinReady) {
+        return;
+    }
+
+    posedJointBounds.assign(std::min(jointBounds.size(), skinPalette.size()), aabb());
+    for (size_t joint = 0; joint < posedJointBounds.size(); joint++) {
+        if (!jointBounds[joint].empty()) {
+            posedJointBounds[joint] = transformBox(skinPalette[joint], jointBounds[joint]);
+        }
+    }
+    aabb skin;
+    characterBounded = skinBounds(posedJointBounds, skinDqReal, {}, skin);
+    characterBounds.add(skin);
+}
+
+// Box of the skin from the posed box of each joint. Rigid and linear blend vertices are in the box
+// around them. A dual quaternion blend q = sum w_i q_i of the joints i of a vertex, with q_i in the
+// hemisphere of the pivot q_0, moves it to p with
+//     |p - o| <= max_i |p_i - o| / n^2,  n^2 = |sum w_i r_i|^2 = sum_ij w_i w_j (r_i . r_j)
+// for any point o, p_i the vertex moved by joint i and r_i the rotation part of q_i, the weights
+// summing to 1. The pairs with the pivot have r_0 . r_i >= 0, the others r_i . r_j >= cos(a_i + a_j)
+// with a_i the angle between r_i and r_0. rotations are the r_i, slack how far each can turn from
+// them (poses between two keys). Returns false if n^2 can get near 0, then bounds is not conservative
+bool GeometryEngine::skinBounds(const std::vector<aabb>& boxes, const std::vector<QVector4D>& rotations, const std::vector<float>& slack,
+                                aabb& bounds) const {
+    bounds = aabb();
+    for (const aabb& box : boxes) {
+        if (!box.empty()) {
+            bounds.add(box);
+        }
+    }
+    if (method != DualQuaternion) {
+        return true;
+    }
+
+    bool bounded = true;
+    for (const influenceSet& set : influenceSets) {
+        if (std::any_of(set.joints, set.joints + set.nbJoints, [&](int joint) {
+            return joint >= static_cast<int>(boxes.size()) || joint >= static_cast<int>(rotations.size());
+        })) {
+            bounded = false;
+            continue;
+        }
+
+        const QVector4D& pivot = rotations[set.joints[0]];
+        float pivotSlack = slack.empty() ? 0.0f : slack[set.joints[0]];
+        float angles[maxSkinInfluences];
+        aabb joints;
+        for (int k = 0; k < set.nbJoints; k++) {
+            int joint = set.joints[k];
+            float cosine = std::min(1.0f, std::abs(QVector4D::dotProduct(rotations[joint], pivot)));
+            float jointSlack = slack.empty() ? 0.0f : slack[joint];
+            angles[k] = std::min(float(M_PI / 2), std::acos(cosine) + jointSlack + pivotSlack);
+            if (!boxes[joint].empty()) {
+                joints.add(boxes[joint]);
+            }
+        }
+        float cross = 0.0f;
+        for (int i = 1; i < set.nbJoints; i++) {
+            for (int j = i + 1; j < set.nbJoints; j++) {
+                cross = std::min(cross, std::cos(angles[i] + angles[j]));
+            }
+        }
+        float n2 = set.minSquares + cross * set.maxCross;
+        if (n2 < 1e-2f || joints.empty()) {
+            bounded = false;
+            continue;
+        }
+        float radius = joints.extent().length() / n2;
+        bounds.add(joints.center() - QVector3D(radius, radius, radius));
+        bounds.add(joints.center() + QVector3D(radius, radius, radius));
+    }
+    return bounded;
+}
+
+bool GeometryEngine::characterVisible(const QMatrix4x4& mvp){
+    QElapsedTimer timer;
+    timer.start();
+
+    // O(joints and influence sets): the palette moves the rest boxes, no vertex is skinned
+    updateCharacterBounds();
+    cullStats.tests++;
+    if (!characterBounded) {
+        cullStats.unbounded++;
+        cullStats.time += timer.nsecsElapsed();
+        return true;
+    }
+    bool visible = frustum(mvp).classify(characterBounds) != Outside;
+    if (!visible) {
+        cullStats.culled++;
+    }
+    cullStats.time += timer.nsecsElapsed();
+    return visible;
+}
+
+void GeometryEngine::selectLod(const QMatrix4x4& mvp){
+    int lod = 0;
+    if (forcedLod >= 0) {
+        lod = std::min(forcedLod, nbLods() - 1);
+    } else if (lodPixelError > 0.0f && !characterBounds.empty()) {
+        // Pixels covered by one mesh unit at the depth of the character: clip w is its distance
+        // to the camera and the second row of mvp scales world units into clip y
+        QVector4D center = mvp * QVector4D(characterBounds.center(), 1.0f);
+        if (center.w() > 0.0f) {
+            float unitsPerClip = QVector3D(mvp(1, 0), mvp(1, 1), mvp(1, 2)).length() / center.w();
+            float pixelsPerUnit = unitsPerClip * 0.5f * viewportHeight * (scale / meshScale);
+            lod = ::selectLod(lodErrors, pixelsPerUnit, lodPixelError);
+        }
+    }
+    if (lod != currentLod) {
+        // The skinned vertices of the new level were not posed yet
+        currentLod = lod;
+        skinnedMeshDirty = true;
+    }
+    lodFrames[currentLod]++;
+}
+
+void GeometryEngine::printLodStats() const {
+    if (skinLods.empty()) {
+        return;
+    }
+    std::cout << "Skin LODs drawn:";
+    for (size_t level = 0; level < skinLods.size(); level++) {
+        std::cout << " " << level << " (" << skinLods[level].nbIndices / 3 << " triangles) " << lodFrames[level] << " times"
+                  << (level + 1 == skinLods.size() ? "\n" : ",");
+    }
+}
+
+void GeometryEngine::printCullingStats() const {
+    if (cullStats.tests == 0) {
+        return;
+    }
+    std::cout << "Culling: " << cullStats.culled << " culled and " << cullStats.tests - cullStats.culled << " visible of "
+              << cullStats.tests << " draws, " << cullStats.unbounded << " drawn untested, "
+              << cullStats.time / 1e3 / cullStats.tests << " us per test\n";
+}
+
+void gpuPassTimer::begin(){
+    if (unsupported) {
+        return;
+    }
+    if (!query.isCreated() && !query.create()) {
+        unsupported = true;
+        return;
+    }
+    if (pending) {
+        if (!query.isResultAvailable()) {
+            return;
+        }
+        totalTime += query.waitForResult() / 1e6;
+        nbSamples++;
+        pending = false;
+    }
+    query.begin();
+    running = true;
+}
+
+void gpuPassTimer::end(){
+    if (running) {
+        query.end();
+        running = false;
+        pending = true;
+    }
+}
+
+void gpuPassTimer::reset(){
+    totalTime = 0;
+    nbSamples = 0;
+}
+
+double gpuPassTimer::averageTime() const{
+    return nbSamples > 0 ? totalTime / nbSamples : 0.0;
+}
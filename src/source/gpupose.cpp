@@ -0,0 +1,170 @@
+#include "../header/gpupose.h"
+#include "../header/posecache.h"
+#include "../header/timing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+poseTexture compilePoseTexture(const std::vector<BVHTree*>& roots, int maxJoints) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<BVHTree*> nodes = preorder(roots);
+
+    poseTexture keys;
+    keys.nbJoints = std::min(static_cast<int>(nodes.size()), maxJoints);
+    float end;
+    clipRange(nodes, keys.startTime, end);
+    for (const BVHTree* node : nodes) {
+        if (node->channelsValues.size() > 1) {
+            keys.frameTime = (end - keys.startTime) / (node->channelsValues.size() - 1);
+            break;
+        }
+    }
+    if (keys.frameTime <= 0.0f) {
+        keys.frameTime = 1.0f / 60.0f;
+    }
+    keys.nbFrames = static_cast<int>(std::ceil((end - keys.startTime) / keys.frameTime - 1e-3f)) + 1;
+
+    keys.parents.assign(keys.nbJoints, -1);
+    for (const BVHTree* node : nodes) {
+        if (node->nodeIndex < keys.nbJoints && node->parent) {
+            keys.parents[node->nodeIndex] = node->parent->nodeIndex;
+        }
+    }
+
+    keys.texels.assign(static_cast<size_t>(keys.nbFrames) * keys.width() * 4, 0.0f);
+    std::vector<int> cursors(nodes.size(), 0);
+    std::vector<QQuaternion> previous(keys.nbJoints);
+    for (int f = 0; f < keys.nbFrames; f++) {
+        float* row = &keys.texels[static_cast<size_t>(f) * keys.width() * 4];
+        for (size_t n = 0; n < nodes.size(); n++) {
+            const BVHTree* node = nodes[n];
+            int joint = node->nodeIndex;
+            if (joint >= keys.nbJoints) {
+                continue;
+            }
+
+            // End sites have no channels: no rotation of their own, their offset only
+            float values[6] = {0, 0, 0, 0, 0, 0};
+            bool hasPosition = false;
+            if (!node->channels.empty()) {
+                float sampled[6];
+                sampleChannels(node, keys.startTime + f * keys.frameTime, sampled, cursors[n]);
+                hasPosition = valuesBySlot(node, sampled, values);
+            }
+            QVector3D offset = hasPosition ? QVector3D(values[0], values[1], values[2]) : node->offset;
+            QQuaternion rotation = eulerToQuaternion(values[3], values[4], values[5]);
+
+            // The shaders blend two keys without checking their sign
+            if (f > 0 && QQuaternion::dotProduct(rotation, previous[joint]) < 0.0f) {
+                rotation = -rotation;
+            }
+            previous[joint] = rotation;
+
+            float* texel = &row[8 * joint];
+            texel[0] = rotation.x();
+            texel[1] = rotation.y();
+            texel[2] = rotation.z();
+            texel[3] = rotation.scalar();
+            texel[4] = offset.x();
+            texel[5] = offset.y();
+            texel[6] = offset.z();
+        }
+    }
+    keys.buildTime = elapsedMs(start);
+    return keys;
+}
+
+void samplePoseTexture(const poseTexture& keys, float time, int joint, QQuaternion& rotation, QVector3D& position) {
+    float t = std::clamp((time - keys.startTime) / keys.frameTime, 0.0f, static_cast<float>(keys.nbFrames - 1));
+    int frame = std::min(static_cast<int>(t), std::max(0, keys.nbFrames - 2));
+    int next = std::min(frame + 1, keys.nbFrames - 1);
+    float blend = t - frame;
+    const float* rows[2] = {&keys.texels[static_cast<size_t>(frame) * keys.width() * 4],
+                            &keys.texels[static_cast<size_t>(next) * keys.width() * 4]};
+
+    rotation = QQuaternion();
+    position = QVector3D(0.0f, 0.0f, 0.0f);
+    for (; joint >= 0; joint = keys.parents[joint]) {
+        const float* a = &rows[0][8 * joint];
+        const float* b = &rows[1][8 * joint];
+        QQuaternion local = (QQuaternion(a[3], a[0], a[1], a[2]) * (1.0f - blend) + QQuaternion(b[3], b[0], b[1], b[2]) * blend).normalized();
+        QVector3D offset = QVector3D(a[4], a[5], a[6]) * (1.0f - blend) + QVector3D(b[4], b[5], b[6]) * blend;
+        position = offset + local.rotatedVector(position);
+        rotation = local * rotation;
+    }
+}
+
+void benchmarkGpuPose(ClipLibrary& library, int maxJoints) {
+    const int nbPoses = 2000;
+    for (const auto& clip : library.clips()) {
+        std::shared_ptr<decodedClip> decoded;
+        try {
+            decoded = library.acquire(clip.name);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            continue;
+        }
+        std::vector<BVHTree*> nodes = preorder(decoded->roots);
+        poseTexture keys = compilePoseTexture(decoded->roots, maxJoints);
+
+        // Each influence of a vertex walks its joint up to the root, four texels per level
+        int depthSum = 0;
+        for (int j = 0; j < keys.nbJoints; j++) {
+            for (int joint = j; joint >= 0; joint = keys.parents[joint]) {
+                depthSum++;
+            }
+        }
+        double meanDepth = keys.nbJoints ? double(depthSum) / keys.nbJoints : 0.0;
+
+        // The CPU work a GPU instance saves: the hierarchy and the palette of its pose
+        std::vector<int> cursors(nodes.size(), 0);
+        std::vector<QQuaternion> rotations(nodes.size());
+        std::vector<QVector3D> positions(nodes.size());
+        float duration = std::max((keys.nbFrames - 1) * keys.frameTime, 1e-3f);
+        auto evaluateStart = std::chrono::steady_clock::now();
+        for (int i = 0; i < nbPoses; i++) {
+            evaluatePose(nodes, keys.startTime + std::fmod(i * 0.0123f, duration), cursors, rotations, positions);
+        }
+        double evaluateTime = elapsedMs(evaluateStart) * 1e6 / nbPoses;
+        benchmarkSink = positions.back().x();
+
+        // On the keys the texture is exact up to float precision, between them the local rotations are
+        // blended as quaternions where the hierarchy blends Euler angles
+        double maxPosition[2] = {0, 0};
+        double maxRotation[2] = {0, 0};
+        double halfwaySum = 0;
+        long long nbHalfway = 0;
+        QQuaternion rotation;
+        QVector3D position;
+        for (int f = 0; f < keys.nbFrames; f++) {
+            for (int half = 0; half < 2; half++) {
+                if (half && f + 1 == keys.nbFrames) {
+                    continue;
+                }
+                float time = keys.startTime + (f + 0.5f * half) * keys.frameTime;
+                evaluatePose(nodes, time, cursors, rotations, positions);
+                for (int j = 0; j < keys.nbJoints; j++) {
+                    samplePoseTexture(keys, time, j, rotation, position);
+                    QQuaternion difference = rotation.conjugated() * rotations[j].normalized();
+                    double angle = 2.0 * std::atan2(difference.vector().length(), std::abs(difference.scalar())) * 180.0 / M_PI;
+                    maxPosition[half] = std::max(maxPosition[half], static_cast<double>((position - positions[j]).length()));
+                    maxRotation[half] = std::max(maxRotation[half], angle);
+                    if (half) {
+                        halfwaySum += angle;
+                        nbHalfway++;
+                    }
+                }
+            }
+        }
+
+        std::cout << "GPU pose " << clip.name << ": " << keys.width() << "x" << keys.nbFrames << " RGBA32F texture, "
+                  << keys.bytes() / 1024.0 << " KiB, compiled in " << keys.buildTime << " ms, " << meanDepth
+                  << " joints per chain (" << 4.0 * meanDepth << " texel reads per influence)\n"
+                  << "  error on keys " << maxPosition[0] << " units " << maxRotation[0] << " degrees, halfway mean "
+                  << (nbHalfway ? halfwaySum / nbHalfway : 0.0) << " max " << maxRotation[1] << " degrees " << maxPosition[1]
+                  << " units; CPU cost per instance "
+                  << evaluateTime << " ns of hierarchy on the CPU path, one time uniform on the GPU path\n";
+    }
+}
@@ -0,0 +1,539 @@
+#include "../header/ik.h"
+#include "../header/clipexport.h"
+#include "../header/memorystats.h"
+#include "../header/xsensdata.h"
+#include "../header/timing.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+// Angle between two directions in radians, clamped so rounding never leaves acos' domain
+static float angleBetween(const QVector3D& a, const QVector3D& b) {
+    return std::acos(std::clamp(QVector3D::dotProduct(a.normalized(), b.normalized()), -1.0f, 1.0f));
+}
+
+static QQuaternion axisAngle(const QVector3D& axis, float radians) {
+    return QQuaternion::fromAxisAndAngle(axis, radians * float(180.0 / M_PI));
+}
+
+ikSkeleton compileIkSkeleton(const std::vector<BVHTree*>& roots) {
+    std::vector<BVHTree*> nodes = preorder(roots);
+    ikSkeleton skeleton;
+    skeleton.rotationChannels.assign(nodes.size() * 3, -1);
+    for (size_t n = 0; n < nodes.size(); n++) {
+        BVHTree* node = nodes[n];
+        skeleton.names.push_back(normalizedName(node->name));
+        skeleton.offset.push_back(node->offset);
+        int parent = -1;
+        for (size_t p = 0; p < n; p++) {
+            if (nodes[p] == node->parent) {
+                parent = p;
+            }
+        }
+        skeleton.parent.push_back(parent);
+
+        for (const auto& channel : node->channels) {
+            int slot = channelSlot(channel);
+            if (slot >= 3) {
+                skeleton.rotationChannels[n * 3 + slot - 3] = skeleton.nbChannels;
+            } else if (slot >= 0 && n == 0) {
+                skeleton.positionChannels[slot] = skeleton.nbChannels;
+            }
+            skeleton.nbChannels++;
+        }
+    }
+    return skeleton;
+}
+
+int findIkJoint(const ikSkeleton& skeleton, const std::string& name) {
+    auto it = std::find(skeleton.names.begin(), skeleton.names.end(), normalizedName(name));
+    return it == skeleton.names.end() ? -1 : static_cast<int>(it - skeleton.names.begin());
+}
+
+ikChain makeIkChain(const ikSkeleton& skeleton, ikMethod method, const std::vector<std::string>& names) {
+    ikChain chain;
+    chain.method = method;
+    for (const auto& name : names) {
+        int joint = findIkJoint(skeleton, name);
+        if (joint < 0) {
+            throw std::invalid_argument("Unknown IK joint " + name);
+        }
+        if (!chain.joints.empty() && skeleton.parent[joint] != chain.joints.back()) {
+            throw std::invalid_argument("IK joint " + name + " is not a child of the previous one");
+        }
+        chain.joints.push_back(joint);
+    }
+    if (chain.joints.size() < 2 || (method == TwoBone && chain.joints.size() != 3)) {
+        throw std::invalid_argument("Two bone IK needs 3 joints, the other solvers at least 2");
+    }
+    return chain;
+}
+
+void ikPoseBatch::resize(int characters, int joints) {
+    nbCharacters = characters;
+    nbJoints = joints;
+    local.assign(static_cast<size_t>(characters) * joints, QQuaternion());
+    rootPosition.assign(characters, QVector3D());
+}
+
+void poseFromFrame(const ikSkeleton& skeleton, const float* frame, ikPoseBatch& poses, int character) {
+    QQuaternion* local = &poses.local[static_cast<size_t>(character) * poses.nbJoints];
+    for (int j = 0; j < poses.nbJoints; j++) {
+        const int* c = &skeleton.rotationChannels[j * 3];
+        local[j] = eulerToQuaternion(c[0] >= 0 ? frame[c[0]] : 0.0f, c[1] >= 0 ? frame[c[1]] : 0.0f, c[2] >= 0 ? frame[c[2]] : 0.0f);
+    }
+    QVector3D root = skeleton.offset.empty() ? QVector3D() : skeleton.offset[0];
+    for (int a = 0; a < 3; a++) {
+        if (skeleton.positionChannels[a] >= 0) {
+            root[a] = frame[skeleton.positionChannels[a]];
+        }
+    }
+    poses.rootPosition[character] = root;
+}
+
+void poseToFrame(const ikSkeleton& skeleton, const ikPoseBatch& poses, int character, float* frame) {
+    const QQuaternion* local = &poses.local[static_cast<size_t>(character) * poses.nbJoints];
+    for (int j = 0; j < poses.nbJoints; j++) {
+        const int* c = &skeleton.rotationChannels[j * 3];
+        if (c[0] < 0 && c[1] < 0 && c[2] < 0) {
+            continue;
+        }
+        // quaternionToEuler gives (z, y, x)
+        QVector3D euler = quaternionToEuler(local[j]) * (180.0f / M_PI);
+        if (c[0] >= 0) frame[c[0]] = euler.z();
+        if (c[1] >= 0) frame[c[1]] = euler.y();
+        if (c[2] >= 0) frame[c[2]] = euler.x();
+    }
+    for (int a = 0; a < 3; a++) {
+        if (skeleton.positionChannels[a] >= 0) {
+            frame[skeleton.positionChannels[a]] = poses.rootPosition[character][a];
+        }
+    }
+}
+
+IkSolver::IkSolver(const ikSkeleton& skeleton, const std::vector<ikChain>& chains)
+    : skeleton(skeleton), chains(chains)
+{
+    size_t longest = 0;
+    for (const auto& chain : chains) {
+        longest = std::max(longest, chain.joints.size());
+    }
+    globalRotation.resize(skeleton.parent.size());
+    globalPosition.resize(skeleton.parent.size());
+    chainRotation.resize(longest);
+    chainPosition.resize(longest);
+    chainOffset.resize(longest);
+    chainLength.resize(longest);
+}
+
+void IkSolver::forwardKinematics(const ikPoseBatch& poses, int character) {
+    const QQuaternion* local = &poses.local[static_cast<size_t>(character) * poses.nbJoints];
+    for (int j = 0; j < poses.nbJoints; j++) {
+        int parent = skeleton.parent[j];
+        if (parent < 0) {
+            globalRotation[j] = local[j];
+            globalPosition[j] = j == 0 ? poses.rootPosition[character] : skeleton.offset[j];
+        } else {
+            globalRotation[j] = globalRotation[parent] * local[j];
+            globalPosition[j] = globalPosition[parent] + globalRotation[parent].rotatedVector(skeleton.offset[j]);
+        }
+    }
+}
+
+void IkSolver::gatherChain(const ikChain& chain) {
+    int n = chain.joints.size();
+    for (int k = 0; k < n; k++) {
+        int joint = chain.joints[k];
+        chainRotation[k] = globalRotation[joint];
+        chainPosition[k] = globalPosition[joint];
+        chainOffset[k] = skeleton.offset[joint];
+        if (k > 0) {
+            chainLength[k - 1] = chainOffset[k].length();
+        }
+    }
+    effectorRotation = globalRotation[chain.joints.back()];
+}
+
+void IkSolver::scatterChain(const ikChain& chain, QQuaternion* local) {
+    int n = chain.joints.size();
+    int parent = skeleton.parent[chain.joints[0]];
+    QQuaternion parentRotation = parent >= 0 ? globalRotation[parent] : QQuaternion();
+    for (int k = 0; k < n - 1; k++) {
+        local[chain.joints[k]] = parentRotation.conjugated() * chainRotation[k];
+        parentRotation = chainRotation[k];
+    }
+    if (chain.keepEffectorOrientation) {
+        local[chain.joints[n - 1]] = parentRotation.conjugated() * effectorRotation;
+    }
+}
+
+int IkSolver::solveTwoBone(const ikChain&, const QVector3D& target) {
+    const QVector3D a = chainPosition[0];
+    const QVector3D b = chainPosition[1];
+    const QVector3D c = chainPosition[2];
+    const float eps = 1e-4f;
+
+    float lab = chainLength[0];
+    float lcb = chainLength[1];
+    float lat = std::clamp((target - a).length(), std::abs(lab - lcb) + eps, lab + lcb - eps);
+
+    // Current and wanted angles of the triangle at the root and at the middle joint
+    float acab0 = angleBetween(c - a, b - a);
+    float babc0 = angleBetween(a - b, c - b);
+    float acat0 = angleBetween(c - a, target - a);
+    float acab1 = std::acos(std::clamp((lcb * lcb - lab * lab - lat * lat) / (-2.0f * lab * lat), -1.0f, 1.0f));
+    float babc1 = std::acos(std::clamp((lat * lat - lab * lab - lcb * lcb) / (-2.0f * lab * lcb), -1.0f, 1.0f));
+
+    // A straight limb has no bend plane, the middle joint then bends around its own X axis like a knee
+    QVector3D bendAxis = QVector3D::crossProduct(c - a, b - a);
+    if (bendAxis.lengthSquared() < 1e-8f * lab * lab * lcb * lcb) {
+        bendAxis = chainRotation[1].rotatedVector(QVector3D(1.0f, 0.0f, 0.0f));
+    }
+    bendAxis.normalize();
+    QVector3D swingAxis = QVector3D::crossProduct(c - a, target - a);
+
+    // Bend the middle joint, open the root in the bend plane, then swing the whole limb onto the target
+    QQuaternion bend = axisAngle(bendAxis, babc1 - babc0);
+    QQuaternion swing = axisAngle(bendAxis, acab1 - acab0);
+    if (swingAxis.lengthSquared() > 1e-12f) {
+        swing = axisAngle(swingAxis.normalized(), acat0) * swing;
+    }
+    chainRotation[0] = swing * chainRotation[0];
+    chainRotation[1] = swing * bend * chainRotation[1];
+    chainPosition[1] = a + chainRotation[0].rotatedVector(chainOffset[1]);
+    chainPosition[2] = chainPosition[1] + chainRotation[1].rotatedVector(chainOffset[2]);
+    return 1;
+}
+
+int IkSolver::solveFabrik(const ikChain& chain, const QVector3D& target) {
+    int n = chain.joints.size();
+    QVector3D root = chainPosition[0];
+    float total = 0.0f;
+    for (int k = 0; k < n - 1; k++) {
+        total += chainLength[k];
+    }
+
+    int iterations = 0;
+    if ((target - root).length() >= total) {
+        // Out of reach, the chain points at the target
+        QVector3D direction = (target - root).normalized();
+        for (int k = 0; k < n - 1; k++) {
+            chainPosition[k + 1] = chainPosition[k] + chainLength[k] * direction;
+        }
+        iterations = 1;
+    } else {
+        while (iterations < chain.maxIterations && (chainPosition[n - 1] - target).length() > chain.tolerance) {
+            // Backward from the target, then forward from the fixed root
+            chainPosition[n - 1] = target;
+            for (int k = n - 2; k >= 0; k--) {
+                chainPosition[k] = chainPosition[k + 1] + chainLength[k] * (chainPosition[k] - chainPosition[k + 1]).normalized();
+            }
+            chainPosition[0] = root;
+            for (int k = 0; k < n - 1; k++) {
+                chainPosition[k + 1] = chainPosition[k] + chainLength[k] * (chainPosition[k + 1] - chainPosition[k]).normalized();
+            }
+            iterations++;
+        }
+    }
+
+    // Rotations turning each bone onto its new direction, the children follow their parent
+    for (int k = 0; k < n - 1; k++) {
+        QVector3D current = chainRotation[k].rotatedVector(chainOffset[k + 1]);
+        QVector3D wanted = chainPosition[k + 1] - chainPosition[k];
+        if (current.lengthSquared() < 1e-12f || wanted.lengthSquared() < 1e-12f) {
+            continue;
+        }
+        QQuaternion delta = QQuaternion::rotationTo(current, wanted);
+        for (int j = k; j < n; j++) {
+            chainRotation[j] = delta * chainRotation[j];
+        }
+    }
+    for (int k = 0; k < n - 1; k++) {
+        chainPosition[k + 1] = chainPosition[k] + chainRotation[k].rotatedVector(chainOffset[k + 1]);
+    }
+    return iterations;
+}
+
+int IkSolver::solveCcd(const ikChain& chain, const QVector3D& target) {
+    int n = chain.joints.size();
+    int iterations = 0;
+    while (iterations < chain.maxIterations && (chainPosition[n - 1] - target).length() > chain.tolerance) {
+        // From the joint nearest the effector to the root, each turns the effector towards the target
+        for (int k = n - 2; k >= 0; k--) {
+            QVector3D toEffector = chainPosition[n - 1] - chainPosition[k];
+            QVector3D toTarget = target - chainPosition[k];
+            if (toEffector.lengthSquared() < 1e-12f || toTarget.lengthSquared() < 1e-12f) {
+                continue;
+            }
+            QQuaternion delta = QQuaternion::rotationTo(toEffector, toTarget);
+            for (int j = k; j < n; j++) {
+                chainRotation[j] = delta * chainRotation[j];
+            }
+            for (int j = k; j < n - 1; j++) {
+                chainPosition[j + 1] = chainPosition[j] + chainRotation[j].rotatedVector(chainOffset[j + 1]);
+            }
+        }
+        iterations++;
+    }
+    return iterations;
+}
+
+void IkSolver::solve(ikPoseBatch& poses, const ikTarget* targets, ikStats* stats) {
+    int nbChainsPerCharacter = chains.size();
+    for (int character = 0; character < poses.nbCharacters; character++) {
+        QQuaternion* local = &poses.local[static_cast<size_t>(character) * poses.nbJoints];
+        bool posed = false;
+        for (int k = 0; k < nbChainsPerCharacter; k++) {
+            const ikTarget& target = targets[character * nbChainsPerCharacter + k];
+            if (target.weight <= 0.0f) {
+                continue;
+            }
+            // Chains solved before may have moved this one
+            if (!posed) {
+                forwardKinematics(poses, character);
+                posed = true;
+            }
+
+            const ikChain& chain = chains[k];
+            gatherChain(chain);
+            int n = chain.joints.size();
+            QVector3D goal = chainPosition[n - 1] + std::min(target.weight, 1.0f) * (target.position - chainPosition[n - 1]);
+
+            int iterations = 0;
+            switch (chain.method) {
+            case TwoBone:
+                iterations = solveTwoBone(chain, goal);
+                break;
+            case Fabrik:
+                iterations = solveFabrik(chain, goal);
+                break;
+            case Ccd:
+                iterations = solveCcd(chain, goal);
+                break;
+            }
+            scatterChain(chain, local);
+            posed = false;
+
+            float error = (chainPosition[n - 1] - goal).length();
+            ikStats& chainStats = stats[k];
+            chainStats.solves++;
+            float reach = 0.0f;
+            for (int j = 0; j < n - 1; j++) {
+                reach += chainLength[j];
+            }
+            chainStats.unreachable += (goal - chainPosition[0]).length() > reach + chain.tolerance;
+            chainStats.iterations += iterations;
+            chainStats.errorSum += error;
+            chainStats.maxError = std::max(chainStats.maxError, static_cast<double>(error));
+            if (error <= chain.tolerance) {
+                chainStats.converged++;
+            }
+        }
+    }
+}
+
+QVector3D IkSolver::effectorPosition(const ikPoseBatch& poses, int character, int chain) {
+    forwardKinematics(poses, character);
+    return globalPosition[chains[chain].joints.back()];
+}
+
+namespace {
+
+struct footContacts {
+    std::vector<char> contact; // Per frame
+    int nbContacts = 0;
+};
+
+// A foot is planted while it stays near the lowest height it reaches and barely moves horizontally
+footContacts detectContacts(const std::vector<QVector3D>& foot, float frameTime) {
+    footContacts contacts;
+    contacts.contact.assign(foot.size(), 0);
+    float lowest = foot.empty() ? 0.0f : foot[0].y();
+    for (const auto& p : foot) {
+        lowest = std::min(lowest, p.y());
+    }
+    const float heightThreshold = 4.0f;
+    const float speedThreshold = 25.0f; // Units per second
+    for (size_t f = 1; f < foot.size(); f++) {
+        QVector3D step = foot[f] - foot[f - 1];
+        float speed = std::sqrt(step.x() * step.x() + step.z() * step.z()) / frameTime;
+        contacts.contact[f] = foot[f].y() < lowest + heightThreshold && speed < speedThreshold;
+        contacts.nbContacts += contacts.contact[f] && !contacts.contact[f - 1];
+    }
+    return contacts;
+}
+
+// Mean horizontal distance a foot moves between two frames of the same contact
+double footSlide(const std::vector<QVector3D>& foot, const footContacts& contacts) {
+    double slide = 0;
+    int nbSteps = 0;
+    for (size_t f = 1; f < foot.size(); f++) {
+        if (contacts.contact[f] && contacts.contact[f - 1]) {
+            QVector3D step = foot[f] - foot[f - 1];
+            slide += std::sqrt(step.x() * step.x() + step.z() * step.z());
+            nbSteps++;
+        }
+    }
+    return nbSteps ? slide / nbSteps : 0.0;
+}
+
+void printStats(const std::string& name, const ikStats& stats, double time, const allocationCounters& allocations) {
+    std::cout << "  " << name << ": " << stats.solves << " solves in " << time << " ms ("
+              << (time > 0 ? stats.solves / time * 1e-3 : 0.0) << " M solves/s), "
+              << stats.unreachable << " out of reach, "
+              << (stats.solves > stats.unreachable ? 100.0 * stats.converged / (stats.solves - stats.unreachable) : 0.0)
+              << "% of the others converged, "
+              << (stats.solves ? double(stats.iterations) / stats.solves : 0.0) << " iterations, error mean "
+              << (stats.solves ? stats.errorSum / stats.solves : 0.0) << " max " << stats.maxError;
+    if (allocationTrackingEnabled()) {
+        std::cout << ", " << allocations.allocations << " allocations";
+    }
+    std::cout << "\n";
+}
+
+} // namespace
+
+void benchmarkIk(ClipLibrary& library, const std::string& clipName) {
+    std::shared_ptr<decodedClip> clip = library.acquire(clipName);
+    ikSkeleton skeleton = compileIkSkeleton(clip->roots);
+    resampleOptions resample;
+    resample.frameTime = library.clips()[library.find(clipName)].header.frameTime;
+    clipFrames frames = resampleClip(clip->roots, resample);
+    int nbJoints = skeleton.parent.size();
+    if (frames.nbFrames < 2) {
+        throw std::runtime_error("IK benchmark needs an animated clip");
+    }
+
+    std::vector<ikChain> limbs = {
+        makeIkChain(skeleton, TwoBone, {"l_thigh", "l_knee", "l_foot"}),
+        makeIkChain(skeleton, TwoBone, {"r_thigh", "r_knee", "r_foot"}),
+        makeIkChain(skeleton, TwoBone, {"l_shoulder", "l_elbow", "l_hand"}),
+        makeIkChain(skeleton, TwoBone, {"r_shoulder", "r_elbow", "r_hand"}),
+    };
+    std::vector<std::string> spine = {"spine1", "spine2", "spine3", "spine4", "neck1"};
+    struct solverCase {
+        std::string name;
+        std::vector<ikChain> chains;
+    };
+    std::vector<solverCase> cases = {
+        {"two bone limbs", limbs},
+        {"FABRIK spine", {makeIkChain(skeleton, Fabrik, spine)}},
+        {"CCD spine", {makeIkChain(skeleton, Ccd, spine)}},
+    };
+
+    // Characters on different frames of the clip, each effector pulled up to reach units away
+    const int nbCharacters = 256;
+    const int nbRounds = 40;
+    const float reach = 20.0f;
+    ikPoseBatch pristine;
+    pristine.resize(nbCharacters, nbJoints);
+    for (int c = 0; c < nbCharacters; c++) {
+        poseFromFrame(skeleton, &frames.values[static_cast<size_t>(c * 7 % frames.nbFrames) * frames.nbChannels], pristine, c);
+    }
+
+    std::cout << "IK on " << clipName << ", " << nbJoints << " joints, batches of " << nbCharacters << " characters\n";
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+    for (const auto& solverCase : cases) {
+        IkSolver solver(skeleton, solverCase.chains);
+        int nbChains = solver.nbChains();
+        std::vector<ikTarget> targets(static_cast<size_t>(nbCharacters) * nbChains);
+        for (int c = 0; c < nbCharacters; c++) {
+            for (int k = 0; k < nbChains; k++) {
+                QVector3D direction;
+                do {
+                    direction = QVector3D(offset(random), offset(random), offset(random));
+                } while (direction.lengthSquared() > 1.0f);
+                targets[c * nbChains + k].position = solver.effectorPosition(pristine, c, k) + reach * direction;
+                targets[c * nbChains + k].weight = 1.0f;
+            }
+        }
+
+        ikPoseBatch poses = pristine;
+        std::vector<ikStats> stats(nbChains);
+        double time = 0;
+        allocationCounters allocations;
+        for (int round = 0; round < nbRounds; round++) {
+            poses.local = pristine.local;
+            poses.rootPosition = pristine.rootPosition;
+            allocationCounters before = allocationSnapshot();
+            auto start = std::chrono::steady_clock::now();
+            solver.solve(poses, targets.data(), stats.data());
+            time += elapsedMs(start);
+            allocationCounters after = allocationSnapshot();
+            allocations.allocations += after.allocations - before.allocations;
+        }
+
+        ikStats total;
+        for (const auto& chainStats : stats) {
+            total.solves += chainStats.solves;
+            total.unreachable += chainStats.unreachable;
+            total.converged += chainStats.converged;
+            total.iterations += chainStats.iterations;
+            total.errorSum += chainStats.errorSum;
+            total.maxError = std::max(total.maxError, chainStats.maxError);
+        }
+        printStats(solverCase.name, total, time, allocations);
+    }
+
+    // Foot planting over the whole clip, every frame one character of the batch
+    std::vector<ikChain> legs = {limbs[0], limbs[1]};
+    for (auto& leg : legs) {
+        leg.keepEffectorOrientation = true;
+    }
+    IkSolver planter(skeleton, legs);
+    ikPoseBatch clipPoses;
+    clipPoses.resize(frames.nbFrames, nbJoints);
+    for (int f = 0; f < frames.nbFrames; f++) {
+        poseFromFrame(skeleton, &frames.values[static_cast<size_t>(f) * frames.nbChannels], clipPoses, f);
+    }
+    std::vector<ikTarget> targets(static_cast<size_t>(frames.nbFrames) * 2);
+    std::vector<footContacts> contacts;
+    std::vector<std::vector<QVector3D>> feet(2);
+    for (int k = 0; k < 2; k++) {
+        for (int f = 0; f < frames.nbFrames; f++) {
+            feet[k].push_back(planter.effectorPosition(clipPoses, f, k));
+        }
+        contacts.push_back(detectContacts(feet[k], frames.frameTime));
+        // Pinned where the contact starts
+        QVector3D pin;
+        for (int f = 0; f < frames.nbFrames; f++) {
+            if (contacts[k].contact[f]) {
+                if (f == 0 || !contacts[k].contact[f - 1]) {
+                    pin = feet[k][f];
+                }
+                targets[f * 2 + k].position = pin;
+                targets[f * 2 + k].weight = 1.0f;
+            }
+        }
+    }
+
+    std::vector<ikStats> stats(2);
+    auto start = std::chrono::steady_clock::now();
+    planter.solve(clipPoses, targets.data(), stats.data());
+    double time = elapsedMs(start);
+
+    // Back through the channels, like an exported clip
+    clipFrames planted = frames;
+    ikPoseBatch plantedPoses;
+    plantedPoses.resize(frames.nbFrames, nbJoints);
+    for (int f = 0; f < frames.nbFrames; f++) {
+        poseToFrame(skeleton, clipPoses, f, &planted.values[static_cast<size_t>(f) * frames.nbChannels]);
+        poseFromFrame(skeleton, &planted.values[static_cast<size_t>(f) * frames.nbChannels], plantedPoses, f);
+    }
+    std::cout << "Foot planting on " << frames.nbFrames << " frames in " << time << " ms\n";
+    for (int k = 0; k < 2; k++) {
+        std::vector<QVector3D> plantedFoot;
+        for (int f = 0; f < frames.nbFrames; f++) {
+            plantedFoot.push_back(planter.effectorPosition(plantedPoses, f, k));
+        }
+        std::cout << "  " << (k ? "right" : "left") << " foot: " << contacts[k].nbContacts << " contacts, "
+                  << stats[k].solves << " planted frames, slide " << footSlide(feet[k], contacts[k]) << " -> "
+                  << footSlide(plantedFoot, contacts[k]) << " units per frame\n";
+    }
+}
@@ -0,0 +1,491 @@
+#include "../header/jobsystem.h"
+#include "../header/cliplibrary.h"
+#include "../header/clipexport.h"
+#include "../header/posecache.h"
+#include "../header/mesh.h"
+#include "../header/timing.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <random>
+
+#include <QQuaternion>
+
+struct jobTask {
+    const char* name;
+    std::function<void()> function;
+    jobAffinity affinity;
+    std::atomic<int> pending{1}; // Unfinished dependencies, plus one while submit() registers them
+    std::atomic<bool> finished{false};
+    std::mutex mutex;            // Successors, and finished while they are added
+    std::vector<std::shared_ptr<jobTask>> successors;
+    std::exception_ptr error;
+};
+
+bool JobHandle::done() const {
+    return !task || task->finished.load();
+}
+
+std::exception_ptr JobHandle::error() const {
+    return task && task->finished.load() ? task->error : nullptr;
+}
+
+static thread_local const JobSystem* workerSystem = nullptr;
+static thread_local int workerIndex = -1;
+
+JobSystem::JobSystem(int nbWorkers)
+    : mainThread(std::this_thread::get_id()), startTime(std::chrono::steady_clock::now())
+{
+    if (nbWorkers < 0) {
+        // One worker at least: loads submitted by the GUI thread must progress between its frames
+        nbWorkers = std::max(2u, std::thread::hardware_concurrency()) - 1;
+    }
+    for (int q = 0; q < nbWorkers + 2; q++) {
+        queues.push_back(std::make_unique<threadQueue>());
+    }
+    for (int w = 1; w <= nbWorkers; w++) {
+        workers.emplace_back(&JobSystem::workerLoop, this, w);
+    }
+}
+
+JobSystem::~JobSystem()
+{
+    while (runMainThreadJobs() > 0 || nbQueued.load() > 0) {
+        if (std::shared_ptr<jobTask> task = findJob(0)) {
+            run(task, 0);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeWorkers.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+JobSystem& JobSystem::shared() {
+    static JobSystem system;
+    return system;
+}
+
+int JobSystem::queueIndex() const {
+    if (workerSystem == this) {
+        return workerIndex;
+    }
+    return onMainThread() ? 0 : static_cast<int>(queues.size()) - 1;
+}
+
+JobHandle JobSystem::submit(const char* name, std::function<void()> job, const std::vector<JobHandle>& dependencies,
+                            jobAffinity affinity) {
+    JobHandle handle;
+    handle.task = std::make_shared<jobTask>();
+    handle.task->name = name;
+    handle.task->function = std::move(job);
+    handle.task->affinity = affinity;
+
+    for (const JobHandle& dependency : dependencies) {
+        if (!dependency.valid()) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(dependency.task->mutex);
+        if (!dependency.task->finished.load()) {
+            handle.task->pending++;
+            dependency.task->successors.push_back(handle.task);
+        }
+    }
+    release(handle.task);
+    return handle;
+}
+
+void JobSystem::release(const std::shared_ptr<jobTask>& task) {
+    if (--task->pending == 0) {
+        schedule(task);
+    }
+}
+
+void JobSystem::schedule(const std::shared_ptr<jobTask>& task) {
+    if (task->affinity == MainThread) {
+        {
+            std::lock_guard<std::mutex> lock(mainMutex);
+            mainJobs.push_back(task);
+        }
+        nbMainJobs++;
+    } else {
+        threadQueue& queue = *queues[queueIndex()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.jobs.push_back(task);
+        }
+        nbQueued++;
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wakeWorkers.notify_one();
+    }
+    notifyWaiters();
+}
+
+void JobSystem::notifyWaiters() {
+    if (nbWaiting.load() > 0) {
+        std::lock_guard<std::mutex> lock(waitMutex);
+        jobDone.notify_all();
+    }
+}
+
+// Own jobs newest first, then the oldest job of another thread
+std::shared_ptr<jobTask> JobSystem::findJob(int index) {
+    if (nbQueued.load() == 0) {
+        return nullptr;
+    }
+    std::shared_ptr<jobTask> task;
+    {
+        threadQueue& own = *queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.jobs.empty()) {
+            task = std::move(own.jobs.back());
+            own.jobs.pop_back();
+        }
+    }
+    for (size_t i = 1; !task && i < queues.size(); i++) {
+        threadQueue& victim = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.jobs.empty()) {
+            task = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            queues[index]->nbSteals++;
+        }
+    }
+    if (task) {
+        nbQueued--;
+    }
+    return task;
+}
+
+std::shared_ptr<jobTask> JobSystem::popMainThreadJob() {
+    if (nbMainJobs.load() == 0) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mainMutex);
+    if (mainJobs.empty()) {
+        return nullptr;
+    }
+    std::shared_ptr<jobTask> task = std::move(mainJobs.front());
+    mainJobs.pop_front();
+    nbMainJobs--;
+    return task;
+}
+
+void JobSystem::run(const std::shared_ptr<jobTask>& task, int index) {
+    auto start = std::chrono::steady_clock::now();
+    try {
+        task->function();
+    } catch (...) {
+        task->error = std::current_exception();
+    }
+    task->function = nullptr;
+    auto end = std::chrono::steady_clock::now();
+
+    threadQueue& queue = *queues[index];
+    queue.nbJobs++;
+    queue.busyTime += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    if (profiling.load()) {
+        jobSample sample = {task->name, index + 1 == static_cast<int>(queues.size()) ? -1 : index,
+                            std::chrono::duration<double, std::milli>(start - startTime).count(),
+                            std::chrono::duration<double, std::milli>(end - start).count()};
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.samples.push_back(sample);
+        }
+        if (profileHook) {
+            profileHook(sample);
+        }
+    }
+
+    std::vector<std::shared_ptr<jobTask>> successors;
+    {
+        std::lock_guard<std::mutex> lock(task->mutex);
+        task->finished = true;
+        successors.swap(task->successors);
+    }
+    for (const auto& successor : successors) {
+        release(successor);
+    }
+    notifyWaiters();
+}
+
+void JobSystem::waitUntil(const std::function<bool()>& finished, bool runMainJobs) {
+    int index = queueIndex();
+    runMainJobs = runMainJobs && index == 0;
+    while (!finished()) {
+        std::shared_ptr<jobTask> task = runMainJobs ? popMainThreadJob() : nullptr;
+        if (!task) {
+            task = findJob(index);
+        }
+        if (task) {
+            run(task, index);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(waitMutex);
+        nbWaiting++;
+        jobDone.wait(lock, [&]() { return finished() || nbQueued.load() > 0 || (runMainJobs && nbMainJobs.load() > 0); });
+        nbWaiting--;
+    }
+}
+
+void JobSystem::wait(const JobHandle& job) {
+    if (job.valid()) {
+        waitUntil([&]() { return job.task->finished.load(); }, job.task->affinity == MainThread);
+    }
+}
+
+void JobSystem::wait(const std::vector<JobHandle>& jobs) {
+    for (const JobHandle& job : jobs) {
+        wait(job);
+    }
+}
+
+void JobSystem::parallelFor(const char* name, int count, int grain, const std::function<void(int, int)>& body) {
+    if (count <= 0) {
+        return;
+    }
+    // A few chunks per thread so the threads that finish first steal the rest
+    int nbChunks = std::min((count + std::max(grain, 1) - 1) / std::max(grain, 1), 4 * nbThreads());
+    int chunk = (count + nbChunks - 1) / nbChunks;
+    if (nbChunks <= 1 || workers.empty()) {
+        body(0, count);
+        return;
+    }
+
+    std::vector<JobHandle> chunks;
+    for (int first = chunk; first < count; first += chunk) {
+        int last = std::min(count, first + chunk);
+        chunks.push_back(submit(name, [&body, first, last]() { body(first, last); }));
+    }
+    std::exception_ptr error;
+    try {
+        body(0, chunk);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    // Chunks never wait for the main thread, so neither does the loop
+    for (const JobHandle& job : chunks) {
+        waitUntil([&]() { return job.task->finished.load(); }, false);
+        if (!error) {
+            error = job.error();
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+int JobSystem::runMainThreadJobs() {
+    int nbRun = 0;
+    while (true) {
+        std::shared_ptr<jobTask> task = popMainThreadJob();
+        // Without workers, nothing else would ever run the jobs queued outside a wait()
+        if (!task && workers.empty()) {
+            task = findJob(0);
+        }
+        if (!task) {
+            return nbRun;
+        }
+        run(task, 0);
+        nbRun++;
+    }
+}
+
+void JobSystem::workerLoop(int index) {
+    workerSystem = this;
+    workerIndex = index;
+    while (true) {
+        if (std::shared_ptr<jobTask> task = findJob(index)) {
+            run(task, index);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeWorkers.wait(lock, [&]() { return stopping || nbQueued.load() > 0; });
+        if (stopping && nbQueued.load() == 0) {
+            return;
+        }
+    }
+}
+
+std::vector<jobSample> JobSystem::takeProfile() {
+    std::vector<jobSample> samples;
+    for (auto& queue : queues) {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        samples.insert(samples.end(), queue->samples.begin(), queue->samples.end());
+        queue->samples.clear();
+    }
+    std::sort(samples.begin(), samples.end(), [](const jobSample& a, const jobSample& b) { return a.start < b.start; });
+    return samples;
+}
+
+void JobSystem::printProfile() {
+    struct nameStats {
+        long long count = 0;
+        double total = 0;
+        double worst = 0;
+    };
+    std::map<std::string, nameStats> byName;
+    for (const jobSample& sample : takeProfile()) {
+        nameStats& stats = byName[sample.name];
+        stats.count++;
+        stats.total += sample.duration;
+        stats.worst = std::max(stats.worst, sample.duration);
+    }
+    for (const auto& entry : byName) {
+        std::cout << "  job " << entry.first << ": " << entry.second.count << " runs, " << entry.second.total << " ms, "
+                  << entry.second.total * 1e3 / entry.second.count << " us mean, " << entry.second.worst * 1e3 << " us worst\n";
+    }
+    for (size_t q = 0; q < queues.size(); q++) {
+        threadQueue& queue = *queues[q];
+        long long nbJobs = queue.nbJobs.exchange(0);
+        long long nbSteals = queue.nbSteals.exchange(0);
+        long long busyTime = queue.busyTime.exchange(0);
+        if (nbJobs == 0) {
+            continue;
+        }
+        std::cout << "  " << (q == 0 ? "main thread" : q + 1 == queues.size() ? "other threads" : "worker " + std::to_string(q))
+                  << ": " << nbJobs << " jobs, " << nbSteals << " stolen, " << busyTime / 1e6 << " ms busy\n";
+    }
+}
+
+void benchmarkJobSystem(ClipLibrary& library, const std::string& meshFile, const std::string& weightsFile) {
+    std::shared_ptr<decodedClip> walk = library.acquire(library.clips().front().name);
+    std::vector<BVHTree*> nodes = preorder(walk->roots);
+    float start = 0.0f;
+    float duration = 1.0f;
+    for (const BVHTree* node : nodes) {
+        if (!node->channelsValues.empty()) {
+            start = node->channelsValues.front()[0];
+            duration = std::max(node->channelsValues.back()[0] - start, 1e-3f);
+            break;
+        }
+    }
+
+    // Four strongest influences of each vertex and a palette of random rigid transforms, 3x4 rows
+    mesh skin = readMesh(meshFile);
+    std::vector<std::vector<weight>> weights = readWeights(weightsFile, skin.nbVertices);
+    std::vector<float> vertexWeights(4 * skin.nbVertices, 0.0f);
+    std::vector<int> vertexJoints(4 * skin.nbVertices, 0);
+    for (int v = 0; v < skin.nbVertices && v < static_cast<int>(weights.size()); v++) {
+        std::vector<weight> influences = weights[v];
+        std::sort(influences.begin(), influences.end(), [](const weight& a, const weight& b) { return a.w > b.w; });
+        for (size_t k = 0; k < influences.size() && k < 4; k++) {
+            vertexWeights[4 * v + k] = influences[k].w;
+            vertexJoints[4 * v + k] = influences[k].i;
+        }
+    }
+    std::mt19937 random(3);
+    std::uniform_real_distribution<float> angle(-30.0f, 30.0f);
+    std::vector<float> palette(12 * 32);
+    for (int j = 0; j < 32; j++) {
+        QQuaternion rotation = QQuaternion::fromEulerAngles(angle(random), angle(random), angle(random));
+        for (int r = 0; r < 3; r++) {
+            QVector3D row = rotation.rotatedVector(QVector3D(r == 0, r == 1, r == 2));
+            palette[12 * j + 4 * r] = row.x();
+            palette[12 * j + 4 * r + 1] = row.y();
+            palette[12 * j + 4 * r + 2] = row.z();
+            palette[12 * j + 4 * r + 3] = 0.01f * j;
+        }
+    }
+    std::vector<QVector3D> skinned(skin.nbVertices);
+
+    const int nbInstances = 4096;
+    const int nbSkinPasses = 64;
+    const int nbEmptyJobs = 100000;
+    int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    double baseline[4] = {0, 0, 0, 0};
+    std::cout << "Job system on 1 to " << maxThreads << " threads: " << library.clips().size() << " clips parsed, "
+              << nbInstances << " crowd poses, " << nbSkinPasses << " CPU skinning passes of " << skin.nbVertices
+              << " vertices, " << nbEmptyJobs << " empty jobs\n";
+    for (int threads : threadCounts) {
+        JobSystem jobs(threads - 1);
+        jobs.setProfiling(threads == maxThreads);
+
+        // One parse per file, the graph joins them into a last job
+        auto parseStart = std::chrono::steady_clock::now();
+        std::vector<JobHandle> parses;
+        std::vector<std::vector<BVHTree*>> parsed(library.clips().size());
+        for (size_t c = 0; c < library.clips().size(); c++) {
+            std::string file = library.clips()[c].file;
+            parses.push_back(jobs.submit("parse clip", [&parsed, c, file]() { parsed[c] = readClip(file); }));
+        }
+        JobHandle joined = jobs.submit("free clips", [&parsed]() {
+            for (auto& roots : parsed) {
+                deleteBVH(roots);
+            }
+        }, parses);
+        jobs.wait(joined);
+        double parseTime = elapsedMs(parseStart);
+
+        // Each instance at its own time, with its own cursors
+        auto poseStart = std::chrono::steady_clock::now();
+        std::vector<float> crowdSinks(nbInstances);
+        jobs.parallelFor("crowd poses", nbInstances, 16, [&](int first, int last) {
+            std::vector<int> cursors(nodes.size(), 0);
+            std::vector<QQuaternion> rotations(nodes.size());
+            std::vector<QVector3D> positions(nodes.size());
+            for (int i = first; i < last; i++) {
+                evaluatePose(nodes, start + std::fmod(i * 0.0173f, duration), cursors, rotations, positions);
+            }
+            // One slot per chunk, the sink is only written once all chunks are done
+            crowdSinks[first] = positions.back().x();
+        });
+        double poseTime = elapsedMs(poseStart);
+        benchmarkSink = crowdSinks.front();
+
+        auto skinStart = std::chrono::steady_clock::now();
+        for (int pass = 0; pass < nbSkinPasses; pass++) {
+            jobs.parallelFor("skin vertices", skin.nbVertices, 512, [&](int first, int last) {
+                for (int v = first; v < last; v++) {
+                    const QVector3D& p = skin.vertexList[v];
+                    float out[3] = {0, 0, 0};
+                    for (int k = 0; k < 4; k++) {
+                        const float* m = &palette[12 * vertexJoints[4 * v + k]];
+                        float w = vertexWeights[4 * v + k];
+                        for (int r = 0; r < 3; r++) {
+                            out[r] += w * (m[4 * r] * p.x() + m[4 * r + 1] * p.y() + m[4 * r + 2] * p.z() + m[4 * r + 3]);
+                        }
+                    }
+                    skinned[v] = QVector3D(out[0], out[1], out[2]);
+                }
+            });
+        }
+        double skinTime = elapsedMs(skinStart);
+        benchmarkSink = skinned.back().x();
+
+        auto emptyStart = std::chrono::steady_clock::now();
+        std::vector<JobHandle> empty;
+        empty.reserve(nbEmptyJobs);
+        for (int j = 0; j < nbEmptyJobs; j++) {
+            empty.push_back(jobs.submit("empty", []() {}));
+        }
+        jobs.wait(empty);
+        double emptyTime = elapsedMs(emptyStart);
+
+        double times[4] = {parseTime, poseTime, skinTime, emptyTime};
+        if (threads == 1) {
+            std::copy(times, times + 4, baseline);
+        }
+        std::cout << threads << (threads > 1 ? " threads" : " thread") << ": parse " << parseTime << " ms (x"
+                  << baseline[0] / parseTime << "), poses " << poseTime << " ms (x" << baseline[1] / poseTime << "), skinning "
+                  << skinTime / nbSkinPasses << " ms per pass (x" << baseline[2] / skinTime << "), "
+                  << emptyTime * 1e3 / nbEmptyJobs << " us per empty job\n";
+        if (threads == maxThreads) {
+            jobs.printProfile();
+        }
+    }
+}
@@ -2,16 +2,35 @@
 // SPDX-License-Identifier: LicenseRef-Qt-Commercial OR BSD-3-Clause
 
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QLabel>
 #include <QSurfaceFormat>
 
+#include "../header/xsensstream.h"
+#include "../header/retarget.h"
+#include "../header/autoweights.h"
+#include "../header/clipexport.h"
+#include "../header/motionmatching.h"
+#include "../header/memorystats.h"
+#include "../header/xsensfilter.h"
+#include "../header/ik.h"
+#include "../header/posecache.h"
+#include "../header/meshlod.h"
+#include "../header/gpupose.h"
+#include "../header/morphtargets.h"
+#include "../header/jobsystem.h"
+#include "../header/picking.h"
+
 #ifndef QT_NO_OPENGL
 #include "../header/mainwidget.h"
+#include "../header/offscreenrenderer.h"
 #endif
 
 int main(int argc, char *argv[])
 {
     QApplication app(argc, argv);
+    // The GUI thread is the main thread of the job system, the one that runs the GL uploads
+    JobSystem::shared();
 
     QSurfaceFormat format;
     format.setDepthBufferSize(24);
@@ -19,8 +38,365 @@ int main(int argc, char *argv[])
 
     app.setApplicationName("SIA");
     app.setApplicationVersion("0.1");
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption replayOption("replay", "Stream an Xsens recording directory to the live port.", "directory");
+    QCommandLineOption liveOption("live", "Drive the rig from Xsens packets received on a local UDP port.", "port", QString::number(xsensStreamPort));
+    QCommandLineOption speedOption("speed", "Replay speed factor.", "factor", "1");
+    parser.addOption(replayOption);
+    parser.addOption(liveOption);
+    parser.addOption(speedOption);
+    QCommandLineOption xsensFilterOption("xsens-filter", "Smooth the live and recorded Xsens orientations with a One Euro filter, beta 0 is a plain low-pass.", "cutoff:beta");
+    QCommandLineOption xsensDriftOption("xsens-drift", "Remove the orientation drift of still Xsens sensors.");
+    QCommandLineOption xsensFilterBenchOption("xsens-filter-bench", "Filter an Xsens recording directory, report the cost per sample and the jitter, then exit.", "directory");
+    QCommandLineOption xsensOption("xsens", "Play an Xsens recording directory instead of a clip, retargeted onto the skin.", "directory");
+    parser.addOption(xsensOption);
+    parser.addOption(xsensFilterOption);
+    parser.addOption(xsensDriftOption);
+    parser.addOption(xsensFilterBenchOption);
+
+    QCommandLineOption renderOption("render", "Render the clip offscreen to PNG frames.", "directory");
+    QCommandLineOption goldenOption("golden", "Render the clip offscreen and compare it to golden PNG frames.", "directory");
+    QCommandLineOption benchOption("bench", "Measure offscreen frames per second at fixed resolutions.");
+    QCommandLineOption framesOption("frames", "Number of offscreen frames.", "count", "60");
+    QCommandLineOption sizeOption("size", "Offscreen frame size.", "WxH", "640x480");
+    QCommandLineOption toleranceOption("tolerance", "Per channel difference allowed against golden frames.", "value", "8");
+    QCommandLineOption mismatchOption("mismatch", "Fraction of pixels allowed over tolerance.", "ratio", "0.005");
+    parser.addOption(renderOption);
+    parser.addOption(goldenOption);
+    parser.addOption(benchOption);
+    parser.addOption(framesOption);
+    parser.addOption(sizeOption);
+    parser.addOption(toleranceOption);
+    parser.addOption(mismatchOption);
+    QCommandLineOption captureOption("capture", "Render the clip offscreen and read the frames back asynchronously into a directory.", "directory");
+    QCommandLineOption recordOption("record", "Record the frames of the window into a directory from the start, C toggles the recording.", "directory");
+    QCommandLineOption captureFormatOption("capture-format", "Frames captured or recorded as png images or a raw yuv420p video.", "format", "png");
+    parser.addOption(captureOption);
+    parser.addOption(recordOption);
+    parser.addOption(captureFormatOption);
+
+    QCommandLineOption skinOnceOption("skin-once", "Skin the mesh once per pose with transform feedback instead of in every draw.");
+    QCommandLineOption skinningOption("skinning", "Skinning method of the mesh shader: lbs or dqs.", "method", "lbs");
+    QCommandLineOption skinCpuOption("skin-cpu", "Skin the mesh once per pose on the CPU, with a kernel per number of influences.");
+    QCommandLineOption influencesOption("influences", "Maximum number of skinning influences per vertex: 1, 2, 4 or 8.", "count", "4");
+    parser.addOption(skinOnceOption);
+    parser.addOption(skinCpuOption);
+    parser.addOption(skinningOption);
+    parser.addOption(influencesOption);
+
+    QCommandLineOption clipOption("clip", "Clip of the models directory to play, without the .bvh extension.", "name", "walk1");
+    QCommandLineOption clipBudgetOption("clip-budget", "Memory budget of the decoded clip cache.", "MiB", "64");
+    parser.addOption(clipOption);
+    parser.addOption(clipBudgetOption);
+
+    QCommandLineOption retargetOption("retarget", "Retarget every clip of the models directory onto the skeleton of a clip, then exit.", "clip");
+    parser.addOption(retargetOption);
+    QCommandLineOption autoWeightsOption("auto-weights", "Compute the skin weights of the mesh automatically, compare them with weights.txt and time them, then exit.");
+    parser.addOption(autoWeightsOption);
+    QCommandLineOption exportOption("export", "Resample every clip of the models directory into a directory, then exit.", "directory");
+    QCommandLineOption exportRateOption("export-rate", "Frame rate of the exported clips.", "fps", "60");
+    QCommandLineOption exportTrimOption("export-trim", "Part of the clips to export, in seconds.", "start:end");
+    QCommandLineOption exportLoopOption("export-loop", "Export a whole number of frames, the frame after the last one being the first.");
+    QCommandLineOption exportBinaryOption("export-binary", "Export binary .clip files instead of BVH.");
+    parser.addOption(exportOption);
+    parser.addOption(exportRateOption);
+    parser.addOption(exportTrimOption);
+    parser.addOption(exportLoopOption);
+    parser.addOption(exportBinaryOption);
+    QCommandLineOption motionMatchingOption("motion-matching", "Build the motion matching database of the models directory and benchmark its searches, then exit.");
+    parser.addOption(motionMatchingOption);
+    QCommandLineOption memoryOption("memory", "Print the memory footprint of the played clip, the mesh and the weights, then exit.");
+    parser.addOption(memoryOption);
+    QCommandLineOption ikOption("ik", "Benchmark the IK solvers on reach targets and plant the feet of a clip, then exit.", "clip");
+    parser.addOption(ikOption);
+    QCommandLineOption bakeOption("bake", "Play clips from global poses baked once per clip: float or quantized.", "precision");
+    QCommandLineOption bakeReportOption("bake-report", "Bake every clip of the models directory, report the memory, the speedup and the error of both precisions, then exit.");
+    parser.addOption(bakeOption);
+    parser.addOption(bakeReportOption);
+    QCommandLineOption lodErrorOption("lod-error", "Draw the coarsest skin level whose simplification error stays under this many pixels.", "pixels");
+    QCommandLineOption lodReportOption("lod-report", "Build the skin level of detail chain, report its triangles, errors, weights and skinning cost, then exit.");
+    parser.addOption(lodErrorOption);
+    parser.addOption(lodReportOption);
+    QCommandLineOption gpuPoseOption("gpu-pose", "Evaluate the poses of the clip in the skinning shaders from a keyframe texture.");
+    QCommandLineOption gpuPoseReportOption("gpu-pose-report", "Compile the keyframe texture of every clip of the models directory, report its size and error, then exit.");
+    parser.addOption(gpuPoseOption);
+    parser.addOption(gpuPoseReportOption);
+    QCommandLineOption morphOption("morph", "Weight of a morph target of the skin, skin.<name>.off next to skin.off. Repeatable.", "name=weight");
+    QCommandLineOption morphReportOption("morph-report", "Build synthetic morph targets on the skin, report their size, error and cost sparse and dense, then exit.");
+    parser.addOption(morphOption);
+    parser.addOption(morphReportOption);
+    QCommandLineOption jobsReportOption("jobs-report", "Parse the clips, evaluate crowd poses and skin the mesh on 1 to every hardware thread, report the speedups and the job profile, then exit.");
+    parser.addOption(jobsReportOption);
+    QCommandLineOption pickReportOption("pick-report", "Subdivide the skin to 400k triangles, report the build, refit and query times of its picking tree, then exit.");
+    parser.addOption(pickReportOption);
+    parser.process(app);
+
+    if (parser.isSet(replayOption)) {
+        replayXsensSession(parser.value(replayOption).toStdString(), parser.value(liveOption).toInt(), parser.value(speedOption).toFloat());
+        return 0;
+    }
+
+    if (parser.isSet(retargetOption)) {
+        ClipLibrary library;
+        library.index("../models");
+        try {
+            benchmarkRetargeting(library, parser.value(retargetOption).toStdString());
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(jobsReportOption)) {
+        ClipLibrary library;
+        library.index("../models");
+        try {
+            benchmarkJobSystem(library, "../models/skin.off", "../models/weights.txt");
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(bakeReportOption)) {
+        ClipLibrary library;
+        library.index("../models");
+        try {
+            benchmarkPoseBaking(library);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(gpuPoseReportOption)) {
+        ClipLibrary library;
+        library.index("../models");
+        try {
+            benchmarkGpuPose(library, maxSkinJoints);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(lodReportOption)) {
+        try {
+            benchmarkLods("../models/skin.off", "../models/weights.txt", lodOptions());
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(morphReportOption)) {
+        try {
+            benchmarkMorphTargets("../models/skin.off", 64);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(pickReportOption)) {
+        try {
+            benchmarkPicking("../models/skin.off", 400000);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(ikOption)) {
+        ClipLibrary library;
+        library.index("../models");
+        try {
+            benchmarkIk(library, parser.value(ikOption).toStdString());
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    xsensFilterOptions xsensFilter;
+    if (parser.isSet(xsensFilterOption)) {
+        QStringList values = parser.value(xsensFilterOption).split(':');
+        xsensFilter.minCutoff = values.value(0).toFloat();
+        if (!values.value(1).isEmpty()) {
+            xsensFilter.beta = values.value(1).toFloat();
+        }
+    }
+    xsensFilter.driftCorrection = parser.isSet(xsensDriftOption);
+
+    if (parser.isSet(xsensFilterBenchOption)) {
+        try {
+            benchmarkXsensFilter(parser.value(xsensFilterBenchOption).toStdString(), xsensFilter);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(memoryOption)) {
+        try {
+            printAssetFootprint("../models", parser.value(clipOption).toStdString());
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(motionMatchingOption)) {
+        ClipLibrary library;
+        library.index("../models");
+        try {
+            benchmarkMotionMatching(library);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(autoWeightsOption)) {
+        ClipLibrary library;
+        library.index("../models");
+        try {
+            // readMesh divides the coordinates by 100, the skeleton gets the same units
+            benchmarkSkinWeights("../models/skin.off", "../models/weights.txt", library.acquire("walk1")->roots, 1.0f / 100.0f);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(exportOption)) {
+        resampleOptions options;
+        options.frameTime = 1.0f / parser.value(exportRateOption).toFloat();
+        if (parser.isSet(exportTrimOption)) {
+            QStringList trim = parser.value(exportTrimOption).split(':');
+            options.start = trim.value(0).toFloat();
+            options.end = trim.value(1).isEmpty() ? -1.0f : trim.value(1).toFloat();
+        }
+        options.loop = parser.isSet(exportLoopOption);
+        try {
+            benchmarkExport("../models", parser.value(exportOption).toStdString(), options,
+                            parser.isSet(exportBinaryOption) ? binaryClip : bvhText);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
 #ifndef QT_NO_OPENGL
+    GeometryEngine::SkinningMethod skinningMethod = parser.value(skinningOption) == "dqs" ? GeometryEngine::DualQuaternion : GeometryEngine::LinearBlend;
+    int nbInfluences = parser.value(influencesOption).toInt();
+    GeometryEngine::SkinningMode skinningMode = parser.isSet(skinCpuOption) ? GeometryEngine::SkinOnCpu
+                                              : parser.isSet(skinOnceOption) ? GeometryEngine::SkinOnce : GeometryEngine::SkinInShader;
+    std::string clipName = parser.value(clipOption).toStdString();
+    size_t clipBudget = size_t(parser.value(clipBudgetOption).toDouble() * (1 << 20));
+
+    std::vector<std::pair<std::string, float>> morphWeights;
+    for (const QString& morph : parser.values(morphOption)) {
+        QStringList parts = morph.split('=');
+        morphWeights.push_back({parts.value(0).toStdString(), parts.size() > 1 ? parts.value(1).toFloat() : 1.0f});
+    }
+
+    bakePrecision bakedPrecision = parser.value(bakeOption) == "quantized" ? BakeQuantized : BakeFloat;
+
+    captureOptions capture;
+    capture.format = parser.value(captureFormatOption) == "yuv" ? CaptureYuv : CapturePng;
+
+    if (parser.isSet(renderOption) || parser.isSet(goldenOption) || parser.isSet(benchOption) || parser.isSet(captureOption)) {
+        QStringList size = parser.value(sizeOption).split('x');
+        OffscreenRenderer renderer(size.value(0).toInt(), size.value(1).toInt());
+        if (!renderer.init()) {
+            return 1;
+        }
+        if (!renderer.setSkinningVariant(skinningMethod, nbInfluences)) {
+            return 1;
+        }
+        if (parser.isSet(bakeOption)) {
+            renderer.setPoseBaking(bakedPrecision);
+        }
+        if (parser.isSet(lodErrorOption)) {
+            renderer.setLodSelection(parser.value(lodErrorOption).toFloat());
+        }
+        if (!renderer.setClip(clipName, clipBudget)) {
+            return 1;
+        }
+        if (skinningMode != GeometryEngine::SkinInShader && !renderer.setSkinningMode(skinningMode)) {
+            std::cerr << (skinningMode == GeometryEngine::SkinOnCpu ? "CPU skinning" : "Skin once mode")
+                      << " unavailable, skinning in the vertex shader\n";
+        }
+        if (parser.isSet(gpuPoseOption) && !renderer.setGpuPose(true)) {
+            return 1;
+        }
+        for (const auto& weight : morphWeights) {
+            renderer.setMorphWeight(weight.first, weight.second);
+        }
+
+        int nbFrames = parser.value(framesOption).toInt();
+        float frameInterval = 1.0f / 30.0f;
+        bool success = true;
+        if (parser.isSet(renderOption)) {
+            success = renderer.renderClip(parser.value(renderOption), nbFrames, frameInterval) && success;
+        }
+        if (parser.isSet(captureOption)) {
+            capture.directory = parser.value(captureOption).toStdString();
+            success = renderer.captureClip(capture, nbFrames, frameInterval) && success;
+        }
+        if (parser.isSet(goldenOption)) {
+            success = renderer.compareWithGolden(parser.value(goldenOption), nbFrames, frameInterval,
+                                                 parser.value(toleranceOption).toInt(), parser.value(mismatchOption).toDouble()) && success;
+        }
+        if (parser.isSet(benchOption)) {
+            renderer.benchmark(nbFrames);
+        }
+        return success ? 0 : 1;
+    }
+
     MainWidget widget;
+    if (parser.isSet(liveOption)) {
+        widget.setLivePort(parser.value(liveOption).toInt());
+    }
+    if (parser.isSet(xsensFilterOption) || parser.isSet(xsensDriftOption)) {
+        widget.setXsensFilter(xsensFilter);
+    }
+    widget.setSkinningMode(skinningMode);
+    widget.setSkinningVariant(skinningMethod, nbInfluences);
+    widget.setClip(clipName, clipBudget);
+    if (parser.isSet(xsensOption)) {
+        widget.setXsensRecording(parser.value(xsensOption).toStdString());
+    }
+    if (parser.isSet(bakeOption)) {
+        widget.setPoseBaking(bakedPrecision);
+    }
+    widget.setGpuPose(parser.isSet(gpuPoseOption));
+    for (const auto& weight : morphWeights) {
+        widget.setMorphWeight(weight.first, weight.second);
+    }
+    if (parser.isSet(recordOption)) {
+        capture.directory = parser.value(recordOption).toStdString();
+        widget.setCapture(capture);
+    }
+    if (parser.isSet(lodErrorOption)) {
+        widget.setLodSelection(parser.value(lodErrorOption).toFloat());
+    }
     widget.show();
 #else
     QLabel note("OpenGL Support required");
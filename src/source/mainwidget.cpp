@@ -3,6 +3,8 @@
 
 #include "../header/mainwidget.h"
 
+#include <QElapsedTimer>
+#include <QKeyEvent>
 #include <QMouseEvent>
 
 #include <cmath>
@@ -12,9 +14,169 @@ MainWidget::~MainWidget()
     // Make sure the context is current when deleting the texture
     // and the buffers.
     makeCurrent();
+    if (geometries) {
+        geometries->printSkinningStats();
+        geometries->printRenderStats();
+        geometries->printCullingStats();
+        geometries->printShaderStats();
+        geometries->printClipStats();
+        geometries->printBakeStats();
+        geometries->printLodStats();
+        geometries->printMorphStats();
+        geometries->printPickStats();
+        geometries->printIkStats();
+    }
+    frameCapture.finish();
+    frameCapture.printStats();
     delete texture;
     delete geometries;
     doneCurrent();
+
+    if (liveStream) {
+        liveStream->stop();
+        liveStream->printStats();
+        delete liveStream;
+    }
+}
+
+void MainWidget::setLivePort(int port)
+{
+    livePort = port;
+}
+
+void MainWidget::setXsensFilter(const xsensFilterOptions& options)
+{
+    xsensFiltered = true;
+    xsensFilter = options;
+}
+
+void MainWidget::setSkinningMode(GeometryEngine::SkinningMode mode)
+{
+    skinningMode = mode;
+}
+
+void MainWidget::setSkinningVariant(GeometryEngine::SkinningMethod method, int nbInfluences)
+{
+    skinningMethod = method;
+    skinningInfluences = nbInfluences;
+}
+
+void MainWidget::setClip(const std::string& name, size_t budget)
+{
+    clipName = name;
+    clipBudget = budget;
+}
+
+void MainWidget::setXsensRecording(const std::string& directory)
+{
+    xsensRecording = directory;
+}
+
+void MainWidget::setPoseBaking(bakePrecision precision)
+{
+    poseBaking = true;
+    bakedPrecision = precision;
+}
+
+void MainWidget::setLodSelection(float maxPixelError)
+{
+    lodPixelError = maxPixelError;
+}
+
+void MainWidget::setGpuPose(bool enabled)
+{
+    gpuPose = enabled;
+}
+
+void MainWidget::setMorphWeight(const std::string& name, float weight)
+{
+    morphWeights[name] = weight;
+}
+
+void MainWidget::setCapture(const captureOptions& options)
+{
+    captureSettings = options;
+    capturing = true;
+}
+
+// D toggles linear blend / dual quaternion skinning, 1, 2, 4 and 8 cap the number of influences,
+// N plays the next clip of the library, M dumps the memory footprint, P refits the picking tree every
+// frame instead of on the first click of a pose, F pins the feet where they stand and releases them
+void MainWidget::keyPressEvent(QKeyEvent *e)
+{
+    if (e->key() == Qt::Key_M) {
+        MemoryReport report;
+        geometries->memoryReport(report);
+        report.print();
+        frameAllocations.print();
+        return;
+    }
+
+    if (e->key() == Qt::Key_C) {
+        makeCurrent();
+        capturing = !frameCapture.active();
+        if (capturing) {
+            capturing = frameCapture.start(width() * devicePixelRatioF(), height() * devicePixelRatioF(), captureSettings);
+        } else {
+            frameCapture.finish();
+            frameCapture.printStats();
+        }
+        doneCurrent();
+        return;
+    }
+
+    if (e->key() == Qt::Key_P) {
+        geometries->setPicking(!geometries->pickingEveryFrame());
+        std::cout << "Picking tree refit " << (geometries->pickingEveryFrame() ? "every frame" : "on click") << "\n";
+        return;
+    }
+
+    if (e->key() == Qt::Key_F) {
+        feetPinned = !feetPinned;
+        if (!feetPinned) {
+            geometries->releaseJoints();
+            std::cout << "Feet released\n";
+            return;
+        }
+        for (const char* foot : {"l_foot", "r_foot"}) {
+            QVector3D position;
+            if (!geometries->jointPosition(foot, position) || !geometries->pinJoint(foot, position)) {
+                std::cerr << "Cannot pin " << foot << " on this rig\n";
+                geometries->releaseJoint(foot);
+            }
+        }
+        std::cout << "Feet pinned\n";
+        return;
+    }
+
+    if (e->key() == Qt::Key_N) {
+        makeCurrent();
+        geometries->playNextClip();
+        doneCurrent();
+        return;
+    }
+
+    GeometryEngine::SkinningMethod method = geometries->skinningMethod();
+    int nbInfluences = geometries->skinningInfluences();
+    if (e->key() == Qt::Key_D) {
+        method = method == GeometryEngine::LinearBlend ? GeometryEngine::DualQuaternion : GeometryEngine::LinearBlend;
+    } else if (e->key() == Qt::Key_1 || e->key() == Qt::Key_2 || e->key() == Qt::Key_4 || e->key() == Qt::Key_8) {
+        nbInfluences = e->key() - Qt::Key_0;
+    } else {
+        QOpenGLWidget::keyPressEvent(e);
+        return;
+    }
+
+    QElapsedTimer switchTimer;
+    switchTimer.start();
+    makeCurrent();
+    bool switched = geometries->setSkinningVariant(method, nbInfluences);
+    doneCurrent();
+    if (switched) {
+        std::cout << (method == GeometryEngine::DualQuaternion ? "Dual quaternion" : "Linear blend") << " skinning, "
+                  << nbInfluences << " influences (" << switchTimer.nsecsElapsed() / 1e6 << " ms)\n";
+    }
+    update();
 }
 
 //! [0]
@@ -22,6 +184,29 @@ void MainWidget::mousePressEvent(QMouseEvent *e)
 {
     // Save mouse press position
     mousePressPosition = QVector2D(e->pos());
+
+    if (!geometries) {
+        return;
+    }
+
+    // Whatever is under the cursor in the frame on screen
+    pickRay ray = rayFromViewport(projection, modelView(), e->pos().x(), e->pos().y(), width(), height());
+    QElapsedTimer pickTimer;
+    pickTimer.start();
+    pickResult picked = geometries->pick(ray);
+    double pickTime = pickTimer.nsecsElapsed() / 1e6;
+    if (picked.joint >= 0) {
+        QVector3D p = picked.jointPosition;
+        std::cout << "Picked joint " << picked.jointName << " (" << picked.joint << ") at (" << p.x() << ", " << p.y() << ", " << p.z() << ")\n";
+    }
+    if (picked.triangle >= 0) {
+        QVector3D p = picked.point;
+        std::cout << "Picked skin triangle " << picked.triangle << ", vertex " << picked.vertex << " at (" << p.x() << ", " << p.y()
+                  << ", " << p.z() << "), " << picked.distance << " from the eye\n";
+    }
+    if (picked.joint >= 0 || picked.triangle >= 0) {
+        std::cout << "Pick in " << pickTime << " ms\n";
+    }
 }
 
 void MainWidget::mouseReleaseEvent(QMouseEvent *e)
@@ -70,36 +255,56 @@ void MainWidget::initializeGL()
 
     glClearColor(0, 0, 0, 1);
 
-    initShaders();
     // initTextures();
 
+    setFocusPolicy(Qt::StrongFocus);
+
     geometries = new GeometryEngine();
+    geometries->printShaderStats();
+    if (clipBudget > 0) {
+        geometries->setClipBudget(clipBudget);
+    }
+    if (poseBaking) {
+        geometries->setPoseBaking(true, bakedPrecision);
+    }
+    if (lodPixelError > 0.0f) {
+        geometries->setLodSelection(lodPixelError);
+    }
+    if (xsensFiltered) {
+        geometries->setXsensFilter(xsensFilter);
+    }
+    if (!xsensRecording.empty()) {
+        geometries->playXsensRecording(xsensRecording);
+    } else if (!clipName.empty()) {
+        geometries->playClip(clipName);
+    }
+    geometries->setSkinningVariant(skinningMethod, skinningInfluences);
+    if (skinningMode != GeometryEngine::SkinInShader && !geometries->setSkinningMode(skinningMode)) {
+        std::cerr << (skinningMode == GeometryEngine::SkinOnCpu ? "CPU skinning" : "Skin once mode")
+                  << " unavailable, skinning in the vertex shader\n";
+    }
+    if (gpuPose) {
+        geometries->setGpuPose(true);
+    }
+    for (const auto& weight : morphWeights) {
+        geometries->setMorphWeight(weight.first, weight.second);
+    }
+
+    // Drive the rig from the Xsens suit (or a replay) instead of the clip
+    if (livePort > 0) {
+        liveStream = new XsensStream("../xsensData/labels.txt", livePort);
+        if (xsensFiltered) {
+            liveStream->setFilter(xsensFilter);
+        }
+        if (liveStream->start() && !geometries->initLiveGeometry(liveStream)) {
+            liveStream->stop();
+        }
+    }
 
     // Use QBasicTimer because its faster than QTimer
     timer.start(12, this);
 }
 
-//! [3]
-void MainWidget::initShaders()
-{
-    // Compile vertex shader
-    if (!program.addShaderFromSourceFile(QOpenGLShader::Vertex, "../src/shader/vshader.glsl"))
-        close();
-
-    // Compile fragment shader
-    if (!program.addShaderFromSourceFile(QOpenGLShader::Fragment, "../src/shader/fshader.glsl"))
-        close();
-
-    // Link shader pipeline
-    if (!program.link())
-        close();
-
-    // Bind shader pipeline for use
-    if (!program.bind())
-        close();
-}
-//! [3]
-
 //! [4]
 void MainWidget::initTextures()
 {
@@ -132,11 +337,31 @@ void MainWidget::resizeGL(int w, int h)
 
     // Set perspective projection
     projection.perspective(fov, aspect, zNear, zFar);
+
+    if (geometries) {
+        geometries->setViewportHeight(h);
+    }
+
+    // The pixel buffers hold whole frames, a new size restarts the capture
+    if (capturing) {
+        capturing = frameCapture.start(w * devicePixelRatioF(), h * devicePixelRatioF(), captureSettings);
+    }
 }
 //! [5]
 
+// Model view transformation of the frame, shared by the draws and the picking rays
+QMatrix4x4 MainWidget::modelView() const
+{
+    QMatrix4x4 matrix;
+    matrix.translate(0.0, 0.0, -5.0);
+    matrix.rotate(rotation);
+    return matrix;
+}
+
 void MainWidget::paintGL()
 {
+    frameAllocations.beginFrame();
+
     qint64 currentTime = QDateTime::currentMSecsSinceEpoch();
     float elapsedTime = static_cast<float>(currentTime - startTime) / 1000.0; // Convert to seconds
     
@@ -155,29 +380,14 @@ void MainWidget::paintGL()
 //! [2]
 
     // texture->bind();
-    program.bind();
 
 //! [6]
-    // Calculate model view transformation
-    QMatrix4x4 matrix;
-    matrix.translate(0.0, 0.0, -5.0);
-    matrix.rotate(rotation);
-
-    // Set modelview-projection matrix
-    program.setUniformValue("mvp_matrix", projection * matrix);
+    // Set modelview-projection matrix and draw, each shader variant gets the matrix
+    geometries->drawScene(projection * modelView());
 //! [6]
 
-    // Use texture unit 0 which contains cube.png
-    // program.setUniformValue("texture", 0);
+    // Read back one or two frames later, never waiting for this one
+    frameCapture.capture();
 
-    // Draw cube geometry
-    // geometries->drawCubeGeometry(&program);
-    // geometries->drawRepereGeometry(&program);
-    program.setUniformValue("isMesh", false);
-    geometries->drawBVHGeometry(&program);
-
-    program.setUniformValue("isMesh", true);
-    program.setUniformValue("rigTranfosList", 0);
-    
-    geometries->drawMeshGeometry(&program);
+    frameAllocations.endFrame();
 }
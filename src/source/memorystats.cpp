@@ -0,0 +1,264 @@
+#include "../header/memorystats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <set>
+#include <stdexcept>
+
+#ifdef TRACK_ALLOCATIONS
+
+static std::atomic<long long> nbAllocations(0);
+static std::atomic<long long> nbFrees(0);
+static std::atomic<size_t> allocatedBytes(0);
+
+// The array, nothrow and sized forms of the standard library call these two
+void* operator new(size_t size) {
+    nbAllocations.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    if (p) {
+        nbFrees.fetch_add(1, std::memory_order_relaxed);
+        std::free(p);
+    }
+}
+
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+bool allocationTrackingEnabled() {
+    return true;
+}
+
+allocationCounters allocationSnapshot() {
+    allocationCounters counters;
+    counters.allocations = nbAllocations.load(std::memory_order_relaxed);
+    counters.frees = nbFrees.load(std::memory_order_relaxed);
+    counters.bytes = allocatedBytes.load(std::memory_order_relaxed);
+    return counters;
+}
+
+#else
+
+bool allocationTrackingEnabled() {
+    return false;
+}
+
+allocationCounters allocationSnapshot() {
+    return allocationCounters();
+}
+
+#endif
+
+size_t stringBytes(const std::string& s) {
+    // Short strings keep their characters inside the object
+    const char* object = reinterpret_cast<const char*>(&s);
+    if (s.data() >= object && s.data() < object + sizeof(std::string)) {
+        return 0;
+    }
+    return s.capacity() + 1;
+}
+
+hierarchyMemory measureHierarchy(const std::vector<BVHTree*>& roots) {
+    hierarchyMemory memory;
+    std::set<std::string> channelNames;
+    std::vector<const BVHTree*> nodeQueue(roots.begin(), roots.end());
+    while (!nodeQueue.empty()) {
+        const BVHTree* node = nodeQueue.back();
+        nodeQueue.pop_back();
+        memory.nbNodes++;
+
+        memory.hierarchyBytes += sizeof(BVHTree) + stringBytes(node->name) + vectorBytes(node->joints);
+        size_t channelBytes = vectorBytes(node->channels);
+        for (const auto& channel : node->channels) {
+            channelBytes += stringBytes(channel);
+            channelNames.insert(channel);
+        }
+        memory.hierarchyBytes += channelBytes;
+        memory.channelNameBytes += channelBytes;
+        memory.nbChannelNames += node->channels.size();
+
+        memory.keyframeBytes += vectorBytes(node->channelsValues);
+        for (const auto& keyFrame : node->channelsValues) {
+            memory.keyframeBytes += vectorBytes(keyFrame);
+            memory.valueBytes += keyFrame.size() * sizeof(float);
+        }
+        memory.nbKeyframeVectors += node->channelsValues.size();
+
+        nodeQueue.insert(nodeQueue.end(), node->joints.begin(), node->joints.end());
+    }
+    memory.nbUniqueChannelNames = channelNames.size();
+    return memory;
+}
+
+size_t meshBytes(const mesh& myMesh) {
+    return vectorBytes(myMesh.vertexList) + vectorBytes(myMesh.indexList) + vectorBytes(myMesh.normalList);
+}
+
+size_t weightsBytes(const std::vector<std::vector<weight>>& weights) {
+    size_t bytes = vectorBytes(weights);
+    for (const auto& vertexWeights : weights) {
+        bytes += vectorBytes(vertexWeights);
+    }
+    return bytes;
+}
+
+void MemoryReport::addCpu(const std::string& subsystem, const std::string& item, size_t bytes) {
+    cpu.push_back({subsystem, item, bytes});
+}
+
+void MemoryReport::addGpu(const std::string& buffer, size_t bytes) {
+    gpu.push_back({"gpu", buffer, bytes});
+}
+
+void MemoryReport::addHierarchy(const std::string& item, const std::vector<BVHTree*>& roots) {
+    hierarchyMemory memory = measureHierarchy(roots);
+    addCpu("hierarchy", item, memory.hierarchyBytes);
+    addCpu("keyframes", item, memory.keyframeBytes);
+}
+
+size_t MemoryReport::cpuBytes() const {
+    size_t bytes = 0;
+    for (const auto& item : cpu) {
+        bytes += item.bytes;
+    }
+    return bytes;
+}
+
+size_t MemoryReport::cpuBytes(const std::string& subsystem) const {
+    size_t bytes = 0;
+    for (const auto& item : cpu) {
+        if (item.subsystem == subsystem) {
+            bytes += item.bytes;
+        }
+    }
+    return bytes;
+}
+
+size_t MemoryReport::gpuBytes() const {
+    size_t bytes = 0;
+    for (const auto& item : gpu) {
+        bytes += item.bytes;
+    }
+    return bytes;
+}
+
+void MemoryReport::print() const {
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "CPU memory: " << cpuBytes() / 1024.0 << " KiB\n";
+
+    // Subsystems in the order they were first added
+    std::vector<std::string> subsystems;
+    for (const auto& item : cpu) {
+        if (std::find(subsystems.begin(), subsystems.end(), item.subsystem) == subsystems.end()) {
+            subsystems.push_back(item.subsystem);
+        }
+    }
+    for (const auto& subsystem : subsystems) {
+        std::cout << "  " << subsystem << ": " << cpuBytes(subsystem) / 1024.0 << " KiB\n";
+        for (const auto& item : cpu) {
+            if (item.subsystem == subsystem) {
+                std::cout << "    " << item.name << ": " << item.bytes / 1024.0 << " KiB\n";
+            }
+        }
+    }
+
+    if (!gpu.empty()) {
+        std::cout << "GPU memory: " << gpuBytes() / 1024.0 << " KiB\n";
+        for (const auto& item : gpu) {
+            std::cout << "  " << item.name << ": " << item.bytes / 1024.0 << " KiB\n";
+        }
+    }
+    std::cout.unsetf(std::ios::floatfield);
+    std::cout << std::setprecision(6);
+}
+
+void AllocationMonitor::beginFrame() {
+    start = allocationSnapshot();
+}
+
+void AllocationMonitor::endFrame() {
+    allocationCounters end = allocationSnapshot();
+    last.allocations = end.allocations - start.allocations;
+    last.frees = end.frees - start.frees;
+    last.bytes = end.bytes - start.bytes;
+
+    total.allocations += last.allocations;
+    total.frees += last.frees;
+    total.bytes += last.bytes;
+    peakAllocations = std::max(peakAllocations, last.allocations);
+    peakBytes = std::max(peakBytes, last.bytes);
+    nbFrames++;
+}
+
+void AllocationMonitor::print() const {
+    if (!allocationTrackingEnabled()) {
+        std::cout << "Allocations: not tracked, build with CONFIG+=track_allocations\n";
+        return;
+    }
+    if (nbFrames == 0) {
+        std::cout << "Allocations: no frame yet\n";
+        return;
+    }
+    std::cout << "Allocations: last frame " << last.allocations << " (" << last.bytes << " bytes, "
+              << last.frees << " frees), " << static_cast<double>(total.allocations) / nbFrames << " per frame ("
+              << static_cast<double>(total.bytes) / nbFrames << " bytes) over " << nbFrames
+              << " frames, peak " << peakAllocations << " (" << peakBytes << " bytes)\n";
+}
+
+void printAssetFootprint(const std::string& directory, const std::string& clip) {
+    MemoryReport report;
+
+    allocationCounters before = allocationSnapshot();
+    std::vector<BVHTree*> roots = readBVH(directory + "/" + clip + ".bvh");
+    allocationCounters parsed = allocationSnapshot();
+    mesh myMesh = readMesh(directory + "/skin.off");
+    std::vector<std::vector<weight>> weights;
+    try {
+        weights = readWeights(directory + "/weights.txt", myMesh.nbVertices);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+    }
+
+    hierarchyMemory memory = measureHierarchy(roots);
+    report.addHierarchy(clip, roots);
+    report.addCpu("mesh", "vertexList", vectorBytes(myMesh.vertexList));
+    report.addCpu("mesh", "indexList", vectorBytes(myMesh.indexList));
+    report.addCpu("mesh", "normalList", vectorBytes(myMesh.normalList));
+    report.addCpu("weights", "weights.txt", weightsBytes(weights));
+    report.print();
+
+    int nbFrames = 0;
+    for (const BVHTree* root : roots) {
+        nbFrames = std::max(nbFrames, static_cast<int>(root->channelsValues.size()));
+    }
+    std::cout << "Hierarchy: " << memory.nbNodes << " nodes of " << sizeof(BVHTree) << " bytes, "
+              << memory.nbChannelNames << " channel names (" << memory.nbUniqueChannelNames << " distinct) in "
+              << memory.channelNameBytes << " bytes\n";
+    std::cout << "Keyframes: " << memory.nbKeyframeVectors << " vectors over " << nbFrames << " frames, "
+              << memory.valueBytes << " bytes of values and " << memory.keyframeBytes - memory.valueBytes
+              << " bytes of vector headers and slack\n";
+    std::cout << "BVHTree node: name " << sizeof(BVHTree::name) << ", offset " << sizeof(BVHTree::offset)
+              << ", channels " << sizeof(BVHTree::channels)
+              << ", channelsValues " << sizeof(BVHTree::channelsValues) << ", joints " << sizeof(BVHTree::joints)
+              << ", the rest with padding " << sizeof(BVHTree) - sizeof(BVHTree::name) - sizeof(BVHTree::offset)
+                                               - sizeof(BVHTree::channels)
+                                               - sizeof(BVHTree::channelsValues) - sizeof(BVHTree::joints)
+              << " bytes\n";
+    if (allocationTrackingEnabled()) {
+        std::cout << "Parsing the clip: " << parsed.allocations - before.allocations << " allocations, "
+                  << parsed.bytes - before.bytes << " bytes\n";
+    }
+
+    deleteBVH(roots);
+}
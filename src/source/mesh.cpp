@@ -67,9 +67,30 @@ mesh readMesh(const std::string& fileName){
             myMesh.indexList.push_back(int3{i, j, k});
     }
 
+    computeNormals(myMesh);
+
     return myMesh;
 }
 
+void computeNormals(mesh& myMesh){
+    myMesh.normalList.assign(myMesh.nbVertices, QVector3D(0.0f, 0.0f, 0.0f));
+
+    // Area weighted face normals accumulated on the vertices
+    for (const auto& face : myMesh.indexList){
+        QVector3D a = myMesh.vertexList[face.i];
+        QVector3D b = myMesh.vertexList[face.j];
+        QVector3D c = myMesh.vertexList[face.k];
+        QVector3D n = QVector3D::crossProduct(b - a, c - a);
+        myMesh.normalList[face.i] += n;
+        myMesh.normalList[face.j] += n;
+        myMesh.normalList[face.k] += n;
+    }
+
+    for (auto& n : myMesh.normalList){
+        n.normalize();
+    }
+}
+
 std::vector<std::vector<weight>> readWeights(const std::string& fileName, int nbVertex){
     std::ifstream inputFile(fileName);
     if (!inputFile.is_open()) {
@@ -91,9 +112,12 @@ std::vector<std::vector<weight>> readWeights(const std::string& fileName, int nb
         tokens >> currentToken;
     }
 
-    for (int vertexIndex = 0; vertexIndex < nbVertex; vertexIndex++){
+    // nbVertex < 0 reads every row of the file
+    for (int vertexIndex = 0; nbVertex < 0 || vertexIndex < nbVertex; vertexIndex++){
         
-        tokens >> currentToken; //Index of the vertex in the first column
+        if (!(tokens >> currentToken)) { //Index of the vertex in the first column
+            break;
+        }
 
         std::vector<weight> vertexWeights;
 
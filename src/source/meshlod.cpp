@@ -0,0 +1,535 @@
+#include "../header/meshlod.h"
+#include "../header/jobsystem.h"
+#include "../header/timing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <queue>
+
+namespace {
+
+// Symmetric 4x4 matrix of the squared distances to a set of planes: xx xy xz xw yy yz yw zz zw ww
+struct quadric {
+    double q[10] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+    void addPlane(const QVector3D& normal, double d, double weight) {
+        double a = normal.x(), b = normal.y(), c = normal.z();
+        double plane[10] = {a * a, a * b, a * c, a * d, b * b, b * c, b * d, c * c, c * d, d * d};
+        for (int i = 0; i < 10; i++) {
+            q[i] += weight * plane[i];
+        }
+    }
+    void add(const quadric& other) {
+        for (int i = 0; i < 10; i++) {
+            q[i] += other.q[i];
+        }
+    }
+    double error(const QVector3D& p) const {
+        double x = p.x(), y = p.y(), z = p.z();
+        double e = q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+                 + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+                 + q[7] * z * z + 2 * q[8] * z + q[9];
+        return std::max(e, 0.0);
+    }
+    // Point of least error, false when the planes do not pin one down (flat or straight regions)
+    bool optimum(QVector3D& p) const {
+        double a = q[0], b = q[1], c = q[2], d = q[4], e = q[5], f = q[7];
+        double det = a * (d * f - e * e) - b * (b * f - c * e) + c * (b * e - c * d);
+        double scale = std::max({std::abs(a), std::abs(d), std::abs(f), 1e-30});
+        if (std::abs(det) < 1e-9 * scale * scale * scale) {
+            return false;
+        }
+        double rx = -q[3], ry = -q[6], rz = -q[8];
+        double x = (rx * (d * f - e * e) - b * (ry * f - e * rz) + c * (ry * e - d * rz)) / det;
+        double y = (a * (ry * f - e * rz) - rx * (b * f - c * e) + c * (b * rz - ry * c)) / det;
+        double z = (a * (d * rz - ry * e) - b * (b * rz - ry * c) + rx * (b * e - c * d)) / det;
+        p = QVector3D(x, y, z);
+        return true;
+    }
+};
+
+struct collapse {
+    double cost;
+    int u;
+    int v;
+    int stampU;
+    int stampV;
+    bool operator>(const collapse& other) const { return cost > other.cost; }
+};
+
+int dominantJoint(const std::vector<weight>& weights) {
+    int joint = -1;
+    float strongest = 0.0f;
+    for (const auto& w : weights) {
+        if (w.w > strongest) {
+            strongest = w.w;
+            joint = w.i;
+        }
+    }
+    return joint;
+}
+
+// Half the L1 distance of two weight sets, 0 when identical and 1 when disjoint
+float weightDistance(const std::vector<weight>& a, const std::vector<weight>& b) {
+    float distance = 0.0f;
+    for (const auto& wa : a) {
+        auto match = std::find_if(b.begin(), b.end(), [&](const weight& wb) { return wb.i == wa.i; });
+        distance += std::abs(wa.w - (match == b.end() ? 0.0f : match->w));
+    }
+    for (const auto& wb : b) {
+        if (std::none_of(a.begin(), a.end(), [&](const weight& wa) { return wa.i == wb.i; })) {
+            distance += wb.w;
+        }
+    }
+    return 0.5f * distance;
+}
+
+// (1 - t) a + t b, strongest maxInfluences kept and summing to 1
+std::vector<weight> blendWeights(const std::vector<weight>& a, const std::vector<weight>& b, float t, int maxInfluences) {
+    std::vector<weight> blended;
+    for (const auto& wa : a) {
+        blended.push_back({wa.i, (1.0f - t) * wa.w});
+    }
+    for (const auto& wb : b) {
+        auto match = std::find_if(blended.begin(), blended.end(), [&](const weight& w) { return w.i == wb.i; });
+        if (match == blended.end()) {
+            blended.push_back({wb.i, t * wb.w});
+        } else {
+            match->w += t * wb.w;
+        }
+    }
+    std::sort(blended.begin(), blended.end(), [](const weight& x, const weight& y) { return x.w > y.w; });
+    while (static_cast<int>(blended.size()) > maxInfluences || (!blended.empty() && !(blended.back().w > 0.0f))) {
+        blended.pop_back();
+    }
+    float sum = 0.0f;
+    for (const auto& w : blended) {
+        sum += w.w;
+    }
+    for (auto& w : blended) {
+        w.w = sum > 0.0f ? w.w / sum : 1.0f / blended.size();
+    }
+    return blended;
+}
+
+class Simplifier
+{
+public:
+    Simplifier(const mesh& source, const std::vector<std::vector<weight>>& weights, const lodOptions& options)
+        : positions(source.vertexList), triangles(source.indexList), weights(weights), options(options)
+    {
+        int nbVertices = positions.size();
+        vertexFaces.resize(nbVertices);
+        faceAlive.assign(triangles.size(), 1);
+        vertexAlive.assign(nbVertices, 1);
+        stamps.assign(nbVertices, 0);
+        quadrics.resize(nbVertices);
+        geometricQuadrics.resize(nbVertices);
+        this->weights.resize(nbVertices);
+
+        for (size_t f = 0; f < triangles.size(); f++) {
+            const int3& t = triangles[f];
+            vertexFaces[t.i].push_back(f);
+            vertexFaces[t.j].push_back(f);
+            vertexFaces[t.k].push_back(f);
+
+            // Unweighted planes: the error is a sum of squared distances, in mesh units squared
+            QVector3D normal = QVector3D::crossProduct(positions[t.j] - positions[t.i], positions[t.k] - positions[t.i]);
+            if (normal.lengthSquared() <= 0.0f) {
+                continue;
+            }
+            normal.normalize();
+            double d = -QVector3D::dotProduct(normal, positions[t.i]);
+            for (int v : {t.i, t.j, t.k}) {
+                geometricQuadrics[v].addPlane(normal, d, 1.0);
+            }
+        }
+        quadrics = geometricQuadrics;
+
+        // Open borders get planes perpendicular to their faces so they do not shrink
+        for (size_t f = 0; f < triangles.size(); f++) {
+            const int3& t = triangles[f];
+            int corners[3] = {t.i, t.j, t.k};
+            QVector3D normal = QVector3D::crossProduct(positions[t.j] - positions[t.i], positions[t.k] - positions[t.i]).normalized();
+            for (int e = 0; e < 3; e++) {
+                int a = corners[e];
+                int b = corners[(e + 1) % 3];
+                if (sharedFaces(a, b) != 1) {
+                    continue;
+                }
+                border.push_back(a);
+                border.push_back(b);
+                QVector3D side = QVector3D::crossProduct(positions[b] - positions[a], normal);
+                if (side.lengthSquared() <= 0.0f) {
+                    continue;
+                }
+                side.normalize();
+                double d = -QVector3D::dotProduct(side, positions[a]);
+                quadrics[a].addPlane(side, d, borderWeight);
+                quadrics[b].addPlane(side, d, borderWeight);
+            }
+        }
+        std::sort(border.begin(), border.end());
+        border.erase(std::unique(border.begin(), border.end()), border.end());
+
+        // Each edge once, from its lower vertex
+        for (size_t f = 0; f < triangles.size(); f++) {
+            const int3& t = triangles[f];
+            int corners[3] = {t.i, t.j, t.k};
+            for (int e = 0; e < 3; e++) {
+                int a = corners[e];
+                int b = corners[(e + 1) % 3];
+                if (a < b || sharedFaces(a, b) == 1) {
+                    pushEdge(a, b);
+                }
+            }
+        }
+        nbFaces = triangles.size();
+    }
+
+    void run(int targetTriangles) {
+        while (nbFaces > targetTriangles && !queue.empty()) {
+            collapse c = queue.top();
+            queue.pop();
+            if (!vertexAlive[c.u] || !vertexAlive[c.v] || stamps[c.u] != c.stampU || stamps[c.v] != c.stampV) {
+                continue;
+            }
+            QVector3D target;
+            float t;
+            if (!evaluate(c.u, c.v, target, t) || !collapseEdge(c.u, c.v, target, t)) {
+                nbRejected++;
+            }
+        }
+    }
+
+    lodMesh result() const {
+        lodMesh lod;
+        std::vector<int> remap(positions.size(), -1);
+        for (size_t v = 0; v < positions.size(); v++) {
+            if (vertexAlive[v] && !vertexFaces[v].empty()) {
+                remap[v] = lod.geometry.vertexList.size();
+                lod.geometry.vertexList.push_back(positions[v]);
+                lod.weights.push_back(weights[v]);
+                lod.sourceVertices.push_back(v);
+            }
+        }
+        for (size_t f = 0; f < triangles.size(); f++) {
+            if (faceAlive[f]) {
+                const int3& t = triangles[f];
+                lod.geometry.indexList.push_back({remap[t.i], remap[t.j], remap[t.k]});
+            }
+        }
+        lod.geometry.nbVertices = lod.geometry.vertexList.size();
+        lod.geometry.nbFaces = lod.geometry.indexList.size();
+        computeNormals(lod.geometry);
+        lod.error = std::sqrt(maxError);
+        lod.nbRejected = nbRejected;
+        return lod;
+    }
+
+private:
+    int sharedFaces(int a, int b) const {
+        int count = 0;
+        for (int f : vertexFaces[a]) {
+            const int3& t = triangles[f];
+            count += faceAlive[f] && (t.i == b || t.j == b || t.k == b);
+        }
+        return count;
+    }
+
+    bool onBorder(int v) const {
+        return std::binary_search(border.begin(), border.end(), v);
+    }
+
+    // Best position of the merged vertex and its parameter along u -> v, false if the collapse is not allowed
+    bool evaluate(int u, int v, QVector3D& target, float& t, double* cost = nullptr) const {
+        if (options.respectInfluences && dominantJoint(weights[u]) != dominantJoint(weights[v])) {
+            return false;
+        }
+
+        quadric q = quadrics[u];
+        q.add(quadrics[v]);
+        QVector3D edge = positions[v] - positions[u];
+        float length2 = edge.lengthSquared();
+
+        // The optimum may leave the edge, it is kept only when it stays near it
+        QVector3D candidates[4] = {positions[u], positions[v], 0.5f * (positions[u] + positions[v]), QVector3D()};
+        int nbCandidates = 3;
+        if (q.optimum(candidates[3]) && (candidates[3] - candidates[2]).lengthSquared() < length2) {
+            nbCandidates = 4;
+        }
+        double best = -1.0;
+        for (int c = 0; c < nbCandidates; c++) {
+            double e = q.error(candidates[c]);
+            if (best < 0.0 || e < best) {
+                best = e;
+                target = candidates[c];
+            }
+        }
+        t = length2 > 0.0f ? std::clamp(QVector3D::dotProduct(target - positions[u], edge) / length2, 0.0f, 1.0f) : 0.0f;
+
+        // Blending different influences smears the deformation, such edges go last
+        if (cost) {
+            *cost = best + weightDistance(weights[u], weights[v]) * length2;
+        }
+        return true;
+    }
+
+    void pushEdge(int u, int v) {
+        QVector3D target;
+        float t;
+        double cost;
+        if (evaluate(u, v, target, t, &cost)) {
+            queue.push({cost, u, v, stamps[u], stamps[v]});
+        }
+    }
+
+    bool collapseEdge(int u, int v, const QVector3D& target, float t) {
+        // Link condition: the only vertices adjacent to both are the opposite corners of the shared faces,
+        // otherwise the collapse pinches the surface
+        int nbShared = sharedFaces(u, v);
+        if (nbShared == 0 || nbShared > 2 || (nbShared == 2 && onBorder(u) && onBorder(v))) {
+            return false;
+        }
+        neighbors.clear();
+        for (int f : vertexFaces[u]) {
+            if (faceAlive[f]) {
+                const int3& tri = triangles[f];
+                for (int w : {tri.i, tri.j, tri.k}) {
+                    if (w != u && w != v) {
+                        neighbors.push_back(w);
+                    }
+                }
+            }
+        }
+        std::sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+        int nbCommon = 0;
+        for (int f : vertexFaces[v]) {
+            if (!faceAlive[f]) {
+                continue;
+            }
+            const int3& tri = triangles[f];
+            for (int w : {tri.i, tri.j, tri.k}) {
+                if (w != u && w != v && std::binary_search(neighbors.begin(), neighbors.end(), w)) {
+                    nbCommon++;
+                    neighbors.erase(std::lower_bound(neighbors.begin(), neighbors.end(), w));
+                }
+            }
+        }
+        if (nbCommon != nbShared) {
+            return false;
+        }
+
+        // No remaining face may flip or collapse to a sliver
+        for (int endpoint : {u, v}) {
+            for (int f : vertexFaces[endpoint]) {
+                if (!faceAlive[f]) {
+                    continue;
+                }
+                const int3& tri = triangles[f];
+                bool hasU = tri.i == u || tri.j == u || tri.k == u;
+                bool hasV = tri.i == v || tri.j == v || tri.k == v;
+                if (hasU && hasV) {
+                    continue;
+                }
+                QVector3D corners[3] = {positions[tri.i], positions[tri.j], positions[tri.k]};
+                QVector3D before = QVector3D::crossProduct(corners[1] - corners[0], corners[2] - corners[0]);
+                int moved = tri.i == endpoint ? 0 : tri.j == endpoint ? 1 : 2;
+                corners[moved] = target;
+                QVector3D after = QVector3D::crossProduct(corners[1] - corners[0], corners[2] - corners[0]);
+                if (QVector3D::dotProduct(before, after) < 0.2f * before.length() * after.length() || after.lengthSquared() <= 0.0f) {
+                    return false;
+                }
+            }
+        }
+
+        for (int f : vertexFaces[v]) {
+            if (!faceAlive[f]) {
+                continue;
+            }
+            int3& tri = triangles[f];
+            bool hasU = tri.i == u || tri.j == u || tri.k == u;
+            if (hasU) {
+                faceAlive[f] = 0;
+                nbFaces--;
+                continue;
+            }
+            if (tri.i == v) tri.i = u;
+            if (tri.j == v) tri.j = u;
+            if (tri.k == v) tri.k = u;
+            vertexFaces[u].push_back(f);
+        }
+        vertexFaces[v].clear();
+        vertexFaces[u].erase(std::remove_if(vertexFaces[u].begin(), vertexFaces[u].end(), [&](int f) { return !faceAlive[f]; }),
+                             vertexFaces[u].end());
+
+        geometricQuadrics[u].add(geometricQuadrics[v]);
+        quadrics[u].add(quadrics[v]);
+        maxError = std::max(maxError, geometricQuadrics[u].error(target));
+        positions[u] = target;
+        weights[u] = blendWeights(weights[u], weights[v], t, options.maxInfluences);
+        if (onBorder(v) && !onBorder(u)) {
+            border.insert(std::lower_bound(border.begin(), border.end(), u), u);
+        }
+        vertexAlive[v] = 0;
+        stamps[u]++;
+        stamps[v]++;
+
+        // The costs of every edge around the merged vertex changed
+        neighbors.clear();
+        for (int f : vertexFaces[u]) {
+            const int3& tri = triangles[f];
+            for (int w : {tri.i, tri.j, tri.k}) {
+                if (w != u) {
+                    neighbors.push_back(w);
+                }
+            }
+        }
+        std::sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+        for (int w : neighbors) {
+            pushEdge(u, w);
+        }
+        return true;
+    }
+
+    const float borderWeight = 100.0f;
+
+    std::vector<QVector3D> positions;
+    std::vector<int3> triangles;
+    std::vector<std::vector<weight>> weights;
+    lodOptions options;
+
+    std::vector<std::vector<int>> vertexFaces;
+    std::vector<char> faceAlive;
+    std::vector<char> vertexAlive;
+    std::vector<int> stamps; // Bumped when a vertex moves, older queue entries are stale
+    std::vector<quadric> quadrics;
+    std::vector<quadric> geometricQuadrics; // Without the border planes, for the reported error
+    std::vector<int> border;
+    std::vector<int> neighbors;
+    std::priority_queue<collapse, std::vector<collapse>, std::greater<collapse>> queue;
+    int nbFaces = 0;
+    int nbRejected = 0;
+    double maxError = 0;
+};
+
+} // namespace
+
+lodMesh simplifyMesh(const mesh& source, const std::vector<std::vector<weight>>& weights, int targetTriangles,
+                     const lodOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    Simplifier simplifier(source, weights, options);
+    simplifier.run(targetTriangles);
+    lodMesh lod = simplifier.result();
+    lod.buildTime = elapsedMs(start);
+    return lod;
+}
+
+std::vector<lodMesh> buildLodChain(const mesh& source, const std::vector<std::vector<weight>>& weights,
+                                   const lodOptions& options) {
+    std::vector<lodMesh> chain(std::max(1, options.nbLods));
+    chain[0].geometry = source;
+    chain[0].weights = weights;
+    chain[0].weights.resize(source.nbVertices);
+    chain[0].sourceVertices.resize(source.nbVertices);
+    std::iota(chain[0].sourceVertices.begin(), chain[0].sourceVertices.end(), 0);
+    if (chain[0].geometry.normalList.size() != source.vertexList.size()) {
+        computeNormals(chain[0].geometry);
+    }
+
+    // Every level starts from the full mesh, so they are independent and simplified in parallel
+    auto simplify = [&](int first, int last) {
+        for (int level = first + 1; level <= last; level++) {
+            int target = static_cast<int>(source.nbFaces * std::pow(options.reduction, level));
+            chain[level] = simplifyMesh(source, weights, target, options);
+        }
+    };
+    if (options.nbThreads == 1) {
+        simplify(0, chain.size() - 1);
+    } else {
+        JobSystem::shared().parallelFor("simplify level", chain.size() - 1, 1, simplify);
+    }
+    return chain;
+}
+
+int selectLod(const std::vector<float>& errors, float pixelsPerUnit, float maxPixelError) {
+    int lod = 0;
+    for (size_t level = 1; level < errors.size(); level++) {
+        if (errors[level] * pixelsPerUnit <= maxPixelError) {
+            lod = level;
+        }
+    }
+    return lod;
+}
+
+void benchmarkLods(const std::string& meshFile, const std::string& weightsFile, const lodOptions& options) {
+    mesh source = readMesh(meshFile);
+    std::vector<std::vector<weight>> weights = readWeights(weightsFile, source.nbVertices);
+    if (static_cast<int>(weights.size()) < source.nbVertices) {
+        throw std::runtime_error(weightsFile + " has fewer rows than " + meshFile + " has vertices");
+    }
+    for (auto& influences : weights) {
+        influences = blendWeights(influences, {}, 0.0f, options.maxInfluences);
+    }
+
+    QVector3D low = source.vertexList.empty() ? QVector3D() : source.vertexList[0];
+    QVector3D high = low;
+    for (const auto& p : source.vertexList) {
+        low = QVector3D(std::min(low.x(), p.x()), std::min(low.y(), p.y()), std::min(low.z(), p.z()));
+        high = QVector3D(std::max(high.x(), p.x()), std::max(high.y(), p.y()), std::max(high.z(), p.z()));
+    }
+    float diagonal = (high - low).length();
+
+    int nbThreads = JobSystem::shared().nbThreads();
+    lodOptions serial = options;
+    serial.nbThreads = 1;
+    auto start = std::chrono::steady_clock::now();
+    buildLodChain(source, weights, serial);
+    double serialTime = elapsedMs(start);
+    lodOptions threaded = options;
+    threaded.nbThreads = 0;
+    start = std::chrono::steady_clock::now();
+    std::vector<lodMesh> chain = buildLodChain(source, weights, threaded);
+    double threadedTime = elapsedMs(start);
+
+    std::cout << "LOD chain of " << meshFile << ": built in " << serialTime << " ms on 1 thread, " << threadedTime
+              << " ms on " << nbThreads << "\n";
+    for (size_t level = 0; level < chain.size(); level++) {
+        const lodMesh& lod = chain[level];
+        size_t maxInfluences = 0;
+        float worstSum = 0.0f;
+        for (const auto& influences : lod.weights) {
+            maxInfluences = std::max(maxInfluences, influences.size());
+            float sum = 0.0f;
+            for (const auto& w : influences) {
+                sum += w.w;
+            }
+            worstSum = std::max(worstSum, std::abs(sum - 1.0f));
+        }
+
+        // What one linear blend skinning pass over the level costs on the CPU
+        std::vector<QVector3D> skinned(lod.geometry.nbVertices);
+        auto skinStart = std::chrono::steady_clock::now();
+        const int nbPasses = 200;
+        for (int pass = 0; pass < nbPasses; pass++) {
+            for (int v = 0; v < lod.geometry.nbVertices; v++) {
+                QVector3D p;
+                for (const auto& w : lod.weights[v]) {
+                    p += w.w * (lod.geometry.vertexList[v] + QVector3D(w.i * 1e-3f, pass * 1e-3f, 0.0f));
+                }
+                skinned[v] = p;
+            }
+        }
+        double skinTime = elapsedMs(skinStart) * 1e3 / nbPasses;
+
+        std::cout << "  LOD " << level << ": " << lod.geometry.nbVertices << " vertices, " << lod.geometry.nbFaces << " triangles, error "
+                  << lod.error << " (" << 100.0 * lod.error / diagonal << "% of the box diagonal), built in " << lod.buildTime
+                  << " ms, " << lod.nbRejected << " collapses refused, up to " << maxInfluences << " influences, weight sums within "
+                  << worstSum << ", skinning " << skinTime << " us\n";
+        benchmarkSink = skinned.empty() ? 0.0f : skinned[0].x();
+    }
+}
@@ -0,0 +1,456 @@
+#include "../header/morphtargets.h"
+#include "../header/timing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static int16_t quantize(float value, float step) {
+    long q = std::lround(value / step);
+    return static_cast<int16_t>(std::clamp(q, -32767L, 32767L));
+}
+
+morphTarget buildMorphTarget(const std::string& name, const mesh& base, const mesh& shape) {
+    morphTarget target;
+    target.name = name;
+
+    std::vector<int> moved;
+    float maxPosition = 0.0f;
+    float maxNormal = 0.0f;
+    for (int v = 0; v < base.nbVertices; v++) {
+        QVector3D position = shape.vertexList[v] - base.vertexList[v];
+        QVector3D normal = shape.normalList[v] - base.normalList[v];
+        if (position.length() <= morphThreshold && normal.length() <= morphNormalThreshold) {
+            continue;
+        }
+        moved.push_back(v);
+        for (int c = 0; c < 3; c++) {
+            maxPosition = std::max(maxPosition, std::abs(position[c]));
+            maxNormal = std::max(maxNormal, std::abs(normal[c]));
+        }
+    }
+
+    // The largest component of the target uses the whole range
+    target.positionStep = maxPosition > 0.0f ? maxPosition / 32767.0f : 1.0f;
+    target.normalStep = maxNormal > 0.0f ? maxNormal / 32767.0f : 1.0f;
+    target.vertices = moved;
+    for (int c = 0; c < 3; c++) {
+        target.positionDeltas[c].reserve(moved.size());
+        target.normalDeltas[c].reserve(moved.size());
+    }
+    for (int v : moved) {
+        QVector3D position = shape.vertexList[v] - base.vertexList[v];
+        QVector3D normal = shape.normalList[v] - base.normalList[v];
+        for (int c = 0; c < 3; c++) {
+            target.positionDeltas[c].push_back(quantize(position[c], target.positionStep));
+            target.normalDeltas[c].push_back(quantize(normal[c], target.normalStep));
+        }
+    }
+    return target;
+}
+
+void readMorphTarget(const std::string& fileName, const std::string& name, mesh& myMesh) {
+    mesh shape = readMesh(fileName);
+    if (shape.nbVertices != myMesh.nbVertices) {
+        throw std::runtime_error(fileName + " has " + std::to_string(shape.nbVertices) + " vertices, its mesh has "
+                                 + std::to_string(myMesh.nbVertices));
+    }
+    if (static_cast<int>(myMesh.normalList.size()) != myMesh.nbVertices) {
+        computeNormals(myMesh);
+    }
+    myMesh.morphTargets.push_back(buildMorphTarget(name, myMesh, shape));
+}
+
+void readMorphTargets(const std::string& meshFile, mesh& myMesh) {
+    std::filesystem::path path(meshFile);
+    std::string prefix = path.stem().string() + ".";
+    std::filesystem::path directory = path.has_parent_path() ? path.parent_path() : std::filesystem::path(".");
+
+    std::vector<std::filesystem::path> shapes;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        std::string fileName = entry.path().filename().string();
+        if (entry.path().extension() == ".off" && fileName.size() > prefix.size() + 4 && fileName.compare(0, prefix.size(), prefix) == 0) {
+            shapes.push_back(entry.path());
+        }
+    }
+    std::sort(shapes.begin(), shapes.end());
+
+    for (const auto& shape : shapes) {
+        std::string name = shape.stem().string().substr(prefix.size());
+        readMorphTarget(shape.string(), name, myMesh);
+        const morphTarget& target = myMesh.morphTargets.back();
+        std::cout << "Morph target " << name << ": " << target.vertices.size() << " of " << myMesh.nbVertices << " vertices\n";
+    }
+}
+
+std::vector<morphTarget> remapMorphTargets(const std::vector<morphTarget>& targets, const std::vector<int>& sourceVertices,
+                                           int nbSourceVertices) {
+    // Vertices of each source vertex, packed
+    std::vector<int> first(nbSourceVertices + 1, 0);
+    for (int source : sourceVertices) {
+        if (source >= 0) {
+            first[source + 1]++;
+        }
+    }
+    for (int s = 0; s < nbSourceVertices; s++) {
+        first[s + 1] += first[s];
+    }
+    std::vector<int> copies(first.back());
+    std::vector<int> cursor(first.begin(), first.end() - 1);
+    for (size_t v = 0; v < sourceVertices.size(); v++) {
+        if (sourceVertices[v] >= 0) {
+            copies[cursor[sourceVertices[v]]++] = v;
+        }
+    }
+
+    std::vector<morphTarget> remapped;
+    std::vector<std::pair<int, int>> entries; // Vertex and delta of the source target
+    for (const morphTarget& target : targets) {
+        entries.clear();
+        for (size_t k = 0; k < target.vertices.size(); k++) {
+            int source = target.vertices[k];
+            for (int c = first[source]; c < first[source + 1]; c++) {
+                entries.push_back({copies[c], static_cast<int>(k)});
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+
+        morphTarget moved;
+        moved.name = target.name;
+        moved.positionStep = target.positionStep;
+        moved.normalStep = target.normalStep;
+        for (const auto& entry : entries) {
+            moved.vertices.push_back(entry.first);
+            for (int c = 0; c < 3; c++) {
+                moved.positionDeltas[c].push_back(target.positionDeltas[c][entry.second]);
+                moved.normalDeltas[c].push_back(target.normalDeltas[c][entry.second]);
+            }
+        }
+        remapped.push_back(std::move(moved));
+    }
+    return remapped;
+}
+
+// values[slots[i]] += deltas[i] * step, the deltas converted eight at a time
+static void accumulate(const int* slots, const int16_t* deltas, int count, float step, float* values) {
+    int i = 0;
+#ifdef __SSE2__
+    __m128 scale = _mm_set1_ps(step);
+    alignas(16) float decoded[8];
+    for (; i + 8 <= count; i += 8) {
+        __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(deltas + i));
+        // Each value copied in both halves of a 32 bit lane, the arithmetic shift extends its sign
+        __m128 low = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16));
+        __m128 high = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(packed, packed), 16));
+        _mm_store_ps(decoded, _mm_mul_ps(low, scale));
+        _mm_store_ps(decoded + 4, _mm_mul_ps(high, scale));
+        for (int k = 0; k < 8; k++) {
+            values[slots[i + k]] += decoded[k];
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        values[slots[i]] += deltas[i] * step;
+    }
+}
+
+void MorphAccumulator::init(std::vector<morphTarget> newTargets, const std::vector<QVector3D>& positions,
+                            const std::vector<QVector3D>& normals) {
+    clear();
+    targets = std::move(newTargets);
+    nbVertices = positions.size();
+
+    std::vector<int> slotOf(nbVertices, -1);
+    for (const morphTarget& target : targets) {
+        for (int v : target.vertices) {
+            if (v < 0 || v >= nbVertices) {
+                throw std::runtime_error("Morph target " + target.name + " moves vertex " + std::to_string(v) + " of "
+                                         + std::to_string(nbVertices));
+            }
+            slotOf[v] = 0;
+        }
+    }
+    for (int v = 0; v < nbVertices; v++) {
+        if (slotOf[v] == 0) {
+            slotOf[v] = slotVertices.size();
+            slotVertices.push_back(v);
+        }
+    }
+
+    targetSlots.resize(targets.size());
+    for (size_t t = 0; t < targets.size(); t++) {
+        for (int v : targets[t].vertices) {
+            targetSlots[t].slots.push_back(slotOf[v]);
+        }
+    }
+
+    for (int v : slotVertices) {
+        baseX.push_back(positions[v].x());
+        baseY.push_back(positions[v].y());
+        baseZ.push_back(positions[v].z());
+        baseNx.push_back(normals[v].x());
+        baseNy.push_back(normals[v].y());
+        baseNz.push_back(normals[v].z());
+    }
+    x = baseX;
+    y = baseY;
+    z = baseZ;
+    nx = baseNx;
+    ny = baseNy;
+    nz = baseNz;
+
+    // Each target pushes its slots one way, the box spans every combination of weights in [0, 1]
+    lowX = highX = baseX;
+    lowY = highY = baseY;
+    lowZ = highZ = baseZ;
+    std::vector<float>* lows[3] = {&lowX, &lowY, &lowZ};
+    std::vector<float>* highs[3] = {&highX, &highY, &highZ};
+    for (size_t t = 0; t < targets.size(); t++) {
+        for (size_t k = 0; k < targetSlots[t].slots.size(); k++) {
+            int slot = targetSlots[t].slots[k];
+            for (int c = 0; c < 3; c++) {
+                float delta = targets[t].positionDeltas[c][k] * targets[t].positionStep;
+                (*(delta < 0.0f ? lows[c] : highs[c]))[slot] += delta;
+            }
+        }
+    }
+
+    touchedMark.assign(slotVertices.size(), 0);
+    changedMark.assign(slotVertices.size(), 0);
+}
+
+void MorphAccumulator::clear() {
+    targets.clear();
+    targetSlots.clear();
+    slotVertices.clear();
+    nbVertices = 0;
+    for (std::vector<float>* values : {&baseX, &baseY, &baseZ, &baseNx, &baseNy, &baseNz, &x, &y, &z, &nx, &ny, &nz,
+                                       &lowX, &lowY, &lowZ, &highX, &highY, &highZ}) {
+        values->clear();
+    }
+    touched.clear();
+    changed.clear();
+    touchedMark.clear();
+    changedMark.clear();
+    generation = 0;
+    deltas = 0;
+}
+
+void MorphAccumulator::apply(const float* weights) {
+    if (++generation == 0) {
+        std::fill(touchedMark.begin(), touchedMark.end(), 0);
+        std::fill(changedMark.begin(), changedMark.end(), 0);
+        generation = 1;
+    }
+    changed.clear();
+    deltas = 0;
+
+    // Back to the base shape where the previous weights moved it, the other slots are there already
+    for (int slot : touched) {
+        x[slot] = baseX[slot];
+        y[slot] = baseY[slot];
+        z[slot] = baseZ[slot];
+        nx[slot] = baseNx[slot];
+        ny[slot] = baseNy[slot];
+        nz[slot] = baseNz[slot];
+        changedMark[slot] = generation;
+        changed.push_back(slot);
+    }
+    touched.clear();
+
+    for (size_t t = 0; t < targets.size(); t++) {
+        float weight = weights[t];
+        if (weight == 0.0f) {
+            continue;
+        }
+        const morphTarget& target = targets[t];
+        const std::vector<int>& slots = targetSlots[t].slots;
+        int count = slots.size();
+        float positionStep = weight * target.positionStep;
+        float normalStep = weight * target.normalStep;
+        accumulate(slots.data(), target.positionDeltas[0].data(), count, positionStep, x.data());
+        accumulate(slots.data(), target.positionDeltas[1].data(), count, positionStep, y.data());
+        accumulate(slots.data(), target.positionDeltas[2].data(), count, positionStep, z.data());
+        accumulate(slots.data(), target.normalDeltas[0].data(), count, normalStep, nx.data());
+        accumulate(slots.data(), target.normalDeltas[1].data(), count, normalStep, ny.data());
+        accumulate(slots.data(), target.normalDeltas[2].data(), count, normalStep, nz.data());
+        deltas += count;
+
+        for (int slot : slots) {
+            if (touchedMark[slot] != generation) {
+                touchedMark[slot] = generation;
+                touched.push_back(slot);
+            }
+            if (changedMark[slot] != generation) {
+                changedMark[slot] = generation;
+                changed.push_back(slot);
+            }
+        }
+    }
+
+    // Blended normals are renormalized once every target is in
+    for (int slot : touched) {
+        float length = std::sqrt(nx[slot] * nx[slot] + ny[slot] * ny[slot] + nz[slot] * nz[slot]);
+        if (length > 0.0f) {
+            nx[slot] /= length;
+            ny[slot] /= length;
+            nz[slot] /= length;
+        }
+    }
+}
+
+int MorphAccumulator::find(const std::string& name) const {
+    for (size_t t = 0; t < targets.size(); t++) {
+        if (targets[t].name == name) {
+            return t;
+        }
+    }
+    return -1;
+}
+
+void MorphAccumulator::bounds(int slot, QVector3D& lo, QVector3D& hi) const {
+    lo = QVector3D(lowX[slot], lowY[slot], lowZ[slot]);
+    hi = QVector3D(highX[slot], highY[slot], highZ[slot]);
+}
+
+size_t MorphAccumulator::bytes() const {
+    size_t total = 0;
+    for (size_t t = 0; t < targets.size(); t++) {
+        total += targets[t].name.size() + targets[t].vertices.size() * (sizeof(int) + 6 * sizeof(int16_t))
+               + targetSlots[t].slots.size() * sizeof(int);
+    }
+    // Vertex, 18 floats of shapes and bounds and 2 marks per slot
+    return total + slotVertices.size() * (sizeof(int) + 18 * sizeof(float) + 2 * sizeof(unsigned))
+         + (touched.capacity() + changed.capacity()) * sizeof(int);
+}
+
+size_t MorphAccumulator::denseBytes() const {
+    return targets.size() * static_cast<size_t>(nbVertices) * 6 * sizeof(float);
+}
+
+void benchmarkMorphTargets(const std::string& meshFile, int nbTargets) {
+    mesh base = readMesh(meshFile);
+    QVector3D lo = base.vertexList[0];
+    QVector3D hi = lo;
+    for (const QVector3D& p : base.vertexList) {
+        for (int c = 0; c < 3; c++) {
+            lo[c] = std::min(lo[c], p[c]);
+            hi[c] = std::max(hi[c], p[c]);
+        }
+    }
+    float diagonal = (hi - lo).length();
+
+    // Smooth bumps along the normals around random vertices, from a few to a tenth of the vertices
+    std::mt19937 random(7);
+    std::uniform_int_distribution<int> anyVertex(0, base.nbVertices - 1);
+    std::uniform_real_distribution<float> radii(0.02f, 0.12f);
+    std::vector<std::vector<float>> dense(nbTargets); // x, y, z, nx, ny, nz of every vertex
+    std::vector<morphTarget> targets;
+    auto buildStart = std::chrono::steady_clock::now();
+    for (int t = 0; t < nbTargets; t++) {
+        QVector3D center = base.vertexList[anyVertex(random)];
+        float radius = radii(random) * diagonal;
+        float amplitude = (t % 2 ? -0.02f : 0.02f) * diagonal;
+        mesh shape = base;
+        for (int v = 0; v < base.nbVertices; v++) {
+            float distance = (base.vertexList[v] - center).length();
+            if (distance < radius) {
+                shape.vertexList[v] += base.normalList[v] * amplitude * 0.5f * (1.0f + std::cos(float(M_PI) * distance / radius));
+            }
+        }
+        computeNormals(shape);
+        targets.push_back(buildMorphTarget("bump" + std::to_string(t), base, shape));
+
+        dense[t].resize(6 * base.nbVertices);
+        for (int v = 0; v < base.nbVertices; v++) {
+            for (int c = 0; c < 3; c++) {
+                dense[t][6 * v + c] = shape.vertexList[v][c] - base.vertexList[v][c];
+                dense[t][6 * v + 3 + c] = shape.normalList[v][c] - base.normalList[v][c];
+            }
+        }
+    }
+    double buildTime = elapsedMs(buildStart);
+    base.morphTargets = std::move(targets);
+
+    size_t nbNonZero = 0;
+    for (const morphTarget& target : base.morphTargets) {
+        nbNonZero += target.vertices.size();
+    }
+    MorphAccumulator morphs;
+    morphs.init(base.morphTargets, base.vertexList, base.normalList);
+    std::cout << "Morph targets of " << meshFile << ": " << nbTargets << " targets built in " << buildTime << " ms, "
+              << nbNonZero << " deltas (" << 100.0 * nbNonZero / (double(nbTargets) * base.nbVertices) << "% of targets x vertices), "
+              << morphs.nbSlots() << " vertices touched; " << morphs.bytes() / 1024.0 << " KiB sparse against "
+              << morphs.denseBytes() / 1024.0 << " KiB dense\n";
+
+    // Weights move every frame, the dense reference rebuilds every vertex from float deltas
+    const int nbFrames = 200;
+    std::vector<float> weights(nbTargets);
+    std::vector<float> shape(6 * base.nbVertices);
+    for (int nbActive : {1, 4, 16, nbTargets}) {
+        if (nbActive > nbTargets) {
+            continue;
+        }
+        auto setWeights = [&](int frame) {
+            for (int t = 0; t < nbTargets; t++) {
+                weights[t] = t < nbActive ? 0.5f + 0.5f * std::sin(0.1f * frame + t) : 0.0f;
+            }
+        };
+
+        long long nbDeltas = 0;
+        auto sparseStart = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < nbFrames; frame++) {
+            setWeights(frame);
+            morphs.apply(weights.data());
+            nbDeltas += morphs.nbDeltas();
+        }
+        double sparseTime = elapsedMs(sparseStart) * 1e3 / nbFrames;
+
+        auto denseStart = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < nbFrames; frame++) {
+            setWeights(frame);
+            for (int v = 0; v < base.nbVertices; v++) {
+                for (int c = 0; c < 3; c++) {
+                    shape[6 * v + c] = base.vertexList[v][c];
+                    shape[6 * v + 3 + c] = base.normalList[v][c];
+                }
+            }
+            for (int t = 0; t < nbTargets; t++) {
+                if (weights[t] == 0.0f) {
+                    continue;
+                }
+                const float* delta = dense[t].data();
+                for (int i = 0; i < 6 * base.nbVertices; i++) {
+                    shape[i] += weights[t] * delta[i];
+                }
+            }
+            for (int v = 0; v < base.nbVertices; v++) {
+                float* n = &shape[6 * v + 3];
+                float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                n[0] /= length;
+                n[1] /= length;
+                n[2] /= length;
+            }
+        }
+        double denseTime = elapsedMs(denseStart) * 1e3 / nbFrames;
+        benchmarkSink = shape[0];
+
+        // Quantization and the vertices left out by the thresholds, on the last frame
+        float maxError = 0.0f;
+        for (int slot = 0; slot < morphs.nbSlots(); slot++) {
+            int v = morphs.vertex(slot);
+            maxError = std::max(maxError, (morphs.position(slot) - QVector3D(shape[6 * v], shape[6 * v + 1], shape[6 * v + 2])).length());
+        }
+
+        std::cout << "  " << nbActive << " active: sparse " << sparseTime << " us/frame (" << nbDeltas / nbFrames
+                  << " deltas), dense " << denseTime << " us/frame, max difference " << maxError << " mesh units\n";
+    }
+}
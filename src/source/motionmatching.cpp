@@ -0,0 +1,452 @@
+#include "../header/motionmatching.h"
+#include "../header/timing.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <random>
+
+#include <QQuaternion>
+#include <QVector3D>
+
+static const int leafSize = 16;
+static const int searchBlock = 256; // Rows scored together by the brute force search
+static const float horizons[3] = {1.0f / 3.0f, 2.0f / 3.0f, 1.0f}; // Seconds ahead of the trajectory samples
+
+// Feature groups as [first, last), normalized together
+static const int featureGroups[][2] = {{0, 6}, {6, 12}, {12, 15}, {15, 21}, {21, 27}};
+
+// Global transforms of the joints the features use, at every keyframe
+struct clipMotion {
+    int nbFrames = 0;
+    float frameTime = 0;
+    std::vector<QVector3D> hips;
+    std::vector<QQuaternion> hipsRotation;
+    std::vector<QVector3D> leftFoot;
+    std::vector<QVector3D> rightFoot;
+};
+
+static bool evaluateClip(const std::vector<BVHTree*>& roots, clipMotion& motion) {
+    std::vector<BVHTree*> nodes = preorder(roots);
+    int hips = -1, leftFoot = -1, rightFoot = -1;
+    for (size_t n = 0; n < nodes.size(); n++) {
+        std::string name = normalizedName(nodes[n]->name);
+        if ((name == "hips" || name == "pelvis") && hips < 0) {
+            hips = n;
+        } else if (name == "l_foot") {
+            leftFoot = n;
+        } else if (name == "r_foot") {
+            rightFoot = n;
+        }
+    }
+    if (hips < 0 || leftFoot < 0 || rightFoot < 0 || nodes[hips]->channelsValues.size() < 2) {
+        return false;
+    }
+
+    const std::vector<std::vector<float>>& timeline = nodes[hips]->channelsValues;
+    motion.nbFrames = timeline.size();
+    motion.frameTime = (timeline.back()[0] - timeline.front()[0]) / (motion.nbFrames - 1);
+
+    // Sampled at the keyframe times of the hips, the keyframes themselves
+    std::vector<QVector3D> positions(nodes.size());
+    std::vector<QQuaternion> rotations(nodes.size());
+    std::vector<int> cursors(nodes.size(), 0);
+    hips = nodes[hips]->nodeIndex;
+    leftFoot = nodes[leftFoot]->nodeIndex;
+    rightFoot = nodes[rightFoot]->nodeIndex;
+    for (int f = 0; f < motion.nbFrames; f++) {
+        evaluatePose(nodes, timeline[f][0], cursors, rotations, positions);
+        motion.hips.push_back(positions[hips]);
+        motion.hipsRotation.push_back(rotations[hips]);
+        motion.leftFoot.push_back(positions[leftFoot]);
+        motion.rightFoot.push_back(positions[rightFoot]);
+    }
+    return true;
+}
+
+static int horizonFrames(const clipMotion& motion, int h) {
+    return std::max(1, static_cast<int>(std::lround(horizons[h] / motion.frameTime)));
+}
+
+// Facing of the hips (their +Z) on the ground
+static QVector3D facing(const clipMotion& motion, int f) {
+    QVector3D forward = motion.hipsRotation[f].rotatedVector(QVector3D(0.0f, 0.0f, 1.0f));
+    forward.setY(0.0f);
+    return forward.lengthSquared() > 0.0f ? forward.normalized() : QVector3D(0.0f, 0.0f, 1.0f);
+}
+
+// Unnormalized features, false if the trajectory runs past the end of the clip
+static bool rawFeatures(const clipMotion& motion, int f, float* features) {
+    if (f < 0 || f + horizonFrames(motion, 2) >= motion.nbFrames) {
+        return false;
+    }
+
+    QVector3D origin(motion.hips[f].x(), 0.0f, motion.hips[f].z());
+    QVector3D forward = facing(motion, f);
+    QQuaternion toCharacter = QQuaternion::fromAxisAndAngle(QVector3D(0.0f, 1.0f, 0.0f),
+                                                            -std::atan2(forward.x(), forward.z()) * 180.0f / M_PI);
+    float rate = 1.0f / motion.frameTime;
+
+    QVector3D vectors[5] = {
+        toCharacter.rotatedVector(motion.leftFoot[f] - origin),
+        toCharacter.rotatedVector(motion.rightFoot[f] - origin),
+        toCharacter.rotatedVector((motion.leftFoot[f + 1] - motion.leftFoot[f]) * rate),
+        toCharacter.rotatedVector((motion.rightFoot[f + 1] - motion.rightFoot[f]) * rate),
+        toCharacter.rotatedVector((motion.hips[f + 1] - motion.hips[f]) * rate),
+    };
+    int d = 0;
+    for (const auto& v : vectors) {
+        features[d++] = v.x();
+        features[d++] = v.y();
+        features[d++] = v.z();
+    }
+
+    for (int h = 0; h < 3; h++) {
+        int future = f + horizonFrames(motion, h);
+        QVector3D position = toCharacter.rotatedVector(QVector3D(motion.hips[future].x(), 0.0f, motion.hips[future].z()) - origin);
+        features[d + 2 * h] = position.x();
+        features[d + 2 * h + 1] = position.z();
+        QVector3D direction = toCharacter.rotatedVector(facing(motion, future));
+        features[d + 6 + 2 * h] = direction.x();
+        features[d + 6 + 2 * h + 1] = direction.z();
+    }
+    return true;
+}
+
+void MotionDatabase::build(ClipLibrary& library) {
+    std::vector<float> rows;
+    std::vector<motionEntry> rowEntries;
+    names.clear();
+
+    float features[nbMotionFeatures];
+    for (const auto& clip : library.clips()) {
+        clipMotion motion;
+        try {
+            if (!evaluateClip(library.acquire(clip.name)->roots, motion)) {
+                std::cerr << "Clip " << clip.name << " lacks the hips or the feet, left out of the motion database\n";
+                continue;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error reading clip " << clip.name << ": " << e.what() << "\n";
+            continue;
+        }
+
+        names.push_back(clip.name);
+        for (int f = 0; rawFeatures(motion, f, features); f++) {
+            rows.insert(rows.end(), features, features + nbMotionFeatures);
+            rowEntries.push_back({static_cast<int>(names.size()) - 1, f});
+        }
+    }
+
+    // Mean per feature, deviation per group so the axes of a vector keep their proportions
+    size_t nbRows = rowEntries.size();
+    for (int d = 0; d < nbMotionFeatures; d++) {
+        double sum = 0;
+        for (size_t r = 0; r < nbRows; r++) {
+            sum += rows[r * nbMotionFeatures + d];
+        }
+        mean[d] = nbRows ? sum / nbRows : 0.0;
+    }
+    for (const auto& group : featureGroups) {
+        double variance = 0;
+        for (int d = group[0]; d < group[1]; d++) {
+            for (size_t r = 0; r < nbRows; r++) {
+                double diff = rows[r * nbMotionFeatures + d] - mean[d];
+                variance += diff * diff;
+            }
+        }
+        variance /= std::max<size_t>(1, nbRows * (group[1] - group[0]));
+        for (int d = group[0]; d < group[1]; d++) {
+            deviation[d] = std::max(std::sqrt(variance), 1e-6);
+        }
+    }
+    for (size_t r = 0; r < nbRows; r++) {
+        for (int d = 0; d < nbMotionFeatures; d++) {
+            rows[r * nbMotionFeatures + d] = (rows[r * nbMotionFeatures + d] - mean[d]) / deviation[d];
+        }
+    }
+
+    build(rows, rowEntries);
+}
+
+void MotionDatabase::build(const std::vector<float>& rows, const std::vector<motionEntry>& rowEntries) {
+    entries = rowEntries;
+    int n = entries.size();
+
+    // Whole blocks, the padding rows are infinitely far from any query
+    stride = (n + searchBlock - 1) / searchBlock * searchBlock;
+    columns.assign(static_cast<size_t>(stride) * nbMotionFeatures, std::numeric_limits<float>::infinity());
+    for (int r = 0; r < n; r++) {
+        for (int d = 0; d < nbMotionFeatures; d++) {
+            columns[static_cast<size_t>(d) * stride + r] = rows[static_cast<size_t>(r) * nbMotionFeatures + d];
+        }
+    }
+
+    nodes.clear();
+    std::vector<int> order(n);
+    for (int r = 0; r < n; r++) {
+        order[r] = r;
+    }
+    if (n > 0) {
+        buildTree(0, n, order);
+    }
+
+    // Leaves are contiguous ranges of order
+    treeRows.resize(static_cast<size_t>(n) * nbMotionFeatures);
+    for (int i = 0; i < n; i++) {
+        for (int d = 0; d < nbMotionFeatures; d++) {
+            treeRows[static_cast<size_t>(i) * nbMotionFeatures + d] = columns[static_cast<size_t>(d) * stride + order[i]];
+        }
+    }
+    treeRowIndex = order;
+}
+
+// Median split on the widest feature of the range
+int MotionDatabase::buildTree(int first, int count, std::vector<int>& order) {
+    int index = nodes.size();
+    nodes.push_back({-1, 0.0f, {-1, -1}, first, count});
+    if (count <= leafSize) {
+        return index;
+    }
+
+    int dimension = 0;
+    float widest = -1.0f;
+    for (int d = 0; d < nbMotionFeatures; d++) {
+        const float* column = &columns[static_cast<size_t>(d) * stride];
+        float low = std::numeric_limits<float>::max();
+        float high = std::numeric_limits<float>::lowest();
+        for (int i = first; i < first + count; i++) {
+            low = std::min(low, column[order[i]]);
+            high = std::max(high, column[order[i]]);
+        }
+        if (high - low > widest) {
+            widest = high - low;
+            dimension = d;
+        }
+    }
+    if (widest <= 0.0f) {
+        return index; // Identical rows, kept in one leaf
+    }
+
+    const float* column = &columns[static_cast<size_t>(dimension) * stride];
+    int half = count / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                     [&](int a, int b) { return column[a] < column[b]; });
+
+    // Read before the children reorder their ranges
+    float split = column[order[first + half]];
+    int left = buildTree(first, half, order);
+    int right = buildTree(first + half, count - half, order);
+    nodes[index] = {dimension, split, {left, right}, first, count};
+    return index;
+}
+
+void MotionDatabase::frameFeatures(int row, float* features) const {
+    for (int d = 0; d < nbMotionFeatures; d++) {
+        features[d] = columns[static_cast<size_t>(d) * stride + row];
+    }
+}
+
+bool MotionDatabase::clipFeatures(const std::vector<BVHTree*>& clip, int frame, float* features) const {
+    clipMotion motion;
+    if (!evaluateClip(clip, motion) || !rawFeatures(motion, frame, features)) {
+        return false;
+    }
+    for (int d = 0; d < nbMotionFeatures; d++) {
+        features[d] = (features[d] - mean[d]) / deviation[d];
+    }
+    return true;
+}
+
+motionMatch MotionDatabase::searchBruteForce(const float* query) const {
+    // Blocks of rows small enough for the distances to stay in cache, each column is read
+    // contiguously and the block size is fixed so the inner loop vectorizes
+    float distances[searchBlock];
+
+    motionMatch best;
+    best.distance = std::numeric_limits<float>::max();
+    for (int first = 0; first < stride; first += searchBlock) {
+        std::fill(distances, distances + searchBlock, 0.0f);
+        for (int d = 0; d < nbMotionFeatures; d++) {
+            const float* column = &columns[static_cast<size_t>(d) * stride + first];
+            float q = query[d];
+            for (int i = 0; i < searchBlock; i++) {
+                float diff = column[i] - q;
+                distances[i] += diff * diff;
+            }
+        }
+        for (int i = 0; i < searchBlock; i++) {
+            if (distances[i] < best.distance) {
+                best.distance = distances[i];
+                best.row = first + i;
+            }
+        }
+    }
+    best.distance = best.row >= 0 ? std::sqrt(best.distance) : 0.0f;
+    return best;
+}
+
+motionMatch MotionDatabase::searchTree(const float* query, int maxLeaves) const {
+    motionMatch best;
+    best.distance = std::numeric_limits<float>::max();
+    int leavesLeft = maxLeaves > 0 ? maxLeaves : std::numeric_limits<int>::max();
+    if (!nodes.empty()) {
+        searchNode(0, query, best, leavesLeft);
+    }
+    best.distance = best.row >= 0 ? std::sqrt(best.distance) : 0.0f;
+    return best;
+}
+
+// Nearer child first, the other one only if the splitting plane is closer than the best match
+void MotionDatabase::searchNode(int index, const float* query, motionMatch& best, int& leavesLeft) const {
+    const kdNode& node = nodes[index];
+    if (node.dimension < 0) {
+        if (leavesLeft == 0) {
+            return;
+        }
+        leavesLeft--;
+        for (int i = node.first; i < node.first + node.count; i++) {
+            const float* row = &treeRows[static_cast<size_t>(i) * nbMotionFeatures];
+            float distance = 0.0f;
+            for (int d = 0; d < nbMotionFeatures && distance < best.distance; d++) {
+                float diff = row[d] - query[d];
+                distance += diff * diff;
+            }
+            if (distance < best.distance) {
+                best.distance = distance;
+                best.row = treeRowIndex[i];
+            }
+        }
+        return;
+    }
+
+    float diff = query[node.dimension] - node.split;
+    int nearer = diff < 0.0f ? 0 : 1;
+    searchNode(node.children[nearer], query, best, leavesLeft);
+    if (diff * diff < best.distance) {
+        searchNode(node.children[1 - nearer], query, best, leavesLeft);
+    }
+}
+
+size_t MotionDatabase::memoryBytes() const {
+    return entries.capacity() * sizeof(motionEntry) + columns.capacity() * sizeof(float) + nodes.capacity() * sizeof(kdNode)
+         + treeRows.capacity() * sizeof(float) + treeRowIndex.capacity() * sizeof(int);
+}
+
+// Row major scan, what a search without the column layout costs
+static motionMatch scanRows(const std::vector<float>& rows, const float* query) {
+    motionMatch best;
+    best.distance = std::numeric_limits<float>::max();
+    int n = rows.size() / nbMotionFeatures;
+    for (int r = 0; r < n; r++) {
+        float distance = 0.0f;
+        for (int d = 0; d < nbMotionFeatures; d++) {
+            float diff = rows[static_cast<size_t>(r) * nbMotionFeatures + d] - query[d];
+            distance += diff * diff;
+        }
+        if (distance < best.distance) {
+            best.distance = distance;
+            best.row = r;
+        }
+    }
+    best.distance = std::sqrt(best.distance);
+    return best;
+}
+
+static void benchmarkSearches(const MotionDatabase& database, const std::vector<float>& rows, const std::string& label) {
+    // Queries near database frames, as a pose and a desired trajectory close to the data would be
+    const int nbQueries = 2000;
+    std::mt19937 random(7);
+    std::uniform_int_distribution<int> pickRow(0, database.nbFrames() - 1);
+    std::normal_distribution<float> noise(0.0f, 0.25f);
+    std::vector<float> queries(nbQueries * nbMotionFeatures);
+    for (int q = 0; q < nbQueries; q++) {
+        database.frameFeatures(pickRow(random), &queries[q * nbMotionFeatures]);
+        for (int d = 0; d < nbMotionFeatures; d++) {
+            queries[q * nbMotionFeatures + d] += noise(random);
+        }
+    }
+
+    std::vector<motionMatch> exact(nbQueries);
+    for (int q = 0; q < nbQueries; q++) {
+        exact[q] = database.searchBruteForce(&queries[q * nbMotionFeatures]);
+    }
+
+    struct method {
+        const char* name;
+        int maxLeaves; // -1 row scan, -2 column brute force
+    };
+    const method methods[] = {{"row major scan", -1}, {"column brute force", -2}, {"k-d tree exact", 0},
+                              {"k-d tree 32 leaves", 32}, {"k-d tree 8 leaves", 8}, {"k-d tree 2 leaves", 2}};
+    for (const auto& m : methods) {
+        int nbFound = 0;
+        double distanceRatio = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int q = 0; q < nbQueries; q++) {
+            const float* query = &queries[q * nbMotionFeatures];
+            motionMatch match = m.maxLeaves == -1 ? scanRows(rows, query)
+                              : m.maxLeaves == -2 ? database.searchBruteForce(query) : database.searchTree(query, m.maxLeaves);
+            // Ties count as found, several frames can be exactly as close
+            nbFound += match.distance <= exact[q].distance * (1.0f + 1e-5f);
+            distanceRatio += exact[q].distance > 0.0f ? match.distance / exact[q].distance : 1.0;
+        }
+        double time = elapsedMs(start);
+        std::cout << label << ", " << m.name << ": " << nbQueries / (time / 1000.0) << " queries/s, "
+                  << time * 1000.0 / nbQueries << " us per query, recall " << 100.0 * nbFound / nbQueries
+                  << " %, distance " << distanceRatio / nbQueries << " x the nearest\n";
+    }
+}
+
+void benchmarkMotionMatching(ClipLibrary& library) {
+    MotionDatabase database;
+    auto start = std::chrono::steady_clock::now();
+    database.build(library);
+    double buildTime = elapsedMs(start);
+    std::cout << "Motion database: " << database.nbFrames() << " frames of " << database.clipNames().size() << " clips, "
+              << nbMotionFeatures << " features, " << database.memoryBytes() / 1024.0 << " KiB, built in " << buildTime << " ms\n";
+    if (database.nbFrames() == 0) {
+        return;
+    }
+
+    // A frame of a clip must find itself
+    const motionEntry& probe = database.entry(database.nbFrames() / 2);
+    float features[nbMotionFeatures];
+    if (database.clipFeatures(library.acquire(database.clipNames()[probe.clip])->roots, probe.frame, features)) {
+        motionMatch match = database.searchTree(features);
+        const motionEntry& found = database.entry(match.row);
+        std::cout << "Query " << database.clipNames()[probe.clip] << " frame " << probe.frame << " matched "
+                  << database.clipNames()[found.clip] << " frame " << found.frame << " at distance " << match.distance << "\n";
+    }
+
+    std::vector<float> rows(database.nbFrames() * nbMotionFeatures);
+    std::vector<motionEntry> rowEntries;
+    for (int r = 0; r < database.nbFrames(); r++) {
+        database.frameFeatures(r, &rows[r * nbMotionFeatures]);
+        rowEntries.push_back(database.entry(r));
+    }
+    benchmarkSearches(database, rows, "Library");
+
+    // Hours of motion capture are far larger: jittered copies of the library frames
+    const int nbSyntheticFrames = 100000;
+    std::mt19937 random(11);
+    std::normal_distribution<float> jitter(0.0f, 0.1f);
+    std::vector<float> syntheticRows(static_cast<size_t>(nbSyntheticFrames) * nbMotionFeatures);
+    std::vector<motionEntry> syntheticEntries(nbSyntheticFrames);
+    for (int r = 0; r < nbSyntheticFrames; r++) {
+        int source = r % database.nbFrames();
+        for (int d = 0; d < nbMotionFeatures; d++) {
+            syntheticRows[static_cast<size_t>(r) * nbMotionFeatures + d] = rows[source * nbMotionFeatures + d] + jitter(random);
+        }
+        syntheticEntries[r] = rowEntries[source];
+    }
+    MotionDatabase synthetic;
+    start = std::chrono::steady_clock::now();
+    synthetic.build(syntheticRows, syntheticEntries);
+    std::cout << "Synthetic database: " << synthetic.nbFrames() << " frames, " << synthetic.memoryBytes() / (1024.0 * 1024.0)
+              << " MiB, built in " << elapsedMs(start) << " ms\n";
+    benchmarkSearches(synthetic, syntheticRows, "Synthetic");
+}
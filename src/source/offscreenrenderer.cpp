@@ -0,0 +1,418 @@
+#include "../header/offscreenrenderer.h"
+
+#include <QDir>
+#include <QElapsedTimer>
+
+OffscreenRenderer::OffscreenRenderer(int width, int height)
+    : width(width), height(height)
+{
+}
+
+OffscreenRenderer::~OffscreenRenderer()
+{
+    if (context.isValid()) {
+        context.makeCurrent(&surface);
+        delete geometries;
+        delete fbo;
+        context.doneCurrent();
+    }
+}
+
+bool OffscreenRenderer::init()
+{
+    context.setFormat(QSurfaceFormat::defaultFormat());
+    if (!context.create()) {
+        std::cerr << "Error creating the offscreen OpenGL context\n";
+        return false;
+    }
+
+    surface.setFormat(context.format());
+    surface.create();
+    if (!context.makeCurrent(&surface)) {
+        std::cerr << "Error making the offscreen OpenGL context current\n";
+        return false;
+    }
+
+    initializeOpenGLFunctions();
+    std::cout << "Offscreen renderer: " << reinterpret_cast<const char*>(glGetString(GL_RENDERER)) << "\n";
+
+    glClearColor(0, 0, 0, 1);
+
+    geometries = new GeometryEngine();
+    geometries->printShaderStats();
+
+    // Golden frames and benchmarks need the whole scene from the first frame
+    geometries->waitForAssets();
+    if (!geometries->assetsReady()) {
+        geometries->printAssetProgress();
+        return false;
+    }
+    resize(width, height);
+    return true;
+}
+
+void OffscreenRenderer::resize(int w, int h)
+{
+    width = w;
+    height = h;
+
+    delete fbo;
+    QOpenGLFramebufferObjectFormat format;
+    format.setAttachment(QOpenGLFramebufferObject::Depth);
+    fbo = new QOpenGLFramebufferObject(width, height, format);
+
+    // Same camera as MainWidget::resizeGL
+    qreal aspect = qreal(width) / qreal(height ? height : 1);
+    const qreal zNear = 3.0, zFar = 7.0, fov = 45.0;
+    projection.setToIdentity();
+    projection.perspective(fov, aspect, zNear, zFar);
+
+    if (geometries) {
+        geometries->setViewportHeight(height);
+    }
+}
+
+bool OffscreenRenderer::setSkinningMode(GeometryEngine::SkinningMode mode)
+{
+    return geometries->setSkinningMode(mode);
+}
+
+bool OffscreenRenderer::setSkinningVariant(GeometryEngine::SkinningMethod method, int nbInfluences)
+{
+    return geometries->setSkinningVariant(method, nbInfluences);
+}
+
+bool OffscreenRenderer::setClip(const std::string& name, size_t budget)
+{
+    if (budget > 0) {
+        geometries->setClipBudget(budget);
+    }
+    if (!geometries->playClip(name)) {
+        return false;
+    }
+    geometries->waitForAssets();
+    geometries->printClipStats();
+    return geometries->clipName() == name;
+}
+
+void OffscreenRenderer::setPoseBaking(bakePrecision precision)
+{
+    geometries->setPoseBaking(true, precision);
+}
+
+void OffscreenRenderer::setLodSelection(float maxPixelError)
+{
+    geometries->setLodSelection(maxPixelError);
+}
+
+bool OffscreenRenderer::setGpuPose(bool enabled)
+{
+    return geometries->setGpuPose(enabled);
+}
+
+void OffscreenRenderer::setMorphWeight(const std::string& name, float weight)
+{
+    geometries->setMorphWeight(name, weight);
+}
+
+void OffscreenRenderer::drawFrame(float time, int nbPasses)
+{
+    geometries->updateAnimation(time);
+
+    fbo->bind();
+    glViewport(0, 0, width, height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+
+    QMatrix4x4 matrix;
+    matrix.translate(0.0, 0.0, -5.0);
+
+    for (int pass = 0; pass < nbPasses; pass++) {
+        geometries->drawScene(projection * matrix);
+    }
+}
+
+// Instances on a grid receding from the camera, each one a quarter second further in the clip
+void OffscreenRenderer::drawCrowd(float time, int nbInstances)
+{
+    fbo->bind();
+    glViewport(0, 0, width, height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+
+    int side = std::max(1, int(std::ceil(std::sqrt(float(nbInstances)))));
+    for (int i = 0; i < nbInstances; i++) {
+        QMatrix4x4 matrix;
+        matrix.translate(((i % side) - 0.5f * (side - 1)) * 0.3f, 0.0, -5.0 - (i / side) * 0.2f);
+        geometries->updateAnimation(time + i * 0.25f);
+        geometries->drawScene(projection * matrix);
+    }
+}
+
+QImage OffscreenRenderer::renderFrame(float time)
+{
+    drawFrame(time);
+    return fbo->toImage();
+}
+
+bool OffscreenRenderer::renderClip(const QString& outputDir, int nbFrames, float frameInterval)
+{
+    QDir().mkpath(outputDir);
+    for (int f = 0; f < nbFrames; f++) {
+        QString fileName = QDir(outputDir).filePath(QString("frame_%1.png").arg(f, 4, 10, QChar('0')));
+        if (!renderFrame(f * frameInterval).save(fileName)) {
+            std::cerr << "Error writing " << fileName.toStdString() << "\n";
+            return false;
+        }
+    }
+    std::cout << nbFrames << " frames written to " << outputDir.toStdString() << "\n";
+    return true;
+}
+
+bool OffscreenRenderer::captureClip(const captureOptions& options, int nbFrames, float frameInterval)
+{
+    FrameCapture capture;
+    captureOptions settings = options;
+    settings.dropWhenBusy = false;
+    if (!capture.start(width, height, settings)) {
+        return false;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int f = 0; f < nbFrames; f++) {
+        drawFrame(f * frameInterval);
+        capture.capture();
+    }
+    double renderTime = timer.nsecsElapsed() / 1e6;
+    capture.finish();
+
+    std::cout << nbFrames << " frames rendered in " << renderTime << " ms, written after " << timer.nsecsElapsed() / 1e6 << " ms\n";
+    capture.printStats();
+    return capture.stats().failed == 0;
+}
+
+int imageDifference(const QImage& image, const QImage& golden, int tolerance, double& meanError)
+{
+    QImage a = image.convertToFormat(QImage::Format_RGBA8888);
+    QImage b = golden.convertToFormat(QImage::Format_RGBA8888);
+
+    int mismatch = 0;
+    double errorSum = 0;
+    for (int y = 0; y < a.height(); y++) {
+        const uchar* lineA = a.constScanLine(y);
+        const uchar* lineB = b.constScanLine(y);
+        for (int x = 0; x < a.width(); x++) {
+            int maxError = 0;
+            for (int c = 0; c < 4; c++) {
+                int error = std::abs(lineA[4 * x + c] - lineB[4 * x + c]);
+                maxError = std::max(maxError, error);
+                errorSum += error;
+            }
+            if (maxError > tolerance) {
+                mismatch++;
+            }
+        }
+    }
+    meanError = errorSum / (4.0 * a.width() * a.height());
+    return mismatch;
+}
+
+bool OffscreenRenderer::compareWithGolden(const QString& goldenDir, int nbFrames, float frameInterval, int tolerance, double maxMismatch)
+{
+    bool success = true;
+    for (int f = 0; f < nbFrames; f++) {
+        QString fileName = QDir(goldenDir).filePath(QString("frame_%1.png").arg(f, 4, 10, QChar('0')));
+        QImage golden(fileName);
+        if (golden.isNull()) {
+            std::cerr << "Missing golden frame " << fileName.toStdString() << "\n";
+            success = false;
+            continue;
+        }
+        if (golden.width() != width || golden.height() != height) {
+            resize(golden.width(), golden.height());
+        }
+
+        double meanError = 0;
+        int mismatch = imageDifference(renderFrame(f * frameInterval), golden, tolerance, meanError);
+        double ratio = double(mismatch) / (width * height);
+        bool ok = ratio <= maxMismatch;
+        success = success && ok;
+
+        std::cout << "Frame " << f << ": " << mismatch << " pixels over tolerance (" << ratio * 100.0
+                  << " %), mean error " << meanError << (ok ? "" : " FAILED") << "\n";
+    }
+    return success;
+}
+
+void OffscreenRenderer::benchmark(int nbFrames)
+{
+    const int sizes[][2] = {{640, 480}, {1280, 720}, {1920, 1080}};
+    const int passes[] = {1, 4};
+    const GeometryEngine::SkinningMode modes[] = {GeometryEngine::SkinInShader, GeometryEngine::SkinOnce, GeometryEngine::SkinOnCpu};
+    const char* modeNames[] = {" skin in shader, ", " skin once, ", " skin on CPU, "};
+    GeometryEngine::SkinningMode initialMode = geometries->skinningMode();
+
+    for (const auto& size : sizes) {
+        resize(size[0], size[1]);
+
+        for (auto mode : modes) {
+            if (!geometries->setSkinningMode(mode)) {
+                continue;
+            }
+            for (int nbPasses : passes) {
+                // Warm up, the first frame compiles the shader variants on some drivers
+                drawFrame(0.0f, nbPasses);
+                glFinish();
+
+                QElapsedTimer timer;
+                timer.start();
+                for (int f = 0; f < nbFrames; f++) {
+                    drawFrame(f / 60.0f, nbPasses);
+                }
+                glFinish();
+                double seconds = timer.nsecsElapsed() / 1e9;
+
+                std::cout << size[0] << "x" << size[1] << modeNames[mode]
+                          << nbPasses << " pass" << (nbPasses > 1 ? "es: " : ": ") << nbFrames / seconds << " fps ("
+                          << seconds * 1000.0 / nbFrames << " ms/frame)\n";
+                geometries->printSkinningStats();
+            }
+        }
+    }
+    geometries->setSkinningMode(initialMode);
+
+    // Driver overhead grows with the number of draws, not the resolution: many passes on a small frame
+    resize(640, 480);
+    const int nbSubmissionPasses = 16;
+    for (bool caching : {false, true}) {
+        geometries->setStateCaching(caching);
+        drawFrame(0.0f, nbSubmissionPasses);
+        glFinish();
+        geometries->resetRenderStats();
+
+        QElapsedTimer timer;
+        timer.start();
+        for (int f = 0; f < nbFrames; f++) {
+            drawFrame(f / 60.0f, nbSubmissionPasses);
+        }
+        glFinish();
+        double seconds = timer.nsecsElapsed() / 1e9;
+
+        std::cout << "640x480 " << nbSubmissionPasses << " passes" << (caching ? "" : ", no state caching") << ": "
+                  << nbFrames / seconds << " fps (" << seconds * 1000.0 / nbFrames << " ms/frame)\n";
+        geometries->printRenderStats();
+    }
+
+    // First switch to a variant compiles it or loads its binary, the second one is a memory hit
+    GeometryEngine::SkinningMethod initialMethod = geometries->skinningMethod();
+    int initialInfluences = geometries->skinningInfluences();
+    for (int round = 0; round < 2; round++) {
+        for (auto method : {GeometryEngine::LinearBlend, GeometryEngine::DualQuaternion}) {
+            for (int nbInfluences : {1, 2, 4, 8}) {
+                QElapsedTimer timer;
+                timer.start();
+                geometries->setSkinningVariant(method, nbInfluences);
+                drawFrame(0.0f);
+                glFinish();
+                std::cout << (method == GeometryEngine::DualQuaternion ? "DQS " : "LBS ") << nbInfluences << " influences, "
+                          << (round == 0 ? "first" : "second") << " switch and frame: " << timer.nsecsElapsed() / 1e6 << " ms\n";
+            }
+        }
+    }
+    geometries->setSkinningVariant(initialMethod, initialInfluences);
+
+    // Every level of the skin forced in turn, the frame cost follows the triangles
+    resize(640, 480);
+    for (int level = 0; level < geometries->nbLods(); level++) {
+        geometries->forceLod(level);
+        drawFrame(0.0f, nbSubmissionPasses);
+        glFinish();
+
+        QElapsedTimer timer;
+        timer.start();
+        for (int f = 0; f < nbFrames; f++) {
+            drawFrame(f / 60.0f, nbSubmissionPasses);
+        }
+        glFinish();
+        double seconds = timer.nsecsElapsed() / 1e9;
+
+        const meshLod& lod = geometries->lod(level);
+        std::cout << "640x480 LOD " << level << " (" << lod.nbIndices / 3 << " triangles, " << lod.nbVertices
+                  << " vertices), " << nbSubmissionPasses << " passes: " << nbFrames / seconds << " fps ("
+                  << seconds * 1000.0 / nbFrames << " ms/frame)\n";
+    }
+    geometries->forceLod(-1);
+    geometries->printLodStats();
+
+    // On the CPU each instance evaluates the hierarchy and uploads its palette, on the GPU it sets its time
+    const int nbInstances = 64;
+    bool initialGpuPose = geometries->gpuPose();
+    for (bool gpu : {false, true}) {
+        if (!geometries->setGpuPose(gpu)) {
+            continue;
+        }
+        drawCrowd(0.0f, nbInstances);
+        glFinish();
+
+        QElapsedTimer timer;
+        timer.start();
+        qint64 cpuTime = 0;
+        for (int f = 0; f < nbFrames; f++) {
+            QElapsedTimer cpuTimer;
+            cpuTimer.start();
+            drawCrowd(f / 60.0f, nbInstances);
+            cpuTime += cpuTimer.nsecsElapsed();
+            glFinish();
+        }
+        double seconds = timer.nsecsElapsed() / 1e9;
+
+        std::cout << "640x480 crowd of " << nbInstances << (gpu ? ", GPU poses: " : ", CPU poses: ") << nbFrames / seconds
+                  << " fps (" << seconds * 1000.0 / nbFrames << " ms/frame, " << cpuTime / 1e3 / (double(nbFrames) * nbInstances)
+                  << " us of CPU per instance)\n";
+    }
+    geometries->setGpuPose(initialGpuPose);
+
+    // A synchronous read stalls until the frame is drawn, the ring maps it once the GPU is done
+    resize(1280, 720);
+    const char* readbackNames[] = {"no readback", "synchronous readback", "pixel buffer capture"};
+    for (int readback = 0; readback < 3; readback++) {
+        FrameCapture capture;
+        if (readback == 2) {
+            captureOptions options;
+            options.format = CaptureYuv;
+            options.directory = QDir::tempPath().toStdString() + "/cube_capture";
+            if (!capture.start(width, height, options)) {
+                continue;
+            }
+        }
+        drawFrame(0.0f);
+        glFinish();
+
+        QElapsedTimer timer;
+        timer.start();
+        for (int f = 0; f < nbFrames; f++) {
+            drawFrame(f / 60.0f);
+            if (readback == 1) {
+                QImage image = fbo->toImage();
+            } else if (readback == 2) {
+                capture.capture();
+            }
+        }
+        glFinish();
+        double seconds = timer.nsecsElapsed() / 1e9;
+
+        std::cout << "1280x720 " << readbackNames[readback] << ": " << nbFrames / seconds << " fps ("
+                  << seconds * 1000.0 / nbFrames << " ms/frame)\n";
+        if (readback == 2) {
+            capture.finish();
+            capture.printStats();
+        }
+    }
+    geometries->printCullingStats();
+    geometries->printBakeStats();
+    geometries->printMorphStats();
+    geometries->printShaderStats();
+}
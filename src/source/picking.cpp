@@ -0,0 +1,516 @@
+#include "../header/picking.h"
+#include "../header/mesh.h"
+#include "../header/jobsystem.h"
+#include "../header/timing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+
+// Leaves stop at this many triangles whatever the heuristic says, and are only made bigger when
+// their triangles share one centroid
+static const int maxLeafTriangles = 4;
+static const int nbSahBins = 12;
+// Deeper nodes are leaves, the query stack holds two entries per level
+static const int maxTreeDepth = 64;
+// Subtrees refit by jobs of their own, the nodes above them after
+static const int nbRefitSubtrees = 64;
+
+static QVector3D minimum(const QVector3D& a, const QVector3D& b) {
+    return QVector3D(std::min(a.x(), b.x()), std::min(a.y(), b.y()), std::min(a.z(), b.z()));
+}
+
+static QVector3D maximum(const QVector3D& a, const QVector3D& b) {
+    return QVector3D(std::max(a.x(), b.x()), std::max(a.y(), b.y()), std::max(a.z(), b.z()));
+}
+
+static float surfaceArea(const QVector3D& low, const QVector3D& high) {
+    QVector3D size = high - low;
+    return 2.0f * (size.x() * size.y() + size.y() * size.z() + size.z() * size.x());
+}
+
+static float surfaceArea(const aabb& box) {
+    return box.empty() ? 0.0f : surfaceArea(box.min, box.max);
+}
+
+pickRay rayFromViewport(const QMatrix4x4& projection, const QMatrix4x4& modelView, float x, float y, int width, int height) {
+    float ndcX = 2.0f * x / width - 1.0f;
+    float ndcY = 1.0f - 2.0f * y / height;
+    QMatrix4x4 inverse = (projection * modelView).inverted();
+    QVector3D nearPoint = inverse.map(QVector3D(ndcX, ndcY, -1.0f));
+    QVector3D farPoint = inverse.map(QVector3D(ndcX, ndcY, 1.0f));
+    return {nearPoint, (farPoint - nearPoint).normalized()};
+}
+
+void TriangleBvh::clear() {
+    nodes.clear();
+    order.clear();
+    indices.clear();
+    leafIndices.clear();
+    subtrees.clear();
+    topNodes.clear();
+    vertices.clear();
+    treeDepth = 0;
+    nodeTests = 0;
+    triangleTests = 0;
+}
+
+void TriangleBvh::build(const std::vector<QVector3D>& positions, const std::vector<int>& triangleIndices) {
+    clear();
+    vertices = positions;
+    indices = triangleIndices;
+    int nbTris = nbTriangles();
+    if (nbTris == 0) {
+        return;
+    }
+
+    std::vector<aabb> boxes(nbTris);
+    std::vector<QVector3D> centers(nbTris);
+    for (int t = 0; t < nbTris; t++) {
+        for (int k = 0; k < 3; k++) {
+            boxes[t].add(vertices[indices[3 * t + k]]);
+        }
+        centers[t] = boxes[t].center();
+    }
+    order.resize(nbTris);
+    for (int t = 0; t < nbTris; t++) {
+        order[t] = t;
+    }
+    nodes.reserve(2 * nbTris / maxLeafTriangles + 1);
+    buildNode(0, nbTris, boxes, centers, 1);
+
+    // The vertices of the triangles of a leaf are contiguous, a refit or a query reads them in a row
+    leafIndices.resize(indices.size());
+    for (int i = 0; i < nbTris; i++) {
+        std::copy(&indices[3 * order[i]], &indices[3 * order[i]] + 3, &leafIndices[3 * i]);
+    }
+
+    // Inner nodes are split a level at a time until there are enough subtrees, a subtree is a range of nodes
+    std::vector<int> roots = {0};
+    bool split = true;
+    while (split && roots.size() < nbRefitSubtrees) {
+        split = false;
+        std::vector<int> children;
+        for (int n : roots) {
+            if (nodes[n].count > 0) {
+                children.push_back(n);
+                continue;
+            }
+            topNodes.push_back(n);
+            children.push_back(n + 1);
+            children.push_back(nodes[n].first);
+            split = true;
+        }
+        roots.swap(children);
+    }
+    for (int root : roots) {
+        int end = root;
+        while (nodes[end].count == 0) {
+            end = nodes[end].first;
+        }
+        subtrees.push_back({root, end + 1});
+    }
+    std::sort(topNodes.begin(), topNodes.end());
+}
+
+int TriangleBvh::buildNode(int first, int last, std::vector<aabb>& boxes, std::vector<QVector3D>& centers, int level) {
+    treeDepth = std::max(treeDepth, level);
+    int index = nodes.size();
+    nodes.push_back({});
+
+    aabb box;
+    aabb centerBox;
+    for (int i = first; i < last; i++) {
+        box.add(boxes[order[i]]);
+        centerBox.add(centers[order[i]]);
+    }
+    nodes[index].low = box.min;
+    nodes[index].high = box.max;
+    nodes[index].first = first;
+    nodes[index].count = last - first;
+    int count = last - first;
+    if (count <= maxLeafTriangles || level >= maxTreeDepth) {
+        return index;
+    }
+
+    QVector3D size = centerBox.max - centerBox.min;
+    int axis = size.x() > size.y() ? (size.x() > size.z() ? 0 : 2) : (size.y() > size.z() ? 1 : 2);
+    int mid = first;
+    if (size[axis] > 0.0f) {
+        // Binned surface area heuristic along the widest axis of the centers
+        aabb binBoxes[nbSahBins];
+        int binCounts[nbSahBins] = {};
+        float binScale = nbSahBins * 0.9999f / size[axis];
+        auto binOf = [&](int t) { return static_cast<int>((centers[t][axis] - centerBox.min[axis]) * binScale); };
+        for (int i = first; i < last; i++) {
+            int bin = binOf(order[i]);
+            binBoxes[bin].add(boxes[order[i]]);
+            binCounts[bin]++;
+        }
+
+        float rightAreas[nbSahBins];
+        int rightCounts[nbSahBins];
+        aabb right;
+        int rightCount = 0;
+        for (int bin = nbSahBins - 1; bin > 0; bin--) {
+            right.add(binBoxes[bin]);
+            rightCount += binCounts[bin];
+            rightAreas[bin] = surfaceArea(right);
+            rightCounts[bin] = rightCount;
+        }
+
+        // Split before bestBin, costs in triangle tests over the area of this node
+        int bestBin = -1;
+        float bestCost = 1e30f;
+        aabb left;
+        int leftCount = 0;
+        for (int bin = 1; bin < nbSahBins; bin++) {
+            left.add(binBoxes[bin - 1]);
+            leftCount += binCounts[bin - 1];
+            if (leftCount == 0 || rightCounts[bin] == 0) {
+                continue;
+            }
+            float cost = surfaceArea(left) * leftCount + rightAreas[bin] * rightCounts[bin];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestBin = bin;
+            }
+        }
+        if (bestBin > 0) {
+            mid = std::partition(order.begin() + first, order.begin() + last, [&](int t) { return binOf(t) < bestBin; }) - order.begin();
+        }
+    }
+    // Same centers or a heuristic that cannot separate them: halves by the widest axis
+    if (mid == first || mid == last) {
+        mid = (first + last) / 2;
+        std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + last,
+                         [&](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+    }
+
+    buildNode(first, mid, boxes, centers, level + 1);
+    int right = buildNode(mid, last, boxes, centers, level + 1);
+    nodes[index].first = right;
+    nodes[index].count = 0;
+    return index;
+}
+
+void TriangleBvh::refitNode(int n) {
+    bvhNode& node = nodes[n];
+    if (node.count > 0) {
+        const int* tri = &leafIndices[3 * node.first];
+        QVector3D low = vertices[tri[0]];
+        QVector3D high = low;
+        for (int k = 1; k < 3 * node.count; k++) {
+            low = minimum(low, vertices[tri[k]]);
+            high = maximum(high, vertices[tri[k]]);
+        }
+        node.low = low;
+        node.high = high;
+    } else {
+        const bvhNode& left = nodes[n + 1];
+        const bvhNode& right = nodes[node.first];
+        node.low = minimum(left.low, right.low);
+        node.high = maximum(left.high, right.high);
+    }
+}
+
+void TriangleBvh::refit(const std::vector<QVector3D>& positions) {
+    vertices = positions;
+    // Children come after their parent, so a subtree is refit backwards and the nodes above it last
+    JobSystem::shared().parallelFor("refit picking tree", subtrees.size(), 1, [&](int first, int last) {
+        for (int s = first; s < last; s++) {
+            for (int n = subtrees[s].end - 1; n >= subtrees[s].root; n--) {
+                refitNode(n);
+            }
+        }
+    });
+    for (auto n = topNodes.rbegin(); n != topNodes.rend(); ++n) {
+        refitNode(*n);
+    }
+}
+
+// Möller-Trumbore, both faces
+bool TriangleBvh::intersectTriangle(const pickRay& ray, const int* tri, triangleHit& hit) const {
+    triangleTests++;
+    const QVector3D& a = vertices[tri[0]];
+    QVector3D e1 = vertices[tri[1]] - a;
+    QVector3D e2 = vertices[tri[2]] - a;
+    QVector3D p = QVector3D::crossProduct(ray.direction, e2);
+    float det = QVector3D::dotProduct(e1, p);
+    if (std::fabs(det) < 1e-12f) {
+        return false;
+    }
+    float invDet = 1.0f / det;
+    QVector3D s = ray.origin - a;
+    float u = QVector3D::dotProduct(s, p) * invDet;
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+    QVector3D q = QVector3D::crossProduct(s, e1);
+    float v = QVector3D::dotProduct(ray.direction, q) * invDet;
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+    float distance = QVector3D::dotProduct(e2, q) * invDet;
+    if (distance < 0.0f) {
+        return false;
+    }
+    hit = {-1, distance, u, v};
+    return true;
+}
+
+bool TriangleBvh::intersect(const pickRay& ray, triangleHit& hit, float maxDistance) const {
+    hit = triangleHit();
+    if (nodes.empty()) {
+        return false;
+    }
+
+    QVector3D inverse(1.0f / ray.direction.x(), 1.0f / ray.direction.y(), 1.0f / ray.direction.z());
+    float nearest = maxDistance;
+    // Entry distance of the ray into a node, false if it misses it before nearest
+    auto enter = [&](const bvhNode& node, float& entry) {
+        nodeTests++;
+        float t0 = 0.0f;
+        float t1 = nearest;
+        for (int c = 0; c < 3; c++) {
+            float a = (node.low[c] - ray.origin[c]) * inverse[c];
+            float b = (node.high[c] - ray.origin[c]) * inverse[c];
+            t0 = std::max(t0, std::min(a, b));
+            t1 = std::min(t1, std::max(a, b));
+        }
+        entry = t0;
+        return t0 <= t1;
+    };
+
+    // Nearer child first, the other one is skipped if a hit came closer than its entry meanwhile
+    struct stackEntry {
+        int node;
+        float entry;
+    };
+    stackEntry stack[2 * maxTreeDepth];
+    int size = 0;
+    float entry;
+    if (enter(nodes[0], entry)) {
+        stack[size++] = {0, entry};
+    }
+    while (size > 0) {
+        stackEntry top = stack[--size];
+        if (top.entry > nearest) {
+            continue;
+        }
+        const bvhNode& node = nodes[top.node];
+        if (node.count > 0) {
+            triangleHit candidate;
+            for (int i = node.first; i < node.first + node.count; i++) {
+                if (intersectTriangle(ray, &leafIndices[3 * i], candidate) && candidate.distance <= nearest) {
+                    nearest = candidate.distance;
+                    hit = candidate;
+                    hit.triangle = order[i];
+                }
+            }
+            continue;
+        }
+        int left = top.node + 1;
+        int right = node.first;
+        float leftEntry, rightEntry;
+        bool hitLeft = enter(nodes[left], leftEntry);
+        bool hitRight = enter(nodes[right], rightEntry);
+        if (hitLeft && hitRight) {
+            if (leftEntry <= rightEntry) {
+                stack[size++] = {right, rightEntry};
+                stack[size++] = {left, leftEntry};
+            } else {
+                stack[size++] = {left, leftEntry};
+                stack[size++] = {right, rightEntry};
+            }
+        } else if (hitLeft) {
+            stack[size++] = {left, leftEntry};
+        } else if (hitRight) {
+            stack[size++] = {right, rightEntry};
+        }
+    }
+    return hit.triangle >= 0;
+}
+
+bool TriangleBvh::intersectBruteForce(const pickRay& ray, triangleHit& hit, float maxDistance) const {
+    hit = triangleHit();
+    float nearest = maxDistance;
+    triangleHit candidate;
+    for (int t = 0; t < nbTriangles(); t++) {
+        if (intersectTriangle(ray, &indices[3 * t], candidate) && candidate.distance <= nearest) {
+            nearest = candidate.distance;
+            hit = candidate;
+            hit.triangle = t;
+        }
+    }
+    return hit.triangle >= 0;
+}
+
+float TriangleBvh::surfaceRatio() const {
+    if (nodes.empty()) {
+        return 0.0f;
+    }
+    double sum = 0.0;
+    for (const bvhNode& node : nodes) {
+        sum += surfaceArea(node.low, node.high);
+    }
+    return sum / std::max(surfaceArea(nodes[0].low, nodes[0].high), 1e-12f);
+}
+
+size_t TriangleBvh::bytes() const {
+    return nodes.size() * sizeof(bvhNode) + (order.size() + indices.size() + leafIndices.size()) * sizeof(int) +
+           vertices.size() * sizeof(QVector3D) + subtrees.size() * sizeof(subtree) + topNodes.size() * sizeof(int);
+}
+
+// Every triangle split in four at the midpoints of its edges, shared edges share their midpoint
+static void subdivide(std::vector<QVector3D>& positions, std::vector<int>& indices) {
+    std::unordered_map<long long, int> midpoints;
+    auto midpoint = [&](int a, int b) {
+        long long key = static_cast<long long>(std::min(a, b)) << 32 | std::max(a, b);
+        auto found = midpoints.find(key);
+        if (found != midpoints.end()) {
+            return found->second;
+        }
+        positions.push_back((positions[a] + positions[b]) * 0.5f);
+        midpoints.emplace(key, positions.size() - 1);
+        return static_cast<int>(positions.size() - 1);
+    };
+    std::vector<int> finer;
+    finer.reserve(4 * indices.size());
+    for (size_t t = 0; t < indices.size(); t += 3) {
+        int a = indices[t], b = indices[t + 1], c = indices[t + 2];
+        int ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+        finer.insert(finer.end(), {a, ab, ca, ab, b, bc, ca, bc, c, ab, bc, ca});
+    }
+    indices.swap(finer);
+}
+
+void benchmarkPicking(const std::string& meshFile, int minTriangles) {
+    mesh source = readMesh(meshFile);
+    std::vector<QVector3D> rest = source.vertexList;
+    std::vector<int> indices;
+    for (const int3& face : source.indexList) {
+        indices.insert(indices.end(), {face.i, face.j, face.k});
+    }
+    if (indices.empty()) {
+        throw std::runtime_error(meshFile + " has no triangles");
+    }
+    while (static_cast<int>(indices.size() / 3) < minTriangles) {
+        subdivide(rest, indices);
+    }
+
+    aabb restBox;
+    for (const QVector3D& p : rest) {
+        restBox.add(p);
+    }
+    QVector3D center = restBox.center();
+    float height = std::max(restBox.max.y() - restBox.min.y(), 1e-6f);
+    float diagonal = (restBox.max - restBox.min).length();
+
+    // A twist around the vertical axis growing with the height and a sway, a pose per frame
+    std::vector<QVector3D> posed(rest.size());
+    auto pose = [&](int frame) {
+        float twist = 0.8f * std::sin(0.07f * frame);
+        float sway = 0.1f * diagonal * std::sin(0.05f * frame);
+        for (size_t v = 0; v < rest.size(); v++) {
+            QVector3D p = rest[v] - center;
+            float h = (rest[v].y() - restBox.min.y()) / height;
+            float angle = twist * h;
+            float c = std::cos(angle), s = std::sin(angle);
+            posed[v] = center + QVector3D(c * p.x() + s * p.z() + sway * h * h, p.y(), -s * p.x() + c * p.z());
+        }
+    };
+
+    TriangleBvh tree;
+    pose(0);
+    auto start = std::chrono::steady_clock::now();
+    tree.build(posed, indices);
+    double buildTime = elapsedMs(start);
+    std::cout << "Picking on " << meshFile << " subdivided to " << tree.nbTriangles() << " triangles and " << rest.size()
+              << " vertices: tree of " << tree.nbNodes() << " nodes, depth " << tree.depth() << ", " << tree.bytes() / 1024.0
+              << " KiB, built in " << buildTime << " ms\n";
+
+    // Rays from a sphere around the mesh towards points of its box, most of them hit it
+    std::mt19937 random(11);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    auto randomRay = [&]() {
+        QVector3D eye;
+        do {
+            eye = QVector3D(unit(random), unit(random), unit(random));
+        } while (eye.lengthSquared() > 1.0f || eye.lengthSquared() < 1e-4f);
+        eye = center + eye.normalized() * diagonal;
+        QVector3D target = center + (restBox.max - restBox.min) * 0.4f * QVector3D(unit(random), unit(random), unit(random));
+        return pickRay{eye, (target - eye).normalized()};
+    };
+
+    const int nbFrames = 120;
+    const int raysPerFrame = 100;
+    double refitTime = 0;
+    double queryTime = 0;
+    double worstQuery = 0;
+    int nbHits = 0;
+    std::vector<pickRay> lastRays;
+    for (int frame = 1; frame <= nbFrames; frame++) {
+        pose(frame);
+        start = std::chrono::steady_clock::now();
+        tree.refit(posed);
+        refitTime += elapsedMs(start);
+
+        lastRays.clear();
+        for (int r = 0; r < raysPerFrame; r++) {
+            pickRay ray = randomRay();
+            lastRays.push_back(ray);
+            triangleHit hit;
+            start = std::chrono::steady_clock::now();
+            nbHits += tree.intersect(ray, hit);
+            double time = elapsedMs(start);
+            queryTime += time;
+            worstQuery = std::max(worstQuery, time);
+            benchmarkSink = hit.distance;
+        }
+    }
+    int nbQueries = nbFrames * raysPerFrame;
+    long long refitNodeTests = tree.nbNodeTests();
+    long long refitTriangleTests = tree.nbTriangleTests();
+    float refitRatio = tree.surfaceRatio();
+
+    // What the refit saves, and what it costs the queries against a tree built on the last pose
+    const int nbRebuilds = 5;
+    TriangleBvh rebuilt;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < nbRebuilds; r++) {
+        rebuilt.build(posed, indices);
+    }
+    double rebuildTime = elapsedMs(start) / nbRebuilds;
+    triangleHit hit;
+    for (const pickRay& ray : lastRays) {
+        rebuilt.intersect(ray, hit);
+    }
+    std::cout << "Picking refit: " << refitTime / nbFrames << " ms per frame against " << rebuildTime << " ms to rebuild, node area "
+              << refitRatio << " times the root after " << nbFrames << " poses (" << rebuilt.surfaceRatio() << " rebuilt)\n";
+    std::cout << "Picking queries: " << nbQueries << " rays, " << 100.0 * nbHits / nbQueries << "% hits, " << queryTime * 1e3 / nbQueries
+              << " us on average, " << worstQuery * 1e3 << " us worst, " << double(refitNodeTests) / nbQueries << " boxes and "
+              << double(refitTriangleTests) / nbQueries << " triangles per ray (" << double(rebuilt.nbNodeTests()) / lastRays.size()
+              << " and " << double(rebuilt.nbTriangleTests()) / lastRays.size() << " on a rebuilt tree)\n";
+
+    // Brute force on the last pose, every hit must agree
+    std::vector<triangleHit> references(lastRays.size());
+    start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < lastRays.size(); r++) {
+        tree.intersectBruteForce(lastRays[r], references[r]);
+    }
+    double bruteTime = elapsedMs(start) / lastRays.size();
+    int nbMismatches = 0;
+    for (size_t r = 0; r < lastRays.size(); r++) {
+        tree.intersect(lastRays[r], hit);
+        if (references[r].triangle != hit.triangle && std::fabs(references[r].distance - hit.distance) > 1e-5f * diagonal) {
+            nbMismatches++;
+        }
+    }
+    std::cout << "Picking brute force: " << bruteTime * 1e3 << " us per ray, " << bruteTime * nbQueries / queryTime << "x slower, "
+              << nbMismatches << " of " << lastRays.size() << " hits differ from the tree\n";
+}
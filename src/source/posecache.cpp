@@ -0,0 +1,234 @@
+#include "../header/posecache.h"
+#include "../header/jobsystem.h"
+#include "../header/timing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+BakedClip::BakedClip(const std::vector<BVHTree*>& roots, const bakeOptions& options)
+    : settings(options)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<BVHTree*> nodes = preorder(roots);
+    joints = nodes.size();
+
+    float end;
+    clipRange(nodes, startTime, end);
+    interval = options.frameTime;
+    if (interval <= 0.0f) {
+        for (const BVHTree* node : nodes) {
+            if (node->channelsValues.size() > 1) {
+                interval = (end - startTime) / (node->channelsValues.size() - 1);
+                break;
+            }
+        }
+    }
+    if (interval <= 0.0f) {
+        interval = 1.0f / 60.0f;
+    }
+    frames = static_cast<int>(std::ceil((end - startTime) / interval - 1e-3f)) + 1;
+
+    // Frames are independent, each chunk bakes a contiguous range with its own keyframe cursors
+    floatPoses.resize(static_cast<size_t>(frames) * joints * 7);
+    if (options.nbThreads == 1) {
+        bakeFrames(nodes, 0, frames);
+    } else {
+        JobSystem::shared().parallelFor("bake frames", frames, 16, [&](int first, int last) { bakeFrames(nodes, first, last); });
+    }
+
+    if (settings.precision == BakeQuantized) {
+        QVector3D positionMax;
+        for (size_t i = 0; i < floatPoses.size(); i += 7) {
+            QVector3D p(floatPoses[i + 4], floatPoses[i + 5], floatPoses[i + 6]);
+            positionMin = i == 0 ? p : QVector3D(std::min(positionMin.x(), p.x()), std::min(positionMin.y(), p.y()), std::min(positionMin.z(), p.z()));
+            positionMax = i == 0 ? p : QVector3D(std::max(positionMax.x(), p.x()), std::max(positionMax.y(), p.y()), std::max(positionMax.z(), p.z()));
+        }
+        positionScale = (positionMax - positionMin) / 65535.0f;
+
+        size_t count = floatPoses.size() / 7;
+        quantizedRotations.resize(count * 4);
+        quantizedPositions.resize(count * 3);
+        for (size_t i = 0; i < count; i++) {
+            const float* pose = &floatPoses[i * 7];
+            for (int c = 0; c < 4; c++) {
+                quantizedRotations[i * 4 + c] = static_cast<int16_t>(std::lround(std::clamp(pose[c], -1.0f, 1.0f) * 32767.0f));
+            }
+            for (int c = 0; c < 3; c++) {
+                float step = positionScale[c] > 0.0f ? (pose[4 + c] - positionMin[c]) / positionScale[c] : 0.0f;
+                quantizedPositions[i * 3 + c] = static_cast<uint16_t>(std::lround(std::clamp(step, 0.0f, 65535.0f)));
+            }
+        }
+        std::vector<float>().swap(floatPoses);
+    }
+    bakingTime = elapsedMs(start);
+}
+
+void BakedClip::bakeFrames(const std::vector<BVHTree*>& nodes, int first, int last) {
+    std::vector<int> cursors(nodes.size(), 0);
+    std::vector<QQuaternion> rotations(joints);
+    std::vector<QVector3D> positions(joints);
+    for (int f = first; f < last; f++) {
+        evaluatePose(nodes, startTime + f * interval, cursors, rotations, positions);
+        for (int j = 0; j < joints; j++) {
+            store(f, j, rotations[j], positions[j]);
+        }
+    }
+}
+
+void BakedClip::store(int frame, int joint, const QQuaternion& rotation, const QVector3D& position) {
+    float* pose = &floatPoses[(static_cast<size_t>(frame) * joints + joint) * 7];
+    pose[0] = rotation.x();
+    pose[1] = rotation.y();
+    pose[2] = rotation.z();
+    pose[3] = rotation.scalar();
+    pose[4] = position.x();
+    pose[5] = position.y();
+    pose[6] = position.z();
+}
+
+void BakedClip::load(int frame, int joint, QQuaternion& rotation, QVector3D& position) const {
+    size_t i = static_cast<size_t>(frame) * joints + joint;
+    if (settings.precision == BakeFloat) {
+        const float* pose = &floatPoses[i * 7];
+        rotation = QQuaternion(pose[3], pose[0], pose[1], pose[2]);
+        position = QVector3D(pose[4], pose[5], pose[6]);
+    } else {
+        const int16_t* q = &quantizedRotations[i * 4];
+        const uint16_t* p = &quantizedPositions[i * 3];
+        rotation = QQuaternion(q[3], q[0], q[1], q[2]) * (1.0f / 32767.0f);
+        position = positionMin + QVector3D(p[0], p[1], p[2]) * positionScale;
+    }
+}
+
+size_t BakedClip::bytes() const {
+    return floatPoses.capacity() * sizeof(float) + quantizedRotations.capacity() * sizeof(int16_t)
+         + quantizedPositions.capacity() * sizeof(uint16_t);
+}
+
+void BakedClip::frameAt(float time, int& frame, float& blend) const {
+    float t = std::clamp((time - startTime) / interval, 0.0f, static_cast<float>(frames - 1));
+    frame = std::min(static_cast<int>(t), std::max(0, frames - 2));
+    blend = frames > 1 ? t - frame : 0.0f;
+}
+
+void BakedClip::sample(int frame, float blend, int joint, QQuaternion& rotation, QVector3D& position) const {
+    QQuaternion nextRotation;
+    QVector3D nextPosition;
+    load(frame, joint, rotation, position);
+    if (blend <= 0.0f || frame + 1 >= frames) {
+        rotation.normalize();
+        return;
+    }
+    load(frame + 1, joint, nextRotation, nextPosition);
+
+    // Normalized lerp along the shorter arc, close enough to slerp between two baked frames
+    if (QQuaternion::dotProduct(rotation, nextRotation) < 0.0f) {
+        nextRotation = -nextRotation;
+    }
+    rotation = (rotation * (1.0f - blend) + nextRotation * blend).normalized();
+    position = position + (nextPosition - position) * blend;
+}
+
+struct poseError {
+    double maxPosition = 0;
+    double maxRotation = 0; // Degrees
+    double rotationSum = 0;
+    long long count = 0;
+
+    void add(const QVector3D& positionDifference, const QQuaternion& a, const QQuaternion& b) {
+        // atan2 keeps the precision of small angles that acos of the dot product loses
+        QQuaternion difference = a.conjugated() * b.normalized();
+        double angle = 2.0 * std::atan2(difference.vector().length(), std::abs(difference.scalar())) * 180.0 / M_PI;
+        maxPosition = std::max(maxPosition, static_cast<double>(positionDifference.length()));
+        maxRotation = std::max(maxRotation, angle);
+        rotationSum += angle;
+        count++;
+    }
+    double meanRotation() const { return count ? rotationSum / count : 0.0; }
+};
+
+void benchmarkPoseBaking(ClipLibrary& library) {
+    const int nbPoses = 2000;
+    size_t totalFloat = 0;
+    size_t totalQuantized = 0;
+    for (const auto& clip : library.clips()) {
+        std::shared_ptr<decodedClip> decoded;
+        try {
+            decoded = library.acquire(clip.name);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            continue;
+        }
+        std::vector<BVHTree*> nodes = preorder(decoded->roots);
+        float start, end;
+        clipRange(nodes, start, end);
+        float duration = std::max(end - start, 1e-3f);
+
+        std::vector<int> cursors(nodes.size(), 0);
+        std::vector<QQuaternion> rotations(nodes.size());
+        std::vector<QVector3D> positions(nodes.size());
+
+        // Poses spread over the clip like a looping playback, so the cursors keep moving forward
+        auto evaluateStart = std::chrono::steady_clock::now();
+        for (int i = 0; i < nbPoses; i++) {
+            evaluatePose(nodes, start + std::fmod(i * 0.0123f, duration), cursors, rotations, positions);
+        }
+        double evaluateTime = elapsedMs(evaluateStart) * 1e6 / nbPoses;
+        std::cout << "Bake " << clip.name << ": " << nodes.size() << " joints, hierarchy evaluation "
+                  << evaluateTime << " ns per pose, decoded clip " << decoded->bytes / 1024.0 << " KiB\n";
+
+        for (bakePrecision precision : {BakeFloat, BakeQuantized}) {
+            bakeOptions options;
+            options.precision = precision;
+            BakedClip baked(decoded->roots, options);
+
+            QQuaternion rotation;
+            QVector3D position;
+            // Summed so the sampling loop is not optimized away
+            QVector3D checksum;
+            auto sampleStart = std::chrono::steady_clock::now();
+            for (int i = 0; i < nbPoses; i++) {
+                int frame;
+                float blend;
+                baked.frameAt(start + std::fmod(i * 0.0123f, duration), frame, blend);
+                for (int j = 0; j < baked.nbJoints(); j++) {
+                    baked.sample(frame, blend, j, rotation, position);
+                    checksum += position;
+                }
+            }
+            double sampleTime = elapsedMs(sampleStart) * 1e6 / nbPoses;
+            benchmarkSink = checksum.x();
+
+            // On the baked frames the error is the precision of the table. Halfway between them the
+            // global interpolation departs from the per channel Euler interpolation of the hierarchy
+            poseError onFrames;
+            poseError halfway;
+            for (int f = 0; f < baked.nbFrames(); f++) {
+                for (float offset : {0.0f, 0.5f}) {
+                    if (offset > 0.0f && f + 1 == baked.nbFrames()) {
+                        continue;
+                    }
+                    float time = start + (f + offset) * baked.frameTime();
+                    evaluatePose(nodes, time, cursors, rotations, positions);
+                    int frame;
+                    float blend;
+                    baked.frameAt(time, frame, blend);
+                    for (int j = 0; j < baked.nbJoints(); j++) {
+                        baked.sample(frame, blend, j, rotation, position);
+                        (offset > 0.0f ? halfway : onFrames).add(position - positions[j], rotation, rotations[j]);
+                    }
+                }
+            }
+
+            (precision == BakeFloat ? totalFloat : totalQuantized) += baked.bytes();
+            std::cout << "  " << (precision == BakeFloat ? "float" : "quantized") << ": " << baked.nbFrames() << " frames baked in "
+                      << baked.bakeTime() << " ms, " << baked.bytes() / 1024.0 << " KiB, " << sampleTime << " ns per pose (speedup "
+                      << (sampleTime > 0 ? evaluateTime / sampleTime : 0.0) << "), error on frames " << onFrames.maxPosition
+                      << " units " << onFrames.maxRotation << " degrees, halfway mean " << halfway.meanRotation() << " max "
+                      << halfway.maxRotation << " degrees\n";
+        }
+    }
+    std::cout << "Baked library: " << totalFloat / 1024.0 << " KiB as floats, " << totalQuantized / 1024.0 << " KiB quantized\n";
+}
@@ -0,0 +1,276 @@
+#include "../header/renderstate.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <QElapsedTimer>
+
+RenderState::RenderState()
+{
+}
+
+RenderState::~RenderState()
+{
+    vertexArrays.clear();
+}
+
+void RenderState::init()
+{
+    initializeOpenGLFunctions();
+
+    // Probe once, without vertex array objects every bind sets the attributes up again
+    QOpenGLVertexArrayObject probe;
+    vaoSupported = probe.create();
+    probe.destroy();
+    if (!vaoSupported) {
+        std::cerr << "Vertex array objects not supported, attributes are set up on every mesh bind\n";
+    }
+}
+
+int RenderState::addMesh(const std::vector<vertexBinding>& layout, QOpenGLBuffer* indexBuffer)
+{
+    meshes.push_back({layout, indexBuffer});
+    return meshes.size() - 1;
+}
+
+void RenderState::beginFrame()
+{
+    currentProgram = nullptr;
+    currentMesh = -1;
+    currentMeshProgram = 0;
+    frameStats.frames++;
+}
+
+void RenderState::bindProgram(QOpenGLShaderProgram* program)
+{
+    if (caching && program == currentProgram) {
+        frameStats.skippedStateChanges++;
+        return;
+    }
+    program->bind();
+    currentProgram = program;
+    frameStats.programBinds++;
+}
+
+void RenderState::setupAttributes(const meshLayout& layout, QOpenGLShaderProgram* program, const std::vector<int>& locations)
+{
+    size_t a = 0;
+    for (const auto& binding : layout.bindings) {
+        binding.buffer->bind();
+        for (const auto& attribute : binding.attributes) {
+            int location = locations[a++];
+            if (location < 0) {
+                continue;
+            }
+            program->enableAttributeArray(location);
+            program->setAttributeBuffer(location, GL_FLOAT, attribute.offset, attribute.tupleSize, binding.stride);
+        }
+    }
+    if (layout.indexBuffer) {
+        layout.indexBuffer->bind();
+    }
+    frameStats.attributeSetups++;
+}
+
+RenderState::vertexArray& RenderState::vertexArrayOf(int mesh, QOpenGLShaderProgram* program)
+{
+    auto key = std::make_pair(mesh, program->programId());
+    auto it = vertexArrays.find(key);
+    if (it != vertexArrays.end()) {
+        return it->second;
+    }
+
+    vertexArray& array = vertexArrays[key];
+    for (const auto& binding : meshes[mesh].bindings) {
+        for (const auto& attribute : binding.attributes) {
+            array.locations.push_back(program->attributeLocation(attribute.name));
+        }
+    }
+
+    if (vaoSupported) {
+        array.vao = std::make_unique<QOpenGLVertexArrayObject>();
+        array.vao->create();
+        array.vao->bind();
+        setupAttributes(meshes[mesh], program, array.locations);
+        array.vao->release();
+    }
+    return array;
+}
+
+void RenderState::bindMesh(int mesh, QOpenGLShaderProgram* program)
+{
+    if (!caching) {
+        // Resolve every attribute by name, as each draw did before this layer existed
+        std::vector<int> locations;
+        for (const auto& binding : meshes[mesh].bindings) {
+            for (const auto& attribute : binding.attributes) {
+                locations.push_back(program->attributeLocation(attribute.name));
+            }
+        }
+        setupAttributes(meshes[mesh], program, locations);
+        frameStats.meshBinds++;
+        return;
+    }
+
+    if (mesh == currentMesh && program->programId() == currentMeshProgram) {
+        frameStats.skippedStateChanges++;
+        return;
+    }
+
+    vertexArray& array = vertexArrayOf(mesh, program);
+    if (array.vao) {
+        array.vao->bind();
+    } else {
+        for (int location : enabledLocations) {
+            if (std::find(array.locations.begin(), array.locations.end(), location) == array.locations.end()) {
+                program->disableAttributeArray(location);
+            }
+        }
+        setupAttributes(meshes[mesh], program, array.locations);
+        enabledLocations = array.locations;
+    }
+
+    currentMesh = mesh;
+    currentMeshProgram = program->programId();
+    frameStats.meshBinds++;
+}
+
+int RenderState::uniformLocation(QOpenGLShaderProgram* program, const char* name)
+{
+    if (!caching) {
+        return program->uniformLocation(name);
+    }
+
+    auto key = std::make_pair(program->programId(), std::string(name));
+    auto it = uniformLocations.find(key);
+    if (it == uniformLocations.end()) {
+        it = uniformLocations.emplace(key, program->uniformLocation(name)).first;
+    }
+    return it->second;
+}
+
+void RenderState::setUniform(QOpenGLShaderProgram* program, const char* name, int value)
+{
+    int location = uniformLocation(program, name);
+    if (location < 0) {
+        return;
+    }
+
+    if (caching) {
+        auto key = std::make_pair(program->programId(), location);
+        auto it = uniformValues.find(key);
+        if (it != uniformValues.end() && it->second == value) {
+            frameStats.skippedStateChanges++;
+            return;
+        }
+        uniformValues[key] = value;
+    }
+
+    program->setUniformValue(location, static_cast<GLint>(value));
+    frameStats.uniformUploads++;
+}
+
+void RenderState::setUniform(QOpenGLShaderProgram* program, const char* name, const QMatrix4x4& value)
+{
+    int location = uniformLocation(program, name);
+    if (location < 0) {
+        return;
+    }
+    program->setUniformValue(location, value);
+    frameStats.uniformUploads++;
+}
+
+void RenderState::release()
+{
+    if (vaoSupported && currentMesh >= 0) {
+        vertexArrays[std::make_pair(currentMesh, currentMeshProgram)].vao->release();
+    }
+    currentMesh = -1;
+    currentMeshProgram = 0;
+}
+
+void RenderState::issue(const drawCall& call)
+{
+    bindProgram(call.program);
+    bindMesh(call.mesh, call.program);
+    for (const auto& uniform : call.uniforms) {
+        setUniform(call.program, uniform.name, uniform.value);
+    }
+
+    if (meshes[call.mesh].indexBuffer) {
+        glDrawElements(call.primitive, call.count, GL_UNSIGNED_SHORT, reinterpret_cast<const void*>(call.first * sizeof(GLushort)));
+    } else {
+        glDrawArrays(call.primitive, call.first, call.count);
+    }
+    frameStats.draws++;
+}
+
+void RenderState::draw(const drawCall& call)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    issue(call);
+    frameStats.batches++;
+    release();
+
+    frameStats.submitTime += timer.nsecsElapsed();
+}
+
+void RenderState::submit(drawCall call)
+{
+    queue.push_back(std::move(call));
+}
+
+void RenderState::flush()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    if (caching) {
+        std::stable_sort(queue.begin(), queue.end(), [](const drawCall& a, const drawCall& b) {
+            if (a.program->programId() != b.program->programId()) {
+                return a.program->programId() < b.program->programId();
+            }
+            return a.mesh < b.mesh;
+        });
+    }
+
+    for (size_t i = 0; i < queue.size(); i++) {
+        if (!caching || i == 0 || queue[i].program != queue[i-1].program || queue[i].mesh != queue[i-1].mesh) {
+            frameStats.batches++;
+        }
+        issue(queue[i]);
+    }
+    queue.clear();
+    release();
+
+    frameStats.submitTime += timer.nsecsElapsed();
+}
+
+void RenderState::setStateCaching(bool enabled)
+{
+    caching = enabled;
+    currentProgram = nullptr;
+    release();
+    uniformValues.clear();
+    resetStats();
+}
+
+void RenderState::resetStats()
+{
+    frameStats = renderStats();
+}
+
+void RenderState::printStats() const
+{
+    double frames = std::max(frameStats.frames, 1);
+    std::cout << "Draw submission" << (caching ? "" : " (no state caching)") << ": "
+              << frameStats.submitTime / 1e6 / frames << " ms CPU per scene, "
+              << frameStats.draws / frames << " draws in " << frameStats.batches / frames << " batches, "
+              << frameStats.programBinds / frames << " program binds, "
+              << frameStats.meshBinds / frames << " mesh binds, "
+              << frameStats.attributeSetups / frames << " attribute setups, "
+              << frameStats.uniformUploads / frames << " uniform uploads, "
+              << frameStats.skippedStateChanges / frames << " redundant changes skipped\n";
+}
@@ -0,0 +1,339 @@
+#include "../header/retarget.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "../header/xsensdata.h"
+#include "../header/timing.h"
+
+// Flat frame index of each of the 6 slots of every node, -1 if the node lacks the channel
+static std::vector<int> channelIndices(const std::vector<BVHTree*>& nodes, int& nbChannels) {
+    std::vector<int> indices(nodes.size() * 6, -1);
+    nbChannels = 0;
+    for (size_t n = 0; n < nodes.size(); n++) {
+        for (const auto& channel : nodes[n]->channels) {
+            int slot = channelSlot(channel);
+            if (slot >= 0) {
+                indices[n * 6 + slot] = nbChannels;
+            }
+            nbChannels++;
+        }
+    }
+    return indices;
+}
+
+// Direction of the first bone leaving the node, null for end sites
+static QVector3D boneDirection(BVHTree* node) {
+    for (auto child : node->joints) {
+        if (child->offset.lengthSquared() > 0.0f) {
+            return child->offset.normalized();
+        }
+    }
+    return QVector3D();
+}
+
+const std::map<std::string, std::string>& defaultJointAliases() {
+    static const std::map<std::string, std::string> aliases = {
+        {"neck", "neck1"},
+        {"pelvis", "hips"},
+        {"shoulderl", "l_shoulder"},
+        {"elbowl", "l_elbow"},
+        {"handl", "l_hand"},
+        {"shoulderr", "r_shoulder"},
+        {"elbowr", "r_elbow"},
+        {"handr", "r_hand"},
+    };
+    return aliases;
+}
+
+retargetMap compileRetargetMap(const std::vector<BVHTree*>& source, const std::vector<BVHTree*>& target,
+                               const std::map<std::string, std::string>& aliases) {
+    std::vector<BVHTree*> sourceNodes = preorder(source);
+    std::vector<BVHTree*> targetNodes = preorder(target);
+
+    retargetMap map;
+    std::vector<int> sourceChannels = channelIndices(sourceNodes, map.nbSourceChannels);
+    std::vector<int> targetChannels = channelIndices(targetNodes, map.nbTargetChannels);
+
+    std::map<BVHTree*, int> sourceIndex;
+    std::map<std::string, int> sourceByName;
+    for (size_t s = 0; s < sourceNodes.size(); s++) {
+        sourceIndex[sourceNodes[s]] = s;
+        if (!sourceNodes[s]->channels.empty()) {
+            sourceByName.emplace(normalizedName(sourceNodes[s]->name), s);
+        }
+        map.sourceParent.push_back(sourceNodes[s]->parent ? sourceIndex[sourceNodes[s]->parent] : -1);
+        for (int a = 0; a < 3; a++) {
+            map.sourceRotationChannels.push_back(sourceChannels[s * 6 + 3 + a]);
+        }
+    }
+
+    std::map<BVHTree*, int> targetIndex;
+    float sourceLength = 0.0f;
+    float targetLength = 0.0f;
+    for (size_t t = 0; t < targetNodes.size(); t++) {
+        BVHTree* node = targetNodes[t];
+        targetIndex[node] = t;
+        map.targetParent.push_back(node->parent ? targetIndex[node->parent] : -1);
+        for (int a = 0; a < 3; a++) {
+            map.targetRotationChannels.push_back(targetChannels[t * 6 + 3 + a]);
+        }
+
+        int matched = -1;
+        if (!node->channels.empty()) {
+            std::string name = normalizedName(node->name);
+            auto it = sourceByName.find(name);
+            if (it == sourceByName.end()) {
+                for (const auto& alias : aliases) {
+                    if (alias.first == name && sourceByName.count(alias.second)) {
+                        it = sourceByName.find(alias.second);
+                    } else if (alias.second == name && sourceByName.count(alias.first)) {
+                        it = sourceByName.find(alias.first);
+                    }
+                }
+            }
+            if (it != sourceByName.end()) {
+                matched = it->second;
+            }
+        }
+        map.targetSource.push_back(matched);
+
+        QQuaternion correction;
+        if (matched >= 0) {
+            map.nbMatched++;
+            QVector3D from = boneDirection(node);
+            QVector3D to = boneDirection(sourceNodes[matched]);
+            if (!from.isNull() && !to.isNull()) {
+                correction = QQuaternion::rotationTo(from, to);
+            }
+            if (node->parent && sourceNodes[matched]->parent) {
+                targetLength += node->offset.length();
+                sourceLength += sourceNodes[matched]->offset.length();
+            }
+        }
+        map.restCorrection.push_back(correction);
+    }
+
+    // The first root of each skeleton carries the translation
+    if (!sourceNodes.empty() && !targetNodes.empty()) {
+        map.sourceRoot = 0;
+        map.targetRoot = 0;
+        map.sourceRootOffset = sourceNodes[0]->offset;
+        map.targetRootOffset = targetNodes[0]->offset;
+        for (int a = 0; a < 3; a++) {
+            map.sourcePositionChannels[a] = sourceChannels[a];
+            map.targetPositionChannels[a] = targetChannels[a];
+        }
+    }
+    if (sourceLength > 0.0f && targetLength > 0.0f) {
+        map.lengthScale = targetLength / sourceLength;
+    }
+    return map;
+}
+
+void retargetFrame(const retargetMap& map, const float* sourceFrame, float* targetFrame, retargetScratch& scratch) {
+    int nbSource = map.sourceParent.size();
+    int nbTarget = map.targetParent.size();
+    scratch.sourceGlobal.resize(nbSource);
+    scratch.targetGlobal.resize(nbTarget);
+
+    for (int s = 0; s < nbSource; s++) {
+        const int* c = &map.sourceRotationChannels[s * 3];
+        QQuaternion local = eulerToQuaternion(c[0] >= 0 ? sourceFrame[c[0]] : 0.0f,
+                                              c[1] >= 0 ? sourceFrame[c[1]] : 0.0f,
+                                              c[2] >= 0 ? sourceFrame[c[2]] : 0.0f);
+        int parent = map.sourceParent[s];
+        scratch.sourceGlobal[s] = parent >= 0 ? scratch.sourceGlobal[parent] * local : local;
+    }
+
+    std::fill(targetFrame, targetFrame + map.nbTargetChannels, 0.0f);
+    for (int t = 0; t < nbTarget; t++) {
+        int parent = map.targetParent[t];
+        QQuaternion parentGlobal = parent >= 0 ? scratch.targetGlobal[parent] : QQuaternion();
+        int s = map.targetSource[t];
+        QQuaternion global = s >= 0 ? scratch.sourceGlobal[s] * map.restCorrection[t] : parentGlobal;
+        scratch.targetGlobal[t] = global;
+
+        const int* c = &map.targetRotationChannels[t * 3];
+        if (c[0] < 0 && c[1] < 0 && c[2] < 0) {
+            continue;
+        }
+        // quaternionToEuler gives (z, y, x)
+        QVector3D euler = quaternionToEuler(parentGlobal.conjugated() * global) * (180.0f / M_PI);
+        if (c[0] >= 0) targetFrame[c[0]] = euler.z();
+        if (c[1] >= 0) targetFrame[c[1]] = euler.y();
+        if (c[2] >= 0) targetFrame[c[2]] = euler.x();
+    }
+
+    if (map.sourceRoot >= 0) {
+        for (int a = 0; a < 3; a++) {
+            if (map.targetPositionChannels[a] < 0) {
+                continue;
+            }
+            float sourceValue = map.sourcePositionChannels[a] >= 0 ? sourceFrame[map.sourcePositionChannels[a]] : map.sourceRootOffset[a];
+            targetFrame[map.targetPositionChannels[a]] = map.targetRootOffset[a] + (sourceValue - map.sourceRootOffset[a]) * map.lengthScale;
+        }
+    }
+}
+
+std::vector<BVHTree*> retargetClip(const retargetMap& map, const std::vector<BVHTree*>& source, const std::vector<BVHTree*>& target) {
+    std::vector<BVHTree*> sourceNodes = preorder(source);
+    std::vector<BVHTree*> roots = copyHierarchy(target);
+    std::vector<BVHTree*> targetNodes = preorder(roots);
+
+    BVHTree* timeline = nullptr;
+    for (auto node : sourceNodes) {
+        if (!node->channels.empty()) {
+            timeline = node;
+            break;
+        }
+    }
+    int nbFrames = timeline ? timeline->channelsValues.size() : 0;
+
+    for (auto node : targetNodes) {
+        if (!node->channels.empty()) {
+            node->channelsValues.assign(nbFrames, std::vector<float>(node->channels.size() + 1));
+        }
+    }
+
+    std::vector<float> sourceFrame(map.nbSourceChannels);
+    std::vector<float> targetFrame(map.nbTargetChannels);
+    retargetScratch scratch;
+    for (int f = 0; f < nbFrames; f++) {
+        int c = 0;
+        for (auto node : sourceNodes) {
+            if (!node->channels.empty()) {
+                std::copy(node->channelsValues[f].begin() + 1, node->channelsValues[f].end(), sourceFrame.begin() + c);
+                c += node->channels.size();
+            }
+        }
+
+        retargetFrame(map, sourceFrame.data(), targetFrame.data(), scratch);
+
+        c = 0;
+        for (auto node : targetNodes) {
+            if (node->channels.empty()) {
+                continue;
+            }
+            std::vector<float>& keyFrame = node->channelsValues[f];
+            keyFrame[0] = timeline->channelsValues[f][0];
+            std::copy(targetFrame.begin() + c, targetFrame.begin() + c + node->channels.size(), keyFrame.begin() + 1);
+            c += node->channels.size();
+        }
+    }
+    return roots;
+}
+
+bool sameHierarchy(const std::vector<BVHTree*>& a, const std::vector<BVHTree*>& b) {
+    std::vector<BVHTree*> nodesA = preorder(a);
+    std::vector<BVHTree*> nodesB = preorder(b);
+    if (nodesA.size() != nodesB.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < nodesA.size(); i++) {
+        if (nodesA[i]->name != nodesB[i]->name || nodesA[i]->channels != nodesB[i]->channels
+            || nodesA[i]->joints.size() != nodesB[i]->joints.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<retargetResult> retargetLibrary(ClipLibrary& library, const std::vector<BVHTree*>& target, int nbThreads) {
+    const std::vector<clipInfo>& clips = library.clips();
+    std::vector<retargetResult> results(clips.size());
+
+    // Clips sharing a hierarchy share a map, compiled by the first worker meeting it
+    std::mutex mapMutex;
+    std::map<std::vector<std::string>, std::shared_ptr<retargetMap>> maps;
+
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < static_cast<int>(clips.size()); i = next++) {
+            retargetResult& result = results[i];
+            result.name = clips[i].name;
+            try {
+                std::shared_ptr<decodedClip> source = library.acquire(clips[i].name);
+
+                std::shared_ptr<retargetMap> map;
+                {
+                    std::lock_guard<std::mutex> lock(mapMutex);
+                    std::shared_ptr<retargetMap>& cached = maps[clips[i].header.jointNames];
+                    if (!cached) {
+                        auto start = std::chrono::steady_clock::now();
+                        cached = std::make_shared<retargetMap>(compileRetargetMap(source->roots, target));
+                        result.compileTime = elapsedMs(start);
+                    }
+                    map = cached;
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                result.clip = std::make_shared<decodedClip>();
+                result.clip->roots = retargetClip(*map, source->roots, target);
+                result.retargetTime = elapsedMs(start);
+                result.nbFrames = clips[i].header.nbFrames;
+            } catch (const std::exception& e) {
+                std::cerr << "Error retargeting " << clips[i].name << ": " << e.what() << "\n";
+                result.clip.reset();
+            }
+        }
+    };
+
+    std::vector<std::future<void>> workers;
+    for (int t = 1; t < nbThreads; t++) {
+        workers.push_back(std::async(std::launch::async, worker));
+    }
+    worker();
+    for (auto& w : workers) {
+        w.wait();
+    }
+    return results;
+}
+
+void benchmarkRetargeting(ClipLibrary& library, const std::string& targetName) {
+    std::shared_ptr<decodedClip> target = library.acquire(targetName);
+
+    for (const auto& clip : library.clips()) {
+        retargetMap map = compileRetargetMap(library.acquire(clip.name)->roots, target->roots);
+        int nbAnimated = 0;
+        for (size_t t = 0; t < map.targetParent.size(); t++) {
+            nbAnimated += map.targetRotationChannels[t * 3] >= 0;
+        }
+        std::cout << "Retarget " << clip.name << " -> " << targetName << ": " << map.nbMatched << " of "
+                  << nbAnimated << " target joints matched, bone length scale " << map.lengthScale << "\n";
+    }
+
+    std::vector<int> threadCounts = {1};
+    if (std::thread::hardware_concurrency() > 1) {
+        threadCounts.push_back(std::thread::hardware_concurrency());
+    }
+    double serialTime = 0;
+    for (int threads : threadCounts) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<retargetResult> results = retargetLibrary(library, target->roots, threads);
+        double totalTime = elapsedMs(start);
+
+        int nbFrames = 0;
+        int nbMaps = 0;
+        double compileTime = 0;
+        for (const auto& result : results) {
+            nbFrames += result.nbFrames;
+            nbMaps += result.compileTime > 0;
+            compileTime += result.compileTime;
+        }
+        if (threads == 1) {
+            serialTime = totalTime;
+        }
+        std::cout << "Retargeting " << results.size() << " clips on " << threads << " threads: " << totalTime << " ms, "
+                  << nbFrames << " frames (" << (nbFrames ? totalTime * 1e6 / nbFrames : 0.0) << " ns per frame), "
+                  << nbMaps << " maps compiled in " << compileTime << " ms, speedup " << serialTime / totalTime << "\n";
+    }
+}
@@ -0,0 +1,236 @@
+#include "../header/shadercache.h"
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QOpenGLContext>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+static const char binaryMagic[4] = {'S', 'I', 'A', 'B'};
+
+ShaderCache::ShaderCache(const QString& directory)
+    : directory(directory)
+{
+    if (this->directory.isEmpty()) {
+        this->directory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/shaders";
+    }
+}
+
+ShaderCache::~ShaderCache()
+{
+    for (auto& program : programs) {
+        delete program.second;
+    }
+}
+
+void ShaderCache::init()
+{
+    initializeOpenGLFunctions();
+
+    // A driver update invalidates every binary, the driver is part of the key
+    driver = QByteArray(reinterpret_cast<const char*>(glGetString(GL_VENDOR))) + "|"
+           + reinterpret_cast<const char*>(glGetString(GL_RENDERER)) + "|"
+           + reinterpret_cast<const char*>(glGetString(GL_VERSION));
+
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    QSurfaceFormat format = context->format();
+    if (context->isOpenGLES()) {
+        binarySupported = format.majorVersion() >= 3;
+    } else {
+        binarySupported = format.version() >= qMakePair(4, 1) || context->hasExtension("GL_ARB_get_program_binary");
+    }
+
+    if (binarySupported) {
+        GLint nbFormats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nbFormats);
+        binarySupported = nbFormats > 0 && QDir().mkpath(directory);
+    }
+    if (!binarySupported) {
+        std::cerr << "Program binaries not available, shaders are compiled at every launch\n";
+    }
+}
+
+QByteArray ShaderCache::readSource(const QString& fileName, int depth)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        std::cerr << "Error opening shader " << fileName.toStdString() << "\n";
+        return QByteArray();
+    }
+
+    // #include "file" is resolved next to the including file
+    QByteArray source;
+    while (!file.atEnd()) {
+        QByteArray line = file.readLine();
+        QByteArray trimmed = line.trimmed();
+        if (trimmed.startsWith("#include") && depth < 8) {
+            int first = trimmed.indexOf('"');
+            int last = trimmed.lastIndexOf('"');
+            if (first >= 0 && last > first) {
+                QString included = QFileInfo(fileName).path() + "/" + QString::fromUtf8(trimmed.mid(first + 1, last - first - 1));
+                source += readSource(included, depth + 1);
+                continue;
+            }
+        }
+        source += line;
+    }
+    return source;
+}
+
+QByteArray ShaderCache::preprocess(const QString& fileName, const QStringList& defines)
+{
+    QByteArray source = readSource(fileName);
+
+    QByteArray header;
+    for (const QString& define : defines) {
+        header += "#define " + define.toUtf8() + "\n";
+    }
+
+    // The defines must follow #version when the source has one
+    int position = 0;
+    if (source.trimmed().startsWith("#version")) {
+        position = source.indexOf('\n') + 1;
+    }
+    return source.insert(position, header);
+}
+
+QOpenGLShaderProgram* ShaderCache::program(const shaderVariant& variant)
+{
+    QByteArray vertexSource = preprocess(variant.vertexFile, variant.defines);
+    QByteArray fragmentSource = variant.fragmentFile.isEmpty() ? QByteArray() : preprocess(variant.fragmentFile, variant.defines);
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(driver);
+    hash.addData(vertexSource);
+    hash.addData(fragmentSource);
+    for (const QByteArray& varying : variant.feedbackVaryings) {
+        hash.addData(varying + ";");
+    }
+    QByteArray key = hash.result().toHex();
+
+    auto it = programs.find(key);
+    if (it != programs.end()) {
+        cacheStats.memoryHits++;
+        return it->second;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    QString binaryFile = directory + "/" + QString::fromLatin1(key) + ".bin";
+
+    QOpenGLShaderProgram* program = new QOpenGLShaderProgram();
+    if (binarySupported && program->create() && loadBinary(program, binaryFile)) {
+        cacheStats.diskHits++;
+        cacheStats.loadTime += timer.nsecsElapsed() / 1e6;
+        programs[key] = program;
+        return program;
+    }
+
+    // A refused binary leaves the program in a failed link state, start from a new one
+    delete program;
+    program = new QOpenGLShaderProgram();
+
+    bool success = program->addShaderFromSourceCode(QOpenGLShader::Vertex, vertexSource);
+    if (success && !fragmentSource.isEmpty()) {
+        success = program->addShaderFromSourceCode(QOpenGLShader::Fragment, fragmentSource);
+    }
+
+    if (success && !variant.feedbackVaryings.isEmpty()) {
+        std::vector<const char*> names;
+        for (const QByteArray& varying : variant.feedbackVaryings) {
+            names.push_back(varying.constData());
+        }
+        glTransformFeedbackVaryings(program->programId(), names.size(), names.data(), GL_INTERLEAVED_ATTRIBS);
+    }
+    if (success && binarySupported) {
+        glProgramParameteri(program->programId(), GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    if (!success || !program->link()) {
+        std::cerr << "Error building " << variant.vertexFile.toStdString() << " (" << variant.defines.join(", ").toStdString()
+                  << "): " << program->log().toStdString() << "\n";
+        delete program;
+        return nullptr;
+    }
+
+    cacheStats.compiled++;
+    cacheStats.compileTime += timer.nsecsElapsed() / 1e6;
+
+    if (binarySupported) {
+        saveBinary(program, binaryFile);
+    }
+    programs[key] = program;
+    return program;
+}
+
+bool ShaderCache::loadBinary(QOpenGLShaderProgram* program, const QString& fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QByteArray content = file.readAll();
+    file.close();
+
+    GLenum format = 0;
+    bool valid = content.size() > static_cast<int>(sizeof(binaryMagic) + sizeof(format))
+              && content.startsWith(QByteArray(binaryMagic, sizeof(binaryMagic)));
+    if (valid) {
+        memcpy(&format, content.constData() + sizeof(binaryMagic), sizeof(format));
+        int offset = sizeof(binaryMagic) + sizeof(format);
+        glProgramBinary(program->programId(), format, content.constData() + offset, content.size() - offset);
+
+        GLint status = 0;
+        glGetProgramiv(program->programId(), GL_LINK_STATUS, &status);
+        valid = status != 0;
+    }
+
+    if (!valid) {
+        cacheStats.rejectedBinaries++;
+        QFile::remove(fileName);
+        return false;
+    }
+
+    // No shader attached: QOpenGLShaderProgram only checks the link status of the binary
+    return program->link();
+}
+
+void ShaderCache::saveBinary(QOpenGLShaderProgram* program, const QString& fileName)
+{
+    GLint length = 0;
+    glGetProgramiv(program->programId(), GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+
+    QByteArray data(length, 0);
+    GLenum format = 0;
+    glGetProgramBinary(program->programId(), length, nullptr, &format, data.data());
+
+    // Written to a temporary file first, a concurrent launch never reads half a binary
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        std::cerr << "Error writing " << fileName.toStdString() << "\n";
+        return;
+    }
+    file.write(binaryMagic, sizeof(binaryMagic));
+    file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+    file.write(data);
+    file.commit();
+}
+
+void ShaderCache::printStats() const
+{
+    std::cout << "Shader cache: " << programs.size() << " programs, "
+              << cacheStats.memoryHits << " memory hits, "
+              << cacheStats.diskHits << " loaded from disk (" << cacheStats.loadTime << " ms), "
+              << cacheStats.compiled << " compiled (" << cacheStats.compileTime << " ms), "
+              << cacheStats.rejectedBinaries << " binaries rejected\n";
+}
@@ -0,0 +1,7 @@
+#include "../header/timing.h"
+
+volatile float benchmarkSink;
+
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
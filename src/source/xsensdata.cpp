@@ -0,0 +1,356 @@
+#include "../header/xsensdata.h"
+#include "../header/xsensfilter.h"
+#include "../header/jobsystem.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <filesystem>
+
+// Same rig as the hierarchy written by xsensToBVH.py
+const std::vector<xsensJoint> xsensSkeleton = {
+    {"PELV",  "pelvis",    "",      QVector3D( 0.0f, 0.0f, 0.0f), {{1,  1}, {0, -1}, {2,  1}}},
+    {"UARML", "shoulderL", "PELV",  QVector3D(-0.1f, 0.3f, 0.0f), {{0, -1}, {2,  1}, {1,  1}}},
+    {"FARML", "elbowL",    "UARML", QVector3D(-0.2f, 0.0f, 0.0f), {{0, -1}, {2,  1}, {1,  1}}},
+    {"UARMR", "shoulderR", "PELV",  QVector3D( 0.1f, 0.3f, 0.0f), {{0,  1}, {2, -1}, {1,  1}}},
+    {"FARMR", "elbowR",    "UARMR", QVector3D( 0.2f, 0.0f, 0.0f), {{0,  1}, {2, -1}, {1,  1}}},
+};
+
+// End sites of the rig, attached to the last joint of each arm
+const std::map<std::string, std::pair<std::string, QVector3D>> xsensEndSites = {
+    {"FARML", {"handL", QVector3D(-0.15f, 0.0f, 0.0f)}},
+    {"FARMR", {"handR", QVector3D( 0.15f, 0.0f, 0.0f)}},
+};
+
+std::map<std::string, std::string> readLabels(const std::string& fileName) {
+    std::ifstream inputFile(fileName);
+    if (!inputFile.is_open()) {
+        throw std::runtime_error("Error opening file: " + fileName);
+    }
+
+    std::map<std::string, std::string> labels;
+    std::string deviceId, label;
+    while (inputFile >> deviceId >> label) {
+        labels[deviceId] = label;
+    }
+    return labels;
+}
+
+static const char* nextField(const char* p, const char* end, float& value) {
+    while (p < end && (*p == '\t' || *p == ' ')) p++;
+    auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc()) {
+        throw std::invalid_argument("Invalid value in Xsens data");
+    }
+    return result.ptr;
+}
+
+xsensSensor readXsensFile(const std::string& fileName) {
+    std::ifstream inputFile(fileName, std::ios::binary);
+    if (!inputFile.is_open()) {
+        throw std::runtime_error("Error opening file: " + fileName);
+    }
+
+    std::string content((std::istreambuf_iterator<char>(inputFile)), std::istreambuf_iterator<char>());
+
+    xsensSensor sensor;
+
+    const char* p = content.data();
+    const char* end = p + content.size();
+
+    // Header: "//" comment lines then the tab separated column names
+    std::vector<std::string> columns;
+    while (p < end) {
+        const char* eol = std::find(p, end, '\n');
+        std::string line(p, eol);
+        p = eol < end ? eol + 1 : end;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+
+        if (line.compare(0, 2, "//") == 0) {
+            size_t pos = line.find("DeviceId:");
+            if (pos != std::string::npos) {
+                std::istringstream(line.substr(pos + 9)) >> sensor.deviceId;
+            }
+            continue;
+        }
+
+        std::istringstream iss(line);
+        std::string column;
+        while (std::getline(iss, column, '\t')) {
+            columns.push_back(column);
+        }
+        break;
+    }
+
+    auto columnIndex = [&columns, &fileName](const std::string& name) {
+        auto it = std::find(columns.begin(), columns.end(), name);
+        if (it == columns.end()) {
+            throw std::invalid_argument("\"" + name + "\" column not found in " + fileName);
+        }
+        return static_cast<int>(it - columns.begin());
+    };
+
+    const int nbColumn = columns.size();
+    const int counterColumn = columnIndex("PacketCounter");
+    const int accColumn = columnIndex("Acc_X");
+    const int freeAccColumn = columnIndex("FreeAcc_E");
+    const int quatColumn = columnIndex("Quat_q0");
+
+    size_t nbLines = std::count(p, end, '\n') + 1;
+    sensor.packetCounters.reserve(nbLines);
+    sensor.accelerations.reserve(nbLines);
+    sensor.freeAccelerations.reserve(nbLines);
+    sensor.quaternions.reserve(nbLines);
+
+    std::vector<float> values(nbColumn);
+    int lastCounter = -1;
+    int wrapOffset = 0;
+
+    while (p < end) {
+        const char* eol = std::find(p, end, '\n');
+        const char* q = p;
+        while (q < eol && (*q == ' ' || *q == '\r')) q++;
+        if (q == eol) {
+            p = eol < end ? eol + 1 : end;
+            continue;
+        }
+
+        for (int k = 0; k < nbColumn; k++) {
+            q = nextField(q, eol, values[k]);
+        }
+        p = eol < end ? eol + 1 : end;
+
+        int counter = static_cast<int>(values[counterColumn]) + wrapOffset;
+        if (counter < lastCounter) {
+            wrapOffset += 65536;
+            counter += 65536;
+        }
+        lastCounter = counter;
+
+        sensor.packetCounters.push_back(counter);
+        sensor.accelerations.push_back(QVector3D(values[accColumn], values[accColumn + 1], values[accColumn + 2]));
+        sensor.freeAccelerations.push_back(QVector3D(values[freeAccColumn], values[freeAccColumn + 1], values[freeAccColumn + 2]));
+        sensor.quaternions.push_back(QQuaternion(values[quatColumn], values[quatColumn + 1], values[quatColumn + 2], values[quatColumn + 3]));
+    }
+
+    return sensor;
+}
+
+std::vector<xsensSensor> readXsensSession(const std::string& directory) {
+    std::map<std::string, std::string> labels = readLabels(directory + "/labels.txt");
+
+    std::vector<std::string> fileList;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        std::string name = entry.path().filename().string();
+        if (entry.is_regular_file() && name.compare(0, 2, "MT") == 0) {
+            fileList.push_back(entry.path().string());
+        }
+    }
+    std::sort(fileList.begin(), fileList.end());
+
+    // One parsing job per sensor file
+    std::vector<xsensSensor> parsed(fileList.size());
+    JobSystem::shared().parallelFor("xsens files", static_cast<int>(fileList.size()), 1, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            parsed[i] = readXsensFile(fileList[i]);
+        }
+    });
+
+    std::vector<xsensSensor> sensors;
+    for (xsensSensor& sensor : parsed) {
+        auto label = labels.find(sensor.deviceId);
+        if (label == labels.end()) {
+            std::cerr << "Unknown Xsens device " << sensor.deviceId << "\n";
+            continue;
+        }
+        sensor.label = label->second;
+        sensors.push_back(std::move(sensor));
+    }
+    return sensors;
+}
+
+QQuaternion multInvQuaternion(const QQuaternion& q1, const QQuaternion& q2) {
+    return q2.conjugated() * q1;
+}
+
+QVector3D quaternionToEuler(const QQuaternion& q) {
+    float w = q.scalar();
+    float x = q.x();
+    float y = q.y();
+    float z = q.z();
+
+    float theta = std::atan2(2 * (w * x + y * z), 1 - 2 * (x * x + y * y));
+    float phi = std::asin(std::max(-1.0f, std::min(1.0f, 2 * (w * y - x * z))));
+    float psi = std::atan2(2 * (w * z + x * y), 1 - 2 * (y * y + z * z));
+
+    return QVector3D(psi, phi, theta);
+}
+
+QQuaternion remapQuaternion(const QQuaternion& q, const xsensAxis order[3]) {
+    float raw[3] = {q.x(), q.y(), q.z()};
+    float v[3] = {0, 0, 0};
+    for (int i = 0; i < 3; i++) {
+        v[order[i].dir] = order[i].sens * raw[i];
+    }
+    return QQuaternion(q.scalar(), v[0], v[1], v[2]);
+}
+
+static BVHTree* addXsensNode(BVHTree* parent, const std::string& name, const QVector3D& offset, int& indexQueue) {
+    BVHTree* node = new BVHTree();
+    node->name = name;
+    node->offset = offset;
+    node->parent = parent;
+    node->nodeIndex = indexQueue;
+    indexQueue++;
+    if (parent) {
+        parent->joints.push_back(node);
+    }
+    return node;
+}
+
+static void countXsensNodes(BVHTree* node) {
+    for (auto child: node->joints) {
+        countXsensNodes(child);
+        node->nbNode += child->nbNode;
+        node->nbLink += child->nbLink + 1;
+    }
+}
+
+// Hierarchy without keyframes, nodes are indexed in depth first order like readBVH
+std::vector<BVHTree*> buildXsensSkeleton(std::map<std::string, BVHTree*>& nodeByLabel) {
+    std::vector<BVHTree*> rootList;
+    int indexQueue = 0;
+
+    std::vector<const xsensJoint*> jointQueue;
+    for (auto it = xsensSkeleton.rbegin(); it != xsensSkeleton.rend(); ++it) {
+        if (it->parentLabel.empty()) jointQueue.push_back(&*it);
+    }
+    while (!jointQueue.empty()) {
+        const xsensJoint* joint = jointQueue.back();
+        jointQueue.pop_back();
+
+        BVHTree* parent = joint->parentLabel.empty() ? nullptr : nodeByLabel[joint->parentLabel];
+        BVHTree* node = addXsensNode(parent, joint->name, joint->offset, indexQueue);
+        if (parent) {
+            node->channels = {"Zrotation", "Yrotation", "Xrotation"};
+        } else {
+            node->channels = {"Xposition", "Yposition", "Zposition", "Zrotation", "Yrotation", "Xrotation"};
+            rootList.push_back(node);
+        }
+        nodeByLabel[joint->label] = node;
+
+        auto endSite = xsensEndSites.find(joint->label);
+        if (endSite != xsensEndSites.end()) {
+            addXsensNode(node, endSite->second.first, endSite->second.second, indexQueue);
+        }
+
+        for (auto it = xsensSkeleton.rbegin(); it != xsensSkeleton.rend(); ++it) {
+            if (it->parentLabel == joint->label) jointQueue.push_back(&*it);
+        }
+    }
+
+    for (auto root: rootList) {
+        countXsensNodes(root);
+    }
+
+    return rootList;
+}
+
+xsensFrames alignXsensSession(const std::vector<xsensSensor>& sensors) {
+    std::map<std::string, const xsensSensor*> sensorByLabel;
+    for (const auto& sensor : sensors) {
+        sensorByLabel[sensor.label] = &sensor;
+    }
+
+    // Common packet range of the recorded joints
+    int firstPacket = 0;
+    int lastPacket = -1;
+    bool first = true;
+    for (const auto& joint : xsensSkeleton) {
+        auto it = sensorByLabel.find(joint.label);
+        if (it == sensorByLabel.end() || it->second->packetCounters.empty()) {
+            std::cerr << "Missing Xsens sensor " << joint.label << "\n";
+            continue;
+        }
+        const std::vector<int>& counters = it->second->packetCounters;
+        firstPacket = first ? counters.front() : std::max(firstPacket, counters.front());
+        lastPacket = first ? counters.back() : std::min(lastPacket, counters.back());
+        first = false;
+    }
+
+    xsensFrames frames;
+    frames.firstPacket = firstPacket;
+    frames.nbFrames = std::max(0, lastPacket - firstPacket + 1);
+    frames.orientations.resize(xsensSkeleton.size());
+    frames.freeAccelerations.resize(xsensSkeleton.size());
+
+    // One job per joint
+    JobSystem::shared().parallelFor("xsens alignment", static_cast<int>(xsensSkeleton.size()), 1, [&](int firstJoint, int lastJoint) {
+        for (int j = firstJoint; j < lastJoint; j++) {
+            auto it = sensorByLabel.find(xsensSkeleton[j].label);
+            const xsensSensor* sensor = it == sensorByLabel.end() ? nullptr : it->second;
+            const xsensJoint& joint = xsensSkeleton[j];
+            std::vector<QQuaternion>& orientation = frames.orientations[j];
+            std::vector<QVector3D>& freeAcceleration = frames.freeAccelerations[j];
+            orientation.assign(frames.nbFrames, QQuaternion());
+            freeAcceleration.assign(frames.nbFrames, QVector3D());
+            if (!sensor || sensor->packetCounters.empty()) {
+                continue;
+            }
+            size_t cursor = 0;
+            for (int f = 0; f < frames.nbFrames; f++) {
+                // Missing packets hold the previous sample
+                while (cursor + 1 < sensor->packetCounters.size() && sensor->packetCounters[cursor + 1] <= frames.firstPacket + f) cursor++;
+                orientation[f] = remapQuaternion(sensor->quaternions[cursor], joint.rotationOrder);
+                freeAcceleration[f] = sensor->freeAccelerations[cursor];
+            }
+        }
+    });
+    return frames;
+}
+
+std::vector<BVHTree*> readXsens(const std::string& directory, float frameInterval, const xsensFilterOptions* filter) {
+    xsensFrames frames = alignXsensSession(readXsensSession(directory));
+    int nbFrames = frames.nbFrames;
+
+    if (filter) {
+        filterXsensFrames(frames.orientations, &frames.freeAccelerations, frameInterval, *filter);
+    }
+
+    // Calibrated orientation of each joint, relative to its first aligned sample
+    std::map<std::string, std::vector<QQuaternion>> calibrated;
+    for (size_t j = 0; j < xsensSkeleton.size(); j++) {
+        std::vector<QQuaternion>& orientation = frames.orientations[j];
+        QQuaternion firstQuaternion = nbFrames > 0 ? orientation[0] : QQuaternion();
+        for (int f = 0; f < nbFrames; f++) {
+            orientation[f] = multInvQuaternion(orientation[f], firstQuaternion);
+        }
+        calibrated[xsensSkeleton[j].label] = std::move(orientation);
+    }
+
+    std::map<std::string, BVHTree*> nodeByLabel;
+    std::vector<BVHTree*> rootList = buildXsensSkeleton(nodeByLabel);
+
+    // Keyframes: parent relative rotations as Z Y X Euler angles in degrees
+    for (const auto& joint : xsensSkeleton) {
+        BVHTree* node = nodeByLabel[joint.label];
+        const std::vector<QQuaternion>& orientation = calibrated[joint.label];
+        const std::vector<QQuaternion>* parentOrientation = joint.parentLabel.empty() ? nullptr : &calibrated[joint.parentLabel];
+
+        node->channelsValues.resize(nbFrames);
+        for (int f = 0; f < nbFrames; f++) {
+            QQuaternion local = parentOrientation ? multInvQuaternion(orientation[f], (*parentOrientation)[f]) : orientation[f];
+            QVector3D euler = quaternionToEuler(local) * (180.0f / M_PI);
+
+            std::vector<float>& keyFrame = node->channelsValues[f];
+            keyFrame.reserve(node->channels.size() + 1);
+            keyFrame.push_back(f * frameInterval);
+            if (!parentOrientation) {
+                keyFrame.insert(keyFrame.end(), {0.0f, 0.0f, 0.0f});
+            }
+            keyFrame.insert(keyFrame.end(), {euler.x(), euler.y(), euler.z()});
+        }
+    }
+
+    return rootList;
+}
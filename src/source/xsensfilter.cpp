@@ -0,0 +1,417 @@
+#include "../header/xsensfilter.h"
+#include "../header/xsensdata.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Four floats processed together, SSE when the target has it. Comparisons return all ones or
+// all zeros per lane, for select()
+#ifdef __SSE2__
+struct lanes {
+    __m128 v;
+    lanes() = default;
+    lanes(__m128 value) : v(value) {}
+    lanes(float value) : v(_mm_set1_ps(value)) {}
+    static lanes load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+static inline lanes operator+(lanes a, lanes b) { return _mm_add_ps(a.v, b.v); }
+static inline lanes operator-(lanes a, lanes b) { return _mm_sub_ps(a.v, b.v); }
+static inline lanes operator*(lanes a, lanes b) { return _mm_mul_ps(a.v, b.v); }
+static inline lanes operator/(lanes a, lanes b) { return _mm_div_ps(a.v, b.v); }
+static inline lanes operator<(lanes a, lanes b) { return _mm_cmplt_ps(a.v, b.v); }
+static inline lanes operator&(lanes a, lanes b) { return _mm_and_ps(a.v, b.v); }
+static inline lanes sqrt(lanes a) { return _mm_sqrt_ps(a.v); }
+// Estimate refined by a Newton step, ~1e-7 relative error
+static inline lanes rsqrt(lanes a) {
+    __m128 r = _mm_rsqrt_ps(a.v);
+    return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(_mm_mul_ps(a.v, r), r)));
+}
+static inline lanes max(lanes a, lanes b) { return _mm_max_ps(a.v, b.v); }
+static inline lanes select(lanes mask, lanes a, lanes b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+#else
+struct lanes {
+    float v[4];
+    lanes() = default;
+    lanes(float value) { std::fill(v, v + 4, value); }
+    static lanes load(const float* p) { lanes l; std::copy(p, p + 4, l.v); return l; }
+    void store(float* p) const { std::copy(v, v + 4, p); }
+};
+
+template <typename F>
+static inline lanes laneWise(lanes a, lanes b, F f) {
+    lanes r;
+    for (int l = 0; l < 4; l++) r.v[l] = f(a.v[l], b.v[l]);
+    return r;
+}
+
+static inline float laneMask(bool b) {
+    unsigned bits = b ? ~0u : 0u;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline unsigned laneBits(float f) {
+    unsigned bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+static inline lanes operator+(lanes a, lanes b) { return laneWise(a, b, [](float x, float y) { return x + y; }); }
+static inline lanes operator-(lanes a, lanes b) { return laneWise(a, b, [](float x, float y) { return x - y; }); }
+static inline lanes operator*(lanes a, lanes b) { return laneWise(a, b, [](float x, float y) { return x * y; }); }
+static inline lanes operator/(lanes a, lanes b) { return laneWise(a, b, [](float x, float y) { return x / y; }); }
+static inline lanes operator<(lanes a, lanes b) { return laneWise(a, b, [](float x, float y) { return laneMask(x < y); }); }
+static inline lanes operator&(lanes a, lanes b) { return laneWise(a, b, [](float x, float y) { return laneMask(laneBits(x) & laneBits(y)); }); }
+static inline lanes sqrt(lanes a) { return laneWise(a, a, [](float x, float) { return std::sqrt(x); }); }
+static inline lanes rsqrt(lanes a) { return laneWise(a, a, [](float x, float) { return 1.0f / std::sqrt(x); }); }
+static inline lanes max(lanes a, lanes b) { return laneWise(a, b, [](float x, float y) { return std::max(x, y); }); }
+static inline lanes select(lanes mask, lanes a, lanes b) {
+    lanes r;
+    for (int l = 0; l < 4; l++) r.v[l] = laneBits(mask.v[l]) ? a.v[l] : b.v[l];
+    return r;
+}
+#endif
+
+// Four quaternions, one per lane
+struct quaternionLanes {
+    lanes w, x, y, z;
+
+    static quaternionLanes load(const float q[4][4]) {
+        return {lanes::load(q[0]), lanes::load(q[1]), lanes::load(q[2]), lanes::load(q[3])};
+    }
+    void store(float q[4][4]) const {
+        w.store(q[0]);
+        x.store(q[1]);
+        y.store(q[2]);
+        z.store(q[3]);
+    }
+};
+
+static inline lanes dot(const quaternionLanes& a, const quaternionLanes& b) {
+    return a.w * b.w + a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static inline quaternionLanes operator+(const quaternionLanes& a, const quaternionLanes& b) {
+    return {a.w + b.w, a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+static inline quaternionLanes operator-(const quaternionLanes& a, const quaternionLanes& b) {
+    return {a.w - b.w, a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+static inline quaternionLanes operator*(lanes s, const quaternionLanes& q) {
+    return {s * q.w, s * q.x, s * q.y, s * q.z};
+}
+
+static inline quaternionLanes product(const quaternionLanes& a, const quaternionLanes& b) {
+    return {a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z,
+            a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+            a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+            a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w};
+}
+
+static inline quaternionLanes conjugated(const quaternionLanes& q) {
+    lanes zero(0.0f);
+    return {q.w, zero - q.x, zero - q.y, zero - q.z};
+}
+
+static inline quaternionLanes normalized(const quaternionLanes& q) {
+    return rsqrt(max(dot(q, q), lanes(1e-12f))) * q;
+}
+
+static inline quaternionLanes select(lanes mask, const quaternionLanes& a, const quaternionLanes& b) {
+    return {select(mask, a.w, b.w), select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z)};
+}
+
+// Smoothing factor of an exponential filter with this cutoff frequency sampled every dt
+static inline lanes smoothingFactor(lanes cutoff, float dt) {
+    lanes tau = lanes(float(2.0 * M_PI) * dt) * cutoff;
+    return tau / (tau + lanes(1.0f));
+}
+
+static double elapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Per call constants of the lane kernel
+struct filterConstants {
+    float dt;
+    float rate;
+    lanes derivativeAlpha;
+    lanes minCutoff;
+    lanes twoBeta;
+    lanes stillRate;
+    lanes stillAcceleration; // Squared
+    lanes stillTime;
+    bool driftCorrection;
+};
+
+static filterConstants makeConstants(const xsensFilterOptions& options, float dt) {
+    filterConstants k;
+    k.dt = dt;
+    k.rate = 1.0f / std::max(dt, 1e-6f);
+    k.derivativeAlpha = smoothingFactor(lanes(options.derivativeCutoff), dt);
+    k.minCutoff = lanes(options.minCutoff);
+    // |dq/dt| is half the angular speed
+    k.twoBeta = lanes(2.0f * options.beta);
+    k.stillRate = lanes(options.stillRate);
+    k.stillAcceleration = lanes(options.stillAcceleration * options.stillAcceleration);
+    k.stillTime = lanes(options.stillTime);
+    k.driftCorrection = options.driftCorrection;
+    return k;
+}
+
+XsensFilter::XsensFilter(int nbSensors, const xsensFilterOptions& options)
+    : sensors(nbSensors), settings(options), blocks((nbSensors + 3) / 4)
+{
+    reset();
+}
+
+void XsensFilter::reset() {
+    for (auto& block : blocks) {
+        std::memset(&block, 0, sizeof(block));
+        std::fill(block.correction[0], block.correction[0] + 4, 1.0f);
+    }
+    primed = false;
+}
+
+void XsensFilter::filterBlock(laneBlock& block, const float input[4][4], const float acceleration[4],
+                              float output[4][4], const filterConstants& k) const {
+    quaternionLanes q = quaternionLanes::load(input);
+    if (!primed) {
+        q = normalized(q);
+        q.store(block.raw);
+        q.store(block.filtered);
+    }
+    quaternionLanes raw = quaternionLanes::load(block.raw);
+    quaternionLanes smooth = quaternionLanes::load(block.filtered);
+
+    // Same hemisphere as the previous sample
+    q = select(dot(q, raw) < lanes(0.0f), lanes(-1.0f) * q, q);
+    quaternionLanes step = q - raw;
+
+    // Speed estimate, itself low-passed so the adaptive cutoff does not follow the noise
+    quaternionLanes derivative = quaternionLanes::load(block.derivative);
+    derivative = derivative + k.derivativeAlpha * (lanes(k.rate) * step - derivative);
+    lanes speed = sqrt(dot(derivative, derivative));
+
+    lanes alpha = smoothingFactor(k.minCutoff + k.twoBeta * speed, k.dt);
+    smooth = normalized(smooth + alpha * (q - smooth));
+
+    quaternionLanes correction = quaternionLanes::load(block.correction);
+    if (k.driftCorrection) {
+        lanes angularRate = lanes(2.0f * k.rate) * sqrt(dot(step, step));
+        lanes still = (angularRate < k.stillRate) & (lanes::load(acceleration) < k.stillAcceleration);
+        lanes stillFor = select(still, lanes::load(block.stillTime) + lanes(k.dt), lanes(0.0f));
+        stillFor.store(block.stillTime);
+
+        // Keep the output where it was: what the raw orientation moves by is drift
+        quaternionLanes drifted = normalized(product(product(correction, raw), conjugated(q)));
+        correction = select(k.stillTime < stillFor + lanes(1e-6f), drifted, correction);
+        correction.store(block.correction);
+    }
+
+    q.store(block.raw);
+    smooth.store(block.filtered);
+    derivative.store(block.derivative);
+    normalized(product(correction, smooth)).store(output);
+}
+
+void XsensFilter::filter(const QQuaternion* quaternions, const QVector3D* freeAccelerations, float dt, QQuaternion* filtered) {
+    filterConstants k = makeConstants(settings, dt);
+    for (size_t b = 0; b < blocks.size(); b++) {
+        // Transpose the sensors of the block to a component per lane vector, the padding lanes repeat
+        // the last sensor. Accelerations are compared squared
+        alignas(16) float input[4][4];
+        alignas(16) float acceleration[4];
+        for (int l = 0; l < 4; l++) {
+            int sensor = std::min(static_cast<int>(4 * b) + l, sensors - 1);
+            const QQuaternion& q = quaternions[sensor];
+            input[0][l] = q.scalar();
+            input[1][l] = q.x();
+            input[2][l] = q.y();
+            input[3][l] = q.z();
+            acceleration[l] = freeAccelerations ? freeAccelerations[sensor].lengthSquared() : 0.0f;
+        }
+
+        alignas(16) float output[4][4];
+        filterBlock(blocks[b], input, acceleration, output, k);
+        for (int l = 0; l < 4 && static_cast<int>(4 * b) + l < sensors; l++) {
+            filtered[4 * b + l] = QQuaternion(output[0][l], output[1][l], output[2][l], output[3][l]);
+        }
+    }
+    primed = true;
+    samples += sensors;
+}
+
+int XsensFilter::nbStillSensors() const {
+    int nbStill = 0;
+    for (int s = 0; s < sensors; s++) {
+        if (blocks[s / 4].stillTime[s % 4] + 1e-6f > settings.stillTime) {
+            nbStill++;
+        }
+    }
+    return nbStill;
+}
+
+void filterXsensFrames(std::vector<std::vector<QQuaternion>>& orientations,
+                       const std::vector<std::vector<QVector3D>>* freeAccelerations,
+                       float frameInterval, const xsensFilterOptions& options) {
+    int nbSensors = orientations.size();
+    if (nbSensors == 0) {
+        return;
+    }
+    size_t nbFrames = orientations[0].size();
+
+    XsensFilter filter(nbSensors, options);
+    std::vector<QQuaternion> frame(nbSensors);
+    std::vector<QVector3D> accelerations(nbSensors);
+    std::vector<QQuaternion> filtered(nbSensors);
+    for (size_t f = 0; f < nbFrames; f++) {
+        for (int s = 0; s < nbSensors; s++) {
+            frame[s] = orientations[s][f];
+            if (freeAccelerations) {
+                accelerations[s] = (*freeAccelerations)[s][f];
+            }
+        }
+        filter.filter(frame.data(), freeAccelerations ? accelerations.data() : nullptr, frameInterval, filtered.data());
+        for (int s = 0; s < nbSensors; s++) {
+            orientations[s][f] = filtered[s];
+        }
+    }
+}
+
+// Same filter one sensor at a time with QQuaternion, the reference of the lane kernel
+static void filterReference(std::vector<QQuaternion>& orientation, const std::vector<QVector3D>& freeAcceleration,
+                            float dt, const xsensFilterOptions& options) {
+    auto smoothing = [dt](float cutoff) {
+        float tau = float(2.0 * M_PI) * dt * cutoff;
+        return tau / (tau + 1.0f);
+    };
+
+    QQuaternion raw = orientation.empty() ? QQuaternion() : orientation[0].normalized();
+    QQuaternion smooth = raw;
+    QVector4D derivative;
+    QQuaternion correction;
+    float stillFor = 0;
+    for (size_t f = 0; f < orientation.size(); f++) {
+        QQuaternion q = f == 0 ? raw : orientation[f];
+        if (QQuaternion::dotProduct(q, raw) < 0) {
+            q = -q;
+        }
+        QVector4D step = q.toVector4D() - raw.toVector4D();
+        derivative += smoothing(options.derivativeCutoff) * (step / dt - derivative);
+        float alpha = smoothing(options.minCutoff + 2.0f * options.beta * derivative.length());
+        smooth = QQuaternion(smooth.toVector4D() + alpha * (q.toVector4D() - smooth.toVector4D())).normalized();
+
+        if (options.driftCorrection) {
+            bool still = 2.0f * step.length() / dt < options.stillRate && freeAcceleration[f].length() < options.stillAcceleration;
+            stillFor = still ? stillFor + dt : 0.0f;
+            if (stillFor + 1e-6f > options.stillTime) {
+                correction = (correction * raw * q.conjugated()).normalized();
+            }
+        }
+        raw = q;
+        orientation[f] = (correction * smooth).normalized();
+    }
+}
+
+// Rotation angle of a quaternion, atan2 stays accurate for the small angles acos loses in rounding
+static float rotationAngle(const QQuaternion& q) {
+    return 2.0f * std::atan2(q.vector().length(), std::abs(q.scalar()));
+}
+
+// RMS angle between consecutive frame to frame rotations, degrees: high frequency noise
+static double jitter(const std::vector<std::vector<QQuaternion>>& orientations) {
+    double sum = 0;
+    long long count = 0;
+    for (const auto& orientation : orientations) {
+        for (size_t f = 2; f < orientation.size(); f++) {
+            QQuaternion step0 = orientation[f - 1] * orientation[f - 2].conjugated();
+            QQuaternion step1 = orientation[f] * orientation[f - 1].conjugated();
+            float angle = rotationAngle(step1 * step0.conjugated());
+            sum += angle * angle;
+            count++;
+        }
+    }
+    return count > 0 ? std::sqrt(sum / count) * 180.0 / M_PI : 0.0;
+}
+
+// Largest angle between two sets of orientations, degrees
+static double maxDifference(const std::vector<std::vector<QQuaternion>>& a, const std::vector<std::vector<QQuaternion>>& b) {
+    double worst = 0;
+    for (size_t s = 0; s < a.size(); s++) {
+        for (size_t f = 0; f < a[s].size(); f++) {
+            worst = std::max(worst, rotationAngle(a[s][f] * b[s][f].conjugated()) * 180.0 / M_PI);
+        }
+    }
+    return worst;
+}
+
+void benchmarkXsensFilter(const std::string& directory, const xsensFilterOptions& options) {
+    const float frameInterval = 1.0f / 60.0f;
+    xsensFrames frames = alignXsensSession(readXsensSession(directory));
+    int nbSensors = frames.orientations.size();
+    std::cout << "Xsens session: " << nbSensors << " sensors, " << frames.nbFrames << " frames, jitter "
+              << jitter(frames.orientations) << " deg\n";
+    if (frames.nbFrames == 0) {
+        return;
+    }
+
+    for (bool driftCorrection : {false, true}) {
+        xsensFilterOptions settings = options;
+        settings.driftCorrection = driftCorrection;
+
+        std::vector<std::vector<QQuaternion>> batch = frames.orientations;
+        auto start = std::chrono::steady_clock::now();
+        filterXsensFrames(batch, &frames.freeAccelerations, frameInterval, settings);
+        double batchTime = elapsedNs(start);
+
+        std::vector<std::vector<QQuaternion>> reference = frames.orientations;
+        start = std::chrono::steady_clock::now();
+        for (int s = 0; s < nbSensors; s++) {
+            filterReference(reference[s], frames.freeAccelerations[s], frameInterval, settings);
+        }
+        double referenceTime = elapsedNs(start);
+
+        long long nbSamples = static_cast<long long>(nbSensors) * frames.nbFrames;
+        std::cout << (driftCorrection ? "With" : "Without") << " drift correction: jitter " << jitter(batch)
+                  << " deg, " << batchTime / nbSamples << " ns per sample in lanes (batch with transposition), "
+                  << referenceTime / nbSamples << " ns per sample with QQuaternion, " << maxDifference(batch, reference)
+                  << " deg apart at most\n";
+    }
+
+    // Per frame cost, the session repeated over more sensors so every lane block is full
+    for (int nbCopies : {1, 16}) {
+        int nbLaneSensors = nbSensors * nbCopies;
+        std::vector<QQuaternion> input(static_cast<size_t>(nbLaneSensors) * frames.nbFrames);
+        std::vector<QVector3D> accelerations(input.size());
+        for (int f = 0; f < frames.nbFrames; f++) {
+            for (int s = 0; s < nbLaneSensors; s++) {
+                input[static_cast<size_t>(f) * nbLaneSensors + s] = frames.orientations[s % nbSensors][f];
+                accelerations[static_cast<size_t>(f) * nbLaneSensors + s] = frames.freeAccelerations[s % nbSensors][f];
+            }
+        }
+
+        XsensFilter filter(nbLaneSensors, options);
+        std::vector<QQuaternion> output(nbLaneSensors);
+        auto start = std::chrono::steady_clock::now();
+        for (int f = 0; f < frames.nbFrames; f++) {
+            size_t first = static_cast<size_t>(f) * nbLaneSensors;
+            filter.filter(&input[first], &accelerations[first], frameInterval, output.data());
+        }
+        double time = elapsedNs(start);
+        std::cout << nbLaneSensors << " sensors: " << time / filter.nbSamples() << " ns per sample, "
+                  << time / frames.nbFrames / 1000.0 << " us per frame\n";
+    }
+}
@@ -0,0 +1,316 @@
+#include "../header/xsensstream.h"
+
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+int64_t xsensClock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int countJoints(uint32_t mask) {
+    return static_cast<int>(std::bitset<32>(mask).count());
+}
+
+XsensStream::XsensStream(const std::string& labelsFile, int port)
+    : port(port)
+{
+    for (const auto& label : readLabels(labelsFile)) {
+        for (size_t j = 0; j < xsensSkeleton.size(); j++) {
+            if (xsensSkeleton[j].label == label.second) {
+                jointOfDevice[std::stoul(label.first, nullptr, 16)] = j;
+                completeMask |= 1u << j;
+            }
+        }
+    }
+
+    for (const auto& joint : xsensSkeleton) {
+        int parent = -1;
+        for (size_t j = 0; j < xsensSkeleton.size(); j++) {
+            if (xsensSkeleton[j].label == joint.parentLabel) parent = j;
+        }
+        parentJoint.push_back(parent);
+    }
+}
+
+XsensStream::~XsensStream()
+{
+    stop();
+}
+
+void XsensStream::setFilter(const xsensFilterOptions& options)
+{
+    filter.reset(new XsensFilter(xsensSkeleton.size(), options));
+}
+
+bool XsensStream::start()
+{
+    socketFd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socketFd < 0) {
+        std::cerr << "Error opening the Xsens stream socket\n";
+        return false;
+    }
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(socketFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        std::cerr << "Error binding the Xsens stream to port " << port << "\n";
+        close(socketFd);
+        socketFd = -1;
+        return false;
+    }
+
+    // Wake up regularly to check for stop()
+    timeval timeout = {0, 100000};
+    setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    running = true;
+    receiver = std::thread(&XsensStream::receiveLoop, this);
+    return true;
+}
+
+void XsensStream::stop()
+{
+    running = false;
+    if (receiver.joinable()) {
+        receiver.join();
+    }
+    if (socketFd >= 0) {
+        close(socketFd);
+        socketFd = -1;
+    }
+}
+
+void XsensStream::receiveLoop()
+{
+    xsensPacket packet;
+    while (running) {
+        ssize_t size = recv(socketFd, &packet, sizeof(packet), 0);
+        if (size == static_cast<ssize_t>(sizeof(packet))) {
+            receivePacket(packet);
+        }
+    }
+}
+
+void XsensStream::receivePacket(const xsensPacket& packet)
+{
+    packetsReceived++;
+
+    auto joint = jointOfDevice.find(packet.deviceId);
+    if (joint == jointOfDevice.end()) {
+        return;
+    }
+
+    if (hasPublished && packet.packetCounter <= lastPublished) {
+        latePackets++;
+        return;
+    }
+
+    int j = joint->second;
+    pendingFrame& frame = pendingFrames[packet.packetCounter];
+    QQuaternion q(packet.quaternion[0], packet.quaternion[1], packet.quaternion[2], packet.quaternion[3]);
+    frame.orientation[j] = remapQuaternion(q, xsensSkeleton[j].rotationOrder);
+    frame.receivedMask |= 1u << j;
+    if (frame.sendTime == 0 || packet.sendTime < frame.sendTime) {
+        frame.sendTime = packet.sendTime;
+    }
+
+    // Publish in PacketCounter order, waiting at most xsensReorderWindow packets for late sensors
+    uint32_t newest = pendingFrames.rbegin()->first;
+    while (!pendingFrames.empty()) {
+        auto oldest = pendingFrames.begin();
+        bool complete = oldest->second.receivedMask == completeMask;
+        bool expired = newest - oldest->first >= static_cast<uint32_t>(xsensReorderWindow);
+        if (!complete && !expired) {
+            break;
+        }
+
+        if (hasPublished && oldest->first > lastPublished + 1) {
+            droppedPackets += static_cast<uint64_t>(oldest->first - lastPublished - 1) * countJoints(completeMask);
+        }
+        droppedPackets += countJoints(completeMask & ~oldest->second.receivedMask);
+
+        publish(oldest->first, oldest->second);
+        pendingFrames.erase(oldest);
+    }
+}
+
+void XsensStream::publish(uint32_t packetCounter, const pendingFrame& frame)
+{
+    int nbJoints = xsensSkeleton.size();
+
+    // Missing sensors hold their previous sample, the first sample of each sensor is the calibration
+    std::array<QQuaternion, xsensMaxJoints> calibrated;
+    for (int j = 0; j < nbJoints; j++) {
+        uint32_t bit = 1u << j;
+        if (frame.receivedMask & bit) {
+            lastOrientation[j] = frame.orientation[j];
+            if (!(calibratedMask & bit)) {
+                firstOrientation[j] = frame.orientation[j];
+                calibratedMask |= bit;
+            }
+        }
+        calibrated[j] = multInvQuaternion(lastOrientation[j], firstOrientation[j]);
+    }
+
+    // Calibrated orientations start at identity, a sensor joining late does not jump
+    if (filter) {
+        int64_t start = xsensClock();
+        float dt = hasPublished ? (packetCounter - lastPublished) * xsensSampleInterval : xsensSampleInterval;
+        filter->filter(calibrated.data(), nullptr, dt, calibrated.data());
+        filterTime += xsensClock() - start;
+        filterSamples += nbJoints;
+    }
+
+    uint64_t n = nbPublished.load(std::memory_order_relaxed);
+    poseSlot& slot = ring[n % xsensPoseRingSize];
+    uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.pose.packetCounter = packetCounter;
+    slot.pose.sendTime = frame.sendTime;
+    slot.pose.publishTime = xsensClock();
+    slot.pose.nbJoints = nbJoints;
+    for (int j = 0; j < nbJoints; j++) {
+        int parent = parentJoint[j];
+        slot.pose.local[j] = parent < 0 ? calibrated[j] : multInvQuaternion(calibrated[j], calibrated[parent]);
+    }
+
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+    nbPublished.store(n + 1, std::memory_order_release);
+
+    hasPublished = true;
+    lastPublished = packetCounter;
+}
+
+bool XsensStream::latestPose(xsensPose& pose)
+{
+    uint64_t n = nbPublished.load(std::memory_order_acquire);
+    if (n == nbConsumed) {
+        return false;
+    }
+
+    // Retry if the receiver overwrote the slot while we were copying it
+    while (true) {
+        poseSlot& slot = ring[(n - 1) % xsensPoseRingSize];
+        uint32_t before = slot.sequence.load(std::memory_order_acquire);
+        if (!(before & 1)) {
+            pose = slot.pose;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == before) {
+                break;
+            }
+        }
+        n = nbPublished.load(std::memory_order_acquire);
+    }
+    nbConsumed = n;
+
+    int64_t latency = xsensClock() - pose.sendTime;
+    posesConsumed++;
+    latencySum += latency;
+    int64_t previousMax = latencyMax.load();
+    while (latency > previousMax && !latencyMax.compare_exchange_weak(previousMax, latency));
+
+    return true;
+}
+
+xsensStreamStats XsensStream::stats() const
+{
+    xsensStreamStats s;
+    s.packetsReceived = packetsReceived;
+    s.latePackets = latePackets;
+    s.droppedPackets = droppedPackets;
+    s.framesPublished = nbPublished;
+    s.posesConsumed = posesConsumed;
+    if (s.posesConsumed > 0) {
+        s.averageLatency = latencySum / static_cast<double>(s.posesConsumed) / 1e6;
+    }
+    s.maxLatency = latencyMax / 1e6;
+    if (filterSamples > 0) {
+        s.filterTime = filterTime / static_cast<double>(filterSamples);
+    }
+    return s;
+}
+
+void XsensStream::printStats() const
+{
+    xsensStreamStats s = stats();
+    std::cout << "Xsens stream: " << s.packetsReceived << " packets, "
+              << s.framesPublished << " poses published, "
+              << s.posesConsumed << " consumed, "
+              << s.droppedPackets << " dropped, "
+              << s.latePackets << " late, latency avg "
+              << s.averageLatency << " ms, max " << s.maxLatency << " ms";
+    if (s.filterTime > 0) {
+        std::cout << ", filter " << s.filterTime << " ns per sample";
+    }
+    std::cout << "\n";
+}
+
+void replayXsensSession(const std::string& directory, int port, float speed) {
+    std::vector<xsensSensor> sensors = readXsensSession(directory);
+    if (sensors.empty()) {
+        throw std::runtime_error("No Xsens recording in " + directory);
+    }
+
+    int firstPacket = sensors[0].packetCounters.front();
+    int lastPacket = sensors[0].packetCounters.back();
+    for (const auto& sensor : sensors) {
+        firstPacket = std::max(firstPacket, sensor.packetCounters.front());
+        lastPacket = std::min(lastPacket, sensor.packetCounters.back());
+    }
+
+    int socketFd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socketFd < 0) {
+        throw std::runtime_error("Error opening the Xsens replay socket");
+    }
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    std::vector<uint32_t> deviceIds;
+    std::vector<size_t> cursors(sensors.size(), 0);
+    for (const auto& sensor : sensors) {
+        deviceIds.push_back(std::stoul(sensor.deviceId, nullptr, 16));
+    }
+
+    auto period = std::chrono::duration<double>(1.0 / (60.0 * speed));
+    auto startTime = std::chrono::steady_clock::now();
+    uint64_t nbSent = 0;
+
+    for (int counter = firstPacket; counter <= lastPacket; counter++) {
+        std::this_thread::sleep_until(startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(period * (counter - firstPacket)));
+
+        for (size_t s = 0; s < sensors.size(); s++) {
+            const xsensSensor& sensor = sensors[s];
+            size_t& cursor = cursors[s];
+            while (cursor < sensor.packetCounters.size() && sensor.packetCounters[cursor] < counter) cursor++;
+            if (cursor == sensor.packetCounters.size() || sensor.packetCounters[cursor] != counter) {
+                continue; // Packet lost during the recording
+            }
+
+            const QQuaternion& q = sensor.quaternions[cursor];
+            xsensPacket packet = {deviceIds[s], static_cast<uint32_t>(counter), {q.scalar(), q.x(), q.y(), q.z()}, xsensClock()};
+            sendto(socketFd, &packet, sizeof(packet), 0, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+            nbSent++;
+        }
+    }
+
+    close(socketFd);
+    std::cout << "Xsens replay: " << nbSent << " packets sent for " << (lastPacket - firstPacket + 1) << " frames\n";
+}